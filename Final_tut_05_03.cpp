@@ -1,14 +1,54 @@
-#include <iostream>         // cout, cerr
-#include <cstdlib>          // EXIT_FAILURE
+#include <cstdio>           // snprintf, fwrite, fopen
+#include <cstdarg>          // va_list
+#include <cstdlib>          // EXIT_FAILURE, atexit
+#include <cstdint>          // intptr_t, uint64_t
+#include <atomic>           // atomic
+#include <thread>           // thread, this_thread
+#include <mutex>            // mutex, unique_lock
+#include <condition_variable> // condition_variable
+#include <deque>            // deque
+#include <functional>       // function
+#include <string>           // string
+#include <chrono>           // steady_clock
+#include <vector>           // vector
+#include <initializer_list> // initializer_list
+#include <algorithm>        // fill, min, sort
+#include <cmath>            // sqrt
+#include <cstddef>          // offsetof
+#include <cstring>          // memcpy, strcmp
+#include <exception>        // terminate
+#include <new>              // bad_alloc
+#if defined(__ELF__)
+#include <link.h>           // dl_iterate_phdr, to tell the GL driver's allocations from the program's
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>      // SSE2 intrinsics for the ray queries
+#define USIMD_SSE 1
+#endif
+// The software rasterizer runs eight lanes in one AVX2 register, so x86 builds need AVX2 at compile time: -mavx2
+// with GCC and Clang, /arch:AVX2 with MSVC. Without it the build stops here instead of quietly falling back to the
+// scalar lanes; define USIMD_SCALAR_LANES to build them anyway. Other architectures always get the scalar lanes.
+#if defined(__AVX2__)
+#include <immintrin.h>      // AVX2 intrinsics for the software rasterizer
+#ifdef _MSC_VER
+#include <intrin.h>         // __cpuid, __cpuidex
+#endif
+#define USIMD_AVX2 1
+#elif (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)) && !defined(USIMD_SCALAR_LANES)
+#error "The software rasterizer needs AVX2: build with -mavx2 (GCC, Clang) or /arch:AVX2 (MSVC), or define USIMD_SCALAR_LANES"
+#endif
 #include <GL/glew.h>        // GLEW library
 #include <GLFW/glfw3.h>     // GLFW library
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>      // Image loading Utility functions
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image_write.h> // PNG encoding for frame capture
 
 // GLM Math Header inclusions
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/quaternion.hpp>
 
 #include <learnOpengl/CAMERA.H> // Camera class
 
@@ -19,9 +59,261 @@ using namespace std; // Standard namespace
 #define GLSL(Version, Source) "#version " #Version " core \n" #Source
 #endif
 
+/*Shader source shared between stages, inserted after the #version line*/
+#ifndef GLSL_CHUNK
+#define GLSL_CHUNK(Source) #Source
+#endif
+
+/*Logging Macros*/
+// Severity levels; messages below ULOG_MIN_LEVEL are stripped at compile time
+#define ULOG_LEVEL_DEBUG 0
+#define ULOG_LEVEL_INFO 1
+#define ULOG_LEVEL_WARNING 2
+#define ULOG_LEVEL_ERROR 3
+
+#ifndef ULOG_MIN_LEVEL
+#define ULOG_MIN_LEVEL ULOG_LEVEL_INFO
+#endif
+
+#if ULOG_MIN_LEVEL <= ULOG_LEVEL_DEBUG
+#define ULOG_DEBUG(...) ULog(ULOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define ULOG_DEBUG(...) ((void)0)
+#endif
+#if ULOG_MIN_LEVEL <= ULOG_LEVEL_INFO
+#define ULOG_INFO(...) ULog(ULOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define ULOG_INFO(...) ((void)0)
+#endif
+#if ULOG_MIN_LEVEL <= ULOG_LEVEL_WARNING
+#define ULOG_WARNING(...) ULog(ULOG_LEVEL_WARNING, __VA_ARGS__)
+#else
+#define ULOG_WARNING(...) ((void)0)
+#endif
+#define ULOG_ERROR(...) ULog(ULOG_LEVEL_ERROR, __VA_ARGS__)
+
+/*Profiling Macros*/
+// Scoped CPU zones for --chrome-trace. While not recording a zone costs a branch; building with
+// UPROFILE_ENABLED=0 removes them altogether.
+#ifndef UPROFILE_ENABLED
+#define UPROFILE_ENABLED 1
+#endif
+
+#define UPROFILE_CONCAT_INNER(a, b) a##b
+#define UPROFILE_CONCAT(a, b) UPROFILE_CONCAT_INNER(a, b)
+
+#if UPROFILE_ENABLED
+// Zone from here to the end of the enclosing scope
+#define UPROFILE_ZONE(Name) UProfileZone UPROFILE_CONCAT(uprofileZone, __LINE__)(Name)
+#define UPROFILE_FUNCTION() UPROFILE_ZONE(__func__)
+// Back-to-back zones in one scope: UPROFILE_SECTION ends the current one and starts the next
+#define UPROFILE_SECTIONS(Name) UProfileSections uprofileSections(Name)
+#define UPROFILE_SECTION(Name) uprofileSections.Next(Name)
+// Label of the calling thread on the timeline; Index < 0 for none
+#define UPROFILE_THREAD(Name, Index) UProfileNameThread(Name, Index)
+#else
+#define UPROFILE_ZONE(Name) ((void)0)
+#define UPROFILE_FUNCTION() ((void)0)
+#define UPROFILE_SECTIONS(Name) ((void)0)
+#define UPROFILE_SECTION(Name) ((void)0)
+#define UPROFILE_THREAD(Name, Index) ((void)0)
+#endif
+
+/*GPU resource tracking*/
+// Records a GL object with its size, owner tag and the file and line that created it
+#define UGPU_TRACK(Kind, Id, Bytes, Tag) URegisterGpuResource(Kind, Id, Bytes, Tag, __FILE__, __LINE__)
+
 // Unnamed namespace
 namespace
 {
+    // Bounded lock-free multi-producer queue (Vyukov style): every slot carries a sequence number
+    // that tells producers and the consumer whether it is free or filled, so neither side ever waits on a lock
+    template <typename T, size_t Capacity>
+    struct UBoundedQueue
+    {
+        static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+        struct Slot
+        {
+            std::atomic<size_t> sequence;
+            T data;
+        };
+
+        Slot slots[Capacity];
+        alignas(64) std::atomic<size_t> enqueuePos;
+        alignas(64) std::atomic<size_t> dequeuePos;
+
+        UBoundedQueue() : enqueuePos(0), dequeuePos(0)
+        {
+            for (size_t i = 0; i < Capacity; ++i)
+                slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        // Returns false instead of blocking when the queue is full
+        bool TryPush(const T& value)
+        {
+            size_t pos = enqueuePos.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                Slot& slot = slots[pos & (Capacity - 1)];
+                size_t sequence = slot.sequence.load(std::memory_order_acquire);
+                intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+                if (diff == 0)
+                {
+                    if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        slot.data = value;
+                        slot.sequence.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0)
+                    return false;
+                else
+                    pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+
+        // Returns false when the queue is empty
+        bool TryPop(T& value)
+        {
+            size_t pos = dequeuePos.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                Slot& slot = slots[pos & (Capacity - 1)];
+                size_t sequence = slot.sequence.load(std::memory_order_acquire);
+                intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+                if (diff == 0)
+                {
+                    if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        value = slot.data;
+                        slot.sequence.store(pos + Capacity, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0)
+                    return false;
+                else
+                    pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+    };
+
+    // A formatted log line waiting for the writer thread
+    struct ULogMessage
+    {
+        int level;          // One of the ULOG_LEVEL_* values
+        double time;        // Seconds since the logger started
+        char text[500];     // Formatted message, truncated if longer
+    };
+
+    // Asynchronous logger: any thread formats into the ring, a background thread does the slow writes
+    struct ULogger
+    {
+        UBoundedQueue<ULogMessage, 1024> queue;
+        std::atomic<bool> running{ false };
+        std::atomic<unsigned long long> dropped{ 0 };     // Messages lost because the ring was full
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::thread writer;
+    };
+
+    ULogger gLogger;
+
+    // CPU profiler: every zone becomes one complete event in a buffer owned by the thread that recorded it, so
+    // recording takes no lock. The buffers are written as Chrome trace-event JSON (chrome://tracing or
+    // ui.perfetto.dev) after every thread has stopped.
+    struct UProfileEvent
+    {
+        const char* name;       // A string literal or function name, so it outlives the run
+        int64_t start;          // Nanoseconds since the profiler started
+        int64_t duration;
+    };
+
+    const size_t PROFILE_CHUNK_EVENTS = 16384;     // Events per allocation; a buffer never moves recorded events
+
+    struct UProfileThread
+    {
+        std::string name;
+        std::vector<std::vector<UProfileEvent>> chunks;
+    };
+
+    struct UProfiler
+    {
+        bool enabled = false;                       // Set once, before any thread records
+        std::chrono::steady_clock::time_point start;
+        std::mutex mutex;                           // Guards threads, which only grows
+        std::deque<UProfileThread> threads;         // Keeps its elements in place as it grows
+    };
+
+    UProfiler gProfiler;
+    thread_local UProfileThread* tProfileThread = nullptr;
+
+    inline int64_t UProfileNow()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - gProfiler.start).count();
+    }
+
+    // The calling thread's buffer, registered on first use; the index in threads is the trace's thread id
+    inline UProfileThread& UProfileCurrentThread()
+    {
+        if (!tProfileThread)
+        {
+            std::lock_guard<std::mutex> lock(gProfiler.mutex);
+            gProfiler.threads.emplace_back();
+            tProfileThread = &gProfiler.threads.back();
+            tProfileThread->name = "thread " + std::to_string(gProfiler.threads.size() - 1);
+        }
+        return *tProfileThread;
+    }
+
+    inline void UProfileRecord(const char* name, int64_t start, int64_t end)
+    {
+        UProfileThread& thread = UProfileCurrentThread();
+        if (thread.chunks.empty() || thread.chunks.back().size() == PROFILE_CHUNK_EVENTS)
+        {
+            thread.chunks.emplace_back();
+            thread.chunks.back().reserve(PROFILE_CHUNK_EVENTS);
+        }
+        thread.chunks.back().push_back({ name, start, end - start });
+    }
+
+    struct UProfileZone
+    {
+        const char* name;
+        int64_t start;          // -1 when not recording
+
+        explicit UProfileZone(const char* zoneName) : name(zoneName), start(gProfiler.enabled ? UProfileNow() : -1) {}
+        ~UProfileZone()
+        {
+            if (start >= 0)
+                UProfileRecord(name, start, UProfileNow());
+        }
+    };
+
+    struct UProfileSections
+    {
+        const char* name;
+        int64_t start;          // -1 when not recording
+
+        explicit UProfileSections(const char* first) : name(first), start(gProfiler.enabled ? UProfileNow() : -1) {}
+        void Next(const char* next)
+        {
+            if (start >= 0)
+            {
+                const int64_t now = UProfileNow();
+                UProfileRecord(name, start, now);
+                start = now;
+            }
+            name = next;
+        }
+        ~UProfileSections()
+        {
+            if (start >= 0)
+                UProfileRecord(name, start, UProfileNow());
+        }
+    };
+
     const char* const WINDOW_TITLE = "Daniel Finley"; // Macro for window title
 
     // Variables for window width and height
@@ -36,823 +328,10295 @@ namespace
         GLuint nIndices;    // Number of indices of the mesh
     };
 
-    // Main GLFW window
-    GLFWwindow* gWindow = nullptr;
-    // Triangle mesh data
-    GLMesh gMesh;
-    // Shader program
-    GLuint gClayProgramId;
-    GLuint gLampProgramId;
+    // Size in bytes of a vertex attribute with the given GL component type and component count
+    constexpr size_t UAttributeSize(GLenum type, GLint components)
+    {
+        return type == GL_INT_2_10_10_10_REV || type == GL_UNSIGNED_INT_2_10_10_10_REV ? 4 :
+            type == GL_FLOAT || type == GL_INT || type == GL_UNSIGNED_INT ? 4 * components :
+            type == GL_HALF_FLOAT || type == GL_SHORT || type == GL_UNSIGNED_SHORT ? 2 * components :
+            type == GL_BYTE || type == GL_UNSIGNED_BYTE ? components : 0;
+    }
 
-    // camera
-    Camera gCamera(glm::vec3(0.0f, 3.0f, 20.0f));
-    float gLastX = WINDOW_WIDTH / 2.0f;
-    float gLastY = WINDOW_HEIGHT / 2.0f;
-    bool gFirstMouse = true;
+    // One vertex attribute: shader location, GL format and where it sits in the vertex struct.
+    // Integer attributes are fed to ivec/uvec inputs through glVertexAttribIPointer.
+    template <GLuint Location, GLint Components, GLenum Type, GLboolean Normalized, bool Integer, size_t Offset, size_t MemberSize>
+    struct UVertexAttribute
+    {
+        static_assert(UAttributeSize(Type, Components) != 0, "Unsupported vertex attribute type");
+        static_assert(UAttributeSize(Type, Components) <= MemberSize, "Vertex attribute format reads past its struct member");
+        static_assert((Type != GL_INT_2_10_10_10_REV && Type != GL_UNSIGNED_INT_2_10_10_10_REV) || Components == 4, "Packed 2_10_10_10 formats have 4 components");
 
-    // timing
-    float gDeltaTime = 0.0f; // time between current frame and last frame
-    float gLastFrame = 0.0f;
+        static const GLuint location = Location;
+        static const size_t offset = Offset;
+        static const size_t size = UAttributeSize(Type, Components);
+
+        static void Enable(GLsizei stride)
+        {
+            if (Integer)
+                glVertexAttribIPointer(Location, Components, Type, stride, (void*)Offset);
+            else
+                glVertexAttribPointer(Location, Components, Type, Normalized, stride, (void*)Offset);
+            glEnableVertexAttribArray(Location);
+        }
+    };
 
-    // Subject position and scale
-    glm::vec3 gCubePosition(0.0f, 0.0f, 0.0f);
-    glm::vec3 gCubeScale(2.0f);
+    // Declares an attribute from a member of the vertex struct, so offsets and sizes can never drift from the struct
+#define UVERTEX_ATTRIBUTE(Vertex, Member, Location, Components, Type, Normalized) \
+    UVertexAttribute<Location, Components, Type, Normalized, false, offsetof(Vertex, Member), sizeof(((Vertex*)0)->Member)>
+#define UVERTEX_INTEGER_ATTRIBUTE(Vertex, Member, Location, Components, Type) \
+    UVertexAttribute<Location, Components, Type, GL_FALSE, true, offsetof(Vertex, Member), sizeof(((Vertex*)0)->Member)>
 
-    // Cube and light color  ***Need to figure out how to allow for new color input**
-    //glm::vec3 gObjectColor(0.6f, 0.5f, 0.75f);
-    glm::vec3 gObjectColor(0.5f, 0.5f, 1.0f);
-    glm::vec3 gLightColor(1.0f, 1.0f, 1.0f);
+    // Compile-time description of a vertex format; stride, offsets and attribute pointers all derive from it
+    template <typename Vertex, typename... Attributes>
+    struct UVertexLayout
+    {
+        static const GLsizei stride = sizeof(Vertex);
 
-    // Light position and scale
-    glm::vec3 gLightPosition(4.0f, 8.0f, 12.0f);
-    glm::vec3 gLightScale(0.5f);
+        static constexpr bool LocationsUnique()
+        {
+            const GLuint locations[] = { Attributes::location... };
+            for (size_t i = 0; i < sizeof...(Attributes); ++i)
+                for (size_t j = i + 1; j < sizeof...(Attributes); ++j)
+                    if (locations[i] == locations[j])
+                        return false;
+            return true;
+        }
 
-    // Lamp animation
-    bool gIsLampOrbiting = true;
+        static constexpr bool AttributesFit()
+        {
+            const size_t ends[] = { (Attributes::offset + Attributes::size)... };
+            for (size_t i = 0; i < sizeof...(Attributes); ++i)
+                if (ends[i] > sizeof(Vertex))
+                    return false;
+            return true;
+        }
 
-    //Attempting to add texture to the scene ********************************
-    //GLuint gTextureBlueDesk;
-    //GLuint gTextureCheckerboard;
-}
+        static_assert(LocationsUnique(), "Two vertex attributes share a shader location");
+        static_assert(AttributesFit(), "Vertex attribute extends past the vertex stride");
 
-/* User-defined Function prototypes to:
- * initialize the program, set the window size,
- * redraw graphics on the window when resized,
- * and render graphics on the screen
- */
-bool UInitialize(int, char* [], GLFWwindow** window);
-void UResizeWindow(GLFWwindow* window, int width, int height);
-void UProcessInput(GLFWwindow* window);
-void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos);
-void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset);
-void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
-void UCreateMesh(GLMesh& mesh);
-void UDestroyMesh(GLMesh& mesh);
-bool UCreateTexture(const char* filename, GLuint& textureId);
-void UDestroyTexture(GLuint textureId);
-void URender();
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId);
-void UDestroyShaderProgram(GLuint programId);
+        // Sets up the attribute pointers of the vertex buffer bound to GL_ARRAY_BUFFER
+        static void Enable()
+        {
+            (Attributes::Enable(stride), ...);
+        }
+    };
 
+    // Scene vertex: half-float position, material index, signed 2_10_10_10 normal, unorm8 color and unorm16
+    // texture coordinates (20 bytes instead of 36)
+    struct UPackedVertex
+    {
+        GLushort position[3];   // Half floats x, y, z
+        GLushort material;      // Index into the material buffer, UMATERIAL_NONE when untextured
+        GLuint normal;          // GL_INT_2_10_10_10_REV, w unused
+        GLubyte color[4];       // r, g, b, a
+        GLushort uv[2];         // Box-mapped over the mesh part, [0, 1]; the material scales it for tiling
+    };
+
+    // Shader locations shared by every vertex format
+    const GLuint UATTRIBUTE_POSITION = 0;
+    const GLuint UATTRIBUTE_NORMAL = 1;
+    const GLuint UATTRIBUTE_COLOR = 2;
+    const GLuint UATTRIBUTE_UV = 3;
+    const GLuint UATTRIBUTE_TANGENT = 4;
+    const GLuint UATTRIBUTE_MATERIAL = 5;
+    const GLuint UATTRIBUTE_LIGHTMAP_UV = 6;
+    const GLuint UATTRIBUTE_OBJECT = 7;         // Per instance: the object a GPU-driven draw belongs to
+
+    typedef UVertexLayout<UPackedVertex,
+        UVERTEX_ATTRIBUTE(UPackedVertex, position, UATTRIBUTE_POSITION, 3, GL_HALF_FLOAT, GL_FALSE),
+        UVERTEX_INTEGER_ATTRIBUTE(UPackedVertex, material, UATTRIBUTE_MATERIAL, 1, GL_UNSIGNED_SHORT),
+        UVERTEX_ATTRIBUTE(UPackedVertex, normal, UATTRIBUTE_NORMAL, 4, GL_INT_2_10_10_10_REV, GL_TRUE),
+        UVERTEX_ATTRIBUTE(UPackedVertex, color, UATTRIBUTE_COLOR, 4, GL_UNSIGNED_BYTE, GL_TRUE),
+        UVERTEX_ATTRIBUTE(UPackedVertex, uv, UATTRIBUTE_UV, 2, GL_UNSIGNED_SHORT, GL_TRUE)> UPackedVertexLayout;
+
+    static_assert(sizeof(UPackedVertex) == 20, "UPackedVertex should stay 20 bytes");
+
+    // Materials of the scene mesh, in the order UCreateMaterials adds them
+    enum UMaterial { UMATERIAL_DESK, UMATERIAL_CHECKERBOARD, UMATERIAL_COUNT, UMATERIAL_NONE = 0xffff };
+
+    // Range of scene mesh vertices belonging to one object, with the material it is drawn with
+    struct UMeshPart
+    {
+        GLushort firstVertex;
+        GLushort vertexCount;
+        GLushort material;
+        const char* name;
+    };
+
+    // Compile-time primitive meshes. The generators are constexpr, so the scene mesh below is computed by the
+    // compiler, packed and all, and lands in read-only data: positions, face normals, box-mapped texture
+    // coordinates and indices with no hand-maintained tables and no work at startup.
+    struct UConstVec3
+    {
+        float x, y, z;
+    };
+
+    constexpr UConstVec3 operator+(UConstVec3 a, UConstVec3 b) { return { a.x + b.x, a.y + b.y, a.z + b.z }; }
+    constexpr UConstVec3 operator-(UConstVec3 a, UConstVec3 b) { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+    constexpr UConstVec3 operator*(UConstVec3 a, float s) { return { a.x * s, a.y * s, a.z * s }; }
+    constexpr UConstVec3 UConstCross(UConstVec3 a, UConstVec3 b) { return { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x }; }
+    constexpr float UConstDot(UConstVec3 a, UConstVec3 b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+    constexpr float UConstAbs(float x) { return x < 0.0f ? -x : x; }
+
+    // Newton iterations from above; exact enough for unit normals
+    constexpr double UConstSqrt(double x)
+    {
+        if (x <= 0.0)
+            return 0.0;
+        double root = x > 1.0 ? x : 1.0;
+        for (int i = 0; i < 64; ++i)
+            root = 0.5 * (root + x / root);
+        return root;
+    }
+
+    constexpr UConstVec3 UConstNormalize(UConstVec3 v)
+    {
+        const double length = UConstSqrt(UConstDot(v, v));
+        return length > 0.0 ? v * static_cast<float>(1.0 / length) : UConstVec3{ 0.0f, 1.0f, 0.0f };
+    }
+
+    // Taylor series after reducing the angle to [-pi, pi]
+    constexpr double UConstSin(double x)
+    {
+        const double pi = 3.14159265358979323846;
+        while (x > pi)
+            x -= 2.0 * pi;
+        while (x < -pi)
+            x += 2.0 * pi;
+        double term = x;
+        double sum = x;
+        for (int n = 1; n < 12; ++n)
+        {
+            term *= -x * x / ((2.0 * n) * (2.0 * n + 1.0));
+            sum += term;
+        }
+        return sum;
+    }
+
+    constexpr double UConstCos(double x) { return UConstSin(x + 3.14159265358979323846 / 2.0); }
+
+    // std::round: halfway cases away from zero
+    constexpr int UConstRound(double x) { return x >= 0.0 ? static_cast<int>(x + 0.5) : -static_cast<int>(-x + 0.5); }
+
+    // Compile-time UPackHalf, with the same round to nearest even
+    constexpr GLushort UConstPackHalf(float value)
+    {
+        const GLuint sign = value < 0.0f ? 0x8000u : 0u;
+        double magnitude = value < 0.0f ? -double(value) : double(value);
+        if (magnitude == 0.0)
+            return static_cast<GLushort>(sign);
+
+        int exponent = 0;
+        double mantissa = magnitude;
+        while (mantissa >= 2.0)
+        {
+            mantissa *= 0.5;
+            ++exponent;
+        }
+        while (mantissa < 1.0)
+        {
+            mantissa *= 2.0;
+            --exponent;
+        }
+        if (exponent + 15 >= 31)
+            return static_cast<GLushort>(sign | 0x7c00u);
+
+        // Units of the last place: 2^-24 for subnormals, 2^(exponent - 10) otherwise
+        double units = exponent + 15 <= 0 ? magnitude * 16777216.0 : (mantissa - 1.0) * 1024.0;
+        GLuint half = static_cast<GLuint>(units);
+        const double remainder = units - half;
+        if (remainder > 0.5 || (remainder == 0.5 && (half & 1u)))
+            ++half; // May carry into the exponent, as in UPackHalf
+        if (exponent + 15 > 0)
+            half += static_cast<GLuint>(exponent + 15) << 10;
+        return static_cast<GLushort>(sign | half);
+    }
+
+    // Compile-time UPackSnorm1010102 with w = 0, UPackUnorm8 and UPackUnorm16
+    constexpr GLuint UConstPackSnorm1010102(UConstVec3 v)
+    {
+        const float x = v.x < -1.0f ? -1.0f : v.x > 1.0f ? 1.0f : v.x;
+        const float y = v.y < -1.0f ? -1.0f : v.y > 1.0f ? 1.0f : v.y;
+        const float z = v.z < -1.0f ? -1.0f : v.z > 1.0f ? 1.0f : v.z;
+        return (static_cast<GLuint>(UConstRound(x * 511.0f)) & 0x3ffu) | ((static_cast<GLuint>(UConstRound(y * 511.0f)) & 0x3ffu) << 10) |
+            ((static_cast<GLuint>(UConstRound(z * 511.0f)) & 0x3ffu) << 20);
+    }
+
+    constexpr GLubyte UConstPackUnorm8(float value) { return static_cast<GLubyte>(UConstRound((value < 0.0f ? 0.0f : value > 1.0f ? 1.0f : value) * 255.0f)); }
+    constexpr GLushort UConstPackUnorm16(float value) { return static_cast<GLushort>(UConstRound((value < 0.0f ? 0.0f : value > 1.0f ? 1.0f : value) * 65535.0f)); }
+
+    static_assert(UConstPackHalf(1.0f) == 0x3c00 && UConstPackHalf(-0.5f) == 0xb800 && UConstPackHalf(65504.0f) == 0x7bff &&
+        UConstPackHalf(1.0e-7f) == 0x0002 && UConstPackHalf(1.0e6f) == 0x7c00, "UConstPackHalf disagrees with IEEE half");
+
+    // Vertex of a generated primitive before packing
+    struct UMeshVertex
+    {
+        UConstVec3 position;
+        UConstVec3 normal;
+    };
+
+    // Vertices and triangle indices of a mesh whose size is known at compile time
+    template <typename Vertex, int VertexCount, int IndexCount>
+    struct UMeshData
+    {
+        static const int vertexCount = VertexCount;
+        static const int indexCount = IndexCount;
+        Vertex verts[VertexCount];
+        GLushort indices[IndexCount];
+    };
+
+    template <int VertexCount, int IndexCount>
+    using UPrimitive = UMeshData<UMeshVertex, VertexCount, IndexCount>;
+
+    template <int VertexCount, int IndexCount>
+    using UPackedMesh = UMeshData<UPackedVertex, VertexCount, IndexCount>;
+
+    // Corners counterclockwise seen from the front, which the face normal points to
+    constexpr UPrimitive<4, 6> UMakeQuad(UConstVec3 a, UConstVec3 b, UConstVec3 c, UConstVec3 d)
+    {
+        const UConstVec3 normal = UConstNormalize(UConstCross(b - a, c - a));
+        return { { { a, normal }, { b, normal }, { c, normal }, { d, normal } }, { 0, 1, 2, 0, 2, 3 } };
+    }
+
+    constexpr UPrimitive<3, 3> UMakeTriangle(UConstVec3 a, UConstVec3 b, UConstVec3 c)
+    {
+        const UConstVec3 normal = UConstNormalize(UConstCross(b - a, c - a));
+        return { { { a, normal }, { b, normal }, { c, normal } }, { 0, 1, 2 } };
+    }
+
+    // Meshes one after the other, with the indices of each moved past the vertices before it
+    template <typename Vertex, int VertexCount, int IndexCount, int PartVertexCount, int PartIndexCount>
+    constexpr void UAppendMesh(UMeshData<Vertex, VertexCount, IndexCount>& mesh, int& firstVertex, int& firstIndex,
+        const UMeshData<Vertex, PartVertexCount, PartIndexCount>& part)
+    {
+        for (int v = 0; v < PartVertexCount; ++v)
+            mesh.verts[firstVertex + v] = part.verts[v];
+        for (int i = 0; i < PartIndexCount; ++i)
+            mesh.indices[firstIndex + i] = static_cast<GLushort>(part.indices[i] + firstVertex);
+        firstVertex += PartVertexCount;
+        firstIndex += PartIndexCount;
+    }
+
+    template <typename Vertex, int... VertexCounts, int... IndexCounts>
+    constexpr UMeshData<Vertex, (VertexCounts + ...), (IndexCounts + ...)> UConcatMeshes(const UMeshData<Vertex, VertexCounts, IndexCounts>&... parts)
+    {
+        static_assert((VertexCounts + ...) <= 65536, "Concatenated mesh needs 32-bit indices");
+        UMeshData<Vertex, (VertexCounts + ...), (IndexCounts + ...)> mesh{};
+        int firstVertex = 0;
+        int firstIndex = 0;
+        (UAppendMesh(mesh, firstVertex, firstIndex, parts), ...);
+        return mesh;
+    }
+
+    // Axis-aligned box with a quad per face
+    constexpr UPrimitive<24, 36> UMakeBox(UConstVec3 lower, UConstVec3 upper)
+    {
+        const float x0 = lower.x, y0 = lower.y, z0 = lower.z;
+        const float x1 = upper.x, y1 = upper.y, z1 = upper.z;
+        return UConcatMeshes(
+            UMakeQuad({ x0, y0, z1 }, { x1, y0, z1 }, { x1, y1, z1 }, { x0, y1, z1 }),     // +z
+            UMakeQuad({ x1, y0, z0 }, { x0, y0, z0 }, { x0, y1, z0 }, { x1, y1, z0 }),     // -z
+            UMakeQuad({ x0, y0, z0 }, { x0, y0, z1 }, { x0, y1, z1 }, { x0, y1, z0 }),     // -x
+            UMakeQuad({ x1, y0, z1 }, { x1, y0, z0 }, { x1, y1, z0 }, { x1, y1, z1 }),     // +x
+            UMakeQuad({ x0, y0, z0 }, { x1, y0, z0 }, { x1, y0, z1 }, { x0, y0, z1 }),     // -y
+            UMakeQuad({ x0, y1, z1 }, { x1, y1, z1 }, { x1, y1, z0 }, { x0, y1, z0 }));    // +y
+    }
+
+    // Horizontal rectangle facing up
+    constexpr UPrimitive<4, 6> UMakePlane(UConstVec3 center, float halfWidth, float halfDepth)
+    {
+        const float x0 = center.x - halfWidth, x1 = center.x + halfWidth;
+        const float z0 = center.z - halfDepth, z1 = center.z + halfDepth;
+        return UMakeQuad({ x0, center.y, z1 }, { x1, center.y, z1 }, { x1, center.y, z0 }, { x0, center.y, z0 });
+    }
+
+    // Rectangular base at lower.y and four flat sides meeting at the apex
+    constexpr UPrimitive<16, 18> UMakePyramid(UConstVec3 lower, UConstVec3 upper, UConstVec3 apex)
+    {
+        const UConstVec3 a = { lower.x, lower.y, lower.z };
+        const UConstVec3 b = { upper.x, lower.y, lower.z };
+        const UConstVec3 c = { upper.x, lower.y, upper.z };
+        const UConstVec3 d = { lower.x, lower.y, upper.z };
+        return UConcatMeshes(UMakeQuad(a, b, c, d), UMakeTriangle(d, c, apex), UMakeTriangle(c, b, apex),
+            UMakeTriangle(b, a, apex), UMakeTriangle(a, d, apex));
+    }
+
+    // Upright cylinder on its base center: a smooth side of Segments facets and two flat caps
+    template <int Segments>
+    constexpr UPrimitive<4 * Segments + 6, 12 * Segments> UMakeCylinder(UConstVec3 base, float radius, float height)
+    {
+        static_assert(Segments >= 3, "A cylinder needs at least three segments");
+        UPrimitive<4 * Segments + 6, 12 * Segments> mesh{};
+        const int bottomCenter = 2 * (Segments + 1);
+        const int topCenter = bottomCenter + Segments + 2;
+        mesh.verts[bottomCenter] = { base, { 0.0f, -1.0f, 0.0f } };
+        mesh.verts[topCenter] = { { base.x, base.y + height, base.z }, { 0.0f, 1.0f, 0.0f } };
+        for (int s = 0; s <= Segments; ++s)
+        {
+            const double angle = 2.0 * 3.14159265358979323846 * s / Segments;
+            const UConstVec3 direction = { static_cast<float>(UConstCos(angle)), 0.0f, static_cast<float>(-UConstSin(angle)) };
+            const UConstVec3 bottom = base + direction * radius;
+            const UConstVec3 top = { bottom.x, bottom.y + height, bottom.z };
+            mesh.verts[2 * s] = { bottom, direction };
+            mesh.verts[2 * s + 1] = { top, direction };
+            mesh.verts[bottomCenter + 1 + s] = { bottom, { 0.0f, -1.0f, 0.0f } };
+            mesh.verts[topCenter + 1 + s] = { top, { 0.0f, 1.0f, 0.0f } };
+        }
+        for (int s = 0; s < Segments; ++s)
+        {
+            const GLushort side[6] = { GLushort(2 * s), GLushort(2 * s + 2), GLushort(2 * s + 3), GLushort(2 * s), GLushort(2 * s + 3), GLushort(2 * s + 1) };
+            const GLushort caps[6] = { GLushort(bottomCenter), GLushort(bottomCenter + 2 + s), GLushort(bottomCenter + 1 + s),
+                GLushort(topCenter), GLushort(topCenter + 1 + s), GLushort(topCenter + 2 + s) };
+            for (int i = 0; i < 6; ++i)
+            {
+                mesh.indices[6 * s + i] = side[i];
+                mesh.indices[6 * Segments + 6 * s + i] = caps[i];
+            }
+        }
+        return mesh;
+    }
+
+    // Latitude-longitude sphere with smooth normals; the pole rows are triangles rather than thin quads
+    template <int Slices, int Stacks>
+    constexpr UPrimitive<(Slices + 1) * (Stacks + 1), 6 * Slices * (Stacks - 1)> UMakeSphere(UConstVec3 center, float radius)
+    {
+        static_assert(Slices >= 3 && Stacks >= 2, "A sphere needs at least three slices and two stacks");
+        UPrimitive<(Slices + 1) * (Stacks + 1), 6 * Slices * (Stacks - 1)> mesh{};
+        const double pi = 3.14159265358979323846;
+        for (int stack = 0; stack <= Stacks; ++stack)
+        {
+            const double polar = pi * stack / Stacks;
+            for (int slice = 0; slice <= Slices; ++slice)
+            {
+                const double azimuth = 2.0 * pi * slice / Slices;
+                const UConstVec3 normal = { static_cast<float>(UConstSin(polar) * UConstCos(azimuth)), static_cast<float>(UConstCos(polar)),
+                    static_cast<float>(-UConstSin(polar) * UConstSin(azimuth)) };
+                mesh.verts[stack * (Slices + 1) + slice] = { center + normal * radius, normal };
+            }
+        }
+        int index = 0;
+        for (int stack = 0; stack < Stacks; ++stack)
+            for (int slice = 0; slice < Slices; ++slice)
+            {
+                const GLushort a = GLushort(stack * (Slices + 1) + slice);
+                const GLushort b = GLushort(a + Slices + 1);
+                if (stack != 0)
+                {
+                    mesh.indices[index++] = a;
+                    mesh.indices[index++] = b;
+                    mesh.indices[index++] = GLushort(a + 1);
+                }
+                if (stack != Stacks - 1)
+                {
+                    mesh.indices[index++] = GLushort(a + 1);
+                    mesh.indices[index++] = b;
+                    mesh.indices[index++] = GLushort(b + 1);
+                }
+            }
+        return mesh;
+    }
+
+    // Packs a primitive as one part of the scene mesh. Texture coordinates are box mapped: each vertex projects
+    // along the dominant axis of its normal onto the part's bounding box.
+    template <int VertexCount, int IndexCount>
+    constexpr UPackedMesh<VertexCount, IndexCount> UPackPart(const UPrimitive<VertexCount, IndexCount>& primitive, GLushort material,
+        UConstVec3 color)
+    {
+        UConstVec3 lower = primitive.verts[0].position;
+        UConstVec3 upper = lower;
+        for (const UMeshVertex& vertex : primitive.verts)
+        {
+            const UConstVec3 p = vertex.position;
+            lower = { p.x < lower.x ? p.x : lower.x, p.y < lower.y ? p.y : lower.y, p.z < lower.z ? p.z : lower.z };
+            upper = { p.x > upper.x ? p.x : upper.x, p.y > upper.y ? p.y : upper.y, p.z > upper.z ? p.z : upper.z };
+        }
+        const UConstVec3 extent = upper - lower;
+
+        UPackedMesh<VertexCount, IndexCount> mesh{};
+        for (int v = 0; v < VertexCount; ++v)
+        {
+            const UConstVec3 p = primitive.verts[v].position;
+            const UConstVec3 n = primitive.verts[v].normal;
+            const UConstVec3 local = { extent.x > 1e-6f ? (p.x - lower.x) / extent.x : 0.0f, extent.y > 1e-6f ? (p.y - lower.y) / extent.y : 0.0f,
+                extent.z > 1e-6f ? (p.z - lower.z) / extent.z : 0.0f };
+            const float ax = UConstAbs(n.x), ay = UConstAbs(n.y), az = UConstAbs(n.z);
+            const float u = ax >= ay && ax >= az ? local.z : local.x;
+            const float w = ax >= ay && ax >= az ? local.y : ay >= az ? local.z : local.y;
+
+            UPackedVertex& vertex = mesh.verts[v];
+            vertex.position[0] = UConstPackHalf(p.x);
+            vertex.position[1] = UConstPackHalf(p.y);
+            vertex.position[2] = UConstPackHalf(p.z);
+            vertex.material = material;
+            vertex.normal = UConstPackSnorm1010102(n);
+            vertex.color[0] = UConstPackUnorm8(color.x);
+            vertex.color[1] = UConstPackUnorm8(color.y);
+            vertex.color[2] = UConstPackUnorm8(color.z);
+            vertex.color[3] = 255;
+            vertex.uv[0] = UConstPackUnorm16(u);
+            vertex.uv[1] = UConstPackUnorm16(w);
+        }
+        for (int i = 0; i < IndexCount; ++i)
+            mesh.indices[i] = primitive.indices[i];
+        return mesh;
+    }
+
+    // Objects of the table. The plane sits 0.01 below the box so the box does not show through it.
+    constexpr auto SCENE_BOX = UPackPart(UMakeBox({ -2.5f, -0.5f, -0.5f }, { -2.0f, 0.0f, 0.5f }), UMATERIAL_CHECKERBOARD, { 1.0f, 1.0f, 1.0f });
+    constexpr auto SCENE_PLANE = UPackPart(UMakePlane({ 0.0f, -0.51f, 0.0f }, 5.0f, 5.0f), UMATERIAL_DESK, { 0.5f, 0.5f, 1.0f });
+    constexpr auto SCENE_PYRAMID = UPackPart(UMakePyramid({ 2.0f, -0.5f, 2.0f }, { 4.0f, -0.5f, 4.0f }, { 3.0f, 1.0f, 3.0f }), UMATERIAL_NONE,
+        { 0.0f, 0.0f, 1.0f });
+    // A shed: walls with a sloping top under an overhanging roof
+    constexpr auto SCENE_HOUSE = UPackPart(UConcatMeshes(
+        UMakeQuad({ 3.5f, -0.5f, -4.0f }, { -0.5f, -0.5f, -4.0f }, { -0.5f, 2.5f, -4.0f }, { 3.5f, 2.5f, -4.0f }),     // Back wall
+        UMakeQuad({ -0.5f, -0.5f, -2.0f }, { 3.5f, -0.5f, -2.0f }, { 3.5f, 1.0f, -2.0f }, { -0.5f, 1.0f, -2.0f }),     // Front wall
+        UMakeQuad({ 3.5f, -0.5f, -2.0f }, { 3.5f, -0.5f, -4.0f }, { 3.5f, 2.5f, -4.0f }, { 3.5f, 1.0f, -2.0f }),       // Right wall
+        UMakeQuad({ -0.5f, -0.5f, -4.0f }, { -0.5f, -0.5f, -2.0f }, { -0.5f, 1.0f, -2.0f }, { -0.5f, 2.5f, -4.0f }),   // Left wall
+        UMakeQuad({ -1.0f, 0.85f, -1.8f }, { 4.0f, 0.85f, -1.8f }, { 4.0f, 2.5f, -4.0f }, { -1.0f, 2.5f, -4.0f })),    // Roof
+        UMATERIAL_NONE, { 0.0f, 0.0f, 1.0f });
+    constexpr auto SCENE_LAMP = UPackPart(UMakeSphere<16, 8>({ 0.0f, 0.0f, 0.0f }, 0.5f), UMATERIAL_NONE, { 1.0f, 1.0f, 1.0f });
+
+    // The scene mesh, parts in sceneParts order, followed by the lamp, which is drawn on its own
+    constexpr auto SCENE_MESH = UConcatMeshes(SCENE_BOX, SCENE_PLANE, SCENE_PYRAMID, SCENE_HOUSE, SCENE_LAMP);
+    const int SCENE_VERTEX_COUNT = SCENE_MESH.vertexCount - SCENE_LAMP.vertexCount;
+    const int SCENE_INDEX_COUNT = SCENE_MESH.indexCount - SCENE_LAMP.indexCount;
+    const int LAMP_FIRST_INDEX = SCENE_INDEX_COUNT;
+    const int LAMP_INDEX_COUNT = SCENE_LAMP.indexCount;
+
+    template <typename Vertex, int VertexCount, int IndexCount>
+    constexpr bool UIndicesInRange(const UMeshData<Vertex, VertexCount, IndexCount>& mesh)
+    {
+        for (GLushort index : mesh.indices)
+            if (index >= VertexCount)
+                return false;
+        return true;
+    }
+
+    static_assert(UIndicesInRange(SCENE_MESH) && UIndicesInRange(UMakeCylinder<12>({ 0.0f, 0.0f, 0.0f }, 1.0f, 1.0f)),
+        "Generated mesh indexes past its vertices");
+
+    constexpr UMeshPart SCENE_PARTS[] = {
+        { 0, GLushort(SCENE_BOX.vertexCount), UMATERIAL_CHECKERBOARD, "Box" },
+        { GLushort(SCENE_BOX.vertexCount), GLushort(SCENE_PLANE.vertexCount), UMATERIAL_DESK, "Plane" },
+        { GLushort(SCENE_BOX.vertexCount + SCENE_PLANE.vertexCount), GLushort(SCENE_PYRAMID.vertexCount), UMATERIAL_NONE, "Pyramid" },
+        { GLushort(SCENE_BOX.vertexCount + SCENE_PLANE.vertexCount + SCENE_PYRAMID.vertexCount), GLushort(SCENE_HOUSE.vertexCount), UMATERIAL_NONE, "House" },
+    };
+
+    // Shader permutations: a shader source names the features it can be specialized on as FEATURE_<NAME> keys,
+    // and every combination a draw asks for is compiled once with each key defined true or false in a prelude
+    // after the #version line. The branches on the keys are constant, so the compiler drops the code of the
+    // features a variant does not have. Variants are keyed by their feature bits and built on first use, or
+    // ahead of time for the ones known when the set is created.
+    enum UShaderFeature : uint32_t
+    {
+        USHADER_TEXTURED = 1 << 0,          // Albedo from the material textures rather than objectColor
+        USHADER_PROBE_LIGHTING = 1 << 1,    // Ambient and diffuse from the baked irradiance probes
+        USHADER_MULTIVIEW = 1 << 2,         // Every view of a multiview pass from one draw (see UMultiview)
+        USHADER_GPU_DRIVEN = 1 << 3,        // Model matrix from the culled object records rather than a uniform (see UGpuScene)
+    };
+    const int SHADER_FEATURE_COUNT = 4;
+    const char* const SHADER_FEATURE_NAMES[SHADER_FEATURE_COUNT] = { "TEXTURED", "PROBE_LIGHTING", "MULTIVIEW", "GPU_DRIVEN" };
+
+    // Shading constants of the lit shaders, defined in every prelude so they fold like literals. The prelude
+    // also carries the multiview lines of the stage (UMultiviewPrelude).
+    const char* const SHADER_CONSTANTS =
+        "#define AMBIENT_STRENGTH 0.1\n"
+        "#define SPECULAR_INTENSITY 1.0\n"
+        "#define HIGHLIGHT_SIZE 16.0\n";
+
+    struct UShaderVariant
+    {
+        uint32_t features;
+        GLuint programId;
+    };
+
+    struct UShaderPermutations
+    {
+        const char* name = "";
+        const char* vertexSource = nullptr;
+        const char* sharedTessSource = nullptr;     // Null for programs without tessellation stages
+        const char* tessControlSource = nullptr;
+        const char* tessEvaluationSource = nullptr;
+        const char* fragmentSource = nullptr;
+        GLuint libraryShaderId = 0;                 // Linked into every variant, as with UCreateShaderProgram
+        uint32_t declared = 0;                      // Features whose key appears in a stage; other bits are ignored
+        void (*setup)(GLuint programId, uint32_t features) = nullptr;   // Fixed uniforms of a new variant
+        std::vector<UShaderVariant> variants;       // A handful at most, searched in order
+    };
+
+    // Index range of every scene part, in SCENE_PARTS order, and the variant of the clay shader it takes. Parts
+    // are objects of the GPU-driven scene, so each one is culled on its own.
+    struct USceneDraw
+    {
+        GLsizei firstIndex;
+        GLsizei indexCount;
+        uint32_t features;
+    };
+
+    constexpr USceneDraw SCENE_DRAWS[] = {
+        { 0, GLsizei(SCENE_BOX.indexCount), USHADER_TEXTURED },
+        { GLsizei(SCENE_BOX.indexCount), GLsizei(SCENE_PLANE.indexCount), USHADER_TEXTURED },
+        { GLsizei(SCENE_BOX.indexCount + SCENE_PLANE.indexCount), GLsizei(SCENE_PYRAMID.indexCount), 0 },
+        { GLsizei(SCENE_BOX.indexCount + SCENE_PLANE.indexCount + SCENE_PYRAMID.indexCount), GLsizei(SCENE_HOUSE.indexCount), 0 },
+    };
+
+    static_assert(sizeof(SCENE_DRAWS) / sizeof(SCENE_DRAWS[0]) == sizeof(SCENE_PARTS) / sizeof(SCENE_PARTS[0]), "One scene draw per part");
+    static_assert(SCENE_DRAWS[3].firstIndex + SCENE_DRAWS[3].indexCount == SCENE_INDEX_COUNT, "Scene draws must cover the scene mesh");
+
+    // Bounding volume hierarchy over triangles for CPU ray queries. Nodes are 32 bytes, two to a cache line, and
+    // siblings are stored next to each other so a node only needs the index of its first child. Leaf triangles
+    // are stored in packs of four in SoA form (vertex 0 and two edges), so one SIMD test covers a whole pack.
+    struct UBvhNode
+    {
+        float lower[3];
+        uint32_t first;         // Interior: left child, the right one follows; leaf: first triangle pack
+        float upper[3];
+        uint32_t count;         // Packs in a leaf, 0 for interior nodes
+    };
+
+    struct UBvhTrianglePack
+    {
+        float v0[3][4];         // x, y, z of vertex 0 of four triangles
+        float e1[3][4];         // Edge v1 - v0
+        float e2[3][4];         // Edge v2 - v0
+        int32_t triangle[4];    // Source triangle, -1 for padding (its edges are zero, so it is never hit)
+    };
+
+    static_assert(sizeof(UBvhNode) == 32, "UBvhNode should stay half a cache line");
+
+    struct UBvh
+    {
+        std::vector<UBvhNode> nodes;
+        std::vector<UBvhTrianglePack> packs;
+        std::vector<int> triangleObject;        // Object of each source triangle
+        std::vector<const char*> objectNames;
+    };
+
+    struct URayHit
+    {
+        int object = -1;
+        int triangle = -1;
+        float distance = 0.0f;
+    };
+
+    const int BVH_BINS = 16;                    // SAH split candidates per axis
+    const int BVH_MAX_LEAF_TRIANGLES = 16;
+    const int BVH_STACK_SIZE = 64;              // Also the deepest the build goes, so traversal never drops a node
+
+    // Baked lighting for the static scene mesh, path traced on the CPU: a lightmap over a second, automatically
+    // unwrapped UV set, and a grid of irradiance probes (ambient cubes) for the geometry without one. Both hold the
+    // light arriving at a surface on the scale of the Phong ambient + diffuse term, so shaders multiply by albedo.
+    const int LIGHTMAP_SIZE = 512;
+    const int LIGHTMAP_GUTTER = 2;              // Texels around each chart, filled by dilation so filtering stays inside
+    const float LIGHTMAP_CHART_COS = 0.99f;     // Triangles sharing a vertex join a chart when their normals are this close
+    const int BAKE_DEFAULT_SAMPLES = 128;       // Hemisphere samples per texel and probe face
+    const int BAKE_BOUNCES = 2;
+    const int BAKE_TEXELS_PER_JOB = 64;
+    const float BAKE_RAY_OFFSET = 1e-3f;        // Lifts rays off their surface so they do not hit it again
+    const float BAKE_SKY = 0.1f;                // Light from rays that leave the scene, the baked form of the ambient term
+    const glm::ivec3 PROBE_GRID(8, 4, 8);
+    const GLuint LIGHTMAP_UNIT = 11;
+    const GLuint PROBE_UNIT = 12;
+
+    // A group of connected, nearly coplanar triangles unwrapped together by projecting along its dominant axis
+    struct ULightmapChart
+    {
+        glm::vec3 normal;
+        int axis;
+        float lower[2];         // Bounds of the projection, in world units
+        float upper[2];
+        int width;              // Size and place in the lightmap, in texels, gutter included
+        int height;
+        int x;
+        int y;
+    };
+
+    // What the path tracer needs: the triangles in world space, their face normals and albedo, and the lamp
+    struct UBakeScene
+    {
+        UBvh bvh;
+        std::vector<glm::vec3> normals;
+        std::vector<glm::vec3> albedo;
+        glm::vec3 lightPosition;
+        glm::vec3 lightColor;
+    };
+
+    // One lightmap texel covered by a triangle: where it is on the surface and which way that surface faces
+    struct UBakeTexel
+    {
+        int texel;
+        glm::vec3 position;
+        glm::vec3 normal;
+    };
+
+    struct UBakedLighting
+    {
+        GLMesh mesh{};                  // The scene mesh with vertices split along chart seams
+        GLuint lightmapUVBuffer = 0;
+        GLuint lightmap = 0;            // RGBA16F, LIGHTMAP_SIZE square
+        GLuint probes = 0;              // RGBA16F 3D; the six faces of every probe sit side by side along x
+        glm::vec3 probeLower;
+        glm::vec3 probeUpper;
+        glm::vec3 lightPosition;        // Where the lamp was when the bake ran
+        UShaderPermutations shaders;    // Lightmapped shading, one variant
+        GLuint programId = 0;
+        bool ready = false;
+    };
+
+    // What a bake computes on the CPU, ready for UUploadBakedLighting
+    struct UBakeResult
+    {
+        std::vector<UPackedVertex> verts;    // The scene mesh split along chart seams
+        std::vector<GLushort> lightmapUV;    // Two unorm16 per vertex
+        std::vector<GLushort> indices;
+        std::vector<glm::vec3> lightmap;     // LIGHTMAP_SIZE square
+        std::vector<glm::vec3> probeTexels;  // In the layout of the probe texture
+        glm::vec3 probeLower;
+        glm::vec3 probeUpper;
+        glm::vec3 lightPosition;
+        bool ok = false;
+    };
+
+    // Texture residency: images of the same format and size share one GL_TEXTURE_2D_ARRAY, each image is a
+    // layer, and shaders reach any of them through the material buffer, so draws never rebind textures.
+    // With ARB_bindless_texture the material holds the array handle; otherwise the arrays sit on fixed units.
+    const int MAX_TEXTURE_ARRAYS = 4;
+    const GLuint TEXTURE_ARRAY_UNIT = 4;        // Units 4..7; the post chain uses 0 and 1
+    const GLuint MATERIAL_BUFFER_BINDING = 3;   // After the parametric buffers 0..2
+
+    struct UTextureImage
+    {
+        std::vector<unsigned char> pixels;      // Freed once uploaded
+        int width;
+        int height;
+        int channels;
+        int array;                              // Texture array and layer it lives in after UCommitTextures
+        int layer;
+    };
+
+    struct UTextureArray
+    {
+        GLenum format;
+        int width;
+        int height;
+        int layers;
+        GLuint texture;
+        GLuint64 handle;                        // Resident bindless handle, 0 without bindless
+    };
+
+    // Mirrors the std430 Material struct in the material shader (48 bytes)
+    struct UMaterialGpu
+    {
+        GLint texture[4];                       // Array, layer, unused, unused; array < 0 when untextured
+        GLuint64 handle;
+        glm::vec2 uvScale;                      // Tiles across the mesh part
+        glm::vec4 tint;
+    };
+
+    static_assert(sizeof(UMaterialGpu) == 48, "UMaterialGpu must match the std430 layout");
+
+    // Frame-scoped bump allocator for transient per-frame data. Two halves alternate, so what a frame wrote is still
+    // intact during the next one (while the GPU or the workers may read it) and is only reset the frame after.
+    // Requests that do not fit go to the heap and are freed with the half; they show up in the overflow statistics.
+    struct UFrameArena
+    {
+        static const int FRAMES = 2;
+
+        unsigned char* storage[FRAMES] = {};
+        std::vector<void*> overflow[FRAMES];    // Heap blocks handed out once the half was full
+        size_t capacity = 0;                    // Bytes per half
+        size_t used = 0;                        // Bytes used by the current frame
+        int current = 0;
+        size_t highWater = 0;                   // Most bytes any single frame used
+        size_t overflowCount = 0;
+        size_t overflowBytes = 0;
+
+        void* Allocate(size_t bytes, size_t alignment)
+        {
+            const uintptr_t base = reinterpret_cast<uintptr_t>(storage[current]);
+            const uintptr_t aligned = (base + used + alignment - 1) & ~uintptr_t(alignment - 1);
+            if (storage[current] && aligned + bytes <= base + capacity)
+            {
+                used = aligned + bytes - base;
+                highWater = std::max(highWater, used);
+                return reinterpret_cast<void*>(aligned);
+            }
+
+            ++overflowCount;
+            overflowBytes += bytes;
+            void* block = ::operator new(bytes);
+            overflow[current].push_back(block);
+            return block;
+        }
+    };
+
+    // STL allocator on top of a frame arena; deallocation is a no-op because the whole half is reset at once.
+    // Containers using it must not outlive the frame after the one that filled them.
+    template <typename T>
+    struct UFrameAllocator
+    {
+        using value_type = T;
+
+        UFrameArena* arena;
+
+        explicit UFrameAllocator(UFrameArena& frameArena) : arena(&frameArena) {}
+        template <typename U>
+        UFrameAllocator(const UFrameAllocator<U>& other) : arena(other.arena) {}
+
+        T* allocate(size_t count) { return static_cast<T*>(arena->Allocate(count * sizeof(T), alignof(T))); }
+        void deallocate(T*, size_t) {}
+    };
+
+    template <typename T, typename U>
+    bool operator==(const UFrameAllocator<T>& a, const UFrameAllocator<U>& b) { return a.arena == b.arena; }
+    template <typename T, typename U>
+    bool operator!=(const UFrameAllocator<T>& a, const UFrameAllocator<U>& b) { return a.arena != b.arena; }
+
+    template <typename T>
+    using UFrameVector = std::vector<T, UFrameAllocator<T>>;
+
+    // Heap allocations made through operator new by the calling thread (see the replacement at the end of the file).
+    // On ELF platforms the GL driver's own operator new resolves to the replacement too; whatever code outside the
+    // program and its C++ runtime allocates is counted apart, as the driver's.
+    thread_local uint64_t tHeapAllocations = 0;
+    thread_local uint64_t tDriverHeapAllocations = 0;
+
+#if defined(__ELF__)
+    // Executable segments of the program and of the C++ runtime, [start, end), recorded once by UFindProgramCode
+    const int MAX_PROGRAM_CODE_RANGES = 16;
+    uintptr_t gProgramCode[MAX_PROGRAM_CODE_RANGES][2];
+    std::atomic<int> gProgramCodeRanges{ 0 };
+
+    // Whether code at an address belongs to a library other than the program and the C++ runtime: the GL driver.
+    // Nothing is driver code until the ranges are recorded.
+    inline bool UIsDriverCode(const void* address)
+    {
+        const int count = gProgramCodeRanges.load(std::memory_order_acquire);
+        const uintptr_t value = reinterpret_cast<uintptr_t>(address);
+        for (int i = 0; i < count; ++i)
+            if (value >= gProgramCode[i][0] && value < gProgramCode[i][1])
+                return false;
+        return count > 0;
+    }
+#endif
+
+    // GPU resource registry: every buffer, texture, renderbuffer and program with its size and creation site.
+    // Tags group resources by owner; a tag can have a byte budget and an eviction callback that is asked to
+    // free memory once per frame while the tag is over it (never from inside the allocation that crossed it).
+    enum UGpuResourceKind { UGPU_BUFFER, UGPU_TEXTURE, UGPU_RENDERBUFFER, UGPU_PROGRAM, UGPU_KIND_COUNT };
+
+    struct UGpuResource
+    {
+        int kind;
+        GLuint id;
+        size_t bytes;
+        const char* tag;
+        const char* file;
+        int line;
+    };
+
+    struct UGpuBudget
+    {
+        std::string tag;
+        size_t limit = 0;                               // Bytes, 0 for no limit
+        std::function<size_t(size_t overBytes)> evict;  // Frees memory of the tag, returns the bytes it released
+        bool exceeded = false;                          // Set on registration, handled by UEnforceGpuBudgets
+        bool warned = false;                            // Warn once per excursion over the limit
+    };
+
+    // The scene holds tens of objects, so lookups are linear
+    struct UGpuRegistry
+    {
+        std::vector<UGpuResource> resources;
+        std::vector<UGpuBudget> budgets;
+        size_t totalBytes = 0;
+        size_t peakBytes = 0;
+    };
+
+    const char* const GPU_RESOURCE_KIND_NAMES[UGPU_KIND_COUNT] = { "buffer", "texture", "renderbuffer", "program" };
+
+    // Fixed-size pool of worker threads; each job gets the index of the worker running it
+    struct UThreadPool
+    {
+        std::vector<std::thread> workers;
+        std::deque<std::function<void(int)>> jobs;
+        std::mutex mutex;
+        std::condition_variable wake;       // Signals workers: a job arrived or the pool stops
+        std::condition_variable idle;       // Signals waiters: the queue drained and no job runs
+        int running = 0;
+        bool stopping = false;
+        const char* name = "worker";        // Threads and jobs on the profiler timeline
+    };
+
+    // A bake started during the session (F5) runs on a thread of its own, so frames keep coming; the render
+    // thread uploads the result once it is done
+    struct UBakeJob
+    {
+        UThreadPool pool;               // One thread; the bake fans out over its own workers
+        UBakeResult result;
+        std::atomic<bool> done{ false };
+        std::atomic<bool> cancel{ false };
+        bool running = false;
+        bool switchOn = false;          // Turn baked shading on when the result arrives
+    };
+
+    // CPU rasterizer for machines without a GL driver. Triangles are set up and binned into square tiles in
+    // parallel, then every tile is rasterized and shaded by one worker, eight pixels at a time, into its own
+    // part of an in-memory framebuffer. Shading is the clay program's Phong model with the same parameters.
+    const int SOFTWARE_TILE_SIZE = 64;          // A multiple of the eight lanes
+    const int SOFTWARE_TRIANGLES_PER_JOB = 256;
+    const int SOFTWARE_TESSELLATION_LEVEL = 16; // Segments per patch edge of the curved primitives; the GPU adapts it
+
+    // --software-reference: a pixel matches the GL frame when no channel is off by more than the tolerance, which
+    // leaves room for the post chain's anti-aliasing and the fixed tessellation. Edges account for up to a quarter
+    // percent of mismatched pixels; leaving out the curved primitives alone costs about half a percent.
+    const int SOFTWARE_REFERENCE_TOLERANCE = 32;
+    const double SOFTWARE_REFERENCE_MAX_MISMATCH = 0.004;
+
+    // Eight float lanes: one AVX register when the build targets AVX2, a plain array the compiler may vectorize
+    // otherwise. Comparisons return masks with every bit of a lane set or clear.
+    struct UFloat8
+    {
+#if USIMD_AVX2
+        __m256 v;
+#else
+        float v[8];
+#endif
+    };
+
+#if USIMD_AVX2
+    inline UFloat8 UBroadcast8(float x) { return { _mm256_set1_ps(x) }; }
+    inline UFloat8 ULoad8(const float* p) { return { _mm256_loadu_ps(p) }; }
+    inline void UStore8(float* p, UFloat8 a) { _mm256_storeu_ps(p, a.v); }
+    inline UFloat8 operator+(UFloat8 a, UFloat8 b) { return { _mm256_add_ps(a.v, b.v) }; }
+    inline UFloat8 operator-(UFloat8 a, UFloat8 b) { return { _mm256_sub_ps(a.v, b.v) }; }
+    inline UFloat8 operator*(UFloat8 a, UFloat8 b) { return { _mm256_mul_ps(a.v, b.v) }; }
+    inline UFloat8 operator/(UFloat8 a, UFloat8 b) { return { _mm256_div_ps(a.v, b.v) }; }
+    inline UFloat8 UMin8(UFloat8 a, UFloat8 b) { return { _mm256_min_ps(a.v, b.v) }; }
+    inline UFloat8 UMax8(UFloat8 a, UFloat8 b) { return { _mm256_max_ps(a.v, b.v) }; }
+    inline UFloat8 USqrt8(UFloat8 a) { return { _mm256_sqrt_ps(a.v) }; }
+    inline UFloat8 ULess8(UFloat8 a, UFloat8 b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+    inline UFloat8 UGreaterEqual8(UFloat8 a, UFloat8 b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) }; }
+    inline UFloat8 UAnd8(UFloat8 a, UFloat8 b) { return { _mm256_and_ps(a.v, b.v) }; }
+    inline UFloat8 USelect8(UFloat8 mask, UFloat8 a, UFloat8 b) { return { _mm256_blendv_ps(b.v, a.v, mask.v) }; }
+    inline int UMask8(UFloat8 mask) { return _mm256_movemask_ps(mask.v); }
+#else
+    inline float UMaskLane(bool set)
+    {
+        const uint32_t bits = set ? 0xffffffffu : 0u;
+        float lane;
+        memcpy(&lane, &bits, sizeof(lane));
+        return lane;
+    }
+
+    inline uint32_t ULaneBits(float lane)
+    {
+        uint32_t bits;
+        memcpy(&bits, &lane, sizeof(bits));
+        return bits;
+    }
+
+    inline UFloat8 UBroadcast8(float x) { UFloat8 r; for (int i = 0; i < 8; ++i) r.v[i] = x; return r; }
+    inline UFloat8 ULoad8(const float* p) { UFloat8 r; memcpy(r.v, p, sizeof(r.v)); return r; }
+    inline void UStore8(float* p, UFloat8 a) { memcpy(p, a.v, sizeof(a.v)); }
+    inline UFloat8 operator+(UFloat8 a, UFloat8 b) { for (int i = 0; i < 8; ++i) a.v[i] += b.v[i]; return a; }
+    inline UFloat8 operator-(UFloat8 a, UFloat8 b) { for (int i = 0; i < 8; ++i) a.v[i] -= b.v[i]; return a; }
+    inline UFloat8 operator*(UFloat8 a, UFloat8 b) { for (int i = 0; i < 8; ++i) a.v[i] *= b.v[i]; return a; }
+    inline UFloat8 operator/(UFloat8 a, UFloat8 b) { for (int i = 0; i < 8; ++i) a.v[i] /= b.v[i]; return a; }
+    inline UFloat8 UMin8(UFloat8 a, UFloat8 b) { for (int i = 0; i < 8; ++i) a.v[i] = std::min(a.v[i], b.v[i]); return a; }
+    inline UFloat8 UMax8(UFloat8 a, UFloat8 b) { for (int i = 0; i < 8; ++i) a.v[i] = std::max(a.v[i], b.v[i]); return a; }
+    inline UFloat8 USqrt8(UFloat8 a) { for (int i = 0; i < 8; ++i) a.v[i] = std::sqrt(a.v[i]); return a; }
+    inline UFloat8 ULess8(UFloat8 a, UFloat8 b) { for (int i = 0; i < 8; ++i) a.v[i] = UMaskLane(a.v[i] < b.v[i]); return a; }
+    inline UFloat8 UGreaterEqual8(UFloat8 a, UFloat8 b) { for (int i = 0; i < 8; ++i) a.v[i] = UMaskLane(a.v[i] >= b.v[i]); return a; }
+    inline UFloat8 UAnd8(UFloat8 a, UFloat8 b) { for (int i = 0; i < 8; ++i) a.v[i] = UMaskLane(ULaneBits(a.v[i]) & ULaneBits(b.v[i])); return a; }
+    inline UFloat8 USelect8(UFloat8 mask, UFloat8 a, UFloat8 b) { for (int i = 0; i < 8; ++i) a.v[i] = ULaneBits(mask.v[i]) ? a.v[i] : b.v[i]; return a; }
+    inline int UMask8(UFloat8 mask) { int bits = 0; for (int i = 0; i < 8; ++i) bits |= (ULaneBits(mask.v[i]) >> 31) << i; return bits; }
+#endif
+
+    // Mip chain of one material image, box filtered like glGenerateMipmap, RGBA8
+    struct USoftwareTexture
+    {
+        std::vector<std::vector<unsigned char>> levels;
+        std::vector<glm::ivec2> sizes;
+    };
+
+    // Vertex after the vertex stage: clip position and what the clay shader passes to the fragment stage
+    struct USoftwareVertex
+    {
+        glm::vec4 clip;
+        glm::vec3 world;
+        glm::vec3 normal;
+        glm::vec2 uv;
+    };
+
+    // Triangle after clipping and setup, in pixels with y down. Edge functions A*x + B*y + C are positive inside.
+    // Depth, 1/w and the attributes divided by w are planes of the same form, so they interpolate linearly and
+    // dividing by the 1/w plane makes the attributes perspective correct.
+    enum USoftwarePlane { USOFT_DEPTH, USOFT_INVERSE_W, USOFT_WORLD, USOFT_NORMAL = USOFT_WORLD + 3, USOFT_UV = USOFT_NORMAL + 3, USOFT_PLANE_COUNT = USOFT_UV + 2 };
+
+    struct USoftwareTriangle
+    {
+        float edge[3][3];
+        float plane[USOFT_PLANE_COUNT][3];
+        int bounds[4];          // First and last pixel column and row covered
+        int material;           // -1 when untextured
+        bool lit;               // False for the lamp, which is flat white
+    };
+
+    // One mesh submitted to the software renderer. Without indices the vertices are read in order, as
+    // glDrawArrays does.
+    struct USoftwareDraw
+    {
+        const std::vector<UPackedVertex>* verts;
+        const std::vector<GLushort>* indices;
+        GLsizei count;
+        glm::mat4 model;
+        bool lit;
+    };
+
+    // Everything URender hands the clay program that the software renderer uses too
+    struct USoftwareFrame
+    {
+        glm::mat4 view;
+        glm::mat4 projection;
+        glm::vec3 objectColor;
+        glm::vec3 lightColor;
+        glm::vec3 lightPosition;
+        glm::vec3 viewPosition;
+    };
+
+    struct USoftwareRenderer
+    {
+        int width = 0;
+        int height = 0;
+        int tilesX = 0;
+        int tilesY = 0;
+        std::vector<uint32_t> color;                // RGBA8, rows top to bottom
+        std::vector<float> depth;
+        std::vector<USoftwareTexture> textures;
+        std::vector<UMaterialGpu> materials;        // texture[0] is the image index, as UAddMaterial stores it
+        UThreadPool pool;
+        int workers = 0;
+
+        // One triangle list and set of tile bins per setup job, so jobs never share a container; a tile walks
+        // them in job order, which keeps the submission order
+        std::vector<std::vector<USoftwareTriangle>> triangles;
+        std::vector<std::vector<std::vector<uint32_t>>> bins;
+    };
+
+    // Frame capture: the presented image is read into a ring of pixel buffers behind fences and mapped a few
+    // frames later, when the copy has long finished, so the render thread never waits on the GPU. The pixels
+    // go to worker threads that encode a PNG file per frame or append to one raw y4m stream.
+    enum UCaptureFormat { UCAPTURE_PNG, UCAPTURE_Y4M };
+
+    const int CAPTURE_RING_SIZE = 4;                // Pixel buffers; a frame is mapped up to three frames after its read
+    const int CAPTURE_FRAMES_PER_WORKER = 2;        // CPU copies an encoder can have queued behind the one it works on
+    const int CAPTURE_Y4M_FRAME_RATE = 60;          // Nominal rate in the y4m header; dropped frames shorten the clip
+    const GLuint64 CAPTURE_FLUSH_TIMEOUT_NS = 1000000000;   // Longest wait for an outstanding readback at shutdown
+    const int CAPTURE_PNG_COMPRESSION = 5;          // stb_image_write's fastest level; rendered frames compress well anyway
+
+    // One frame copied out of a pixel buffer for an encoder, with the encoder's scratch memory. Everything is
+    // sized when the capture starts.
+    struct UCapturedFrame
+    {
+        unsigned long long number = 0;          // Position among the captured frames: file number, stream order
+        std::vector<unsigned char> pixels;      // RGBA rows bottom to top, as glReadPixels returns them
+        std::vector<unsigned char> rgb;         // RGB rows top to bottom, what the PNG encoder takes
+        std::vector<unsigned char> encoded;     // PNG file or y4m frame; reserved for the usual PNG size
+    };
+
+    struct UCaptureSlot
+    {
+        GLuint buffer = 0;                      // GL_PIXEL_PACK_BUFFER of one frame
+        GLsync fence = 0;                       // Set while the read is in flight
+    };
+
+    struct UFrameCapture
+    {
+        int format = UCAPTURE_PNG;
+        std::string path;                       // printf pattern of the PNG files, or the y4m file
+        int width = 0;                          // Captured size; frames of another size are dropped
+        int height = 0;
+
+        UCaptureSlot ring[CAPTURE_RING_SIZE];
+        int nextSlot = 0;                       // Slot the next frame is read into
+        int pending = 0;                        // Reads in flight, ending just before nextSlot
+
+        UThreadPool pool;
+        int workers = 0;
+        std::vector<UCapturedFrame> frames;
+        std::vector<int> freeFrames;
+        UBoundedQueue<int, 64> finished;        // Frames the encoders are done with
+
+        // The y4m stream is appended to in capture order by whichever worker holds the next frame
+        FILE* stream = nullptr;
+        std::mutex streamMutex;
+        std::condition_variable streamTurn;
+        unsigned long long nextStreamFrame = 0;
+
+        unsigned long long captured = 0;        // Handed to the encoders
+        unsigned long long droppedReadback = 0; // Every pixel buffer still in flight: the GPU is behind
+        unsigned long long droppedEncoder = 0;  // No free CPU frame: the encoders are behind
+        unsigned long long droppedSize = 0;     // Window size differs from the capture size
+        unsigned long long reportedDrops = 0;
+        std::atomic<unsigned long long> failed{ 0 };            // Frames that could not be written
+        std::atomic<unsigned long long> encodeMicroseconds{ 0 };
+    };
+
+    // Virtual texture page file: this header, then every page of mip 0 in row-major order, then mip 1 and so on
+    // up to the single page of the last mip. A page is PAGE_CONTENT texels square plus a PAGE_BORDER copied from
+    // its neighbours (wrapping), stored as RGBA8.
+    struct UVirtualTextureHeader
+    {
+        char magic[4];                      // "UVT1"
+        uint32_t width;                     // Mip 0 size in texels, a power of two of at least one page
+        uint32_t height;
+        uint32_t pageContent;
+        uint32_t pageBorder;
+        uint32_t mipCount;
+        uint32_t pageCount;
+    };
+
+    const int VIRTUAL_PAGE_CONTENT = 128;
+    const int VIRTUAL_PAGE_BORDER = 4;
+    const int VIRTUAL_PAGE_SIZE = VIRTUAL_PAGE_CONTENT + 2 * VIRTUAL_PAGE_BORDER;
+    const size_t VIRTUAL_PAGE_BYTES = size_t(VIRTUAL_PAGE_SIZE) * VIRTUAL_PAGE_SIZE * 4;
+    const int VIRTUAL_CACHE_PAGES = 8;              // Physical cache is 8 x 8 pages, whatever the texture size
+    const int VIRTUAL_LOADS_IN_FLIGHT = 16;
+    const int VIRTUAL_UPLOADS_PER_FRAME = 8;
+    const GLuint VIRTUAL_INDIRECTION_UNIT = 8;
+    const GLuint VIRTUAL_CACHE_UNIT = 9;
+    const GLuint VIRTUAL_SPARSE_UNIT = 10;
+    const GLuint VIRTUAL_FEEDBACK_BINDING = 4;
+
+    // A page read by a worker into a staging buffer, waiting for the render thread to upload it
+    struct UVirtualPageLoad
+    {
+        int page;
+        bool ok;
+        std::vector<unsigned char> pixels;
+    };
+
+    // Pages stream from the page file into a fixed physical cache. The indirection texture has one texel per
+    // virtual page at every mip and tells the shader where (or whether) that page is resident. Fragments record
+    // the pages they want in the feedback buffer, which comes back asynchronously and drives the requests.
+    struct UVirtualTexture
+    {
+        UVirtualTextureHeader header = {};
+        int pagesX = 0;                     // Pages of mip 0
+        int pagesY = 0;
+        std::vector<int> mipOffset;         // Index of the first page of each mip
+        std::vector<int> pageSlot;          // Cache slot holding each page, -1 when not resident
+        std::vector<unsigned char> pageLoading;
+        std::vector<int> slotPage;          // Page held by each cache slot, -1 when free
+        std::vector<unsigned long long> slotLastUsed;
+        int pinnedPage = -1;                // The last mip's page, always resident so every lookup resolves
+
+        GLuint indirection = 0;             // GL_RGBA8UI, one texel per page per mip: cache x, cache y, -, resident
+        GLuint cache = 0;                   // Physical pages, or the sparse texture itself
+        GLuint feedback = 0;                // uint frame stamp per page, written by fragments
+        GLuint readback = 0;
+        GLsync readbackFence = 0;
+        GLuint readbackStamp = 0;
+        std::vector<GLuint> feedbackData;
+        bool sparse = false;
+
+        UThreadPool pool;
+        std::vector<FILE*> workerFiles;     // One handle per worker so reads do not serialize on a seek
+        std::vector<UVirtualPageLoad> staging;
+        std::vector<int> freeStaging;
+        UBoundedQueue<int, 32> completed;   // Staging indices finished by the workers
+
+        unsigned long long loads = 0;
+        unsigned long long evictions = 0;
+    };
+
+    // Streamed world file: this header, the table of cell records in row-major order (x fastest), then each cell's
+    // vertices and 16-bit indices. Positions are relative to the cell's corner so half floats stay precise on a
+    // site of any size; the cell's world offset is applied by the model matrix.
+    struct UWorldHeader
+    {
+        char magic[4];                      // "UWS1"
+        uint32_t cellsX;
+        uint32_t cellsZ;
+        float cellSize;                     // World units per cell side
+        float origin[3];                    // World position of the corner of cell 0
+    };
+
+    struct UWorldCellRecord
+    {
+        uint64_t offset;                    // Byte offset of the cell's vertices in the file
+        uint32_t vertexCount;
+        uint32_t indexCount;
+    };
+
+    const uint32_t WORLD_DEFAULT_CELLS = 64;        // --world-size default: 64 x 64 cells
+    const float WORLD_CELL_SIZE = 8.0f;
+    const int WORLD_LOAD_RADIUS = 3;                // Cells kept around the camera and around where it is heading
+    const double WORLD_PREFETCH_SECONDS = 1.5;      // How far ahead the velocity is extrapolated
+    const int WORLD_LOADS_IN_FLIGHT = 8;
+    const int WORLD_UPLOADS_PER_FRAME = 2;          // Caps the buffer creation work a frame can take on
+    const int WORLD_GROUND_INDICES = 6;             // Every cell starts with its textured ground quad
+    const uint32_t WORLD_MAX_CELL_VERTICES = 65536; // Indexed with GLushort
+    const uint32_t WORLD_MAX_CELL_INDICES = 6 * WORLD_MAX_CELL_VERTICES; // Well above the two triangles per vertex of closed meshes
+    const size_t WORLD_DEFAULT_BUDGET = 32u << 20;  // "world" GPU budget unless --gpu-budget sets one
+
+    enum UWorldCellState { UCELL_UNLOADED, UCELL_LOADING, UCELL_RESIDENT };
+
+    // A cell read by a worker, waiting for the render thread to upload it
+    struct UWorldCellLoad
+    {
+        int cell;
+        bool ok;
+        std::vector<UPackedVertex> verts;
+        std::vector<GLushort> indices;
+    };
+
+    struct UWorldCell
+    {
+        int state = UCELL_UNLOADED;
+        GLuint vao = 0;
+        GLuint buffers[2] = {};
+        GLsizei indexCount = 0;
+    };
+
+    // Only the header and the cell table are read up front; cells near the camera (and near where it will be
+    // shortly) are read on the I/O threads and uploaded a few per frame. The "world" GPU budget evicts the
+    // farthest cells.
+    struct UWorld
+    {
+        UWorldHeader header = {};
+        uint64_t fileSize = 0;
+        std::vector<UWorldCellRecord> records;
+        std::vector<UWorldCell> cells;
+        std::vector<int> resident;          // Indices of the resident cells, in no particular order
+
+        glm::vec3 lastCameraPosition = glm::vec3(0.0f);
+        glm::vec3 velocity = glm::vec3(0.0f); // Smoothed camera velocity, units per second
+
+        UThreadPool pool;
+        std::vector<FILE*> workerFiles;
+        std::vector<UWorldCellLoad> staging;
+        std::vector<int> freeStaging;
+        UBoundedQueue<int, 32> completed;
+
+        unsigned long long loads = 0;
+        unsigned long long evictions = 0;
+        double worstUpdateMs = 0.0;         // Longest UUpdateWorld, the hitch the streaming adds to a frame
+    };
+
+    struct UTextureResidency
+    {
+        std::vector<UTextureImage> images;
+        std::vector<UTextureArray> arrays;
+        std::vector<UMaterialGpu> materials;
+        GLuint materialBuffer = 0;
+        GLuint materialShader = 0;              // Fragment shader object with materialColor(), linked into the lit programs
+        bool bindless = false;
+    };
+
+    // Curved primitives evaluated on the GPU by the tessellation stages from a few bytes of control data
+    enum UParametricType { UPARAMETRIC_SPHERE, UPARAMETRIC_CYLINDER, UPARAMETRIC_TORUS, UPARAMETRIC_BICUBIC };
+
+    struct UParametricPrimitive
+    {
+        int type;                   // One of UParametricType
+        int node;                   // Transform node placing the primitive
+        glm::vec4 params;           // Sphere: radius; cylinder: radius, height; torus: major, minor radius
+        int controlPointOffset;     // First of 16 control points for bicubic patches, -1 otherwise
+    };
+
+    // std430 mirrors of the records read by the tessellation shaders
+    struct UParametricGpuPrimitive
+    {
+        glm::mat4 model;
+        glm::mat4 normalMatrix;
+        glm::vec4 params;
+        GLint info[4];              // type, controlPointOffset
+    };
+
+    struct UParametricGpuPatch
+    {
+        glm::vec4 uvRange;          // u0, v0, u1, v1 inside the primitive's parameter domain
+        GLint info[4];              // primitive, region (cylinder body or caps)
+    };
+
+    // Offscreen framebuffer; multisampled targets use renderbuffers and are resolved with a blit
+    struct URenderTarget
+    {
+        GLuint framebuffer = 0;
+        GLuint color = 0;           // Texture, or renderbuffer when multisampled
+        GLuint depth = 0;           // Renderbuffer, 0 when the target has no depth
+        int width = 0;
+        int height = 0;
+        int samples = 0;
+        GLenum format = 0;
+    };
+
+    // GPU duration of a block of commands, read back a few frames later so the CPU never waits on the GPU
+    struct UGpuTimer
+    {
+        static const int LATENCY = 3;
+        GLuint queries[LATENCY] = {};
+        bool pending[LATENCY] = {};
+        double milliseconds = 0.0;  // Smoothed duration
+    };
+
+    // One fullscreen pass. It samples the previous pass output as sourceTexture and the most recent color
+    // result as colorTexture, and writes its own target, or the window when it is the last enabled pass.
+    struct UPostPass
+    {
+        const char* name;
+        const GLchar* fragmentSource;
+        GLenum outputFormat;
+        bool producesColor;         // Output is an image (not edges or weights) and becomes colorTexture
+        bool enabled;
+        GLuint programId;
+        URenderTarget target;
+        UGpuTimer timer;
+    };
+
+    // Anti-aliasing configurations that can be compared at runtime
+    enum UAntiAliasingMode { UAA_NONE, UAA_FXAA, UAA_SMAA, UAA_MSAA2, UAA_MSAA4, UAA_MODE_COUNT };
+
+    // Scene rendering into an HDR target followed by a list of fullscreen passes
+    struct UPostChain
+    {
+        URenderTarget scene;        // RGBA16F color and depth
+        URenderTarget msaaScene;    // Multisampled scene for the MSAA modes, resolved into scene
+        std::vector<UPostPass> passes;
+        GLuint vao = 0;             // Attribute-less fullscreen triangle
+        UGpuTimer sceneTimer;
+        UGpuTimer resolveTimer;
+        int width = 0;
+        int height = 0;
+        int mode = UAA_FXAA;
+        int toneMapPass = -1;
+        int fxaaPass = -1;
+        int smaaEdgePass = -1;
+        int smaaWeightPass = -1;
+        int smaaBlendPass = -1;
+        int upscalePass = -1;
+
+        // Dynamic resolution: the scene and the AA passes use the lower-left renderWidth x renderHeight
+        // corner of the full-size targets, and the upscale pass stretches it over the window
+        int renderWidth = 0;
+        int renderHeight = 0;
+        float renderScale = 1.0f;
+        bool dynamicResolution = false;
+        double frameBudgetMs = 0.0;
+        unsigned long long lastScaleChange = 0;
+    };
+
+    // Multiview: several views of the scene rendered into the layers of one texture array by a single
+    // submission of the draw list. With OVR_multiview the driver broadcasts every draw to all views; otherwise
+    // each draw is instanced once per view and the vertex shader sends every instance to its layer through
+    // gl_Layer. The layers are then tiled side by side into the scene target, so the post chain, the overlay
+    // and captures see one wide image.
+    const int MULTIVIEW_MAX_VIEWS = 4;              // viewProjections[] in the multiview vertex shaders
+    const float MULTIVIEW_FIELD_OF_VIEW = 45.0f;    // As URender passes it to glm::perspective
+    const float MULTIVIEW_NEAR = 0.1f;
+    const float MULTIVIEW_FAR = 100.0f;
+    const float STEREO_EYE_SEPARATION = 0.065f;     // World units between the eyes
+    const float STEREO_CONVERGENCE = 10.0f;         // Distance at which both eyes see the same point
+
+    enum UMultiviewPath { UMULTIVIEW_OFF, UMULTIVIEW_OVR, UMULTIVIEW_LAYERED };
+    enum UMultiviewLayout { UMULTIVIEW_STEREO, UMULTIVIEW_WALL };
+
+    struct UMultiview
+    {
+        int path = UMULTIVIEW_OFF;
+        int layout = UMULTIVIEW_STEREO;
+        int views = 1;
+        GLsizei instances = 1;          // Per draw: the views on the layered path, 1 otherwise
+        int width = 0;                  // Size of one layer
+        int height = 0;
+        GLuint framebuffer = 0;
+        GLuint color = 0;               // RGBA16F 2D array, a layer per view
+        GLuint depth = 0;               // DEPTH_COMPONENT24 2D array
+        GLuint blitFramebuffer = 0;     // Reads one layer at a time for the tiling
+        glm::mat4 viewProjection[MULTIVIEW_MAX_VIEWS];
+    };
+
+    struct UParametricScene
+    {
+        std::vector<UParametricPrimitive> primitives;
+        std::vector<glm::vec4> controlPoints;
+        GLuint vao = 0;             // Attribute-less; patch ids come from gl_VertexID
+        GLuint buffers[3] = {};     // Primitives, patches, control points
+        GLsizei patchCount = 0;
+    };
+
+    // Parent/child transforms stored as parallel arrays in topological order (a parent always precedes its children),
+    // so world matrices can be refreshed in one forward pass that only touches nodes below a change
+    struct UTransformHierarchy
+    {
+        std::vector<int> parent;            // Index of the parent node, -1 for roots
+        std::vector<glm::vec3> position;    // Local translation
+        std::vector<glm::quat> rotation;    // Local rotation
+        std::vector<glm::vec3> scale;       // Local scale
+        std::vector<glm::mat4> world;       // Cached world matrix
+        std::vector<unsigned char> dirty;   // Local transform changed since the last update
+        size_t firstDirty = 0;              // Lowest dirty index; equals the node count when nothing is dirty
+        size_t lastUpdateCount = 0;         // Number of world matrices rebuilt by the last update
+        std::vector<uint32_t> rebuiltIn;    // Update that last rebuilt the node's world matrix
+        uint32_t updateIndex = 0;           // Counts the updates that rebuilt anything
+    };
+
+    // Keyframe animation. Tracks are grouped by value width (scalars, vectors and quaternions) and stored SoA: key
+    // times and every value component in arrays of their own, the keys of one track back to back. Evaluation takes
+    // four tracks at a time and blends four keys per lane with weights from the interpolation mode, so step, linear
+    // and cubic tracks share one SIMD path. Values are a function of the absolute clock time alone.
+    enum UInterpolation { UINTERPOLATE_STEP, UINTERPOLATE_LINEAR, UINTERPOLATE_CUBIC };    // Cubic is Catmull-Rom
+    enum UAnimationTarget { UANIMATE_POSITION, UANIMATE_ROTATION, UANIMATE_SCALE, UANIMATE_VALUE };
+
+    struct UAnimationTracks
+    {
+        int components = 0;                     // 1, 3, or 4 for quaternions as x, y, z, w
+
+        // Per track
+        std::vector<uint32_t> firstKey;         // First key after the leading guard
+        std::vector<uint32_t> keyCount;         // Keys without the guards
+        std::vector<unsigned char> interpolation;
+        std::vector<unsigned char> looping;     // Repeats with the span of its keys; the last key equals the first
+        std::vector<uint32_t> cursor;           // Segment found last time, a search hint only
+        std::vector<unsigned char> target;      // One of UAnimationTarget
+        std::vector<int> node;                  // Transform node of the position, rotation and scale targets
+        std::vector<float*> value;              // Floats written by UANIMATE_VALUE, e.g. a color
+
+        // Per key. Each track's keys have a guard key ahead and two behind, so the four keys a segment blends are
+        // adjacent in every component array.
+        std::vector<float> keyTime;             // Seconds, increasing within a track
+        std::vector<float> keyValue[4];
+
+        // Per track, padded to a multiple of four: values at the last evaluated time
+        std::vector<float> result[4];
+    };
+
+    struct UAnimation
+    {
+        UAnimationTracks scalars;               // Light parameters and other single floats
+        UAnimationTracks vectors;               // Positions, scales and colors
+        UAnimationTracks rotations;
+        double time = 0.0;                      // Clock the tracks are played at
+        double evaluatedTime = -1.0;            // Time the results belong to
+    };
+
+    // Performance overlay (F3). Stats go into fixed-size rings every frame. The text is formatted a few times a
+    // second and its glyphs are uploaded only when it changed. Panel, frame-time graph and text are a single
+    // attribute-less draw whose vertex shader builds every quad from gl_VertexID.
+    const int HUD_HISTORY = 128;                // Frames in the graph; frameTimes[] in hudVertexShaderSource
+    const int HUD_MAX_GLYPHS = 1024;
+    const int HUD_MAX_LINES = 18;
+    const int HUD_FIXED_QUADS = 2 + HUD_HISTORY; // Panel, bars and budget line, ahead of the glyphs
+    const int HUD_GLYPH_SCALE = 2;              // Window pixels per font pixel
+    const int HUD_MARGIN = 8;
+    const int HUD_GRAPH_HEIGHT = 64;
+    const double HUD_TEXT_INTERVAL = 0.25;      // Seconds between text refreshes
+    const GLuint HUD_GLYPH_BINDING = 5;
+    const GLuint HUD_FONT_UNIT = 13;
+    enum UHudColor { UHUD_WHITE, UHUD_GREEN, UHUD_YELLOW, UHUD_RED };
+
+    // 5x7 font for ASCII 32 to 126: five columns per glyph, bit 0 the top row
+    const int HUD_FIRST_CHAR = 32;
+    const int HUD_CHAR_COUNT = 95;
+    const unsigned char HUD_FONT[HUD_CHAR_COUNT][5] = {
+        { 0x00, 0x00, 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x5f, 0x00, 0x00 }, { 0x00, 0x07, 0x00, 0x07, 0x00 }, { 0x14, 0x7f, 0x14, 0x7f, 0x14 },
+        { 0x24, 0x2a, 0x7f, 0x2a, 0x12 }, { 0x23, 0x13, 0x08, 0x64, 0x62 }, { 0x36, 0x49, 0x55, 0x22, 0x50 }, { 0x00, 0x05, 0x03, 0x00, 0x00 },
+        { 0x00, 0x1c, 0x22, 0x41, 0x00 }, { 0x00, 0x41, 0x22, 0x1c, 0x00 }, { 0x08, 0x2a, 0x1c, 0x2a, 0x08 }, { 0x08, 0x08, 0x3e, 0x08, 0x08 },
+        { 0x00, 0x50, 0x30, 0x00, 0x00 }, { 0x08, 0x08, 0x08, 0x08, 0x08 }, { 0x00, 0x60, 0x60, 0x00, 0x00 }, { 0x20, 0x10, 0x08, 0x04, 0x02 },
+        { 0x3e, 0x51, 0x49, 0x45, 0x3e }, { 0x00, 0x42, 0x7f, 0x40, 0x00 }, { 0x42, 0x61, 0x51, 0x49, 0x46 }, { 0x21, 0x41, 0x45, 0x4b, 0x31 },
+        { 0x18, 0x14, 0x12, 0x7f, 0x10 }, { 0x27, 0x45, 0x45, 0x45, 0x39 }, { 0x3c, 0x4a, 0x49, 0x49, 0x30 }, { 0x01, 0x71, 0x09, 0x05, 0x03 },
+        { 0x36, 0x49, 0x49, 0x49, 0x36 }, { 0x06, 0x49, 0x49, 0x29, 0x1e }, { 0x00, 0x36, 0x36, 0x00, 0x00 }, { 0x00, 0x56, 0x36, 0x00, 0x00 },
+        { 0x08, 0x14, 0x22, 0x41, 0x00 }, { 0x14, 0x14, 0x14, 0x14, 0x14 }, { 0x00, 0x41, 0x22, 0x14, 0x08 }, { 0x02, 0x01, 0x51, 0x09, 0x06 },
+        { 0x32, 0x49, 0x79, 0x41, 0x3e }, { 0x7e, 0x11, 0x11, 0x11, 0x7e }, { 0x7f, 0x49, 0x49, 0x49, 0x36 }, { 0x3e, 0x41, 0x41, 0x41, 0x22 },
+        { 0x7f, 0x41, 0x41, 0x22, 0x1c }, { 0x7f, 0x49, 0x49, 0x49, 0x41 }, { 0x7f, 0x09, 0x09, 0x01, 0x01 }, { 0x3e, 0x41, 0x41, 0x51, 0x32 },
+        { 0x7f, 0x08, 0x08, 0x08, 0x7f }, { 0x00, 0x41, 0x7f, 0x41, 0x00 }, { 0x20, 0x40, 0x41, 0x3f, 0x01 }, { 0x7f, 0x08, 0x14, 0x22, 0x41 },
+        { 0x7f, 0x40, 0x40, 0x40, 0x40 }, { 0x7f, 0x02, 0x04, 0x02, 0x7f }, { 0x7f, 0x04, 0x08, 0x10, 0x7f }, { 0x3e, 0x41, 0x41, 0x41, 0x3e },
+        { 0x7f, 0x09, 0x09, 0x09, 0x06 }, { 0x3e, 0x41, 0x51, 0x21, 0x5e }, { 0x7f, 0x09, 0x19, 0x29, 0x46 }, { 0x46, 0x49, 0x49, 0x49, 0x31 },
+        { 0x01, 0x01, 0x7f, 0x01, 0x01 }, { 0x3f, 0x40, 0x40, 0x40, 0x3f }, { 0x1f, 0x20, 0x40, 0x20, 0x1f }, { 0x7f, 0x20, 0x18, 0x20, 0x7f },
+        { 0x63, 0x14, 0x08, 0x14, 0x63 }, { 0x03, 0x04, 0x78, 0x04, 0x03 }, { 0x61, 0x51, 0x49, 0x45, 0x43 }, { 0x00, 0x7f, 0x41, 0x41, 0x00 },
+        { 0x02, 0x04, 0x08, 0x10, 0x20 }, { 0x00, 0x41, 0x41, 0x7f, 0x00 }, { 0x04, 0x02, 0x01, 0x02, 0x04 }, { 0x40, 0x40, 0x40, 0x40, 0x40 },
+        { 0x00, 0x01, 0x02, 0x04, 0x00 }, { 0x20, 0x54, 0x54, 0x54, 0x78 }, { 0x7f, 0x48, 0x44, 0x44, 0x38 }, { 0x38, 0x44, 0x44, 0x44, 0x20 },
+        { 0x38, 0x44, 0x44, 0x48, 0x7f }, { 0x38, 0x54, 0x54, 0x54, 0x18 }, { 0x08, 0x7e, 0x09, 0x01, 0x02 }, { 0x08, 0x14, 0x54, 0x54, 0x3c },
+        { 0x7f, 0x08, 0x04, 0x04, 0x78 }, { 0x00, 0x44, 0x7d, 0x40, 0x00 }, { 0x20, 0x40, 0x44, 0x3d, 0x00 }, { 0x00, 0x7f, 0x10, 0x28, 0x44 },
+        { 0x00, 0x41, 0x7f, 0x40, 0x00 }, { 0x7c, 0x04, 0x18, 0x04, 0x78 }, { 0x7c, 0x08, 0x04, 0x04, 0x78 }, { 0x38, 0x44, 0x44, 0x44, 0x38 },
+        { 0x7c, 0x14, 0x14, 0x14, 0x08 }, { 0x08, 0x14, 0x14, 0x18, 0x7c }, { 0x7c, 0x08, 0x04, 0x04, 0x08 }, { 0x48, 0x54, 0x54, 0x54, 0x20 },
+        { 0x04, 0x3f, 0x44, 0x40, 0x20 }, { 0x3c, 0x40, 0x40, 0x20, 0x7c }, { 0x1c, 0x20, 0x40, 0x20, 0x1c }, { 0x3c, 0x40, 0x30, 0x40, 0x3c },
+        { 0x44, 0x28, 0x10, 0x28, 0x44 }, { 0x0c, 0x50, 0x50, 0x50, 0x3c }, { 0x44, 0x64, 0x54, 0x4c, 0x44 }, { 0x00, 0x08, 0x36, 0x41, 0x00 },
+        { 0x00, 0x00, 0x7f, 0x00, 0x00 }, { 0x00, 0x41, 0x36, 0x08, 0x00 }, { 0x10, 0x08, 0x08, 0x10, 0x08 }
+    };
+
+    // Last N samples of one statistic
+    template <int N>
+    struct UStatRing
+    {
+        float values[N] = {};
+        int next = 0;           // Slot the next sample goes into; the oldest sample once the ring is full
+        int count = 0;
+
+        void Push(float value)
+        {
+            values[next] = value;
+            next = (next + 1) % N;
+            count = std::min(count + 1, N);
+        }
+        float Average() const
+        {
+            float sum = 0.0f;
+            for (int i = 0; i < count; ++i)
+                sum += values[i];
+            return count ? sum / count : 0.0f;
+        }
+        float Max() const
+        {
+            float highest = 0.0f;
+            for (int i = 0; i < count; ++i)
+                highest = std::max(highest, values[i]);
+            return highest;
+        }
+    };
+
+    // Work submitted by the render thread this frame
+    struct UFrameCounters
+    {
+        unsigned draws = 0;
+        unsigned patches = 0;           // Tessellated on the GPU, so their triangles are not counted
+        unsigned long long triangles = 0;
+        unsigned long long culledTriangles = 0; // Handed to the GPU cull: the most its draws can add
+
+    };
+
+    // Overlay text, one line per statistic; each line has one color
+    struct UHudText
+    {
+        char chars[HUD_MAX_GLYPHS] = {};    // Lines end in '\n'
+        unsigned char lineColor[HUD_MAX_LINES] = {};
+        int length = 0;
+        int lines = 0;
+    };
+
+    struct UHud
+    {
+        bool visible = false;
+        GLuint programId = 0;
+        GLuint vao = 0;                 // Attribute-less
+        GLuint font = 0;                // GL_R8 atlas, glyphs side by side with a blank column between them
+        GLuint glyphBuffer = 0;         // uvec2 per glyph: x | y << 16 in window pixels, atlas cell | color << 8
+        int glyphCount = 0;
+        int textWidth = 0;              // Pixels, for the panel size
+        int textHeight = 0;
+        double budgetMs = 0.0;          // Frame budget the graph and the frame line are colored against
+        UGpuTimer timer;
+
+        UStatRing<HUD_HISTORY> frameMs;         // Wall time between frames
+        UStatRing<HUD_HISTORY> draws;
+        UStatRing<HUD_HISTORY> triangles;
+        UStatRing<HUD_HISTORY> patches;
+        UStatRing<HUD_HISTORY> culledTriangles;
+        UStatRing<HUD_HISTORY> heapAllocations; // Render thread
+        UStatRing<HUD_HISTORY> driverAllocations; // Render thread, made by the GL driver
+        uint64_t lastHeapAllocations = 0;
+        uint64_t lastDriverAllocations = 0;
+
+        UHudText text;                  // What the glyph buffer holds
+        double lastTextTime = -1.0e9;
+    };
+
+    // GPU-driven scene: the bounds and draw record of every object live in a storage buffer. A compute pass tests
+    // them against the view frustums, and with --hiz against last frame's depth pyramid, and appends the
+    // survivors to an indirect command buffer, one run per clay variant. URender then issues one multi-draw per
+    // run, so the CPU cost of a frame does not grow with the object count. A draw finds its object through an
+    // instanced attribute over 0, 1, 2, ... that the command's baseInstance points into.
+    const GLuint CULL_OBJECT_BINDING = 6;       // Storage buffers; 6 and 7 are the last of the guaranteed eight
+    const GLuint CULL_COMMAND_BINDING = 7;
+    const GLuint CULL_COUNTER_BINDING = 0;      // Atomic counters, draws per batch
+    const GLuint CULL_GROUP_SIZE = 64;          // local_size_x of cullComputeShaderSource
+    const GLuint HIZ_GROUP_SIZE = 8;            // local_size_x and _y of hizComputeShaderSource
+    const GLuint HIZ_UNIT = 14;
+    const int CULL_MAX_PLANES = 6 * MULTIVIEW_MAX_VIEWS;   // frustumPlanes[] in cullComputeShaderSource
+    const GLuint GPU_SCENE_PARTS = 4;           // Objects 0..3 are the scene parts, placed by the subject node
+    const float STRESS_FIELD_SPACING = 6.0f;    // World units between the objects --objects adds
+    const float STRESS_FIELD_CLEARING = 16.0f;  // Half size of the square around the desk they stay out of
+
+    // Runs of the command buffer, one per variant of the clay shader
+    enum UCullBatch { UCULL_TEXTURED, UCULL_UNTEXTURED, UCULL_BATCH_COUNT };
+
+    // Object record, std430 as CullObject in the cull and clay shaders
+    struct UCullObject
+    {
+        glm::mat4 model;
+        glm::vec4 lower;            // World-space bounding box, w unused
+        glm::vec4 upper;
+        GLuint firstIndex;          // Into the scene mesh
+        GLuint indexCount;
+        GLuint batch;               // UCullBatch
+        GLuint padding;
+    };
+
+    static_assert(sizeof(UCullObject) == 112, "UCullObject must match the std430 layout of CullObject");
+
+    // glMultiDrawElementsIndirect command
+    struct UDrawElementsCommand
+    {
+        GLuint count;
+        GLuint instanceCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance;        // Object index
+    };
+
+    struct UGpuScene
+    {
+        std::vector<UCullObject> objects;       // CPU copy; the parts are refreshed when the subject moves
+        glm::vec3 partLower[GPU_SCENE_PARTS];   // Mesh-space bounds of the parts
+        glm::vec3 partUpper[GPU_SCENE_PARTS];
+        GLuint objectBuffer = 0;
+        GLuint commandBuffer = 0;               // UCULL_BATCH_COUNT runs of capacity commands
+        GLuint counterBuffer = 0;               // Draws per batch; also the parameter buffer of the count draws
+        GLuint objectIndexBuffer = 0;           // 0, 1, 2, ... read per instance through UATTRIBUTE_OBJECT
+        GLuint vao = 0;                         // Scene mesh buffers plus the object index
+        GLuint cullProgramId = 0;
+        GLsizei capacity = 0;                   // Commands per batch: every object could land in one
+        unsigned long long triangles = 0;       // Of every object, the parts included
+        unsigned long long partTriangles = 0;
+        bool drawCount = false;                 // ARB_indirect_parameters: the draw counts stay on the GPU
+
+        // Hi-Z occlusion (--hiz): the farthest depth of the previous frame over ever larger squares
+        bool occlusion = false;
+        GLuint hizProgramId = 0;
+        GLuint depth = 0;                       // DEPTH_COMPONENT24 copy of the scene depth
+        GLuint depthFramebuffer = 0;
+        GLuint pyramid = 0;                     // R32F, one level per halving
+        int width = 0;                          // Level 0, the size of the scene target
+        int height = 0;
+        int levels = 0;
+        bool pyramidReady = false;              // A frame has been captured since the pyramid was (re)created
+        int pyramidRegionWidth = 0;             // Render region the captured frame covered
+        int pyramidRegionHeight = 0;
+        glm::mat4 pyramidViewProjection;        // Of the captured frame
+    };
+
+    // Main GLFW window
+    GLFWwindow* gWindow = nullptr;
+    // Triangle mesh data
+    GLMesh gMesh;
+    // Shader programs, specialized per feature set
+    UShaderPermutations gClayShaders;
+    UShaderPermutations gLampShaders;
+
+    // camera
+    Camera gCamera(glm::vec3(0.0f, 3.0f, 20.0f));
+    float gLastX = WINDOW_WIDTH / 2.0f;
+    float gLastY = WINDOW_HEIGHT / 2.0f;
+    bool gFirstMouse = true;
+
+    // timing
+    float gDeltaTime = 0.0f; // time between current frame and last frame
+    float gLastFrame = 0.0f;
+
+    // Input events recorded by the GLFW callbacks and consumed in order by the simulation step
+    enum UInputEventType { UINPUT_KEY, UINPUT_MOUSE_BUTTON, UINPUT_CURSOR, UINPUT_SCROLL };
+
+    struct UInputEvent
+    {
+        int type;       // One of UInputEventType
+        int code;       // Key or mouse button
+        int action;     // GLFW_PRESS, GLFW_RELEASE or GLFW_REPEAT
+        double x;       // Cursor position or scroll offset
+        double y;
+        double time;    // glfwGetTime() when the event was delivered
+    };
+
+    // Time from the oldest input handled in a frame until that frame was presented, in seconds
+    struct UInputLatency
+    {
+        double last = 0.0;
+        double average = 0.0;   // Exponential moving average
+        double worst = 0.0;
+        unsigned long long samples = 0;
+    };
+
+    UBoundedQueue<UInputEvent, 1024> gInputQueue;
+    std::atomic<unsigned long long> gInputDropped{ 0 };
+    bool gKeyDown[GLFW_KEY_LAST + 1] = {};
+    double gInputTime = 0.0;            // Time the camera has been integrated up to
+    double gOldestPendingInput = -1.0;  // Timestamp of the oldest event consumed this frame, -1 when none
+    UInputLatency gInputLatency;
+
+    // Command line options
+    struct UOptions
+    {
+        const char* recordPath = nullptr;      // --record: write the camera path flown this session
+        const char* playbackPath = nullptr;    // --playback: drive the camera from a recorded path
+        const char* tracePath = nullptr;       // --trace: write per-frame timings as CSV
+        const char* benchmarkPath = nullptr;   // --benchmark: run the CPU micro-benchmarks, write JSON results and exit
+        const char* virtualTexturePath = nullptr;  // --virtual-texture: stream the desk texture from this page file
+        const char* buildVirtualTexturePath = nullptr; // --build-virtual-texture: write a procedural page file and exit
+        int virtualTextureSize = 4096;         // --virtual-texture-size: mip 0 size of the built page file
+        const char* worldPath = nullptr;       // --world: stream a cell-partitioned site around the camera
+        const char* buildWorldPath = nullptr;  // --build-world: write a procedural site and exit
+        int worldSize = WORLD_DEFAULT_CELLS;   // --world-size: cells per side of the built site
+        std::vector<std::pair<std::string, size_t>> gpuBudgets; // --gpu-budget tag=MB, repeatable
+        int antiAliasing = UAA_FXAA;           // --aa none|fxaa|smaa|msaa2|msaa4
+        double frameBudgetMs = 0.0;            // --frame-budget ms: scale the render resolution to fit this GPU time
+        int allocCheckFrames = 0;              // --alloc-check N: fail unless N frames after warm-up allocate nothing
+        int bakeSamples = 0;                   // --bake N: path trace the lighting at load with N samples, start baked
+        const char* softwarePath = nullptr;    // --software: render one frame on the CPU to this PPM image and exit
+        const char* softwareReferencePath = nullptr; // --software-reference: fail unless the --software image matches this GL frame
+        const char* capturePath = nullptr;     // --capture: record every presented frame as PNG files or a y4m stream
+        const char* chromeTracePath = nullptr; // --chrome-trace: write the CPU zones of the session as trace-event JSON
+        int multiviewViews = 0;                // --stereo, --view-wall N: views rendered in one pass, side by side
+        int multiviewLayout = UMULTIVIEW_STEREO;
+        int extraObjects = 0;                  // --objects N: scatter N copies of the scene parts around the desk
+        bool hiz = false;                      // --hiz: also cull objects hidden behind last frame's depth
+    };
+
+    UOptions gOptions;
+
+    // Fixed simulation step used while playing back a camera path, so every run sees the same views
+    const double PLAYBACK_TIMESTEP = 1.0 / 60.0;
+
+    // One camera pose on a recorded flythrough
+    struct UCameraSample
+    {
+        double time;
+        glm::vec3 position;
+        float yaw;
+        float pitch;
+        float zoom;
+    };
+
+    // Recorded flythrough and the playback cursor into it
+    struct UCameraPath
+    {
+        std::vector<UCameraSample> samples;
+        size_t cursor = 0;
+    };
+
+    // Timing of one rendered frame for the --trace output
+    struct UFrameTiming
+    {
+        double simulationTime;  // Seconds on the simulation clock
+        double cpuMs;           // Wall time from frame start to buffer swap
+        double gpuSceneMs;      // Scene pass on the GPU (a few frames delayed)
+        double gpuPostMs;       // MSAA resolve and post-processing passes on the GPU
+        float renderScale;      // Dynamic resolution scale in use this frame
+    };
+
+    UCameraPath gCameraPath;
+    FILE* gCameraRecordFile = nullptr;
+    std::vector<UFrameTiming> gFrameTrace;
+
+    // Statistics of one micro-benchmark; every sample is the mean time per operation over a timed batch
+    struct UBenchmarkResult
+    {
+        const char* name;
+        size_t bytesPerOp;              // Bytes touched per operation, 0 when throughput is meaningless
+        size_t iterationsPerSample;
+        std::vector<double> samplesNs;
+        double medianNs;
+        double meanNs;
+        double stddevNs;
+        double minNs;
+    };
+
+    // Scene transforms: the subject mesh and the lamp hang off a common root
+    UTransformHierarchy gTransforms;
+    int gRootNode = -1;
+    int gSubjectNode = -1;
+    int gLampNode = -1;
+
+    // Cube and light color  ***Need to figure out how to allow for new color input**
+    //glm::vec3 gObjectColor(0.6f, 0.5f, 0.75f);
+    glm::vec3 gObjectColor(0.5f, 0.5f, 1.0f);
+    glm::vec3 gLightColor(1.0f, 1.0f, 1.0f);
+
+    // Keyframed nodes and values; the clock only runs while the lamp orbits
+    UAnimation gAnimation;
+    bool gIsLampOrbiting = true;
+
+    // Tessellated primitives and the target on-screen length of a tessellated edge
+    UParametricScene gParametricScene;
+    UShaderPermutations gParametricShaders;
+    const float TESSELLATION_EDGE_PIXELS = 12.0f;
+
+    // Post-processing
+    UPostChain gPostChain;
+    UMultiview gMultiview;
+    bool gFramebufferResized = false;
+    int gFramebufferWidth = WINDOW_WIDTH;
+    int gFramebufferHeight = WINDOW_HEIGHT;
+    unsigned long long gFrameIndex = 0;
+    const char* const ANTI_ALIASING_NAMES[UAA_MODE_COUNT] = { "none", "fxaa", "smaa", "msaa2", "msaa4" };
+    const float MIN_RENDER_SCALE = 0.5f;
+    const float MAX_RENDER_SCALE = 1.0f;
+    const double DEFAULT_FRAME_BUDGET_MS = 1000.0 / 60.0;
+
+    // Textures and materials of the scene
+    UTextureResidency gTextures;
+    UVirtualTexture gVirtualTexture;
+
+    // Streamed site around the scene
+    UWorld gWorld;
+
+    // Scene parts and the --objects field, culled and drawn from GPU buffers
+    UGpuScene gGpuScene;
+
+    // Triangles of the scene mesh for click picking
+    UBvh gSceneBvh;
+
+    // Baked lighting, and whether shading uses it (F5)
+    UBakedLighting gBakedLighting;
+    bool gBakedLightingOn = false;
+    UBakeJob gBakeJob;
+
+    // Session recording (--capture)
+    UFrameCapture gCapture;
+
+    // Performance overlay (F3) and the work it reports
+    UHud gHud;
+    UFrameCounters gFrameCounters;
+
+    // GPU memory accounting
+    UGpuRegistry gGpuRegistry;
+
+    // Transient per-frame memory
+    const size_t FRAME_ARENA_BYTES = 1 << 20;
+    UFrameArena gFrameArena;
+
+    // --alloc-check: frames skipped before counting (pipelines, timers and page streaming settle first)
+    const int ALLOC_CHECK_WARMUP_FRAMES = 30;
+    uint64_t gAllocCheckStart = 0;
+    bool gAllocCheckFailed = false;
+}
+
+/* User-defined Function prototypes to:
+ * initialize the program, set the window size,
+ * redraw graphics on the window when resized,
+ * and render graphics on the screen
+ */
+bool UParseCommandLine(int argc, char* argv[]);
+bool UInitialize(int, char* [], GLFWwindow** window);
+void UResizeWindow(GLFWwindow* window, int width, int height);
+void UProcessInput(GLFWwindow* window);
+void UIntegrateHeldKeys(float deltaTime);
+void UApplyInputEvent(GLFWwindow* window, const UInputEvent& event);
+void URecordInputEvent(int type, int code, int action, double x, double y);
+void UUpdateInputLatency(double latency);
+void UKeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods);
+void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos);
+void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset);
+void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
+void UBuildMeshData(std::vector<UPackedVertex>& verts, std::vector<GLushort>& indices, std::vector<UMeshPart>* parts = nullptr);
+void UCreateMesh(GLMesh& mesh);
+void UDestroyMesh(GLMesh& mesh);
+GLushort UPackHalf(float value);
+float UUnpackHalf(GLushort half);
+GLuint UPackSnorm1010102(const glm::vec3& value, float w);
+glm::vec3 UUnpackSnorm1010102(GLuint packed);
+GLubyte UPackUnorm8(float value);
+GLushort UPackUnorm16(float value);
+bool UCreateTexture(const char* filename, GLuint& textureId);
+void UDestroyTexture(GLuint textureId);
+int UAddTexture(UTextureResidency& residency, const char* filename, const glm::vec3& fallbackA, const glm::vec3& fallbackB, int fallbackCells);
+int UAddMaterial(UTextureResidency& residency, int image, const glm::vec2& uvScale, const glm::vec4& tint);
+bool UCommitTextures(UTextureResidency& residency);
+void UAddSceneMaterials(UTextureResidency& residency);
+bool UCreateMaterials(UTextureResidency& residency);
+void UBindMaterialTextures(const UTextureResidency& residency, GLuint programId);
+void UDestroyTextures(UTextureResidency& residency);
+int USeek64(FILE* file, int64_t offset, int origin);
+int64_t UTell64(FILE* file);
+bool UBuildWorld(const char* filename, int cells);
+bool UCreateWorld(UWorld& world, const char* filename);
+void UUpdateWorld(UWorld& world);
+void UDrawWorld(const UWorld& world, GLuint groundProgramId, GLuint programId);
+size_t UEvictWorldCells(UWorld& world, size_t bytes);
+void UDestroyWorld(UWorld& world);
+void UBuildBvh(UBvh& bvh, const std::vector<glm::vec3>& positions, const std::vector<uint32_t>& indices, int workerCount);
+bool UIntersectBvh(const UBvh& bvh, const glm::vec3& origin, const glm::vec3& direction, float maxDistance, URayHit& hit);
+void UCreatePickScene(UBvh& bvh);
+bool UPickScreen(const glm::vec2& ndc, URayHit& hit);
+bool UUnwrapLightmap(const std::vector<glm::vec3>& positions, const std::vector<uint32_t>& indices,
+    std::vector<uint32_t>& sourceVertex, std::vector<uint32_t>& unwrappedIndices, std::vector<glm::vec2>& lightmapUV);
+glm::vec3 UBakeDirect(const UBakeScene& scene, const glm::vec3& point, const glm::vec3& normal, uint64_t& rays);
+glm::vec3 UBakeIndirect(const UBakeScene& scene, const glm::vec3& point, const glm::vec3& normal, int bounces, uint32_t& rng, uint64_t& rays);
+bool UComputeBake(UBakeResult& result, const glm::mat4& model, const glm::vec3& lightPosition, const glm::vec3& lightColor,
+    const glm::vec3& albedo, int samples, const std::atomic<bool>* cancel);
+bool UUploadBakedLighting(UBakedLighting& baked, const UBakeResult& result);
+bool UBakeLighting(UBakedLighting& baked, int samples);
+void UStartBake(int samples);
+void UUpdateBake();
+void UStopBake();
+void USetProbeUniforms(const UBakedLighting& baked, GLuint programId);
+void USetBakedLighting(bool on);
+void UDestroyBakedLighting(UBakedLighting& baked);
+void UCreateSoftwareTexture(USoftwareTexture& texture, const UTextureImage& image);
+glm::vec4 USampleSoftwareLevel(const USoftwareTexture& texture, int level, const glm::vec2& uv);
+glm::vec4 USampleSoftwareTexture(const USoftwareTexture& texture, const glm::vec2& uv, float lod);
+#if USIMD_AVX2
+bool UCpuSupportsAvx2();
+#endif
+bool UCreateSoftwareRenderer(USoftwareRenderer& renderer, int width, int height, const UTextureResidency& residency);
+void USetupSoftwareTriangle(const USoftwareRenderer& renderer, const USoftwareVertex* corners, int material, bool lit,
+    std::vector<USoftwareTriangle>& triangles);
+void UShadeSoftwarePixels(USoftwareRenderer& renderer, const USoftwareFrame& frame, const USoftwareTriangle& triangle,
+    UFloat8 x, float y, UFloat8 mask, UFloat8 depth, size_t pixel);
+void URasterizeSoftwareTile(USoftwareRenderer& renderer, const USoftwareFrame& frame, int tile);
+void URenderSoftware(USoftwareRenderer& renderer, const USoftwareFrame& frame, const std::vector<USoftwareDraw>& draws);
+bool UWriteSoftwareImage(const USoftwareRenderer& renderer, const char* filename);
+bool UCompareSoftwareImage(const USoftwareRenderer& renderer, const char* referencePath);
+void UDestroySoftwareRenderer(USoftwareRenderer& renderer);
+bool URenderSoftwareImage(const char* filename);
+int UFindCaptureFormat(const char* path);
+bool UCreateFrameCapture(UFrameCapture& capture, const char* path, int width, int height);
+void UCaptureFrame(UFrameCapture& capture);
+void URetireCaptureReadbacks(UFrameCapture& capture, bool wait);
+void UEncodeCapturedFrame(UFrameCapture& capture, int index);
+size_t UEncodeY4mFrame(const unsigned char* rgba, int width, int height, unsigned char* out);
+bool UEncodePng(const unsigned char* rgba, int width, int height, std::vector<unsigned char>& rgb, std::vector<unsigned char>& out);
+void UDestroyFrameCapture(UFrameCapture& capture);
+void UCountDraw(unsigned long long triangles);
+bool UCreateHud(UHud& hud, double budgetMs);
+void UUpdateHud(UHud& hud);
+void UAppendHudLine(UHudText& text, int color, const char* format, ...);
+void UFormatHudText(const UHud& hud, UHudText& text);
+void UBuildHudGlyphs(UHud& hud);
+void UDrawHud(UHud& hud, int width, int height);
+void UDestroyHud(UHud& hud);
+void UCreateFrameArena(UFrameArena& arena, size_t bytesPerFrame);
+void UBeginFrameArena(UFrameArena& arena);
+void UDestroyFrameArena(UFrameArena& arena);
+bool UUpdateAllocationCheck();
+void UFindProgramCode();
+void* UCountedNew(size_t size, const void* caller);
+void URegisterGpuResource(int kind, GLuint id, size_t bytes, const char* tag, const char* file, int line);
+void UReleaseGpuResource(int kind, GLuint id);
+size_t UGpuFormatBytes(GLenum format);
+size_t UGpuTextureBytes(GLenum format, int width, int height, int layers, int levels);
+size_t UGpuTagBytes(const char* tag);
+UGpuBudget& UFindGpuBudget(const char* tag);
+void USetGpuBudget(const char* tag, size_t limit);
+void USetGpuEvictionCallback(const char* tag, std::function<size_t(size_t)> evict);
+void UEnforceGpuBudgets();
+void UDumpGpuResources();
+int UReportGpuLeaks();
+void UStartThreadPool(UThreadPool& pool, int workerCount, const char* name = "worker");
+void USubmitJob(UThreadPool& pool, std::function<void(int)> job);
+void UWaitThreadPool(UThreadPool& pool);
+void UStopThreadPool(UThreadPool& pool);
+void UVirtualTextureTexel(int x, int y, int mip, unsigned char* rgba);
+bool UBuildVirtualTexture(const char* filename, int size);
+bool UCreateVirtualTexture(UVirtualTexture& texture, const char* filename);
+void UUpdateVirtualTexture(UVirtualTexture& texture);
+void UCaptureVirtualTextureFeedback(UVirtualTexture& texture);
+void USetVirtualTextureUniforms(const UVirtualTexture& texture, GLuint programId);
+void UDestroyVirtualTexture(UVirtualTexture& texture);
+void URender();
+bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId, GLuint libraryShaderId = 0);
+bool UCreateShaderProgram(const char* vtxShaderSource, const char* sharedTessSource, const char* tessControlSource,
+    const char* tessEvaluationSource, const char* fragShaderSource, GLuint& programId, GLuint libraryShaderId = 0);
+bool UCreateComputeProgram(const char* computeSource, GLuint& programId);
+void UDestroyShaderProgram(GLuint programId);
+void UDeclareShaderPermutations(UShaderPermutations& set, const char* name, const char* vertexSource, const char* fragmentSource,
+    GLuint libraryShaderId = 0);
+void UDeclareShaderPermutations(UShaderPermutations& set, const char* name, const char* vertexSource, const char* sharedTessSource,
+    const char* tessControlSource, const char* tessEvaluationSource, const char* fragmentSource, GLuint libraryShaderId = 0);
+bool UBuildShaderPermutation(UShaderPermutations& set, uint32_t features, GLuint& programId);
+GLuint UGetShaderPermutation(UShaderPermutations& set, uint32_t features);
+bool UWarmShaderPermutations(UShaderPermutations& set, std::initializer_list<uint32_t> featureSets);
+void UDestroyShaderPermutations(UShaderPermutations& set);
+void USetupLitVariant(GLuint programId, uint32_t features);
+void USetLitUniforms(GLuint programId, const glm::mat4& view, const glm::mat4& projection, const glm::vec3& lightPosition);
+int UAddParametricPrimitive(UParametricScene& scene, int type, int node, const glm::vec4& params, const glm::vec4* controlPoints);
+void UGetParametricSegments(int type, int& uSegments, int& vSegments, int& regions);
+void UCreateParametricBuffers(UParametricScene& scene);
+void UUpdateParametricTransforms(UParametricScene& scene);
+void UDestroyParametricScene(UParametricScene& scene);
+void UEvaluateParametricSurface(const UParametricScene& scene, const UParametricPrimitive& primitive, int region, const glm::vec2& uv,
+    glm::vec3& position, glm::vec3& normal);
+void UTessellateParametricPrimitive(const UParametricScene& scene, const UParametricPrimitive& primitive, int level,
+    std::vector<UPackedVertex>& verts, std::vector<GLushort>& indices);
+void ULogStart();
+void ULogStop();
+void ULog(int level, const char* format, ...);
+bool ULoadCameraPath(const char* filename, UCameraPath& path);
+void URecordCameraSample(FILE* file, double time);
+bool UApplyCameraPath(UCameraPath& path, double time);
+bool UWriteFrameTrace(const char* filename, const std::vector<UFrameTiming>& trace);
+void UProfileNameThread(const char* name, int index);
+bool UWriteChromeTrace(const char* filename);
+bool URunBenchmarks(const char* resultsPath);
+int UAddTransform(UTransformHierarchy& hierarchy, int parent, const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale);
+void USetTransformPosition(UTransformHierarchy& hierarchy, int node, const glm::vec3& position);
+void USetTransformRotation(UTransformHierarchy& hierarchy, int node, const glm::quat& rotation);
+void USetTransformScale(UTransformHierarchy& hierarchy, int node, const glm::vec3& scale);
+void UUpdateTransforms(UTransformHierarchy& hierarchy);
+bool UWasTransformRebuilt(const UTransformHierarchy& hierarchy, int node);
+int UAddScalarTrack(UAnimation& animation, float* value, int interpolation, bool looping, const float* times, const float* keys, size_t keyCount);
+int UAddVectorTrack(UAnimation& animation, int target, int node, glm::vec3* value, int interpolation, bool looping, const float* times,
+    const glm::vec3* keys, size_t keyCount);
+int UAddRotationTrack(UAnimation& animation, int node, int interpolation, bool looping, const float* times, const glm::quat* keys, size_t keyCount);
+void UEvaluateAnimation(UAnimation& animation, double time);
+void UApplyAnimation(const UAnimation& animation, UTransformHierarchy& hierarchy);
+void UCreateScene();
+bool UCreateRenderTarget(URenderTarget& target, int width, int height, GLenum colorFormat, bool withDepth, int samples);
+void UDestroyRenderTarget(URenderTarget& target);
+void UBeginGpuTimer(UGpuTimer& timer);
+void UEndGpuTimer();
+int UAddPostPass(UPostChain& chain, const char* name, const GLchar* fragmentSource, GLenum outputFormat, bool producesColor);
+bool UCreatePostChain(UPostChain& chain, int width, int height, int mode);
+bool UResizePostChain(UPostChain& chain, int width, int height);
+void USetAntiAliasingMode(UPostChain& chain, int mode);
+int UFindAntiAliasingMode(const char* name);
+void UBeginScenePass(UPostChain& chain);
+void URunPostChain(UPostChain& chain);
+double UPostChainMilliseconds(const UPostChain& chain);
+void USetDynamicResolution(UPostChain& chain, bool enabled, double frameBudgetMs);
+void USetRenderScale(UPostChain& chain, float scale);
+void UUpdateDynamicResolution(UPostChain& chain);
+void UDestroyPostChain(UPostChain& chain);
+bool UCreateMultiview(UMultiview& multiview, int views, int layout, int width, int height);
+bool UCreateMultiviewTargets(UMultiview& multiview, int width, int height);
+void UUpdateMultiviewMatrices(UMultiview& multiview, const Camera& camera, int width, int height);
+std::string UMultiviewPrelude(const UMultiview& multiview, GLenum stage, bool enabled);
+void USetMultiviewUniforms(const UMultiview& multiview, GLuint programId);
+void UBeginMultiviewPass(UMultiview& multiview, const UPostChain& chain, const Camera& camera);
+void UEndMultiviewPass(const UMultiview& multiview, const UPostChain& chain);
+void UDestroyMultiviewTargets(UMultiview& multiview);
+void UTransformBounds(const glm::mat4& model, const glm::vec3& lower, const glm::vec3& upper, glm::vec4& worldLower, glm::vec4& worldUpper);
+void UExtractFrustumPlanes(const glm::mat4& viewProjection, glm::vec4* planes);
+bool UCreateGpuScene(UGpuScene& scene, int extraObjects, bool occlusion);
+void UUpdateGpuSceneParts(UGpuScene& scene);
+void UDrawGpuScene(UGpuScene& scene, GLuint firstObject, const glm::mat4& viewProjection, const GLuint* programIds);
+bool UCreateDepthPyramid(UGpuScene& scene, int width, int height);
+void UBuildDepthPyramid(UGpuScene& scene, const UPostChain& chain, const glm::mat4& viewProjection);
+void UDestroyDepthPyramid(UGpuScene& scene);
+void UDestroyGpuScene(UGpuScene& scene);
+
+
+/* Vertex Shader Source Code*/
+const GLchar* clayVertexShaderSource = GLSL(440,
+
+layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
+layout(location = 1) in vec3 normal; // VAP position 1 for normals
+layout(location = 3) in vec2 uv; // VAP position 3 for texture coordinates
+layout(location = 5) in uint material; // VAP position 5 for the material index
+layout(location = 7) in uint objectIndex; // FEATURE_GPU_DRIVEN: per instance, from the command's baseInstance
+
+out vec3 vertexNormal; // For outgoing normals to fragment shader
+out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
+out vec2 vertexUV; // For outgoing texture coordinates
+flat out int vertexMaterial; // For outgoing material index, -1 when untextured
+
+// FEATURE_GPU_DRIVEN: object records of the GPU-driven scene (UCullObject)
+struct CullObject
+{
+    mat4 model;
+    vec4 lower;
+    vec4 upper;
+    uvec4 draw;
+};
+
+layout(std430, binding = 6) readonly buffer CullObjects
+{
+    CullObject objects[];
+};
+
+//Uniform / Global variables for the  transform matrices
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+uniform mat4 viewProjections[4]; // FEATURE_MULTIVIEW: one per view, in place of view and projection
+
+void main()
+{
+    mat4 objectModel = FEATURE_GPU_DRIVEN ? objects[objectIndex].model : model;
+    mat4 viewProjection = FEATURE_MULTIVIEW ? viewProjections[VIEW_INDEX] : projection * view;
+    gl_Position = viewProjection * objectModel * vec4(position, 1.0f); // Transforms vertices into clip coordinates
+    SET_VIEW_LAYER();
+
+    vertexFragmentPos = vec3(objectModel * vec4(position, 1.0f)); // Gets fragment / pixel position in world space only (exclude view and projection)
+
+    vertexNormal = mat3(transpose(inverse(objectModel))) * normal; // get normal vectors in world space only and exclude normal translation properties
+
+    vertexUV = uv;
+    vertexMaterial = material == 0xffffu ? -1 : int(material);
+}
+);
+
+
+/* Fragment Shader Source Code*/
+const GLchar* clayFragmentShaderSource = GLSL(440,
+    in vec4 vertexColor; // Variable to hold incoming color data from vertex shader
+
+in vec3 vertexNormal; // For incoming normals
+in vec3 vertexFragmentPos; // For incoming fragment position
+in vec2 vertexUV; // For incoming texture coordinates
+flat in int vertexMaterial; // For incoming material index
+
+out vec4 fragmentColor; // For outgoing cube color to the GPU
+
+// Uniform / Global variables for object color, light color, light position, and camera/view position
+uniform vec3 objectColor;
+uniform vec3 lightColor;
+uniform vec3 lightPos;
+uniform vec3 viewPosition;
+
+// Baked shading (FEATURE_PROBE_LIGHTING): ambient and diffuse come from the irradiance probes
+uniform sampler3D irradianceProbes; // The six faces of every probe side by side along x
+uniform vec3 probeLower;
+uniform vec3 probeUpper;
+uniform ivec3 probeCount;
+
+vec4 materialColor(int material, vec2 uv); // Texture lookup, linked in from the material shader
+
+// One face of the ambient cubes (+x, -x, +y, -y, +z, -z), filtered between the probes around the point
+vec3 probeFace(int face, vec3 cell)
+{
+    vec3 texel = clamp(cell * vec3(probeCount), vec3(0.5), vec3(probeCount) - vec3(0.5));
+    texel.x += float(face * probeCount.x);
+    return texture(irradianceProbes, texel / vec3(probeCount * ivec3(6, 1, 1))).rgb;
+}
+
+vec3 probeIrradiance(vec3 position, vec3 normal)
+{
+    vec3 cell = (position - probeLower) / (probeUpper - probeLower);
+    vec3 weight = normal * normal;
+    return weight.x * probeFace(normal.x < 0.0 ? 1 : 0, cell)
+        + weight.y * probeFace(normal.y < 0.0 ? 3 : 2, cell)
+        + weight.z * probeFace(normal.z < 0.0 ? 5 : 4, cell);
+}
+
+void main()
+{
+    /*Phong lighting model calculations to generate ambient, diffuse, and specular components*/
+
+    //Calculate Ambient lighting*/
+    vec3 ambient = AMBIENT_STRENGTH * lightColor; // Generate ambient light color from the ambient or global lighting strength
+
+    //Calculate Diffuse lighting*/
+    vec3 norm = normalize(vertexNormal); // Normalize vectors to 1 unit
+    norm = dot(norm, viewPosition - vertexFragmentPos) < 0.0 ? -norm : norm; // Mesh winding is mixed, so face the normal towards the viewer
+    vec3 lightDirection = normalize(lightPos - vertexFragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on cube
+    float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light
+    vec3 diffuse = impact * lightColor; // Generate diffuse light color
+
+    //Calculate Specular lighting*/
+    vec3 viewDir = normalize(viewPosition - vertexFragmentPos); // Calculate view direction
+    vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
+    //Calculate specular component from the highlight size and the specular light strength
+    float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), HIGHLIGHT_SIZE);
+    vec3 specular = SPECULAR_INTENSITY * specularComponent * lightColor;
+
+    // Textured variants take their color from the material, the rest from objectColor
+    vec3 albedo = FEATURE_TEXTURED ? materialColor(vertexMaterial, vertexUV).rgb : objectColor;
+
+    // Calculate phong result
+    vec3 lighting = FEATURE_PROBE_LIGHTING ? probeIrradiance(vertexFragmentPos, norm) : ambient + diffuse;
+    vec3 phong = (lighting + specular) * albedo;
+
+    fragmentColor = vec4(phong, 1.0f); // Send lighting results to GPU
+}
+);
+
+/* Baked Shader Source Code*/
+// The clay shader with ambient and diffuse read from the lightmap; specular depends on the viewer and stays dynamic
+const GLchar* bakedVertexShaderSource = GLSL(440,
+
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec3 normal;
+layout(location = 3) in vec2 uv;
+layout(location = 5) in uint material;
+layout(location = 6) in vec2 lightmapUV; // VAP position 6 for the unwrapped lightmap coordinates
+
+out vec3 vertexNormal;
+out vec3 vertexFragmentPos;
+out vec2 vertexUV;
+out vec2 vertexLightmapUV;
+flat out int vertexMaterial;
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+uniform mat4 viewProjections[4];
+
+void main()
+{
+    mat4 viewProjection = FEATURE_MULTIVIEW ? viewProjections[VIEW_INDEX] : projection * view;
+    gl_Position = viewProjection * model * vec4(position, 1.0f);
+    SET_VIEW_LAYER();
+    vertexFragmentPos = vec3(model * vec4(position, 1.0f));
+    vertexNormal = mat3(transpose(inverse(model))) * normal;
+    vertexUV = uv;
+    vertexLightmapUV = lightmapUV;
+    vertexMaterial = material == 0xffffu ? -1 : int(material);
+}
+);
+
+const GLchar* bakedFragmentShaderSource = GLSL(440,
+
+in vec3 vertexNormal;
+in vec3 vertexFragmentPos;
+in vec2 vertexUV;
+in vec2 vertexLightmapUV;
+flat in int vertexMaterial;
+
+out vec4 fragmentColor;
+
+uniform vec3 objectColor;
+uniform vec3 lightColor;
+uniform vec3 lightPos;
+uniform vec3 viewPosition;
+uniform sampler2D lightmap; // Ambient and diffuse light, baked
+
+vec4 materialColor(int material, vec2 uv);
+
+void main()
+{
+    vec3 norm = normalize(vertexNormal);
+    norm = dot(norm, viewPosition - vertexFragmentPos) < 0.0 ? -norm : norm;
+    vec3 lightDirection = normalize(lightPos - vertexFragmentPos);
+    vec3 viewDir = normalize(viewPosition - vertexFragmentPos);
+    vec3 reflectDir = reflect(-lightDirection, norm);
+    vec3 specular = SPECULAR_INTENSITY * pow(max(dot(viewDir, reflectDir), 0.0), HIGHLIGHT_SIZE) * lightColor;
+
+    vec4 texel = materialColor(vertexMaterial, vertexUV);
+    vec3 albedo = vertexMaterial < 0 ? objectColor : texel.rgb;
+
+    fragmentColor = vec4((texture(lightmap, vertexLightmapUV).rgb + specular) * albedo, 1.0f);
+}
+);
+
+/* Lamp Shader Source Code*/
+const GLchar* lampVertexShaderSource = GLSL(440,
+
+    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
+
+        //Uniform / Global variables for the  transform matrices
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+uniform mat4 viewProjections[4];
+
+void main()
+{
+    mat4 viewProjection = FEATURE_MULTIVIEW ? viewProjections[VIEW_INDEX] : projection * view;
+    gl_Position = viewProjection * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
+    SET_VIEW_LAYER();
+}
+);
+
+/* Fragment Shader Source Code*/
+const GLchar* lampFragmentShaderSource = GLSL(440,
+
+    out vec4 fragmentColor; // For outgoing lamp color (smaller cube) to the GPU
+
+void main()
+{
+    fragmentColor = vec4(1.0f); // Set color to white (1.0f,1.0f,1.0f) with alpha 1.0
+}
+);
+
+/* Parametric Primitive Shader Source Code*/
+// The vertex stage only forwards the patch id; all geometry comes from the storage buffers
+const GLchar* parametricVertexShaderSource = GLSL(440,
+
+flat out int vertexPatch; // Patch record index for the control stage
+
+void main()
+{
+    vertexPatch = gl_VertexID;
+}
+);
+
+// Storage buffers and surface evaluation shared by the control and evaluation stages
+const GLchar* parametricSurfaceSource = GLSL_CHUNK(
+
+struct Primitive
+{
+    mat4 model;
+    mat4 normalMatrix;
+    vec4 params;
+    ivec4 info; // type, control point offset
+};
+
+struct Patch
+{
+    vec4 uvRange; // u0, v0, u1, v1
+    ivec4 info; // primitive, region
+};
+
+layout(std430, binding = 0) readonly buffer PrimitiveBuffer { Primitive primitives[]; };
+layout(std430, binding = 1) readonly buffer PatchBuffer { Patch patches[]; };
+layout(std430, binding = 2) readonly buffer ControlPointBuffer { vec4 controlPoints[]; };
+
+const float PI = 3.14159265;
+
+// Cubic Bernstein basis and its derivative
+vec4 bernstein(float t)
+{
+    float s = 1.0 - t;
+    return vec4(s * s * s, 3.0 * t * s * s, 3.0 * t * t * s, t * t * t);
+}
+
+vec4 bernsteinDerivative(float t)
+{
+    float s = 1.0 - t;
+    return vec4(-3.0 * s * s, 3.0 * s * s - 6.0 * t * s, 6.0 * t * s - 3.0 * t * t, 3.0 * t * t);
+}
+
+// Object-space position and normal of a primitive at a parameter coordinate
+void evaluateSurface(int primitive, int region, vec2 uv, out vec3 position, out vec3 normal)
+{
+    vec4 params = primitives[primitive].params;
+    int type = primitives[primitive].info.x;
+    float phi = 2.0 * PI * uv.x;
+    vec2 ring = vec2(cos(phi), sin(phi));
+
+    if (type == 0) // Sphere
+    {
+        float theta = PI * uv.y;
+        normal = vec3(sin(theta) * ring.x, cos(theta), sin(theta) * ring.y);
+        position = params.x * normal;
+    }
+    else if (type == 1) // Cylinder: region 0 bottom cap, 1 body, 2 top cap
+    {
+        if (region == 0)
+        {
+            position = vec3(uv.y * params.x * ring.x, 0.0, uv.y * params.x * ring.y);
+            normal = vec3(0.0, -1.0, 0.0);
+        }
+        else if (region == 1)
+        {
+            position = vec3(params.x * ring.x, uv.y * params.y, params.x * ring.y);
+            normal = vec3(ring.x, 0.0, ring.y);
+        }
+        else
+        {
+            position = vec3((1.0 - uv.y) * params.x * ring.x, params.y, (1.0 - uv.y) * params.x * ring.y);
+            normal = vec3(0.0, 1.0, 0.0);
+        }
+    }
+    else if (type == 2) // Torus
+    {
+        float theta = 2.0 * PI * uv.y;
+        vec3 tubeDirection = vec3(cos(theta) * ring.x, sin(theta), cos(theta) * ring.y);
+        position = vec3(params.x * ring.x, 0.0, params.x * ring.y) + params.y * tubeDirection;
+        normal = tubeDirection;
+    }
+    else // Bicubic Bezier patch
+    {
+        int offset = primitives[primitive].info.y;
+        vec4 bu = bernstein(uv.x);
+        vec4 bv = bernstein(uv.y);
+        vec4 du = bernsteinDerivative(uv.x);
+        vec4 dv = bernsteinDerivative(uv.y);
+        vec3 tangentU = vec3(0.0);
+        vec3 tangentV = vec3(0.0);
+        position = vec3(0.0);
+        for (int j = 0; j < 4; ++j)
+        {
+            for (int i = 0; i < 4; ++i)
+            {
+                vec3 point = controlPoints[offset + j * 4 + i].xyz;
+                position += bu[i] * bv[j] * point;
+                tangentU += du[i] * bv[j] * point;
+                tangentV += bu[i] * dv[j] * point;
+            }
+        }
+        normal = cross(tangentV, tangentU);
+        normal = length(normal) > 1e-6 ? normalize(normal) : vec3(0.0, 1.0, 0.0);
+    }
+}
+
+vec3 worldPosition(int patchId, vec2 uv)
+{
+    int primitive = patches[patchId].info.x;
+    vec3 position;
+    vec3 normal;
+    evaluateSurface(primitive, patches[patchId].info.y, uv, position, normal);
+    return vec3(primitives[primitive].model * vec4(position, 1.0));
+}
+);
+
+// Picks per-edge tessellation levels from the on-screen length of each patch edge
+const GLchar* parametricControlShaderSource = GLSL_CHUNK(
+
+layout(vertices = 1) out;
+
+flat in int vertexPatch[];
+patch out int patchIndex; // Forwarded to the evaluation stage
+
+uniform mat4 view;
+uniform mat4 projection;
+uniform vec2 viewportSize;
+uniform float targetEdgePixels;
+
+vec2 toScreen(vec3 position)
+{
+    vec4 clip = projection * view * vec4(position, 1.0);
+    return (clip.xy / max(clip.w, 0.0001) * 0.5 + 0.5) * viewportSize;
+}
+
+// Edge length measured through its midpoint so curvature counts; symmetric in a and b, so neighbouring
+// patches agree on the level of a shared edge and no cracks open
+float edgeLevel(int patchId, vec2 a, vec2 b)
+{
+    vec2 pa = toScreen(worldPosition(patchId, a));
+    vec2 pm = toScreen(worldPosition(patchId, 0.5 * (a + b)));
+    vec2 pb = toScreen(worldPosition(patchId, b));
+    float pixels = length(pm - pa) + length(pb - pm);
+    return clamp(pixels / targetEdgePixels, 1.0, 64.0);
+}
+
+void main()
+{
+    if (gl_InvocationID == 0)
+    {
+        int index = vertexPatch[0];
+        vec4 range = patches[index].uvRange;
+        patchIndex = index;
+
+        // Quad domain edges: 0 is u = u0, 1 is v = v0, 2 is u = u1, 3 is v = v1
+        gl_TessLevelOuter[0] = edgeLevel(index, range.xy, vec2(range.x, range.w));
+        gl_TessLevelOuter[1] = edgeLevel(index, range.xy, vec2(range.z, range.y));
+        gl_TessLevelOuter[2] = edgeLevel(index, vec2(range.z, range.y), range.zw);
+        gl_TessLevelOuter[3] = edgeLevel(index, vec2(range.x, range.w), range.zw);
+        gl_TessLevelInner[0] = max(gl_TessLevelOuter[1], gl_TessLevelOuter[3]);
+        gl_TessLevelInner[1] = max(gl_TessLevelOuter[0], gl_TessLevelOuter[2]);
+    }
+}
+);
+
+// Evaluates the surface at each generated vertex and feeds the Phong fragment shader
+const GLchar* parametricEvaluationShaderSource = GLSL_CHUNK(
+
+layout(quads, fractional_even_spacing, ccw) in;
+
+patch in int patchIndex;
+
+out vec3 vertexNormal; // For outgoing normals to fragment shader
+out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
+out vec2 vertexUV; // Surface parameters double as texture coordinates
+flat out int vertexMaterial; // Curved primitives are untextured
+
+uniform mat4 view;
+uniform mat4 projection;
+
+void main()
+{
+    vec4 range = patches[patchIndex].uvRange;
+    int primitive = patches[patchIndex].info.x;
+    vec2 uv = mix(range.xy, range.zw, gl_TessCoord.xy);
+
+    vec3 position;
+    vec3 normal;
+    evaluateSurface(primitive, patches[patchIndex].info.y, uv, position, normal);
+
+    vec4 world = primitives[primitive].model * vec4(position, 1.0);
+    vertexFragmentPos = world.xyz;
+    vertexNormal = mat3(primitives[primitive].normalMatrix) * normal;
+    vertexUV = uv;
+    vertexMaterial = -1;
+    gl_Position = projection * view * world;
+}
+);
+
+/* Material Shader Source Code*/
+// Compiled on its own and linked into every lit program; one variant per texture path
+const GLchar* materialStructSource = GLSL_CHUNK(
+
+struct Material
+{
+    ivec4 texture; // array, layer, virtual; array < 0 when untextured
+    uvec2 handle; // Bindless sampler2DArray handle
+    vec2 uvScale;
+    vec4 tint;
+};
+
+layout(std430, binding = 3) readonly buffer Materials
+{
+    Material materials[];
+};
+
+// Virtual texture: indirection lookup into the physical page cache (or the sparse texture), with page
+// requests written to the feedback buffer
+uniform usampler2D vtIndirection;
+uniform sampler2D vtCache;
+uniform sampler2D vtSparseTexture;
+uniform int vtSparse;
+uniform ivec2 vtPages; // Pages of mip 0
+uniform int vtMipCount;
+uniform uint vtFrame;
+
+layout(std430, binding = 4) buffer VirtualTextureFeedback
+{
+    uint vtFeedback[];
+};
+
+const float VT_PAGE_CONTENT = 128.0;
+const float VT_PAGE_BORDER = 4.0;
+
+int vtPageOffset(int mip)
+{
+    int offset = 0;
+    for (int level = 0; level < mip; ++level)
+        offset += max(vtPages.x >> level, 1) * max(vtPages.y >> level, 1);
+    return offset;
+}
+
+vec4 virtualTextureColor(vec2 uv, vec2 dx, vec2 dy)
+{
+    vec2 texels = vec2(vtPages) * VT_PAGE_CONTENT;
+    float lod = 0.5 * log2(max(max(dot(dx * texels, dx * texels), dot(dy * texels, dy * texels)), 1e-8));
+    int mip = clamp(int(floor(lod)), 0, vtMipCount - 1);
+    vec2 wrapped = fract(uv);
+
+    // One pixel in 16 reports its page, rotating with the frame so every visible page shows up within a few frames
+    ivec2 pixel = ivec2(gl_FragCoord.xy) + ivec2(int(vtFrame) & 3, (int(vtFrame) >> 2) & 3);
+    if ((pixel.x & 3) == 0 && (pixel.y & 3) == 0)
+    {
+        ivec2 pages = max(vtPages >> mip, ivec2(1));
+        ivec2 page = min(ivec2(wrapped * vec2(pages)), pages - 1);
+        vtFeedback[vtPageOffset(mip) + page.y * pages.x + page.x] = vtFrame;
+    }
+
+    // Finest resident mip at or above the wanted one; the last mip is always resident
+    for (int level = mip; level < vtMipCount; ++level)
+    {
+        ivec2 pages = max(vtPages >> level, ivec2(1));
+        vec2 pageCoordinate = wrapped * vec2(pages);
+        ivec2 page = min(ivec2(pageCoordinate), pages - 1);
+        uvec4 entry = texelFetch(vtIndirection, page, level);
+        if (entry.a == 0u)
+            continue;
+
+        if (vtSparse != 0)
+            return textureLod(vtSparseTexture, wrapped, float(level));
+
+        vec2 inside = (pageCoordinate - vec2(page)) * VT_PAGE_CONTENT + VT_PAGE_BORDER;
+        vec2 physical = vec2(entry.xy) * (VT_PAGE_CONTENT + 2.0 * VT_PAGE_BORDER) + inside;
+        return textureLod(vtCache, physical / vec2(textureSize(vtCache, 0)), 0.0);
+    }
+    return vec4(1.0, 0.0, 1.0, 1.0);
+}
+);
+
+// Texture arrays on fixed units. Sampler arrays may only be indexed with constants here, so the array is
+// picked by a switch, and gradients are taken up front because the branches are not uniform.
+const GLchar* materialArraySource = GLSL_CHUNK(
+
+uniform sampler2DArray textureArrays[4];
+
+vec4 materialColor(int material, vec2 uv)
+{
+    Material m = materials[max(material, 0)];
+    vec2 scaled = uv * m.uvScale;
+    vec2 dx = dFdx(scaled);
+    vec2 dy = dFdy(scaled);
+    if (material < 0)
+        return vec4(1.0);
+    if (m.texture.z != 0)
+        return virtualTextureColor(scaled, dx, dy) * m.tint;
+    if (m.texture.x < 0)
+        return vec4(1.0);
+
+    vec3 coordinate = vec3(scaled, float(m.texture.y));
+    vec4 texel = vec4(1.0);
+    switch (m.texture.x)
+    {
+    case 0: texel = textureGrad(textureArrays[0], coordinate, dx, dy); break;
+    case 1: texel = textureGrad(textureArrays[1], coordinate, dx, dy); break;
+    case 2: texel = textureGrad(textureArrays[2], coordinate, dx, dy); break;
+    case 3: texel = textureGrad(textureArrays[3], coordinate, dx, dy); break;
+    }
+    return texel * m.tint;
+}
+);
+
+// Bindless: the material carries the array handle itself
+const GLchar* materialBindlessSource = GLSL_CHUNK(
+
+vec4 materialColor(int material, vec2 uv)
+{
+    Material m = materials[max(material, 0)];
+    vec2 scaled = uv * m.uvScale;
+    vec2 dx = dFdx(scaled);
+    vec2 dy = dFdy(scaled);
+    if (material < 0)
+        return vec4(1.0);
+    if (m.texture.z != 0)
+        return virtualTextureColor(scaled, dx, dy) * m.tint;
+    if (m.texture.x < 0)
+        return vec4(1.0);
+
+    return textureGrad(sampler2DArray(m.handle), vec3(scaled, float(m.texture.y)), dx, dy) * m.tint;
+}
+);
+
+/* Post-processing Shader Source Code*/
+// Fullscreen triangle generated from gl_VertexID
+const GLchar* postVertexShaderSource = GLSL(440,
+
+out vec2 textureCoordinate;
+
+uniform vec2 uvScale; // Fraction of the source textures covered by the rendered image
+
+void main()
+{
+    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    textureCoordinate = corner * uvScale;
+    gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+}
+);
+
+// HDR scene to display range; the scene is lit for [0, 1], so this clamps and stores luma for the AA passes
+const GLchar* toneMapFragmentShaderSource = GLSL(440,
+
+in vec2 textureCoordinate;
+out vec4 fragmentColor;
+
+uniform sampler2D sourceTexture;
+
+void main()
+{
+    vec3 color = clamp(texture(sourceTexture, textureCoordinate).rgb, 0.0, 1.0);
+    fragmentColor = vec4(color, dot(color, vec3(0.299, 0.587, 0.114)));
+}
+);
+
+// FXAA: one pass, five luma taps decide whether and along which direction to blur
+const GLchar* fxaaFragmentShaderSource = GLSL(440,
+
+in vec2 textureCoordinate;
+out vec4 fragmentColor;
+
+uniform sampler2D sourceTexture;
+uniform vec2 texelSize;
+
+const float FXAA_SPAN_MAX = 8.0;
+const float FXAA_REDUCE_MUL = 1.0 / 8.0;
+const float FXAA_REDUCE_MIN = 1.0 / 128.0;
+
+void main()
+{
+    float lumaNW = texture(sourceTexture, textureCoordinate + vec2(-1.0, 1.0) * texelSize).a;
+    float lumaNE = texture(sourceTexture, textureCoordinate + vec2(1.0, 1.0) * texelSize).a;
+    float lumaSW = texture(sourceTexture, textureCoordinate + vec2(-1.0, -1.0) * texelSize).a;
+    float lumaSE = texture(sourceTexture, textureCoordinate + vec2(1.0, -1.0) * texelSize).a;
+    vec4 center = texture(sourceTexture, textureCoordinate);
+    float lumaMin = min(center.a, min(min(lumaNW, lumaNE), min(lumaSW, lumaSE)));
+    float lumaMax = max(center.a, max(max(lumaNW, lumaNE), max(lumaSW, lumaSE)));
+
+    // Blur direction runs along the edge, perpendicular to the luma gradient
+    vec2 direction = vec2(-((lumaNW + lumaNE) - (lumaSW + lumaSE)), (lumaNW + lumaSW) - (lumaNE + lumaSE));
+    float directionReduce = max((lumaNW + lumaNE + lumaSW + lumaSE) * 0.25 * FXAA_REDUCE_MUL, FXAA_REDUCE_MIN);
+    float inverseDirectionMin = 1.0 / (min(abs(direction.x), abs(direction.y)) + directionReduce);
+    direction = clamp(direction * inverseDirectionMin, vec2(-FXAA_SPAN_MAX), vec2(FXAA_SPAN_MAX)) * texelSize;
+
+    vec4 colorA = 0.5 * (texture(sourceTexture, textureCoordinate + direction * (1.0 / 3.0 - 0.5)) +
+        texture(sourceTexture, textureCoordinate + direction * (2.0 / 3.0 - 0.5)));
+    vec4 colorB = colorA * 0.5 + 0.25 * (texture(sourceTexture, textureCoordinate - direction * 0.5) +
+        texture(sourceTexture, textureCoordinate + direction * 0.5));
+    float lumaB = dot(colorB.rgb, vec3(0.299, 0.587, 0.114));
+
+    // The wide blur is rejected when it leaves the local luma range (it crossed another edge)
+    fragmentColor = (lumaB < lumaMin || lumaB > lumaMax) ? vec4(colorA.rgb, 1.0) : vec4(colorB.rgb, 1.0);
+}
+);
+
+// SMAA 1: luma edges with local contrast adaptation. r marks an edge with the left neighbour, g with the one below.
+const GLchar* smaaEdgeFragmentShaderSource = GLSL(440,
+
+out vec4 fragmentColor;
+
+uniform sampler2D sourceTexture;
+uniform ivec2 renderSize;
+
+const float THRESHOLD = 0.1;
+
+float lumaAt(ivec2 p)
+{
+    return texelFetch(sourceTexture, clamp(p, ivec2(0), renderSize - 1), 0).a;
+}
+
+void main()
+{
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    float luma = lumaAt(p);
+    vec2 delta = abs(luma - vec2(lumaAt(p + ivec2(-1, 0)), lumaAt(p + ivec2(0, -1))));
+    vec2 edges = step(THRESHOLD, delta);
+
+    if (dot(edges, vec2(1.0)) > 0.0)
+    {
+        // Drop edges that are much weaker than a neighbouring one, so one contour does not produce parallel edges
+        float maxDelta = max(delta.x, delta.y);
+        maxDelta = max(maxDelta, abs(luma - lumaAt(p + ivec2(1, 0))));
+        maxDelta = max(maxDelta, abs(luma - lumaAt(p + ivec2(0, 1))));
+        maxDelta = max(maxDelta, abs(lumaAt(p + ivec2(-1, 0)) - lumaAt(p + ivec2(-2, 0))));
+        maxDelta = max(maxDelta, abs(lumaAt(p + ivec2(0, -1)) - lumaAt(p + ivec2(0, -2))));
+        edges *= step(maxDelta, 2.0 * delta);
+    }
+
+    fragmentColor = vec4(edges, 0.0, 0.0);
+}
+);
+
+// SMAA 2: blending weights. Each edge is followed to both ends, the crossing edges at its ends classify
+// the pattern (L, Z or U), and the coverage of the reconstructed silhouette line is computed analytically.
+// r/g: this pixel takes the left color / the left pixel takes this color; b/a: same for the edge below.
+const GLchar* smaaWeightFragmentShaderSource = GLSL(440,
+
+out vec4 fragmentColor;
+
+uniform sampler2D sourceTexture;
+uniform ivec2 renderSize;
+
+const int MAX_SEARCH = 16;
+
+vec2 edgesAt(ivec2 p)
+{
+    if (any(lessThan(p, ivec2(0))) || any(greaterThanEqual(p, renderSize)))
+        return vec2(0.0);
+    return texelFetch(sourceTexture, p, 0).rg;
+}
+
+// Offset of the silhouette from the edge at one end: +0.5 when the contour turns on the positive side only
+float endOffset(float positiveCrossing, float negativeCrossing)
+{
+    if (positiveCrossing > 0.5 && negativeCrossing < 0.5)
+        return 0.5;
+    if (negativeCrossing > 0.5 && positiveCrossing < 0.5)
+        return -0.5;
+    return 0.0;
+}
+
+// Silhouette offset at the center of pixel t along an edge of the given length
+float lineOffset(float a, float b, float t, float len)
+{
+    float s = (t + 0.5) / len;
+    if (a != 0.0 && a == b)
+        return a * abs(2.0 * s - 1.0); // U shape dips to the edge in the middle
+    return mix(a, b, s); // Z and L shapes; straight edges (both ends open) get nothing
+}
+
+void main()
+{
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    vec2 e = edgesAt(p);
+    vec4 weights = vec4(0.0);
+
+    if (e.r > 0.5) // Vertical edge on the left of this pixel; the positive side is this pixel's column
+    {
+        int down = 0;
+        while (down < MAX_SEARCH && edgesAt(p - ivec2(0, down + 1)).r > 0.5)
+            ++down;
+        int up = 0;
+        while (up < MAX_SEARCH && edgesAt(p + ivec2(0, up + 1)).r > 0.5)
+            ++up;
+
+        ivec2 bottom = p - ivec2(0, down);
+        ivec2 top = p + ivec2(0, up);
+        float a = endOffset(edgesAt(bottom).g, edgesAt(bottom - ivec2(1, 0)).g);
+        float b = endOffset(edgesAt(top + ivec2(0, 1)).g, edgesAt(top + ivec2(-1, 1)).g);
+        float offset = lineOffset(a, b, float(down), float(down + up + 1));
+        weights.r = max(offset, 0.0);
+        weights.g = max(-offset, 0.0);
+    }
+
+    if (e.g > 0.5) // Horizontal edge below this pixel; the positive side is this pixel's row
+    {
+        int left = 0;
+        while (left < MAX_SEARCH && edgesAt(p - ivec2(left + 1, 0)).g > 0.5)
+            ++left;
+        int right = 0;
+        while (right < MAX_SEARCH && edgesAt(p + ivec2(right + 1, 0)).g > 0.5)
+            ++right;
+
+        ivec2 first = p - ivec2(left, 0);
+        ivec2 last = p + ivec2(right, 0);
+        float a = endOffset(edgesAt(first).r, edgesAt(first - ivec2(0, 1)).r);
+        float b = endOffset(edgesAt(last + ivec2(1, 0)).r, edgesAt(last + ivec2(1, -1)).r);
+        float offset = lineOffset(a, b, float(left), float(left + right + 1));
+        weights.b = max(offset, 0.0);
+        weights.a = max(-offset, 0.0);
+    }
+
+    fragmentColor = weights;
+}
+);
+
+// SMAA 3: neighbourhood blending with the weights of this pixel and of its right and upper neighbours
+const GLchar* smaaBlendFragmentShaderSource = GLSL(440,
+
+out vec4 fragmentColor;
+
+uniform sampler2D sourceTexture; // Blending weights
+uniform sampler2D colorTexture;
+uniform ivec2 renderSize;
+
+void main()
+{
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    ivec2 last = renderSize - 1;
+    vec4 color = texelFetch(colorTexture, p, 0);
+
+    vec4 weights = texelFetch(sourceTexture, p, 0);
+    float wLeft = weights.r;
+    float wDown = weights.b;
+    float wRight = texelFetch(sourceTexture, min(p + ivec2(1, 0), last), 0).g;
+    float wUp = texelFetch(sourceTexture, min(p + ivec2(0, 1), last), 0).a;
+    float total = wLeft + wRight + wDown + wUp;
+
+    if (total <= 0.0)
+    {
+        fragmentColor = vec4(color.rgb, 1.0);
+        return;
+    }
+
+    float scale = total > 1.0 ? 1.0 / total : 1.0;
+    vec3 neighbours = wLeft * texelFetch(colorTexture, max(p - ivec2(1, 0), ivec2(0)), 0).rgb +
+        wRight * texelFetch(colorTexture, min(p + ivec2(1, 0), last), 0).rgb +
+        wDown * texelFetch(colorTexture, max(p - ivec2(0, 1), ivec2(0)), 0).rgb +
+        wUp * texelFetch(colorTexture, min(p + ivec2(0, 1), last), 0).rgb;
+    fragmentColor = vec4(color.rgb * (1.0 - total * scale) + neighbours * scale, 1.0);
+}
+);
+
+// Upscale with sharpening: bilinear sample plus an unsharp mask from the four neighbouring source texels,
+// clamped to their range so it cannot ring. Sharpening grows as the render scale drops.
+const GLchar* upscaleFragmentShaderSource = GLSL(440,
+
+in vec2 textureCoordinate;
+out vec4 fragmentColor;
+
+uniform sampler2D sourceTexture;
+uniform vec2 texelSize;
+uniform vec2 uvScale;
+uniform float sharpness;
+
+void main()
+{
+    // Keep the bilinear footprint inside the rendered corner of the source
+    vec2 limit = uvScale - 0.5 * texelSize;
+    vec2 uv = min(textureCoordinate, limit);
+    vec3 center = texture(sourceTexture, uv).rgb;
+    vec3 left = texture(sourceTexture, max(uv - vec2(texelSize.x, 0.0), vec2(0.0))).rgb;
+    vec3 right = texture(sourceTexture, min(uv + vec2(texelSize.x, 0.0), limit)).rgb;
+    vec3 down = texture(sourceTexture, max(uv - vec2(0.0, texelSize.y), vec2(0.0))).rgb;
+    vec3 up = texture(sourceTexture, min(uv + vec2(0.0, texelSize.y), limit)).rgb;
+
+    vec3 lowest = min(center, min(min(left, right), min(down, up)));
+    vec3 highest = max(center, max(max(left, right), max(down, up)));
+    vec3 sharpened = center + sharpness * (4.0 * center - left - right - down - up) * 0.25;
+    fragmentColor = vec4(clamp(sharpened, lowest, highest), 1.0);
+}
+);
+
+// Performance overlay: every quad comes from gl_VertexID. Quad 0 is the panel, then one bar per frame of history
+// (128, HUD_HISTORY), the frame budget line over them and one quad per glyph of the text. Bars are green
+// within the budget, yellow up to 1.5 times it and red beyond. Positions are window pixels from the top left.
+const GLchar* hudVertexShaderSource = GLSL(440,
+
+layout(std430, binding = 5) readonly buffer HudGlyphs
+{
+    uvec2 glyphs[];     // x | y << 16, atlas cell | color << 8
+};
+
+uniform vec2 screenSize;
+uniform vec4 panel;                 // x, y, width, height
+uniform vec4 graph;
+uniform float budgetMs;
+uniform float graphMs;              // Frame time at the top of the graph
+uniform float frameTimes[128];
+uniform int historyStart;           // Oldest frame in frameTimes
+uniform float glyphScale;
+
+out vec4 color;
+out vec2 fontCoordinate;
+flat out int textured;
+
+const int corners[6] = int[6](0, 1, 2, 2, 1, 3);
+const vec4 palette[4] = vec4[4](vec4(1.0), vec4(0.3, 0.9, 0.3, 1.0), vec4(1.0, 0.85, 0.2, 1.0), vec4(1.0, 0.3, 0.25, 1.0));
+
+void main()
+{
+    int quad = gl_VertexID / 6;
+    int corner = corners[gl_VertexID % 6];
+    vec2 unit = vec2(corner & 1, corner >> 1);
+
+    vec4 rect;
+    textured = 0;
+    fontCoordinate = vec2(0.0);
+    if (quad == 0)
+    {
+        rect = panel;
+        color = vec4(0.0, 0.0, 0.0, 0.65);
+    }
+    else if (quad <= 128)
+    {
+        int bar = quad - 1;
+        float ms = frameTimes[(historyStart + bar) % 128];
+        float height = graph.w * min(ms / graphMs, 1.0);
+        float width = graph.z / 128.0;
+        rect = vec4(graph.x + bar * width, graph.y + graph.w - height, width, height);
+        color = palette[ms <= budgetMs ? 1 : (ms <= 1.5 * budgetMs ? 2 : 3)];
+    }
+    else if (quad == 129)
+    {
+        rect = vec4(graph.x, graph.y + graph.w * (1.0 - min(budgetMs / graphMs, 1.0)), graph.z, 1.0);
+        color = vec4(1.0, 1.0, 1.0, 0.8);
+    }
+    else
+    {
+        uvec2 glyph = glyphs[quad - 130];
+        rect = vec4(float(glyph.x & 0xffffu), float(glyph.x >> 16), 5.0 * glyphScale, 7.0 * glyphScale);
+        fontCoordinate = vec2(float((glyph.y & 0xffu) * 6u), 0.0) + unit * vec2(5.0, 7.0);
+        color = palette[glyph.y >> 8];
+        textured = 1;
+    }
+
+    vec2 pixel = rect.xy + unit * rect.zw;
+    gl_Position = vec4(pixel.x / screenSize.x * 2.0 - 1.0, 1.0 - pixel.y / screenSize.y * 2.0, 0.0, 1.0);
+}
+);
+
+
+const GLchar* hudFragmentShaderSource = GLSL(440,
+
+in vec4 color;
+in vec2 fontCoordinate;
+flat in int textured;
+out vec4 fragmentColor;
+
+uniform sampler2D font;
+
+void main()
+{
+    if (textured != 0 && texelFetch(font, ivec2(fontCoordinate), 0).r < 0.5)
+        discard;
+    fragmentColor = color;
+}
+);
+
+
+// Frustum and occlusion culling of the GPU-driven scene, one object per invocation. A visible object gets a
+// draw command in the run of its batch; the run's atomic counter hands out the slots. The occlusion test
+// projects the object's box with last frame's transform and compares its nearest depth with the farthest
+// depth of the pyramid level at which the box covers at most 2x2 texels.
+const GLchar* cullComputeShaderSource = GLSL(440,
+
+layout(local_size_x = 64) in;
+
+struct CullObject
+{
+    mat4 model;
+    vec4 lower;
+    vec4 upper;
+    uvec4 draw;     // firstIndex, indexCount, batch
+};
+
+struct DrawCommand
+{
+    uint count;
+    uint instanceCount;
+    uint firstIndex;
+    int baseVertex;
+    uint baseInstance;
+};
+
+layout(std430, binding = 6) readonly buffer CullObjects
+{
+    CullObject objects[];
+};
+
+layout(std430, binding = 7) writeonly buffer DrawCommands
+{
+    DrawCommand commands[];
+};
+
+layout(binding = 0, offset = 0) uniform atomic_uint texturedDraws;
+layout(binding = 0, offset = 4) uniform atomic_uint untexturedDraws;
+
+uniform uint firstObject;
+uniform uint objectCount;
+uniform uint capacity;              // Commands per batch
+uniform uint instances;             // Per draw: one per view on the layered multiview path
+uniform int planeCount;
+uniform vec4 frustumPlanes[24];     // Six per view, pointing inwards
+uniform bool occlusion;
+uniform sampler2D depthPyramid;
+uniform int pyramidLevels;
+uniform ivec2 pyramidSize;          // Level 0; textureSize() with a per-object level is unreliable on some drivers
+uniform vec2 pyramidRegion;         // Level 0 texels the captured frame covered
+uniform mat4 pyramidViewProjection;
+
+bool insideFrustum(int first, vec3 lower, vec3 upper)
+{
+    for (int plane = first; plane < first + 6; ++plane)
+    {
+        vec3 farthest = mix(lower, upper, greaterThan(frustumPlanes[plane].xyz, vec3(0.0)));
+        if (dot(frustumPlanes[plane].xyz, farthest) + frustumPlanes[plane].w < 0.0)
+            return false;
+    }
+    return true;
+}
+
+bool occluded(vec3 lower, vec3 upper)
+{
+    vec3 nearest = vec3(1.0);
+    vec3 farthest = vec3(-1.0);
+    for (int corner = 0; corner < 8; ++corner)
+    {
+        vec3 point = mix(lower, upper, bvec3((corner & 1) != 0, (corner & 2) != 0, (corner & 4) != 0));
+        vec4 clip = pyramidViewProjection * vec4(point, 1.0);
+        if (clip.w <= 0.0)
+            return false;
+        nearest = min(nearest, clip.xyz / clip.w);
+        farthest = max(farthest, clip.xyz / clip.w);
+    }
+
+    vec2 pixelLower = clamp(nearest.xy * 0.5 + 0.5, 0.0, 1.0) * pyramidRegion;
+    vec2 pixelUpper = clamp(farthest.xy * 0.5 + 0.5, 0.0, 1.0) * pyramidRegion;
+    vec2 extent = pixelUpper - pixelLower;
+    int level = clamp(int(ceil(log2(max(max(extent.x, extent.y), 1.0)))), 0, pyramidLevels - 1);
+    ivec2 size = max(pyramidSize >> level, ivec2(1));
+    ivec2 first = clamp(ivec2(pixelLower) >> level, ivec2(0), size - 1);
+    ivec2 last = clamp(ivec2(pixelUpper) >> level, ivec2(0), size - 1);
+
+    float occluderDepth = 0.0;
+    for (int y = first.y; y <= last.y; ++y)
+        for (int x = first.x; x <= last.x; ++x)
+            occluderDepth = max(occluderDepth, texelFetch(depthPyramid, ivec2(x, y), level).r);
+    return nearest.z * 0.5 + 0.5 > occluderDepth;
+}
+
+void main()
+{
+    uint index = firstObject + gl_GlobalInvocationID.x;
+    if (index >= objectCount)
+        return;
+
+    vec3 lower = objects[index].lower.xyz;
+    vec3 upper = objects[index].upper.xyz;
+    bool visible = false;
+    for (int first = 0; first < planeCount && !visible; first += 6)
+        visible = insideFrustum(first, lower, upper);
+    if (!visible || (occlusion && occluded(lower, upper)))
+        return;
+
+    uvec4 draw = objects[index].draw;
+    uint slot = draw.z == 0u ? atomicCounterIncrement(texturedDraws) : atomicCounterIncrement(untexturedDraws);
+    commands[draw.z * capacity + slot] = DrawCommand(draw.y, instances, draw.x, 0, index);
+}
+);
+
+
+// One level of the depth pyramid per dispatch. Level 0 copies the scene depth, with the far plane outside the
+// render region; every other texel takes the farthest of the 2x2 texels under it in the level above, and the
+// last row and column also take the odd texel left over, so no source texel is skipped.
+const GLchar* hizComputeShaderSource = GLSL(440,
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+layout(r32f, binding = 0) writeonly uniform image2D destination;
+uniform sampler2D source;           // Scene depth for level 0, the pyramid otherwise
+uniform int sourceLevel;            // -1 for the copy of level 0
+uniform ivec2 sourceSize;           // Of the source level, or the render region for the copy
+uniform ivec2 destinationSize;
+
+void main()
+{
+    ivec2 texel = ivec2(gl_GlobalInvocationID.xy);
+    if (any(greaterThanEqual(texel, destinationSize)))
+        return;
+
+    float depth = 1.0;
+    if (sourceLevel < 0)
+    {
+        if (all(lessThan(texel, sourceSize)))
+            depth = texelFetch(source, texel, 0).r;
+    }
+    else
+    {
+        ivec2 first = texel * 2;
+        ivec2 last = min(first + 1 + ivec2(equal(texel, destinationSize - 1)) * (sourceSize & 1), sourceSize - 1);
+        depth = 0.0;
+        for (int y = first.y; y <= last.y; ++y)
+            for (int x = first.x; x <= last.x; ++x)
+                depth = max(depth, texelFetch(source, ivec2(x, y), sourceLevel).r);
+    }
+    imageStore(destination, texel, vec4(depth));
+}
+);
+
+// Keeps the compiler from optimizing away a benchmarked result
+template <typename T>
+inline void UDoNotOptimize(const T& value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "r,m"(value) : "memory");
+#else
+    static volatile const void* sink;
+    sink = &value;
+#endif
+}
+
+
+// Times an operation: calibrates a batch size of at least ~10 ms, then records a number of batches
+template <typename Operation>
+UBenchmarkResult URunBenchmark(const char* name, size_t bytesPerOp, Operation operation)
+{
+    typedef std::chrono::steady_clock Clock;
+    const int sampleCount = 15;
+    const double minBatchNs = 10.0e6;
+
+    UBenchmarkResult result;
+    result.name = name;
+    result.bytesPerOp = bytesPerOp;
+
+    // Warm up caches and grow the batch until it is long enough to time reliably
+    size_t iterations = 1;
+    for (;;)
+    {
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < iterations; ++i)
+            operation();
+        double elapsedNs = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        if (elapsedNs >= minBatchNs || iterations >= (size_t(1) << 30))
+            break;
+        iterations *= 2;
+    }
+    result.iterationsPerSample = iterations;
+
+    for (int sample = 0; sample < sampleCount; ++sample)
+    {
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < iterations; ++i)
+            operation();
+        double elapsedNs = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        result.samplesNs.push_back(elapsedNs / iterations);
+    }
+
+    std::vector<double> sorted = result.samplesNs;
+    std::sort(sorted.begin(), sorted.end());
+    result.medianNs = sorted[sorted.size() / 2];
+    result.minNs = sorted.front();
+
+    double sum = 0.0;
+    for (double value : sorted)
+        sum += value;
+    result.meanNs = sum / sorted.size();
+
+    double variance = 0.0;
+    for (double value : sorted)
+        variance += (value - result.meanNs) * (value - result.meanNs);
+    result.stddevNs = std::sqrt(variance / (sorted.size() - 1));
+
+    return result;
+}
+
+
+// Images are loaded with Y axis going down, but OpenGL's Y axis goes up, so let's flip it
+void flipImageVertically(unsigned char* image, int width, int height, int channels)
+{
+    for (int j = 0; j < height / 2; ++j)
+    {
+        int index1 = j * width * channels;
+        int index2 = (height - 1 - j) * width * channels;
+
+        for (int i = width * channels; i > 0; --i)
+        {
+            unsigned char tmp = image[index1];
+            image[index1] = image[index2];
+            image[index2] = tmp;
+            ++index1;
+            ++index2;
+        }
+    }
+}
+
+
+int main(int argc, char* argv[])
+{
+    // Start the background log writer before anything reports, and note where the program's code lies before a GL
+    // driver is loaded next to it
+    ULogStart();
+    UFindProgramCode();
+
+#if USIMD_AVX2
+    // The build targets AVX2; say so instead of faulting on the first AVX2 instruction of an older CPU
+    if (!UCpuSupportsAvx2())
+    {
+        ULOG_ERROR("This build needs a CPU with AVX2; rebuild without -mavx2 (or /arch:AVX2) and with USIMD_SCALAR_LANES");
+        return EXIT_FAILURE;
+    }
+#endif
+
+    if (!UParseCommandLine(argc, argv))
+        return EXIT_FAILURE;
+
+    // Record zones from here on when a trace was asked for
+    if (gOptions.chromeTracePath)
+    {
+        gProfiler.start = std::chrono::steady_clock::now();
+        gProfiler.enabled = true;
+        UPROFILE_THREAD("main", -1);
+    }
+
+    // The micro-benchmarks only exercise CPU code and need no window or GL context
+    if (gOptions.benchmarkPath)
+        return URunBenchmarks(gOptions.benchmarkPath) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    // Same for the virtual texture page file builder
+    if (gOptions.buildVirtualTexturePath)
+        return UBuildVirtualTexture(gOptions.buildVirtualTexturePath, gOptions.virtualTextureSize) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    // And the world builder
+    if (gOptions.buildWorldPath)
+        return UBuildWorld(gOptions.buildWorldPath, gOptions.worldSize) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    // And the software renderer, for machines without a GPU
+    if (gOptions.softwarePath)
+        return URenderSoftwareImage(gOptions.softwarePath) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (!UInitialize(argc, argv, &gWindow))
+        return EXIT_FAILURE;
+
+    // Budgets apply from the first allocation; dropping MSAA is the one thing that can give render target memory back
+    for (const std::pair<std::string, size_t>& budget : gOptions.gpuBudgets)
+        USetGpuBudget(budget.first.c_str(), budget.second);
+    USetGpuEvictionCallback("render targets", [](size_t) {
+        const size_t before = UGpuTagBytes("render targets");
+        if (gPostChain.mode == UAA_MSAA2 || gPostChain.mode == UAA_MSAA4)
+        {
+            ULOG_WARNING("Render target budget exceeded, falling back from MSAA to FXAA");
+            USetAntiAliasingMode(gPostChain, UAA_FXAA);
+        }
+        return before - std::min(before, UGpuTagBytes("render targets"));
+    });
+
+    // Per-frame scratch memory, allocated once
+    UCreateFrameArena(gFrameArena, FRAME_ARENA_BYTES);
+
+    // Camera path recording and playback
+    if (gOptions.playbackPath)
+    {
+        if (!ULoadCameraPath(gOptions.playbackPath, gCameraPath))
+            return EXIT_FAILURE;
+
+        // Reserve the whole trace up front so playback frames never grow it
+        gFrameTrace.reserve(static_cast<size_t>(gCameraPath.samples.back().time / PLAYBACK_TIMESTEP) + 2);
+        glfwSwapInterval(0); // Measure the renderer, not the display refresh
+    }
+    if (gOptions.recordPath)
+    {
+        gCameraRecordFile = fopen(gOptions.recordPath, "w");
+        if (!gCameraRecordFile)
+        {
+            ULOG_ERROR("Failed to open camera path %s for writing", gOptions.recordPath);
+            return EXIT_FAILURE;
+        }
+        fprintf(gCameraRecordFile, "# time x y z yaw pitch zoom\n");
+    }
+
+    // Open the streamed texture first so the desk material can point at it
+    if (gOptions.virtualTexturePath && !UCreateVirtualTexture(gVirtualTexture, gOptions.virtualTexturePath))
+        return EXIT_FAILURE;
+
+    // Load the textures into arrays and describe the materials that use them
+    if (!UCreateMaterials(gTextures))
+        return EXIT_FAILURE;
+
+    // Only the cell table of the site is read here; the cells stream in around the camera
+    if (gOptions.worldPath && !UCreateWorld(gWorld, gOptions.worldPath))
+        return EXIT_FAILURE;
+
+    // Create the mesh
+    UCreateMesh(gMesh); // Calls the function to create the Vertex Buffer Object
+
+    // Place the subject and the lamp in the scene
+    UCreateScene();
+    UCreateParametricBuffers(gParametricScene);
+
+    // CPU copy of the scene triangles for picking
+    UCreatePickScene(gSceneBvh);
+
+    // Multiview output, set up ahead of the shaders since its variants depend on the path it takes
+    if (gOptions.multiviewViews > 0
+        && !UCreateMultiview(gMultiview, gOptions.multiviewViews, gOptions.multiviewLayout, WINDOW_WIDTH, WINDOW_HEIGHT))
+        return EXIT_FAILURE;
+    const uint32_t viewFeatures = gMultiview.path != UMULTIVIEW_OFF ? USHADER_MULTIVIEW : 0u;
+
+    // Create the shader programs; the variants of dynamic shading are built now, the probe-lit ones by the bake
+    UDeclareShaderPermutations(gClayShaders, "clay", clayVertexShaderSource, clayFragmentShaderSource, gTextures.materialShader);
+    gClayShaders.setup = USetupLitVariant;
+    if (!UWarmShaderPermutations(gClayShaders, { USHADER_TEXTURED | viewFeatures, viewFeatures,
+            USHADER_GPU_DRIVEN | USHADER_TEXTURED | viewFeatures, USHADER_GPU_DRIVEN | viewFeatures }))
+        return EXIT_FAILURE;
+
+    UDeclareShaderPermutations(gLampShaders, "lamp", lampVertexShaderSource, lampFragmentShaderSource);
+    if (!UWarmShaderPermutations(gLampShaders, { viewFeatures }))
+        return EXIT_FAILURE;
+
+    UDeclareShaderPermutations(gParametricShaders, "parametric", parametricVertexShaderSource, parametricSurfaceSource,
+        parametricControlShaderSource, parametricEvaluationShaderSource, clayFragmentShaderSource, gTextures.materialShader);
+    gParametricShaders.setup = USetupLitVariant;
+    if (!UWarmShaderPermutations(gParametricShaders, { 0 }))
+        return EXIT_FAILURE;
+
+    // Object records and culling for the GPU-driven draws. The depth pyramid is of the single-view scene target,
+    // so multiview frames cull against the frustums only.
+    if (gOptions.hiz && gMultiview.path != UMULTIVIEW_OFF)
+        ULOG_WARNING("--hiz is ignored with multiview output");
+    if (!UCreateGpuScene(gGpuScene, gOptions.extraObjects, gOptions.hiz && gMultiview.path == UMULTIVIEW_OFF))
+        return EXIT_FAILURE;
+
+    // Static lighting, baked before the first frame when asked for
+    if (gOptions.bakeSamples > 0 && UBakeLighting(gBakedLighting, gOptions.bakeSamples))
+        USetBakedLighting(true);
+
+    // Offscreen scene target and post-processing passes
+    if (!UCreatePostChain(gPostChain, WINDOW_WIDTH, WINDOW_HEIGHT, gOptions.antiAliasing))
+        return EXIT_FAILURE;
+    if (gOptions.frameBudgetMs > 0.0)
+        USetDynamicResolution(gPostChain, true, gOptions.frameBudgetMs);
+
+    // Performance overlay, hidden until F3
+    if (!UCreateHud(gHud, gOptions.frameBudgetMs > 0.0 ? gOptions.frameBudgetMs : DEFAULT_FRAME_BUDGET_MS))
+        return EXIT_FAILURE;
+
+    // Session recording, at the size of the window's framebuffer
+    int captureWidth = 0;
+    int captureHeight = 0;
+    glfwGetFramebufferSize(gWindow, &captureWidth, &captureHeight);
+    if (gOptions.capturePath && !UCreateFrameCapture(gCapture, gOptions.capturePath, captureWidth, captureHeight))
+        return EXIT_FAILURE;
+
+    // Where the GPU memory went
+    UDumpGpuResources();
+
+    // Sets the background color of the window to black (it will be implicitely used by glClear)
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+
+    // render loop
+    // -----------
+    while (!glfwWindowShouldClose(gWindow))
+    {
+        UPROFILE_ZONE("frame");
+
+        // Recycle the scratch memory of the frame before last
+        UBeginFrameArena(gFrameArena);
+
+        // per-frame timing
+// --------------------
+        const std::chrono::steady_clock::time_point frameStart = std::chrono::steady_clock::now();
+        float currentFrame = glfwGetTime();
+        if (gOptions.playbackPath)
+            currentFrame = gLastFrame + PLAYBACK_TIMESTEP; // Playback runs on a fixed step independent of the wall clock
+        gDeltaTime = currentFrame - gLastFrame;
+        gLastFrame = currentFrame;
+
+        // input
+        // -----
+        UProcessInput(gWindow);
+        UUpdateBake();
+
+        // A recorded path overrides the interactive camera; the run ends with the path
+        if (gOptions.playbackPath && !UApplyCameraPath(gCameraPath, currentFrame))
+            glfwSetWindowShouldClose(gWindow, true);
+        if (gCameraRecordFile)
+            URecordCameraSample(gCameraRecordFile, currentFrame);
+
+        // Render this frame
+        URender();
+
+        if (gOptions.tracePath)
+        {
+            UFrameTiming timing;
+            timing.simulationTime = currentFrame;
+            timing.cpuMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count();
+            timing.gpuSceneMs = gPostChain.sceneTimer.milliseconds;
+            timing.gpuPostMs = UPostChainMilliseconds(gPostChain);
+            timing.renderScale = gPostChain.renderScale;
+            gFrameTrace.push_back(timing);
+        }
+
+        // Input-to-present latency for the events handled this frame
+        if (gOldestPendingInput >= 0.0)
+        {
+            UUpdateInputLatency(glfwGetTime() - gOldestPendingInput);
+            gOldestPendingInput = -1.0;
+        }
+
+        {
+            UPROFILE_ZONE("glfwPollEvents");
+            glfwPollEvents();
+        }
+        ++gFrameIndex;
+
+        if (gOptions.allocCheckFrames > 0 && !UUpdateAllocationCheck())
+            glfwSetWindowShouldClose(gWindow, true);
+    }
+
+    // Finish recording and write the timing trace
+    if (gCameraRecordFile)
+        fclose(gCameraRecordFile);
+    if (gOptions.tracePath)
+        UWriteFrameTrace(gOptions.tracePath, gFrameTrace);
+
+    // Release mesh data
+    UDestroyGpuScene(gGpuScene);
+    UDestroyMesh(gMesh);
+    UDestroyParametricScene(gParametricScene);
+    UDestroyWorld(gWorld);
+    UStopBake();
+    UDestroyBakedLighting(gBakedLighting);
+
+    // Release textures and materials
+    UDestroyTextures(gTextures);
+    UDestroyVirtualTexture(gVirtualTexture);
+
+    // Release shader program
+    UDestroyShaderPermutations(gClayShaders);
+    UDestroyShaderPermutations(gLampShaders);
+    UDestroyShaderPermutations(gParametricShaders);
+    UDestroyPostChain(gPostChain);
+    UDestroyMultiviewTargets(gMultiview);
+    UDestroyHud(gHud);
+    UDestroyFrameCapture(gCapture);
+
+    // Everything created above must have been released by now
+    UReportGpuLeaks();
+    UDestroyFrameArena(gFrameArena);
+
+    // Every worker has stopped, so the profiler buffers are complete
+    if (gOptions.chromeTracePath)
+        UWriteChromeTrace(gOptions.chromeTracePath);
+
+    exit(gAllocCheckFailed ? EXIT_FAILURE : EXIT_SUCCESS); // Terminates the program successfully
+}
+
+
+// Reads the command line options; unknown options are reported and stop the program
+bool UParseCommandLine(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* argument = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+        if (strcmp(argument, "--record") == 0 && value)
+            gOptions.recordPath = argv[++i];
+        else if (strcmp(argument, "--playback") == 0 && value)
+            gOptions.playbackPath = argv[++i];
+        else if (strcmp(argument, "--trace") == 0 && value)
+            gOptions.tracePath = argv[++i];
+        else if (strcmp(argument, "--benchmark") == 0 && value)
+            gOptions.benchmarkPath = argv[++i];
+        else if (strcmp(argument, "--aa") == 0 && value && UFindAntiAliasingMode(value) >= 0)
+            gOptions.antiAliasing = UFindAntiAliasingMode(argv[++i]);
+        else if (strcmp(argument, "--frame-budget") == 0 && value && atof(value) > 0.0)
+            gOptions.frameBudgetMs = atof(argv[++i]);
+        else if (strcmp(argument, "--alloc-check") == 0 && value && atoi(value) > 0)
+            gOptions.allocCheckFrames = atoi(argv[++i]);
+        else if (strcmp(argument, "--gpu-budget") == 0 && value && strchr(value, '=') && atof(strchr(value, '=') + 1) > 0.0)
+        {
+            const char* separator = strchr(argv[++i], '=');
+            gOptions.gpuBudgets.emplace_back(std::string(static_cast<const char*>(argv[i]), separator), static_cast<size_t>(atof(separator + 1) * 1048576.0));
+        }
+        else if (strcmp(argument, "--virtual-texture") == 0 && value)
+            gOptions.virtualTexturePath = argv[++i];
+        else if (strcmp(argument, "--build-virtual-texture") == 0 && value)
+            gOptions.buildVirtualTexturePath = argv[++i];
+        else if (strcmp(argument, "--virtual-texture-size") == 0 && value && atoi(value) >= VIRTUAL_PAGE_CONTENT &&
+            (atoi(value) & (atoi(value) - 1)) == 0)
+            gOptions.virtualTextureSize = atoi(argv[++i]);
+        else if (strcmp(argument, "--world") == 0 && value)
+            gOptions.worldPath = argv[++i];
+        else if (strcmp(argument, "--build-world") == 0 && value)
+            gOptions.buildWorldPath = argv[++i];
+        else if (strcmp(argument, "--world-size") == 0 && value && atoi(value) > 0)
+            gOptions.worldSize = atoi(argv[++i]);
+        else if (strcmp(argument, "--bake") == 0 && value && atoi(value) > 0)
+            gOptions.bakeSamples = atoi(argv[++i]);
+        else if (strcmp(argument, "--software") == 0 && value)
+            gOptions.softwarePath = argv[++i];
+        else if (strcmp(argument, "--software-reference") == 0 && value)
+            gOptions.softwareReferencePath = argv[++i];
+        else if (strcmp(argument, "--capture") == 0 && value && UFindCaptureFormat(value) >= 0)
+            gOptions.capturePath = argv[++i];
+        else if (strcmp(argument, "--chrome-trace") == 0 && value)
+            gOptions.chromeTracePath = argv[++i];
+        else if (strcmp(argument, "--stereo") == 0)
+        {
+            gOptions.multiviewViews = 2;
+            gOptions.multiviewLayout = UMULTIVIEW_STEREO;
+        }
+        else if (strcmp(argument, "--view-wall") == 0 && value && atoi(value) >= 2 && atoi(value) <= MULTIVIEW_MAX_VIEWS)
+        {
+            gOptions.multiviewViews = atoi(argv[++i]);
+            gOptions.multiviewLayout = UMULTIVIEW_WALL;
+        }
+        else if (strcmp(argument, "--objects") == 0 && value && atoi(value) >= 0)
+            gOptions.extraObjects = atoi(argv[++i]);
+        else if (strcmp(argument, "--hiz") == 0)
+            gOptions.hiz = true;
+        else
+        {
+            ULOG_ERROR("Unknown or incomplete option %s", argument);
+            ULOG_ERROR("Usage: %s [--record path] [--playback path] [--trace path] [--benchmark results.json] [--aa none|fxaa|smaa|msaa2|msaa4] [--frame-budget ms]"
+                " [--virtual-texture pages.vt] [--build-virtual-texture pages.vt] [--virtual-texture-size power of two]"
+                " [--world site.uws] [--build-world site.uws] [--world-size cells] [--gpu-budget tag=MB]... [--alloc-check frames] [--bake samples] [--software image.ppm]"
+                " [--software-reference frame.png]"
+                " [--capture frame%05d.png|session.y4m] [--chrome-trace trace.json] [--stereo] [--view-wall 2..4] [--objects count] [--hiz]", argv[0]);
+            return false;
+        }
+    }
+
+    if (gOptions.tracePath && !gOptions.playbackPath)
+        ULOG_WARNING("--trace without --playback measures an interactive, non-repeatable run");
+
+    return true;
+}
+
+
+// Initialize GLFW, GLEW, and create a window
+bool UInitialize(int argc, char* argv[], GLFWwindow** window)
+{
+    // GLFW: initialize and configure
+    // ------------------------------
+    glfwInit();
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+#ifdef __APPLE__
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#endif
+
+    // GLFW: window creation
+    // ---------------------
+    * window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
+    if (*window == NULL)
+    {
+        ULOG_ERROR("Failed to create GLFW window");
+        glfwTerminate();
+        return false;
+    }
+    glfwMakeContextCurrent(*window);
+    glfwSetFramebufferSizeCallback(*window, UResizeWindow);
+    glfwSetKeyCallback(*window, UKeyCallback);
+    glfwSetCursorPosCallback(*window, UMousePositionCallback);
+    glfwSetScrollCallback(*window, UMouseScrollCallback);
+    glfwSetMouseButtonCallback(*window, UMouseButtonCallback);
+
+    // tell GLFW to capture our mouse
+    glfwSetInputMode(*window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+
+    // GLEW: initialize
+    // ----------------
+    // Note: if using GLEW version 1.13 or earlier
+    glewExperimental = GL_TRUE;
+    GLenum GlewInitResult = glewInit();
+
+    if (GLEW_OK != GlewInitResult)
+    {
+        ULOG_ERROR("%s", glewGetErrorString(GlewInitResult));
+        return false;
+    }
+
+    // Displays GPU OpenGL version
+    ULOG_INFO("OpenGL Version: %s", glGetString(GL_VERSION));
+
+    return true;
+}
+
+
+// Drains the input queue in arrival order and advances the camera to the current frame time.
+// Held keys are integrated over the exact intervals between events, so presses shorter than a frame still move
+// the camera and mouse motion is applied at the point in time it happened.
+void UProcessInput(GLFWwindow* window)
+{
+    UPROFILE_FUNCTION();
+
+    const double frameTime = gLastFrame;
+
+    UInputEvent event;
+    while (gInputQueue.TryPop(event))
+    {
+        // Events are stamped when GLFW delivers them; keep them inside the interval being simulated
+        const double eventTime = std::min(std::max(event.time, gInputTime), frameTime);
+        UIntegrateHeldKeys(static_cast<float>(eventTime - gInputTime));
+        gInputTime = eventTime;
+
+        if (gOldestPendingInput < 0.0)
+            gOldestPendingInput = event.time;
+
+        UApplyInputEvent(window, event);
+    }
+
+    // Integrate the remainder of the frame with the final key state
+    UIntegrateHeldKeys(static_cast<float>(frameTime - gInputTime));
+    gInputTime = frameTime;
+
+    static unsigned long long reportedDrops = 0;
+    const unsigned long long dropped = gInputDropped.load(std::memory_order_relaxed);
+    if (dropped != reportedDrops)
+    {
+        ULOG_WARNING("%llu input events dropped, input queue full", dropped - reportedDrops);
+        reportedDrops = dropped;
+    }
+}
+
+
+// Moves the camera for every held movement key over the given time slice
+void UIntegrateHeldKeys(float deltaTime)
+{
+    if (deltaTime <= 0.0f)
+        return;
+
+    if (gKeyDown[GLFW_KEY_W])
+        gCamera.ProcessKeyboard(FORWARD, deltaTime);
+    if (gKeyDown[GLFW_KEY_S])
+        gCamera.ProcessKeyboard(BACKWARD, deltaTime);
+    if (gKeyDown[GLFW_KEY_A])
+        gCamera.ProcessKeyboard(LEFT, deltaTime);
+    if (gKeyDown[GLFW_KEY_D])
+        gCamera.ProcessKeyboard(RIGHT, deltaTime);
+    if (gKeyDown[GLFW_KEY_Q])
+        gCamera.ProcessKeyboard(UP, deltaTime);
+    if (gKeyDown[GLFW_KEY_E])
+        gCamera.ProcessKeyboard(DOWN, deltaTime);
+}
+
+
+// Applies one recorded event to the key state, camera and scene toggles
+void UApplyInputEvent(GLFWwindow* window, const UInputEvent& event)
+{
+    switch (event.type)
+    {
+    case UINPUT_KEY:
+    {
+        if (event.code < 0 || event.code > GLFW_KEY_LAST || event.action == GLFW_REPEAT)
+            break;
+
+        gKeyDown[event.code] = (event.action == GLFW_PRESS);
+        if (event.action != GLFW_PRESS)
+            break;
+
+        if (event.code == GLFW_KEY_ESCAPE)
+            glfwSetWindowShouldClose(window, true);
+
+        // Pause and resume lamp orbiting; a moving lamp leaves the baked lighting behind
+        if (event.code == GLFW_KEY_L)
+        {
+            gIsLampOrbiting = true;
+            if (gBakedLightingOn || gBakeJob.switchOn)
+                USetBakedLighting(false);
+        }
+        else if (event.code == GLFW_KEY_K)
+            gIsLampOrbiting = false;
+
+        // Cycle anti-aliasing modes for side-by-side comparison
+        if (event.code == GLFW_KEY_F1)
+            USetAntiAliasingMode(gPostChain, (gPostChain.mode + 1) % UAA_MODE_COUNT);
+
+        // Toggle dynamic resolution scaling
+        if (event.code == GLFW_KEY_F2)
+            USetDynamicResolution(gPostChain, !gPostChain.dynamicResolution,
+                gOptions.frameBudgetMs > 0.0 ? gOptions.frameBudgetMs : DEFAULT_FRAME_BUDGET_MS);
+
+        // Show or hide the performance overlay; its text is refreshed right away
+        if (event.code == GLFW_KEY_F3)
+        {
+            gHud.visible = !gHud.visible;
+            gHud.lastTextTime = -1.0e9;
+        }
+
+        // Print the GPU memory table
+        if (event.code == GLFW_KEY_F4)
+            UDumpGpuResources();
+
+        // Switch between baked and dynamic shading (bakes on first use)
+        if (event.code == GLFW_KEY_F5)
+            USetBakedLighting(!(gBakedLightingOn || gBakeJob.switchOn));
+    }
+    break;
+
+    case UINPUT_MOUSE_BUTTON:
+    {
+        switch (event.code)
+        {
+        case GLFW_MOUSE_BUTTON_LEFT:
+        {
+            if (event.action != GLFW_PRESS)
+                break;
+
+            // The cursor is captured by the camera, so the pick ray goes through the centre of the view
+            const auto start = std::chrono::steady_clock::now();
+            URayHit hit;
+            const bool picked = UPickScreen(glm::vec2(0.0f), hit);
+            const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            if (picked)
+                ULOG_INFO("Picked %s, triangle %d, at %.3f units (%.4f ms)", hit.object >= 0 ? gSceneBvh.objectNames[hit.object] : "unnamed",
+                    hit.triangle, hit.distance, ms);
+            else
+                ULOG_INFO("Picked nothing (%.4f ms)", ms);
+        }
+        break;
+
+        case GLFW_MOUSE_BUTTON_MIDDLE:
+            ULOG_INFO(event.action == GLFW_PRESS ? "Middle mouse button pressed" : "Middle mouse button released");
+            break;
+
+        case GLFW_MOUSE_BUTTON_RIGHT:
+            ULOG_INFO(event.action == GLFW_PRESS ? "Right mouse button pressed" : "Right mouse button released");
+            break;
+
+        default:
+            ULOG_WARNING("Unhandled mouse button event");
+            break;
+        }
+    }
+    break;
+
+    case UINPUT_CURSOR:
+    {
+        if (gFirstMouse)
+        {
+            gLastX = event.x;
+            gLastY = event.y;
+            gFirstMouse = false;
+        }
+
+        float xoffset = event.x - gLastX;
+        float yoffset = gLastY - event.y; // reversed since y-coordinates go from bottom to top
+
+        gLastX = event.x;
+        gLastY = event.y;
+
+        gCamera.ProcessMouseMovement(xoffset, yoffset);
+    }
+    break;
+
+    case UINPUT_SCROLL:
+        gCamera.ProcessMouseScroll(event.y);
+        break;
+    }
+}
+
+
+// Records an input event with its timestamp; called from the GLFW callbacks, never blocks
+void URecordInputEvent(int type, int code, int action, double x, double y)
+{
+    UInputEvent event;
+    event.type = type;
+    event.code = code;
+    event.action = action;
+    event.x = x;
+    event.y = y;
+    event.time = glfwGetTime();
+
+    if (!gInputQueue.TryPush(event))
+        gInputDropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+// Folds one input-to-present sample into the latency metric
+void UUpdateInputLatency(double latency)
+{
+    gInputLatency.last = latency;
+    gInputLatency.average = gInputLatency.samples == 0 ? latency : gInputLatency.average + (latency - gInputLatency.average) * 0.05;
+    gInputLatency.worst = std::max(gInputLatency.worst, latency);
+    ++gInputLatency.samples;
+
+    ULOG_DEBUG("Input latency %.2f ms (avg %.2f ms, worst %.2f ms)", latency * 1000.0, gInputLatency.average * 1000.0, gInputLatency.worst * 1000.0);
+}
+
+// glfw: whenever the window size changed (by OS or user resize) this callback function executes
+void UResizeWindow(GLFWwindow* window, int width, int height)
+{
+    glViewport(0, 0, width, height);
+
+    // Offscreen targets follow the window on the next frame
+    gFramebufferWidth = width;
+    gFramebufferHeight = height;
+    gFramebufferResized = true;
+}
+
+
+// glfw: whenever a key is pressed, repeated or released, this callback is called
+// ------------------------------------------------------------------------------
+void UKeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+    URecordInputEvent(UINPUT_KEY, key, action, 0.0, 0.0);
+}
+
+
+// glfw: whenever the mouse moves, this callback is called
+// -------------------------------------------------------
+void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
+{
+    URecordInputEvent(UINPUT_CURSOR, 0, 0, xpos, ypos);
+}
+
+
+// glfw: whenever the mouse scroll wheel scrolls, this callback is called
+// ----------------------------------------------------------------------
+void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset) {
+
+    URecordInputEvent(UINPUT_SCROLL, 0, 0, xoffset, yoffset);
+
+}
+
+
+// glfw: handle mouse button events
+// --------------------------------
+void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
+{
+    URecordInputEvent(UINPUT_MOUSE_BUTTON, button, action, 0.0, 0.0);
+}
+
+// Functioned called to render a frame
+void URender()
+{
+    UPROFILE_FUNCTION();
+    UPROFILE_SECTIONS("animation");
+
+    // Animated nodes and values are evaluated at the clock time, not stepped, so they cannot drift; a paused clock
+    // leaves them alone
+    if (gIsLampOrbiting)
+        gAnimation.time += gDeltaTime;
+    if (gAnimation.time != gAnimation.evaluatedTime)
+    {
+        UEvaluateAnimation(gAnimation, gAnimation.time);
+        UApplyAnimation(gAnimation, gTransforms);
+    }
+
+    // Refresh world matrices of the nodes that moved (and their children) only
+    UPROFILE_SECTION("transforms");
+    UUpdateTransforms(gTransforms);
+    const glm::vec3 lightPosition = glm::vec3(gTransforms.world[gLampNode][3]);
+
+    // Render the scene offscreen; the post chain brings it to the window
+    UPROFILE_SECTION("scene setup");
+    if (gFramebufferResized && gFramebufferWidth > 0 && gFramebufferHeight > 0)
+    {
+        UResizePostChain(gPostChain, gFramebufferWidth, gFramebufferHeight);
+        if (gMultiview.path != UMULTIVIEW_OFF)
+            UCreateMultiviewTargets(gMultiview, gFramebufferWidth, gFramebufferHeight);
+        gFramebufferResized = false;
+    }
+    UUpdateDynamicResolution(gPostChain);
+    UEnforceGpuBudgets();
+    UBeginScenePass(gPostChain);
+
+    // Multiview frames draw every view at once into the view layers, tiled into the scene target at the end
+    const bool multiview = gMultiview.path != UMULTIVIEW_OFF;
+    const uint32_t viewFeatures = multiview ? USHADER_MULTIVIEW : 0u;
+    const GLsizei instances = gMultiview.instances;
+    if (multiview)
+        UBeginMultiviewPass(gMultiview, gPostChain, gCamera);
+
+    // Enable z-depth
+    glEnable(GL_DEPTH_TEST);
+
+    // Clear the frame and z buffers
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    // Model matrix comes from the cached world transform of the subject
+    glm::mat4 model = gTransforms.world[gSubjectNode];
+
+    // camera/view transformation
+    glm::mat4 view = gCamera.GetViewMatrix();
+
+    // Creates a perspective projection
+    glm::mat4 projection = glm::perspective(45.0f, (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
+
+    // Baked shading takes the probe-lit variants; the scene mesh switches to its lightmapped copy below
+    const bool baked = gBakedLightingOn && gBakedLighting.ready;
+    const uint32_t lighting = baked ? USHADER_PROBE_LIGHTING : 0u;
+
+    // Activate the VBOs contained within the mesh's VAO
+    glBindVertexArray(gMesh.vao);
+
+    // Materials for every textured object; the texture arrays stay bound (or resident) for the whole run
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MATERIAL_BUFFER_BINDING, gTextures.materialBuffer);
+
+    // Streamed pages that arrived since the last frame, and the feedback stamp for this one
+    UPROFILE_SECTION("virtual texture");
+    UUpdateVirtualTexture(gVirtualTexture);
+
+    // Transform, color, light and camera uniforms of the clay variants this frame draws with: per-draw model
+    // matrices for the streamed site, object records for the GPU-driven scene
+    const GLuint texturedProgramId = UGetShaderPermutation(gClayShaders, USHADER_TEXTURED | lighting | viewFeatures);
+    const GLuint untexturedProgramId = UGetShaderPermutation(gClayShaders, lighting | viewFeatures);
+    const GLuint objectProgramIds[UCULL_BATCH_COUNT] = {
+        UGetShaderPermutation(gClayShaders, USHADER_GPU_DRIVEN | USHADER_TEXTURED | lighting | viewFeatures),
+        UGetShaderPermutation(gClayShaders, USHADER_GPU_DRIVEN | lighting | viewFeatures),
+    };
+    for (GLuint programId : { texturedProgramId, untexturedProgramId, objectProgramIds[UCULL_TEXTURED], objectProgramIds[UCULL_UNTEXTURED] })
+        USetLitUniforms(programId, view, projection, lightPosition);
+
+    // Draws the triangles
+    UPROFILE_SECTION("scene mesh");
+    if (baked)
+    {
+        const GLuint programId = UGetShaderPermutation(gBakedLighting.shaders, viewFeatures);
+        USetLitUniforms(programId, view, projection, lightPosition);
+        glUniformMatrix4fv(glGetUniformLocation(programId, "model"), 1, GL_FALSE, glm::value_ptr(model));
+
+        glBindVertexArray(gBakedLighting.mesh.vao);
+        glDrawElementsInstanced(GL_TRIANGLES, gBakedLighting.mesh.nIndices, GL_UNSIGNED_SHORT, NULL, instances);
+        UCountDraw(gBakedLighting.mesh.nIndices / 3 * gMultiview.views);
+    }
+
+    // The scene parts and the --objects field, culled on the GPU and drawn by one multi-draw per variant, so
+    // untextured objects never run the material lookup. Baked frames have drawn the parts already.
+    UPROFILE_SECTION("gpu scene");
+    if (gTransforms.lastUpdateCount > 0)
+        UUpdateGpuSceneParts(gGpuScene);
+    UDrawGpuScene(gGpuScene, baked ? GPU_SCENE_PARTS : 0, projection * view, objectProgramIds);
+    glBindVertexArray(gMesh.vao);
+
+    // STREAMED SITE: whatever cells are resident, each placed by its own model matrix
+    UPROFILE_SECTION("world");
+    UUpdateWorld(gWorld);
+    UDrawWorld(gWorld, texturedProgramId, untexturedProgramId);
+    glBindVertexArray(gMesh.vao);
+
+    // CURVED PRIMITIVES: tessellated on the GPU from their control data
+    //------------------------------------------------------------------
+    // OVR_multiview excludes tessellation stages, so multiview frames leave the curved primitives out
+    UPROFILE_SECTION("parametric");
+    if (gParametricScene.patchCount > 0 && !multiview)
+    {
+        // The lamp moves every frame, so only a rebuild of a primitive's own node (or an ancestor) re-uploads
+        const bool moved = gTransforms.lastUpdateCount > 0 && std::any_of(gParametricScene.primitives.begin(), gParametricScene.primitives.end(),
+            [](const UParametricPrimitive& primitive) { return UWasTransformRebuilt(gTransforms, primitive.node); });
+        if (moved)
+            UUpdateParametricTransforms(gParametricScene);
+
+        // Curved primitives are untextured, so only the lighting picks the variant
+        const GLuint programId = UGetShaderPermutation(gParametricShaders, lighting);
+        USetLitUniforms(programId, view, projection, lightPosition);
+        // Edges are measured in the pixels the scene is rendered at, which dynamic resolution and resizes change
+        glUniform2f(glGetUniformLocation(programId, "viewportSize"), (GLfloat)gPostChain.renderWidth, (GLfloat)gPostChain.renderHeight);
+        glUniform1f(glGetUniformLocation(programId, "targetEdgePixels"), TESSELLATION_EDGE_PIXELS);
+
+        for (GLuint binding = 0; binding < 3; ++binding)
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, gParametricScene.buffers[binding]);
+
+        glBindVertexArray(gParametricScene.vao);
+        glPatchParameteri(GL_PATCH_VERTICES, 1);
+        glDrawArrays(GL_PATCHES, 0, gParametricScene.patchCount);
+        UCountDraw(0);
+        gFrameCounters.patches += gParametricScene.patchCount;
+
+        // Back to the scene mesh for the lamp
+        glBindVertexArray(gMesh.vao);
+    }
+
+     // LAMP: draw lamp
+    //----------------
+    UPROFILE_SECTION("lamp");
+    const GLuint lampProgramId = UGetShaderPermutation(gLampShaders, viewFeatures);
+    glUseProgram(lampProgramId);
+
+    //Transform the smaller cube used as a visual que for the light source
+    model = gTransforms.world[gLampNode];
+
+    // Reference matrix uniforms from the Lamp Shader program
+    GLint modelLoc = glGetUniformLocation(lampProgramId, "model");
+    GLint viewLoc = glGetUniformLocation(lampProgramId, "view");
+    GLint projLoc = glGetUniformLocation(lampProgramId, "projection");
+
+    // Pass matrix data to the Lamp Shader program's matrix uniforms
+    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
+    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+    USetMultiviewUniforms(gMultiview, lampProgramId);
+
+    glDrawElementsInstanced(GL_TRIANGLES, LAMP_INDEX_COUNT, GL_UNSIGNED_SHORT, (void*)(LAMP_FIRST_INDEX * sizeof(GLushort)), instances);
+    UCountDraw(LAMP_INDEX_COUNT / 3 * gMultiview.views);
+
+    // The finished depth becomes the occluders of the next frame's cull
+    UPROFILE_SECTION("depth pyramid");
+    if (gGpuScene.occlusion)
+        UBuildDepthPyramid(gGpuScene, gPostChain, projection * view);
+
+    if (multiview)
+        UEndMultiviewPass(gMultiview, gPostChain);
+
+    // Deactivate the Vertex Array Object
+    glBindVertexArray(0);
+    glUseProgram(0);
+
+    // Ask for this frame's page requests back
+    UCaptureVirtualTextureFeedback(gVirtualTexture);
+
+    // Resolve, anti-alias and present to the window
+    UPROFILE_SECTION("post chain");
+    UEndGpuTimer();
+    URunPostChain(gPostChain);
+
+    // Overlay on top of the presented image, so captures include it
+    UPROFILE_SECTION("hud");
+    UUpdateHud(gHud);
+    UDrawHud(gHud, gFramebufferWidth, gFramebufferHeight);
+
+    // Queue the presented image for the encoders
+    UPROFILE_SECTION("capture");
+    UCaptureFrame(gCapture);
+
+    // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
+    UPROFILE_SECTION("glfwSwapBuffers");
+    glfwSwapBuffers(gWindow);    // Flips the the back buffer with the front buffer every frame.
+}
+
+
+// Converts a float to IEEE half precision (round to nearest even, overflow to infinity)
+GLushort UPackHalf(float value)
+{
+    GLuint bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    const GLuint sign = (bits >> 16) & 0x8000u;
+    const GLuint exponent = (bits >> 23) & 0xffu;
+    GLuint mantissa = bits & 0x7fffffu;
+
+    if (exponent == 0xffu) // Inf or NaN
+        return static_cast<GLushort>(sign | 0x7c00u | (mantissa ? 0x200u : 0u));
+
+    int halfExponent = static_cast<int>(exponent) - 127 + 15;
+    if (halfExponent >= 31)
+        return static_cast<GLushort>(sign | 0x7c00u);
+
+    if (halfExponent <= 0) // Subnormal half or zero
+    {
+        if (halfExponent < -10)
+            return static_cast<GLushort>(sign);
+        mantissa |= 0x800000u;
+        const GLuint shift = static_cast<GLuint>(14 - halfExponent);
+        GLuint half = mantissa >> shift;
+        const GLuint remainder = mantissa & ((1u << shift) - 1u);
+        const GLuint halfway = 1u << (shift - 1);
+        if (remainder > halfway || (remainder == halfway && (half & 1u)))
+            ++half;
+        return static_cast<GLushort>(sign | half);
+    }
+
+    GLuint half = (static_cast<GLuint>(halfExponent) << 10) | (mantissa >> 13);
+    const GLuint remainder = mantissa & 0x1fffu;
+    if (remainder > 0x1000u || (remainder == 0x1000u && (half & 1u)))
+        ++half; // May carry into the exponent, which correctly rounds up to the next power of two or infinity
+    return static_cast<GLushort>(sign | half);
+}
+
+
+// Converts IEEE half precision back to a float
+float UUnpackHalf(GLushort half)
+{
+    const GLuint sign = (GLuint(half) & 0x8000u) << 16;
+    const GLuint exponent = (half >> 10) & 0x1fu;
+    GLuint mantissa = half & 0x3ffu;
+
+    GLuint bits;
+    if (exponent == 0x1fu) // Inf or NaN
+        bits = sign | 0x7f800000u | (mantissa << 13);
+    else if (exponent != 0)
+        bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+    else if (mantissa == 0)
+        bits = sign;
+    else // Subnormal half: normalize
+    {
+        int shift = 0;
+        while (!(mantissa & 0x400u))
+        {
+            mantissa <<= 1;
+            ++shift;
+        }
+        bits = sign | (GLuint(127 - 15 - shift + 1) << 23) | ((mantissa & 0x3ffu) << 13);
+    }
+
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+
+// Packs a vector with components in [-1, 1] into GL_INT_2_10_10_10_REV (x in the low bits)
+GLuint UPackSnorm1010102(const glm::vec3& value, float w)
+{
+    const int x = static_cast<int>(std::round(glm::clamp(value.x, -1.0f, 1.0f) * 511.0f));
+    const int y = static_cast<int>(std::round(glm::clamp(value.y, -1.0f, 1.0f) * 511.0f));
+    const int z = static_cast<int>(std::round(glm::clamp(value.z, -1.0f, 1.0f) * 511.0f));
+    const int iw = static_cast<int>(std::round(glm::clamp(w, -1.0f, 1.0f)));
+    return (static_cast<GLuint>(x) & 0x3ffu) | ((static_cast<GLuint>(y) & 0x3ffu) << 10) |
+        ((static_cast<GLuint>(z) & 0x3ffu) << 20) | ((static_cast<GLuint>(iw) & 0x3u) << 30);
+}
+
+
+// Unpacks GL_INT_2_10_10_10_REV the way GL normalizes it (w dropped)
+glm::vec3 UUnpackSnorm1010102(GLuint packed)
+{
+    glm::vec3 value;
+    for (int k = 0; k < 3; ++k)
+    {
+        int component = static_cast<int>((packed >> (10 * k)) & 0x3ffu);
+        if (component & 0x200)
+            component -= 0x400;
+        value[k] = std::max(component / 511.0f, -1.0f);
+    }
+    return value;
+}
+
+
+// Packs a value in [0, 1] into an unsigned normalized byte
+GLubyte UPackUnorm8(float value)
+{
+    return static_cast<GLubyte>(std::round(glm::clamp(value, 0.0f, 1.0f) * 255.0f));
+}
+
+
+// Packs a value in [0, 1] into an unsigned normalized 16-bit integer, as used for texture coordinates
+GLushort UPackUnorm16(float value)
+{
+    return static_cast<GLushort>(std::round(glm::clamp(value, 0.0f, 1.0f) * 65535.0f));
+}
+
+
+// Copies the scene mesh, without the lamp, out of the compile-time tables for the CPU-side users
+void UBuildMeshData(std::vector<UPackedVertex>& verts, std::vector<GLushort>& indices, std::vector<UMeshPart>* parts)
+{
+    verts.assign(SCENE_MESH.verts, SCENE_MESH.verts + SCENE_VERTEX_COUNT);
+    indices.assign(SCENE_MESH.indices, SCENE_MESH.indices + SCENE_INDEX_COUNT);
+    if (parts)
+        parts->assign(std::begin(SCENE_PARTS), std::end(SCENE_PARTS));
+}
+
+
+// Implements the UCreateMesh function
+void UCreateMesh(GLMesh& mesh)
+{
+    UPROFILE_FUNCTION();
+
+    glGenVertexArrays(1, &mesh.vao); // we can also generate multiple VAOs or buffers at the same time
+    glBindVertexArray(mesh.vao);
+
+    // Create 2 buffers: first one for the vertex data; second one for the indices
+    glGenBuffers(2, mesh.vbos);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos[0]); // Activates the buffer
+    glBufferData(GL_ARRAY_BUFFER, sizeof(SCENE_MESH.verts), SCENE_MESH.verts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+    UGPU_TRACK(UGPU_BUFFER, mesh.vbos[0], sizeof(SCENE_MESH.verts), "mesh");
+
+    // The scene parts are drawn with nIndices; the lamp's indices follow them
+    mesh.nIndices = SCENE_INDEX_COUNT;
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos[1]);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(SCENE_MESH.indices), SCENE_MESH.indices, GL_STATIC_DRAW);
+    UGPU_TRACK(UGPU_BUFFER, mesh.vbos[1], sizeof(SCENE_MESH.indices), "mesh");
+
+    // Attribute pointers, stride and offsets all come from the compile-time layout
+    UPackedVertexLayout::Enable();
+}
+
+
+void UDestroyMesh(GLMesh& mesh)
+{
+    glDeleteVertexArrays(1, &mesh.vao);
+    glDeleteBuffers(2, mesh.vbos);
+    UReleaseGpuResource(UGPU_BUFFER, mesh.vbos[0]);
+    UReleaseGpuResource(UGPU_BUFFER, mesh.vbos[1]);
+}
+
+/*Generate and load the texture*/
+bool UCreateTexture(const char* filename, GLuint& textureId)
+{
+    UPROFILE_FUNCTION();
+
+    int width, height, channels;
+    unsigned char* image = stbi_load(filename, &width, &height, &channels, 0);
+    if (image)
+    {
+        flipImageVertically(image, width, height, channels);
+
+        glGenTextures(1, &textureId);
+        glBindTexture(GL_TEXTURE_2D, textureId);
+
+        // set the texture wrapping parameters
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        // set texture filtering parameters
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+        if (channels == 3)
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
+        else if (channels == 4)
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
+        else
+        {
+            ULOG_ERROR("Not implemented to handle image with %d channels", channels);
+            stbi_image_free(image);
+            glBindTexture(GL_TEXTURE_2D, 0);
+            glDeleteTextures(1, &textureId);
+            return false;
+        }
+
+        glGenerateMipmap(GL_TEXTURE_2D);
+        const int levels = 1 + static_cast<int>(std::floor(std::log2(static_cast<float>(std::max(width, height)))));
+        UGPU_TRACK(UGPU_TEXTURE, textureId, UGpuTextureBytes(channels == 4 ? GL_RGBA8 : GL_RGB8, width, height, 1, levels), "textures");
+
+        stbi_image_free(image);
+        glBindTexture(GL_TEXTURE_2D, 0); // Unbind the texture
+
+        return true;
+    }
+
+    // Error loading the image
+    return false;
+}
+
+
+void UDestroyTexture(GLuint textureId)
+{
+    glDeleteTextures(1, &textureId);
+    UReleaseGpuResource(UGPU_TEXTURE, textureId);
+}
+
+
+// Compiles one shader stage from one or more source strings (the first must start with #version)
+bool UCompileShader(GLenum type, const char* const* sources, GLsizei sourceCount, const char* stageName, GLuint& shaderId)
+{
+    // Compilation error reporting
+    int success = 0;
+    char infoLog[512];
+
+    shaderId = glCreateShader(type);
+    glShaderSource(shaderId, sourceCount, sources, NULL);
+    glCompileShader(shaderId);
+
+    // check for shader compile errors
+    glGetShaderiv(shaderId, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        glGetShaderInfoLog(shaderId, sizeof(infoLog), NULL, infoLog);
+        ULOG_ERROR("ERROR::SHADER::%s::COMPILATION_FAILED\n%s", stageName, infoLog);
+
+        return false;
+    }
+
+    return true;
+}
+
+
+// Links the compiled stages into a program
+bool ULinkShaderProgram(const GLuint* shaderIds, int shaderCount, GLuint& programId)
+{
+    // Linkage error reporting
+    int success = 0;
+    char infoLog[512];
+
+    // Create a Shader program object.
+    programId = glCreateProgram();
+
+    // Attached compiled shaders to the shader program
+    for (int i = 0; i < shaderCount; ++i)
+        glAttachShader(programId, shaderIds[i]);
+
+    glLinkProgram(programId);   // links the shader program
+    // check for linking errors
+    glGetProgramiv(programId, GL_LINK_STATUS, &success);
+    if (!success)
+    {
+        glGetProgramInfoLog(programId, sizeof(infoLog), NULL, infoLog);
+        ULOG_ERROR("ERROR::SHADER::PROGRAM::LINKING_FAILED\n%s", infoLog);
+
+        return false;
+    }
+
+    glUseProgram(programId);    // Uses the shader program
+
+    GLint binaryLength = 0;
+    glGetProgramiv(programId, GL_PROGRAM_BINARY_LENGTH, &binaryLength);
+    UGPU_TRACK(UGPU_PROGRAM, programId, static_cast<size_t>(binaryLength), "shaders");
+
+    return true;
+}
+
+
+// Implements the UCreateShaders function
+// A non-zero libraryShaderId is a precompiled shader object (such as the material lookup) linked in as well
+bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId, GLuint libraryShaderId)
+{
+    UPROFILE_FUNCTION();
+
+    GLuint shaderIds[3] = { 0, 0, libraryShaderId };
+
+    // Compile the vertex and fragment shaders, and print compilation errors (if any)
+    if (!UCompileShader(GL_VERTEX_SHADER, &vtxShaderSource, 1, "VERTEX", shaderIds[0]))
+        return false;
+    if (!UCompileShader(GL_FRAGMENT_SHADER, &fragShaderSource, 1, "FRAGMENT", shaderIds[1]))
+        return false;
+
+    const bool linked = ULinkShaderProgram(shaderIds, libraryShaderId ? 3 : 2, programId);
+
+    // The program keeps what it needs; the stage objects would otherwise leak
+    glDeleteShader(shaderIds[0]);
+    glDeleteShader(shaderIds[1]);
+    return linked;
+}
+
+
+// Creates a program with tessellation stages; the control and evaluation stages are prefixed with a shared
+// source chunk, which is inserted right after the #version line
+bool UCreateShaderProgram(const char* vtxShaderSource, const char* sharedTessSource, const char* tessControlSource,
+    const char* tessEvaluationSource, const char* fragShaderSource, GLuint& programId, GLuint libraryShaderId)
+{
+    UPROFILE_FUNCTION();
+
+    static const char* const versionLine = "#version 440 core\n";
+    const char* const tessControlSources[] = { versionLine, sharedTessSource, tessControlSource };
+    const char* const tessEvaluationSources[] = { versionLine, sharedTessSource, tessEvaluationSource };
+    GLuint shaderIds[5] = { 0, 0, 0, 0, libraryShaderId };
+
+    if (!UCompileShader(GL_VERTEX_SHADER, &vtxShaderSource, 1, "VERTEX", shaderIds[0]))
+        return false;
+    if (!UCompileShader(GL_TESS_CONTROL_SHADER, tessControlSources, 3, "TESS_CONTROL", shaderIds[1]))
+        return false;
+    if (!UCompileShader(GL_TESS_EVALUATION_SHADER, tessEvaluationSources, 3, "TESS_EVALUATION", shaderIds[2]))
+        return false;
+    if (!UCompileShader(GL_FRAGMENT_SHADER, &fragShaderSource, 1, "FRAGMENT", shaderIds[3]))
+        return false;
+
+    const bool linked = ULinkShaderProgram(shaderIds, libraryShaderId ? 5 : 4, programId);
+
+    for (int i = 0; i < 4; ++i)
+        glDeleteShader(shaderIds[i]);
+    return linked;
+}
+
+
+// Compiles and links a compute program, for passes that run outside the draw pipeline
+bool UCreateComputeProgram(const char* computeSource, GLuint& programId)
+{
+    UPROFILE_FUNCTION();
+
+    GLuint shaderId = 0;
+    if (!UCompileShader(GL_COMPUTE_SHADER, &computeSource, 1, "COMPUTE", shaderId))
+        return false;
+
+    const bool linked = ULinkShaderProgram(&shaderId, 1, programId);
+    glDeleteShader(shaderId);
+    return linked;
+}
+
+
+void UDestroyShaderProgram(GLuint programId)
+{
+    glDeleteProgram(programId);
+    UReleaseGpuResource(UGPU_PROGRAM, programId);
+}
+
+
+// Sets up a permutation set; variants are compiled by UGetShaderPermutation or UWarmShaderPermutations
+void UDeclareShaderPermutations(UShaderPermutations& set, const char* name, const char* vertexSource, const char* fragmentSource,
+    GLuint libraryShaderId)
+{
+    UDeclareShaderPermutations(set, name, vertexSource, nullptr, nullptr, nullptr, fragmentSource, libraryShaderId);
+}
+
+
+void UDeclareShaderPermutations(UShaderPermutations& set, const char* name, const char* vertexSource, const char* sharedTessSource,
+    const char* tessControlSource, const char* tessEvaluationSource, const char* fragmentSource, GLuint libraryShaderId)
+{
+    set.name = name;
+    set.vertexSource = vertexSource;
+    set.sharedTessSource = sharedTessSource;
+    set.tessControlSource = tessControlSource;
+    set.tessEvaluationSource = tessEvaluationSource;
+    set.fragmentSource = fragmentSource;
+    set.libraryShaderId = libraryShaderId;
+
+    // A feature is declared when its key appears in any stage
+    set.declared = 0;
+    const char* const stages[] = { vertexSource, sharedTessSource, tessControlSource, tessEvaluationSource, fragmentSource };
+    for (int feature = 0; feature < SHADER_FEATURE_COUNT; ++feature)
+    {
+        char key[64];
+        snprintf(key, sizeof(key), "FEATURE_%s", SHADER_FEATURE_NAMES[feature]);
+        for (const char* source : stages)
+            if (source && strstr(source, key))
+                set.declared |= 1u << feature;
+    }
+}
+
+
+// Compiles and links the variant of the set with the given features
+bool UBuildShaderPermutation(UShaderPermutations& set, uint32_t features, GLuint& programId)
+{
+    UPROFILE_FUNCTION();
+    const auto start = std::chrono::steady_clock::now();
+
+    std::string prelude;
+    std::string featureList;
+    for (int feature = 0; feature < SHADER_FEATURE_COUNT; ++feature)
+    {
+        const bool enabled = (features & (1u << feature)) != 0;
+        prelude += std::string("#define FEATURE_") + SHADER_FEATURE_NAMES[feature] + (enabled ? " true\n" : " false\n");
+        if (enabled)
+            featureList += std::string(featureList.empty() ? "" : "|") + SHADER_FEATURE_NAMES[feature];
+    }
+    prelude += SHADER_CONSTANTS;
+
+    // The GLSL() sources carry their own #version line; the prelude has to go after it
+    static const char* const versionLine = "#version 440 core\n";
+    auto body = [](const char* source) { return strchr(source, '\n') + 1; };
+
+    const bool tessellated = set.sharedTessSource != nullptr;
+    GLuint shaderIds[5] = {};
+    int shaderCount = 0;
+    bool compiled = true;
+    std::string stagePrelude;
+    auto compile = [&](GLenum type, const char* shared, const char* source, const char* stageName) {
+        stagePrelude = prelude + UMultiviewPrelude(gMultiview, type, (features & USHADER_MULTIVIEW) != 0);
+        const char* sources[4] = { versionLine, stagePrelude.c_str() };
+        GLsizei count = 2;
+        if (shared)
+            sources[count++] = shared;
+        sources[count++] = shared ? source : body(source);
+        compiled = compiled && UCompileShader(type, sources, count, stageName, shaderIds[shaderCount++]);
+    };
+    compile(GL_VERTEX_SHADER, nullptr, set.vertexSource, "VERTEX");
+    if (tessellated)
+    {
+        compile(GL_TESS_CONTROL_SHADER, set.sharedTessSource, set.tessControlSource, "TESS_CONTROL");
+        compile(GL_TESS_EVALUATION_SHADER, set.sharedTessSource, set.tessEvaluationSource, "TESS_EVALUATION");
+    }
+    compile(GL_FRAGMENT_SHADER, nullptr, set.fragmentSource, "FRAGMENT");
+
+    const int stageCount = shaderCount;
+    if (set.libraryShaderId)
+        shaderIds[shaderCount++] = set.libraryShaderId;
+    const bool linked = compiled && ULinkShaderProgram(shaderIds, shaderCount, programId);
+
+    for (int i = 0; i < stageCount; ++i)
+        glDeleteShader(shaderIds[i]);
+    if (!linked)
+    {
+        if (programId)
+            glDeleteProgram(programId);
+        programId = 0;
+        ULOG_ERROR("Shader %s: variant %s failed to build", set.name, featureList.empty() ? "base" : featureList.c_str());
+        return false;
+    }
+
+    ULOG_INFO("Shader %s: built variant %s in %.1f ms", set.name, featureList.empty() ? "base" : featureList.c_str(),
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    return true;
+}
+
+
+// Returns the program for the features, building it on first use; features the shader does not declare are
+// ignored, so callers can ask for what a draw needs without knowing the shader. 0 when the build fails.
+GLuint UGetShaderPermutation(UShaderPermutations& set, uint32_t features)
+{
+    features &= set.declared;
+    for (const UShaderVariant& variant : set.variants)
+        if (variant.features == features)
+            return variant.programId;
+
+    GLuint programId = 0;
+    if (!UBuildShaderPermutation(set, features, programId))
+        return 0;
+    if (set.setup)
+        set.setup(programId, features);
+    set.variants.push_back({ features, programId });
+    return programId;
+}
+
+
+// Builds the variants known to be needed ahead of time, so no frame waits on the compiler for them
+bool UWarmShaderPermutations(UShaderPermutations& set, std::initializer_list<uint32_t> featureSets)
+{
+    for (uint32_t features : featureSets)
+        if (!UGetShaderPermutation(set, features))
+            return false;
+    return true;
+}
+
+
+void UDestroyShaderPermutations(UShaderPermutations& set)
+{
+    for (const UShaderVariant& variant : set.variants)
+        UDestroyShaderProgram(variant.programId);
+    set.variants.clear();
+}
+
+
+// Fixed uniforms of a lit variant: the texture units, and the probe grid when the variant reads it and a bake
+// has made one
+void USetupLitVariant(GLuint programId, uint32_t features)
+{
+    UBindMaterialTextures(gTextures, programId);
+    if ((features & USHADER_PROBE_LIGHTING) && gBakedLighting.ready)
+        USetProbeUniforms(gBakedLighting, programId);
+}
+
+
+// Per-frame uniforms every lit program takes: transforms, colors, the light and the camera. Leaves the program bound.
+void USetLitUniforms(GLuint programId, const glm::mat4& view, const glm::mat4& projection, const glm::vec3& lightPosition)
+{
+    const glm::vec3 cameraPosition = gCamera.Position;
+    glUseProgram(programId);
+    glUniformMatrix4fv(glGetUniformLocation(programId, "view"), 1, GL_FALSE, glm::value_ptr(view));
+    glUniformMatrix4fv(glGetUniformLocation(programId, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+    glUniform3f(glGetUniformLocation(programId, "objectColor"), gObjectColor.r, gObjectColor.g, gObjectColor.b);
+    glUniform3f(glGetUniformLocation(programId, "lightColor"), gLightColor.r, gLightColor.g, gLightColor.b);
+    glUniform3f(glGetUniformLocation(programId, "lightPos"), lightPosition.x, lightPosition.y, lightPosition.z);
+    glUniform3f(glGetUniformLocation(programId, "viewPosition"), cameraPosition.x, cameraPosition.y, cameraPosition.z);
+    USetMultiviewUniforms(gMultiview, programId);
+    USetVirtualTextureUniforms(gVirtualTexture, programId);
+}
+
+
+// Appends a node to the hierarchy; the parent must already exist so the arrays stay in topological order
+int UAddTransform(UTransformHierarchy& hierarchy, int parent, const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale)
+{
+    const int node = static_cast<int>(hierarchy.parent.size());
+    if (parent >= node)
+        return -1;
+
+    hierarchy.parent.push_back(parent);
+    hierarchy.position.push_back(position);
+    hierarchy.rotation.push_back(rotation);
+    hierarchy.scale.push_back(scale);
+    hierarchy.world.push_back(glm::mat4(1.0f));
+    hierarchy.dirty.push_back(1);
+    hierarchy.rebuiltIn.push_back(0);
+    hierarchy.firstDirty = std::min(hierarchy.firstDirty, static_cast<size_t>(node));
+
+    return node;
+}
+
+
+// Moves a node and flags it so the next update rebuilds it and its subtree
+void USetTransformPosition(UTransformHierarchy& hierarchy, int node, const glm::vec3& position)
+{
+    hierarchy.position[node] = position;
+    hierarchy.dirty[node] = 1;
+    hierarchy.firstDirty = std::min(hierarchy.firstDirty, static_cast<size_t>(node));
+}
+
+
+// Rebuilds world matrices in one forward pass starting at the first dirty node.
+// A node is rebuilt when its own transform changed or its parent was rebuilt in this pass;
+// a clean scene returns immediately.
+void UUpdateTransforms(UTransformHierarchy& hierarchy)
+{
+    const size_t count = hierarchy.parent.size();
+    hierarchy.lastUpdateCount = 0;
+    if (hierarchy.firstDirty >= count)
+        return;
+
+    ++hierarchy.updateIndex;
+    for (size_t i = hierarchy.firstDirty; i < count; ++i)
+    {
+        const int parent = hierarchy.parent[i];
+        if (!hierarchy.dirty[i] && (parent < 0 || !hierarchy.dirty[parent]))
+            continue;
+
+        // Local matrix: transformations are applied right-to-left order (scale, rotate, translate)
+        glm::mat4 local = glm::translate(hierarchy.position[i]) * glm::mat4_cast(hierarchy.rotation[i]) * glm::scale(hierarchy.scale[i]);
+        hierarchy.world[i] = parent < 0 ? local : hierarchy.world[parent] * local;
+
+        // Mark as rebuilt so children further down the arrays pick up the change
+        hierarchy.dirty[i] = 1;
+        hierarchy.rebuiltIn[i] = hierarchy.updateIndex;
+        ++hierarchy.lastUpdateCount;
+    }
+
+    std::fill(hierarchy.dirty.begin() + hierarchy.firstDirty, hierarchy.dirty.end(), 0);
+    hierarchy.firstDirty = count;
+}
+
+
+// True when the last update rebuilt the node's world matrix, because it or one of its ancestors moved
+bool UWasTransformRebuilt(const UTransformHierarchy& hierarchy, int node)
+{
+    return hierarchy.lastUpdateCount > 0 && hierarchy.rebuiltIn[node] == hierarchy.updateIndex;
+}
+
+
+// Flags a node's rotation as changed, like USetTransformPosition
+void USetTransformRotation(UTransformHierarchy& hierarchy, int node, const glm::quat& rotation)
+{
+    hierarchy.rotation[node] = rotation;
+    hierarchy.dirty[node] = 1;
+    hierarchy.firstDirty = std::min(hierarchy.firstDirty, static_cast<size_t>(node));
+}
+
+
+void USetTransformScale(UTransformHierarchy& hierarchy, int node, const glm::vec3& scale)
+{
+    hierarchy.scale[node] = scale;
+    hierarchy.dirty[node] = 1;
+    hierarchy.firstDirty = std::min(hierarchy.firstDirty, static_cast<size_t>(node));
+}
+
+
+// Appends a track with at least one key. Values are interleaved, components per key; each end gets the guard keys
+// a blend reads past it, wrapped for loops and repeated otherwise.
+int UAddAnimationTrack(UAnimationTracks& tracks, int components, int target, int node, float* value, int interpolation, bool looping,
+    const float* times, const float* values, size_t keyCount)
+{
+    const bool loop = looping && keyCount > 1;
+    tracks.components = components;
+    const int track = static_cast<int>(tracks.firstKey.size());
+    tracks.firstKey.push_back(static_cast<uint32_t>(tracks.keyTime.size() + 1));
+    tracks.keyCount.push_back(static_cast<uint32_t>(keyCount));
+    tracks.interpolation.push_back(static_cast<unsigned char>(interpolation));
+    tracks.looping.push_back(loop ? 1 : 0);
+    tracks.cursor.push_back(0);
+    tracks.target.push_back(static_cast<unsigned char>(target));
+    tracks.node.push_back(node);
+    tracks.value.push_back(value);
+
+    const long last = static_cast<long>(keyCount) - 1;
+    for (long k = -1; k <= last + 2; ++k)
+    {
+        long key = std::min(std::max(k, 0L), last);
+        if (loop && (k < 0 || k > last))
+            key = (k % last + last) % last;
+        tracks.keyTime.push_back(times[key]);
+        for (int c = 0; c < components; ++c)
+            tracks.keyValue[c].push_back(values[key * components + c]);
+    }
+
+    const size_t padded = (tracks.firstKey.size() + 3) & ~size_t(3);
+    for (int c = 0; c < components; ++c)
+        tracks.result[c].resize(padded, 0.0f);
+    return track;
+}
+
+
+// Single float, e.g. a light parameter
+int UAddScalarTrack(UAnimation& animation, float* value, int interpolation, bool looping, const float* times, const float* keys, size_t keyCount)
+{
+    if (keyCount == 0)
+        return -1;
+    return UAddAnimationTrack(animation.scalars, 1, UANIMATE_VALUE, -1, value, interpolation, looping, times, keys, keyCount);
+}
+
+
+// Position or scale of a node, or a vec3 value such as a color (node -1)
+int UAddVectorTrack(UAnimation& animation, int target, int node, glm::vec3* value, int interpolation, bool looping, const float* times,
+    const glm::vec3* keys, size_t keyCount)
+{
+    if (keyCount == 0)
+        return -1;
+    return UAddAnimationTrack(animation.vectors, 3, target, node, value ? glm::value_ptr(*value) : nullptr, interpolation, looping, times,
+        glm::value_ptr(keys[0]), keyCount);
+}
+
+
+// Node rotation. Keys are flipped into the hemisphere of their predecessor so blending takes the short way round.
+int UAddRotationTrack(UAnimation& animation, int node, int interpolation, bool looping, const float* times, const glm::quat* keys, size_t keyCount)
+{
+    if (keyCount == 0)
+        return -1;
+
+    std::vector<float> values;
+    glm::quat previous = keys[0];
+    for (size_t k = 0; k < keyCount; ++k)
+    {
+        glm::quat key = keys[k];
+        if (previous.x * key.x + previous.y * key.y + previous.z * key.z + previous.w * key.w < 0.0f)
+            key = glm::quat(-key.w, -key.x, -key.y, -key.z);
+        const float components[4] = { key.x, key.y, key.z, key.w };
+        values.insert(values.end(), components, components + 4);
+        previous = key;
+    }
+    return UAddAnimationTrack(animation.rotations, 4, UANIMATE_ROTATION, node, nullptr, interpolation, looping, times, values.data(), keyCount);
+}
+
+
+// Finds the segment of a track at the given time. Returns the position within it and the first of the four adjacent
+// keys a blend reads (previous, start, end, next); step tracks report position 0, so all modes share the blend.
+inline float UFindKeySegment(UAnimationTracks& tracks, size_t track, double time, uint32_t& blendKey)
+{
+    const uint32_t first = tracks.firstKey[track];
+    const uint32_t count = tracks.keyCount[track];
+    const float* times = tracks.keyTime.data() + first;
+
+    double local = time;
+    const double start = times[0], end = times[count - 1];
+    if (tracks.looping[track] && end > start)
+        local = time - std::floor((time - start) / (end - start)) * (end - start);
+    local = std::min(std::max(local, start), end);
+
+    // Time mostly moves forward, so the last segment is checked first and the search only runs after a jump
+    uint32_t segment = tracks.cursor[track];
+    if (segment >= count || times[segment] > local)
+        segment = static_cast<uint32_t>(std::upper_bound(times, times + count, static_cast<float>(local)) - times) - 1;
+    while (segment + 1 < count && times[segment + 1] <= local)
+        ++segment;
+    tracks.cursor[track] = segment;
+    blendKey = first + segment - 1;
+
+    if (tracks.interpolation[track] == UINTERPOLATE_STEP || segment + 1 == count)
+        return 0.0f;
+    const float span = times[segment + 1] - times[segment];
+    return span > 0.0f ? std::min(std::max(static_cast<float>((local - times[segment]) / span), 0.0f), 1.0f) : 0.0f;
+}
+
+
+// Evaluates every track of a group into its results, four tracks per batch. Only IEEE-exact operations are used
+// (no reciprocal estimates), so the SIMD and scalar paths give the same values on every machine.
+void UEvaluateAnimationTracks(UAnimationTracks& tracks, double time)
+{
+    const size_t trackCount = tracks.firstKey.size();
+    const int components = tracks.components;
+    for (size_t base = 0; base < trackCount; base += 4)
+    {
+        // Lanes past the last track blend the first keys with weight 1 into the padding
+        uint32_t blendKey[4] = {};
+        float u[4] = {};
+        bool cubic[4] = {};
+        for (size_t lane = 0; lane < 4 && base + lane < trackCount; ++lane)
+        {
+            u[lane] = UFindKeySegment(tracks, base + lane, time, blendKey[lane]);
+            cubic[lane] = tracks.interpolation[base + lane] == UINTERPOLATE_CUBIC;
+        }
+
+#if USIMD_SSE
+        // Catmull-Rom weights where the lane is cubic, (0, 1 - u, u, 0) otherwise
+        const __m128 t = _mm_loadu_ps(u);
+        const __m128 t2 = _mm_mul_ps(t, t);
+        const __m128 t3 = _mm_mul_ps(t2, t);
+        const __m128 half = _mm_set1_ps(0.5f);
+        const __m128 cubicLanes = _mm_castsi128_ps(_mm_setr_epi32(-int(cubic[0]), -int(cubic[1]), -int(cubic[2]), -int(cubic[3])));
+        const __m128 c0 = _mm_mul_ps(half, _mm_sub_ps(_mm_sub_ps(_mm_add_ps(t2, t2), t3), t));
+        const __m128 c1 = _mm_mul_ps(half, _mm_add_ps(_mm_sub_ps(_mm_mul_ps(_mm_set1_ps(3.0f), t3), _mm_mul_ps(_mm_set1_ps(5.0f), t2)), _mm_set1_ps(2.0f)));
+        const __m128 c2 = _mm_mul_ps(half, _mm_add_ps(_mm_sub_ps(_mm_mul_ps(_mm_set1_ps(4.0f), t2), _mm_mul_ps(_mm_set1_ps(3.0f), t3)), t));
+        const __m128 c3 = _mm_mul_ps(half, _mm_sub_ps(t3, t2));
+        const __m128 w0 = _mm_and_ps(cubicLanes, c0);
+        const __m128 w1 = _mm_or_ps(_mm_and_ps(cubicLanes, c1), _mm_andnot_ps(cubicLanes, _mm_sub_ps(_mm_set1_ps(1.0f), t)));
+        const __m128 w2 = _mm_or_ps(_mm_and_ps(cubicLanes, c2), _mm_andnot_ps(cubicLanes, t));
+        const __m128 w3 = _mm_and_ps(cubicLanes, c3);
+
+        // One load per lane fetches its four keys; the transpose turns them into one register per key
+        __m128 blended[4];
+        for (int c = 0; c < components; ++c)
+        {
+            const float* values = tracks.keyValue[c].data();
+            __m128 key0 = _mm_loadu_ps(values + blendKey[0]);
+            __m128 key1 = _mm_loadu_ps(values + blendKey[1]);
+            __m128 key2 = _mm_loadu_ps(values + blendKey[2]);
+            __m128 key3 = _mm_loadu_ps(values + blendKey[3]);
+            _MM_TRANSPOSE4_PS(key0, key1, key2, key3);
+            blended[c] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(w0, key0), _mm_mul_ps(w1, key1)), _mm_mul_ps(w2, key2)), _mm_mul_ps(w3, key3));
+        }
+
+        // Blended quaternions are renormalized (normalized lerp)
+        if (components == 4)
+        {
+            const __m128 lengthSquared = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(blended[0], blended[0]), _mm_mul_ps(blended[1], blended[1])),
+                _mm_mul_ps(blended[2], blended[2])), _mm_mul_ps(blended[3], blended[3]));
+            const __m128 length = _mm_max_ps(_mm_sqrt_ps(lengthSquared), _mm_set1_ps(1e-20f));
+            for (int c = 0; c < 4; ++c)
+                blended[c] = _mm_div_ps(blended[c], length);
+        }
+        for (int c = 0; c < components; ++c)
+            _mm_storeu_ps(tracks.result[c].data() + base, blended[c]);
+#else
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            const float t = u[lane], t2 = t * t, t3 = t2 * t;
+            float w[4] = { 0.0f, 1.0f - t, t, 0.0f };
+            if (cubic[lane])
+            {
+                w[0] = 0.5f * (((t2 + t2) - t3) - t);
+                w[1] = 0.5f * ((3.0f * t3 - 5.0f * t2) + 2.0f);
+                w[2] = 0.5f * ((4.0f * t2 - 3.0f * t3) + t);
+                w[3] = 0.5f * (t3 - t2);
+            }
+
+            float blended[4];
+            for (int c = 0; c < components; ++c)
+            {
+                const float* keys = tracks.keyValue[c].data() + blendKey[lane];
+                blended[c] = ((w[0] * keys[0] + w[1] * keys[1]) + w[2] * keys[2]) + w[3] * keys[3];
+            }
+            if (components == 4)
+            {
+                const float length = std::max(std::sqrt(((blended[0] * blended[0] + blended[1] * blended[1]) + blended[2] * blended[2]) +
+                    blended[3] * blended[3]), 1e-20f);
+                for (int c = 0; c < 4; ++c)
+                    blended[c] /= length;
+            }
+            for (int c = 0; c < components; ++c)
+                tracks.result[c][base + lane] = blended[c];
+        }
+#endif
+    }
+}
+
+
+// Evaluates all tracks at an absolute time
+void UEvaluateAnimation(UAnimation& animation, double time)
+{
+    UPROFILE_FUNCTION();
+
+    UEvaluateAnimationTracks(animation.scalars, time);
+    UEvaluateAnimationTracks(animation.vectors, time);
+    UEvaluateAnimationTracks(animation.rotations, time);
+    animation.evaluatedTime = time;
+}
+
+
+// Writes the evaluated values to their nodes and floats
+void UApplyAnimation(const UAnimation& animation, UTransformHierarchy& hierarchy)
+{
+    const UAnimationTracks* groups[3] = { &animation.scalars, &animation.vectors, &animation.rotations };
+    for (const UAnimationTracks* tracks : groups)
+    {
+        for (size_t track = 0; track < tracks->firstKey.size(); ++track)
+        {
+            const int node = tracks->node[track];
+            switch (tracks->target[track])
+            {
+            case UANIMATE_POSITION:
+                USetTransformPosition(hierarchy, node, glm::vec3(tracks->result[0][track], tracks->result[1][track], tracks->result[2][track]));
+                break;
+            case UANIMATE_SCALE:
+                USetTransformScale(hierarchy, node, glm::vec3(tracks->result[0][track], tracks->result[1][track], tracks->result[2][track]));
+                break;
+            case UANIMATE_ROTATION:
+                USetTransformRotation(hierarchy, node, glm::quat(tracks->result[3][track], tracks->result[0][track], tracks->result[1][track],
+                    tracks->result[2][track]));
+                break;
+            default:
+                for (int c = 0; c < tracks->components; ++c)
+                    tracks->value[track][c] = tracks->result[c][track];
+                break;
+            }
+        }
+    }
+}
+
+
+// Builds the scene hierarchy: the subject is scaled by 2 at the origin, the lamp starts above and in front of it
+void UCreateScene()
+{
+    gRootNode = UAddTransform(gTransforms, -1, glm::vec3(0.0f), glm::quat(1.0f, 0.0f, 0.0f, 0.0f), glm::vec3(1.0f));
+    gSubjectNode = UAddTransform(gTransforms, gRootNode, glm::vec3(0.0f, 0.0f, 0.0f), glm::quat(1.0f, 0.0f, 0.0f, 0.0f), glm::vec3(2.0f));
+    gLampNode = UAddTransform(gTransforms, gRootNode, glm::vec3(4.0f, 8.0f, 12.0f), glm::quat(1.0f, 0.0f, 0.0f, 0.0f), glm::vec3(0.5f));
+
+    // The lamp circles the vertical axis at 45 degrees a second: a looping cubic track through 32 points of the circle
+    const int orbitKeys = 33;
+    const float orbitPeriod = 8.0f;
+    float orbitTimes[orbitKeys];
+    glm::vec3 orbitPositions[orbitKeys];
+    for (int k = 0; k < orbitKeys; ++k)
+    {
+        const float turn = float(k % (orbitKeys - 1)) / (orbitKeys - 1);
+        orbitTimes[k] = orbitPeriod * k / (orbitKeys - 1);
+        orbitPositions[k] = glm::vec3(glm::rotate(glm::radians(360.0f) * turn, glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(4.0f, 8.0f, 12.0f, 1.0f));
+    }
+    UAddVectorTrack(gAnimation, UANIMATE_POSITION, gLampNode, nullptr, UINTERPOLATE_CUBIC, true, orbitTimes, orbitPositions, orbitKeys);
+
+    // Curved objects on the table, children of the subject so they share its placement and scale
+    const glm::quat identity(1.0f, 0.0f, 0.0f, 0.0f);
+    int node = UAddTransform(gTransforms, gSubjectNode, glm::vec3(0.75f, -0.25f, 2.0f), identity, glm::vec3(1.0f));
+    UAddParametricPrimitive(gParametricScene, UPARAMETRIC_SPHERE, node, glm::vec4(0.25f, 0.0f, 0.0f, 0.0f), nullptr);
+
+    node = UAddTransform(gTransforms, gSubjectNode, glm::vec3(-1.0f, -0.5f, 1.5f), identity, glm::vec3(1.0f));
+    UAddParametricPrimitive(gParametricScene, UPARAMETRIC_CYLINDER, node, glm::vec4(0.2f, 0.5f, 0.0f, 0.0f), nullptr);
+
+    node = UAddTransform(gTransforms, gSubjectNode, glm::vec3(1.5f, -0.45f, 0.5f), identity, glm::vec3(1.0f));
+    UAddParametricPrimitive(gParametricScene, UPARAMETRIC_TORUS, node, glm::vec4(0.3f, 0.05f, 0.0f, 0.0f), nullptr);
+
+    // A gently curved sheet lying on the table
+    glm::vec4 sheet[16];
+    for (int j = 0; j < 4; ++j)
+        for (int i = 0; i < 4; ++i)
+            sheet[j * 4 + i] = glm::vec4(i / 3.0f, (i == 1 || i == 2) && (j == 1 || j == 2) ? 0.3f : 0.0f, j / 3.0f, 1.0f);
+    node = UAddTransform(gTransforms, gSubjectNode, glm::vec3(-2.0f, -0.5f, -1.5f), identity, glm::vec3(1.0f));
+    UAddParametricPrimitive(gParametricScene, UPARAMETRIC_BICUBIC, node, glm::vec4(0.0f), sheet);
+
+    UUpdateTransforms(gTransforms);
+}
+
+
+// Drains the log ring to stdout on a background thread; flushes only when the ring runs dry
+void ULogWriterLoop()
+{
+    static const char* const levelNames[] = { "DEBUG", "INFO", "WARNING", "ERROR" };
+    ULogMessage message;
+    unsigned long long reportedDrops = 0;
+
+    for (;;)
+    {
+        bool wroteAny = false;
+        while (gLogger.queue.TryPop(message))
+        {
+            fprintf(stdout, "[%10.3f] %s: %s\n", message.time, levelNames[message.level], message.text);
+            wroteAny = true;
+        }
+
+        unsigned long long dropped = gLogger.dropped.load(std::memory_order_relaxed);
+        if (dropped != reportedDrops)
+        {
+            fprintf(stdout, "WARNING: %llu log messages dropped\n", dropped - reportedDrops);
+            reportedDrops = dropped;
+            wroteAny = true;
+        }
+
+        if (wroteAny)
+            fflush(stdout);
+        else if (!gLogger.running.load(std::memory_order_acquire))
+            break;
+        else
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+}
+
+
+// Starts the writer thread; messages logged before this are still queued and written once it runs
+void ULogStart()
+{
+    if (gLogger.running.exchange(true))
+        return;
+
+    gLogger.writer = std::thread(ULogWriterLoop);
+    atexit(ULogStop); // Flush on every exit path, including early EXIT_FAILURE returns
+}
+
+
+// Stops the writer after it has drained everything queued so far
+void ULogStop()
+{
+    if (!gLogger.running.exchange(false))
+        return;
+
+    if (gLogger.writer.joinable())
+        gLogger.writer.join();
+}
+
+
+// Formats on the calling thread and hands the line to the writer; never blocks, drops when the ring is full
+void ULog(int level, const char* format, ...)
+{
+    ULogMessage message;
+    message.level = level;
+    message.time = std::chrono::duration<double>(std::chrono::steady_clock::now() - gLogger.start).count();
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message.text, sizeof(message.text), format, args);
+    va_end(args);
+
+    if (!gLogger.queue.TryPush(message))
+        gLogger.dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+// Loads a recorded camera path ("time x y z yaw pitch zoom" per line, '#' starts a comment)
+bool ULoadCameraPath(const char* filename, UCameraPath& path)
+{
+    FILE* file = fopen(filename, "r");
+    if (!file)
+    {
+        ULOG_ERROR("Failed to open camera path %s", filename);
+        return false;
+    }
+
+    path.samples.clear();
+    path.cursor = 0;
+
+    char line[256];
+    while (fgets(line, sizeof(line), file))
+    {
+        if (line[0] == '#')
+            continue;
+
+        UCameraSample sample;
+        if (sscanf(line, "%lf %f %f %f %f %f %f", &sample.time, &sample.position.x, &sample.position.y, &sample.position.z,
+            &sample.yaw, &sample.pitch, &sample.zoom) == 7)
+            path.samples.push_back(sample);
+    }
+    fclose(file);
+
+    if (path.samples.empty())
+    {
+        ULOG_ERROR("Camera path %s has no samples", filename);
+        return false;
+    }
+
+    ULOG_INFO("Loaded camera path %s: %zu samples, %.2f s", filename, path.samples.size(), path.samples.back().time);
+    return true;
+}
+
+
+// Appends the current camera pose to a path being recorded
+void URecordCameraSample(FILE* file, double time)
+{
+    fprintf(file, "%.6f %.6f %.6f %.6f %.6f %.6f %.6f\n", time, gCamera.Position.x, gCamera.Position.y, gCamera.Position.z,
+        gCamera.Yaw, gCamera.Pitch, gCamera.Zoom);
+}
+
+
+// Places the camera at the interpolated pose for the given time; returns false once the path has ended
+bool UApplyCameraPath(UCameraPath& path, double time)
+{
+    const std::vector<UCameraSample>& samples = path.samples;
+    if (time > samples.back().time)
+        return false;
+
+    // Time only moves forward during playback, so the cursor just advances
+    while (path.cursor + 1 < samples.size() && samples[path.cursor + 1].time <= time)
+        ++path.cursor;
+
+    const UCameraSample& from = samples[path.cursor];
+    const UCameraSample& to = samples[std::min(path.cursor + 1, samples.size() - 1)];
+    const double span = to.time - from.time;
+    const float t = span > 0.0 ? static_cast<float>(glm::clamp((time - from.time) / span, 0.0, 1.0)) : 0.0f;
+
+    gCamera.Position = glm::mix(from.position, to.position, t);
+    gCamera.Yaw = glm::mix(from.yaw, to.yaw, t);
+    gCamera.Pitch = glm::mix(from.pitch, to.pitch, t);
+    gCamera.Zoom = glm::mix(from.zoom, to.zoom, t);
+
+    // Zero mouse movement refreshes the camera's front/right/up vectors from the new yaw and pitch
+    gCamera.ProcessMouseMovement(0.0f, 0.0f);
+
+    return true;
+}
+
+
+// Writes the per-frame timings as CSV for comparing runs
+bool UWriteFrameTrace(const char* filename, const std::vector<UFrameTiming>& trace)
+{
+    FILE* file = fopen(filename, "w");
+    if (!file)
+    {
+        ULOG_ERROR("Failed to open frame trace %s for writing", filename);
+        return false;
+    }
+
+    fprintf(file, "frame,simulation_time,cpu_ms,gpu_scene_ms,gpu_post_ms,render_scale\n");
+    for (size_t i = 0; i < trace.size(); ++i)
+        fprintf(file, "%zu,%.6f,%.4f,%.4f,%.4f,%.3f\n", i, trace[i].simulationTime, trace[i].cpuMs, trace[i].gpuSceneMs,
+            trace[i].gpuPostMs, trace[i].renderScale);
+    fclose(file);
+
+    ULOG_INFO("Wrote %zu frame timings to %s", trace.size(), filename);
+    return true;
+}
+
+// Labels the calling thread on the profiler timeline
+void UProfileNameThread(const char* name, int index)
+{
+    if (!gProfiler.enabled)
+        return;
+
+    UProfileThread& thread = UProfileCurrentThread();
+    thread.name = name;
+    if (index >= 0)
+        thread.name += " " + std::to_string(index);
+}
+
+
+// Chrome trace-event JSON: a name record per thread, then every zone as a complete ("X") event in microseconds.
+// Only call once the recording threads have stopped.
+bool UWriteChromeTrace(const char* filename)
+{
+    FILE* file = fopen(filename, "w");
+    if (!file)
+    {
+        ULOG_ERROR("Failed to open Chrome trace %s for writing", filename);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(gProfiler.mutex);
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"%s\"}}", WINDOW_TITLE);
+
+    size_t events = 0;
+    for (size_t tid = 0; tid < gProfiler.threads.size(); ++tid)
+    {
+        const UProfileThread& thread = gProfiler.threads[tid];
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"%s\"}}", tid, thread.name.c_str());
+        for (const std::vector<UProfileEvent>& chunk : thread.chunks)
+            for (const UProfileEvent& event : chunk)
+            {
+                fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f}", event.name, tid,
+                    event.start / 1000.0, event.duration / 1000.0);
+                ++events;
+            }
+    }
+    fprintf(file, "\n]}\n");
+
+    const bool written = !ferror(file);
+    if (fclose(file) != 0 || !written)
+    {
+        ULOG_ERROR("Failed to write Chrome trace %s", filename);
+        return false;
+    }
+    ULOG_INFO("Chrome trace: %zu zones from %zu threads written to %s", events, gProfiler.threads.size(), filename);
+    return true;
+}
+
+
+
+// Runs the CPU micro-benchmarks of the renderer's building blocks and writes every sample as JSON
+bool URunBenchmarks(const char* resultsPath)
+{
+    std::vector<UBenchmarkResult> results;
+
+    // Image flips at typical texture sizes
+    const int imageSizes[][3] = { { 256, 256, 3 }, { 1024, 1024, 4 }, { 2048, 2048, 4 } };
+    static char imageNames[3][64];
+    for (int i = 0; i < 3; ++i)
+    {
+        const int width = imageSizes[i][0], height = imageSizes[i][1], channels = imageSizes[i][2];
+        std::vector<unsigned char> image(size_t(width) * height * channels);
+        for (size_t p = 0; p < image.size(); ++p)
+            image[p] = static_cast<unsigned char>(p * 31);
+
+        snprintf(imageNames[i], sizeof(imageNames[i]), "flipImageVertically/%dx%dx%d", width, height, channels);
+        results.push_back(URunBenchmark(imageNames[i], image.size(), [&]() {
+            flipImageVertically(image.data(), width, height, channels);
+            UDoNotOptimize(image[0]);
+        }));
+    }
+
+    // Mesh building and index data of the scene
+    std::vector<UPackedVertex> verts;
+    std::vector<GLushort> indices;
+    UBuildMeshData(verts, indices);
+    const size_t meshBytes = verts.size() * sizeof(UPackedVertex) + indices.size() * sizeof(GLushort);
+    results.push_back(URunBenchmark("UBuildMeshData", meshBytes, [&]() {
+        UBuildMeshData(verts, indices);
+        UDoNotOptimize(verts.data());
+        UDoNotOptimize(indices.data());
+    }));
+
+    // Matrix composition as done per object and per frame
+    glm::vec3 position(1.0f, 2.0f, 3.0f);
+    glm::quat rotation = glm::angleAxis(glm::radians(30.0f), glm::normalize(glm::vec3(1.0f, 1.0f, 0.0f)));
+    glm::vec3 scale(2.0f);
+    results.push_back(URunBenchmark("ModelMatrix", 0, [&]() {
+        glm::mat4 model = glm::translate(position) * glm::mat4_cast(rotation) * glm::scale(scale);
+        UDoNotOptimize(model);
+    }));
+
+    glm::mat4 model = glm::translate(position) * glm::mat4_cast(rotation) * glm::scale(scale);
+    glm::mat4 view = gCamera.GetViewMatrix();
+    results.push_back(URunBenchmark("ModelViewProjection", 0, [&]() {
+        glm::mat4 projection = glm::perspective(45.0f, (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
+        glm::mat4 mvp = projection * view * model;
+        UDoNotOptimize(mvp);
+    }));
+    results.push_back(URunBenchmark("NormalMatrix", 0, [&]() {
+        glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(model)));
+        UDoNotOptimize(normalMatrix);
+    }));
+
+    // BVH build and ray queries on a bumpy grid, small enough to rebuild per sample and large enough to pick from
+    auto makeGrid = [](int size, std::vector<glm::vec3>& positions, std::vector<uint32_t>& gridIndices) {
+        positions.clear();
+        gridIndices.clear();
+        for (int z = 0; z <= size; ++z)
+            for (int x = 0; x <= size; ++x)
+                positions.emplace_back(float(x), std::sin(x * 0.37f) * std::cos(z * 0.23f) * 3.0f, float(z));
+        for (int z = 0; z < size; ++z)
+            for (int x = 0; x < size; ++x)
+            {
+                const uint32_t corner = uint32_t(z * (size + 1) + x);
+                const uint32_t quad[6] = { corner, corner + 1, corner + size + 1, corner + 1, corner + size + 2, corner + size + 1 };
+                gridIndices.insert(gridIndices.end(), quad, quad + 6);
+            }
+    };
+    std::vector<glm::vec3> gridPositions;
+    std::vector<uint32_t> gridIndices;
+    const int buildWorkers = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    makeGrid(256, gridPositions, gridIndices);
+    UBvh bvh;
+    results.push_back(URunBenchmark("UBuildBvh/131k", gridIndices.size() * sizeof(uint32_t), [&]() {
+        UBuildBvh(bvh, gridPositions, gridIndices, buildWorkers);
+        UDoNotOptimize(bvh.nodes.data());
+    }));
+
+    makeGrid(708, gridPositions, gridIndices);
+    const auto buildStart = std::chrono::steady_clock::now();
+    UBuildBvh(bvh, gridPositions, gridIndices, buildWorkers);
+    ULOG_INFO("BVH over %zu triangles: %zu nodes, built in %.1f ms on %d threads", gridIndices.size() / 3, bvh.nodes.size(),
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildStart).count(), buildWorkers);
+    uint32_t rayHash = 12345u;
+    results.push_back(URunBenchmark("UIntersectBvh/1M", 0, [&]() {
+        rayHash = rayHash * 1664525u + 1013904223u;
+        const glm::vec3 origin(float(rayHash % 708), 20.0f, float((rayHash >> 10) % 708));
+        URayHit hit;
+        UDoNotOptimize(UIntersectBvh(bvh, origin, glm::normalize(glm::vec3(0.3f, -1.0f, 0.2f)), 1e30f, hit));
+    }));
+
+    // Keyframe animation of a thousand objects: cubic position, linear rotation, stepped or linear scale, a color and
+    // a light intensity each, played a frame further per operation
+    const int animatedObjects = 1024;
+    const int animationKeys = 9;
+    UTransformHierarchy animatedNodes;
+    UAnimation animation;
+    std::vector<glm::vec3> animatedColors(animatedObjects);
+    std::vector<float> animatedIntensities(animatedObjects);
+    for (int i = 0; i < animatedObjects; ++i)
+    {
+        const glm::quat identity(1.0f, 0.0f, 0.0f, 0.0f);
+        const int node = UAddTransform(animatedNodes, -1, glm::vec3(0.0f), identity, glm::vec3(1.0f));
+        float times[animationKeys], intensities[animationKeys];
+        glm::vec3 positions[animationKeys], scales[animationKeys], colors[animationKeys];
+        glm::quat rotations[animationKeys];
+        for (int k = 0; k < animationKeys; ++k)
+        {
+            const int key = k % (animationKeys - 1);    // Loops end on their first key
+            const float phase = i * 0.37f + key * 0.79f;
+            times[k] = k * 0.25f;
+            positions[k] = glm::vec3(std::sin(phase), std::cos(phase * 1.3f), float(key)) * 4.0f;
+            rotations[k] = glm::angleAxis(phase, glm::normalize(glm::vec3(1.0f, float(i % 7), 2.0f)));
+            scales[k] = glm::vec3(1.0f + 0.1f * key);
+            colors[k] = glm::vec3(0.5f + 0.5f * std::sin(phase), 0.5f, 0.5f + 0.5f * std::cos(phase));
+            intensities[k] = 1.0f + std::sin(phase);
+        }
+        UAddVectorTrack(animation, UANIMATE_POSITION, node, nullptr, UINTERPOLATE_CUBIC, true, times, positions, animationKeys);
+        UAddRotationTrack(animation, node, UINTERPOLATE_LINEAR, true, times, rotations, animationKeys);
+        UAddVectorTrack(animation, UANIMATE_SCALE, node, nullptr, i % 2 ? UINTERPOLATE_STEP : UINTERPOLATE_LINEAR, false, times, scales, animationKeys);
+        UAddVectorTrack(animation, UANIMATE_VALUE, -1, &animatedColors[i], UINTERPOLATE_LINEAR, true, times, colors, animationKeys);
+        UAddScalarTrack(animation, &animatedIntensities[i], UINTERPOLATE_CUBIC, true, times, intensities, animationKeys);
+    }
+    double animationTime = 0.0;
+    results.push_back(URunBenchmark("UEvaluateAnimation/1k objects", 0, [&]() {
+        animationTime += 1.0 / 60.0;
+        UEvaluateAnimation(animation, animationTime);
+        UApplyAnimation(animation, animatedNodes);
+        UDoNotOptimize(animatedNodes.position.data());
+        UDoNotOptimize(animatedColors.data());
+    }));
+
+    // Transient lists: general-purpose heap against the frame arena
+    results.push_back(URunBenchmark("std::vector<int>/256", 256 * sizeof(int), [&]() {
+        std::vector<int> list;
+        for (int i = 0; i < 256; ++i)
+            list.push_back(i);
+        UDoNotOptimize(list.data());
+    }));
+    UFrameArena benchmarkArena;
+    UCreateFrameArena(benchmarkArena, 64 * 1024);
+    results.push_back(URunBenchmark("UFrameVector<int>/256", 256 * sizeof(int), [&]() {
+        UBeginFrameArena(benchmarkArena);
+        UFrameVector<int> list{ UFrameAllocator<int>(benchmarkArena) };
+        for (int i = 0; i < 256; ++i)
+            list.push_back(i);
+        UDoNotOptimize(list.data());
+    }));
+    UDestroyFrameArena(benchmarkArena);
+
+    // Profiler zones, idle and recording; the recording run reuses one chunk so memory stays flat, and the
+    // benchmark's own events are dropped again afterwards
+#if UPROFILE_ENABLED
+    const bool wasProfiling = gProfiler.enabled;
+    gProfiler.enabled = false;
+    results.push_back(URunBenchmark("UPROFILE_ZONE/off", 0, [&]() {
+        UPROFILE_ZONE("benchmark");
+    }));
+    if (!wasProfiling)
+        gProfiler.start = std::chrono::steady_clock::now();
+    gProfiler.enabled = true;
+    UProfileThread& profileThread = UProfileCurrentThread();
+    const size_t profileChunks = profileThread.chunks.size();
+    const size_t profileEvents = profileChunks ? profileThread.chunks.back().size() : 0;
+    results.push_back(URunBenchmark("UPROFILE_ZONE/on", 0, [&]() {
+        {
+            UPROFILE_ZONE("benchmark");
+        }
+        if (profileThread.chunks.back().size() == PROFILE_CHUNK_EVENTS)
+            profileThread.chunks.back().resize(profileThread.chunks.size() == profileChunks ? profileEvents : 0);
+    }));
+    profileThread.chunks.resize(std::max<size_t>(profileChunks, 1));
+    profileThread.chunks.back().resize(profileEvents);
+    gProfiler.enabled = wasProfiling;
+#endif
+
+    // Camera view matrix
+    results.push_back(URunBenchmark("Camera::GetViewMatrix", 0, [&]() {
+        glm::mat4 cameraView = gCamera.GetViewMatrix();
+        UDoNotOptimize(cameraView);
+    }));
+
+    // Human-readable summary
+    for (const UBenchmarkResult& result : results)
+    {
+        if (result.bytesPerOp)
+            ULOG_INFO("%-36s %12.1f ns/op  +-%5.1f%%  %10.1f MB/s", result.name, result.medianNs, 100.0 * result.stddevNs / result.meanNs,
+                result.bytesPerOp / result.medianNs * 1.0e3);
+        else
+            ULOG_INFO("%-36s %12.1f ns/op  +-%5.1f%%", result.name, result.medianNs, 100.0 * result.stddevNs / result.meanNs);
+    }
+
+    // Machine-readable results with the raw samples, so runs can be compared statistically
+    FILE* file = fopen(resultsPath, "w");
+    if (!file)
+    {
+        ULOG_ERROR("Failed to open benchmark results %s for writing", resultsPath);
+        return false;
+    }
+
+    fprintf(file, "{\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const UBenchmarkResult& result = results[i];
+        fprintf(file, "    {\"name\": \"%s\", \"iterations_per_sample\": %zu, \"bytes_per_op\": %zu, "
+            "\"median_ns\": %.3f, \"mean_ns\": %.3f, \"stddev_ns\": %.3f, \"min_ns\": %.3f, \"bytes_per_second\": %.1f, \"samples_ns\": [",
+            result.name, result.iterationsPerSample, result.bytesPerOp, result.medianNs, result.meanNs, result.stddevNs, result.minNs,
+            result.bytesPerOp ? result.bytesPerOp / result.medianNs * 1.0e9 : 0.0);
+        for (size_t j = 0; j < result.samplesNs.size(); ++j)
+            fprintf(file, "%s%.3f", j ? ", " : "", result.samplesNs[j]);
+        fprintf(file, "]}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+
+    ULOG_INFO("Wrote %zu benchmark results to %s", results.size(), resultsPath);
+    return true;
+}
+
+
+// Adds a curved primitive; bicubic patches copy their 16 control points (row-major, u fastest)
+int UAddParametricPrimitive(UParametricScene& scene, int type, int node, const glm::vec4& params, const glm::vec4* controlPoints)
+{
+    UParametricPrimitive primitive;
+    primitive.type = type;
+    primitive.node = node;
+    primitive.params = params;
+    primitive.controlPointOffset = -1;
+
+    if (type == UPARAMETRIC_BICUBIC)
+    {
+        primitive.controlPointOffset = static_cast<int>(scene.controlPoints.size());
+        scene.controlPoints.insert(scene.controlPoints.end(), controlPoints, controlPoints + 16);
+    }
+
+    scene.primitives.push_back(primitive);
+    return static_cast<int>(scene.primitives.size()) - 1;
+}
+
+
+// Patches a primitive of the given type is split into: a grid of uSegments by vSegments over each region
+void UGetParametricSegments(int type, int& uSegments, int& vSegments, int& regions)
+{
+    // Closed surfaces wrap around in u, so they get more patches there
+    uSegments = 1;
+    vSegments = 1;
+    regions = 1;
+    if (type == UPARAMETRIC_SPHERE || type == UPARAMETRIC_TORUS)
+    {
+        uSegments = 8;
+        vSegments = 4;
+    }
+    else if (type == UPARAMETRIC_CYLINDER)
+    {
+        uSegments = 8;
+        regions = 3; // Bottom cap, body, top cap
+    }
+}
+
+
+// Splits every primitive into a few patches (each tessellates to at most 64x64) and uploads the records
+void UCreateParametricBuffers(UParametricScene& scene)
+{
+    std::vector<UParametricGpuPatch> patches;
+    for (size_t p = 0; p < scene.primitives.size(); ++p)
+    {
+        int uSegments, vSegments, regions;
+        UGetParametricSegments(scene.primitives[p].type, uSegments, vSegments, regions);
+
+        for (int region = 0; region < regions; ++region)
+        {
+            for (int v = 0; v < vSegments; ++v)
+            {
+                for (int u = 0; u < uSegments; ++u)
+                {
+                    UParametricGpuPatch patch;
+                    patch.uvRange = glm::vec4((float)u / uSegments, (float)v / vSegments, (float)(u + 1) / uSegments, (float)(v + 1) / vSegments);
+                    patch.info[0] = static_cast<GLint>(p);
+                    patch.info[1] = region;
+                    patch.info[2] = 0;
+                    patch.info[3] = 0;
+                    patches.push_back(patch);
+                }
+            }
+        }
+    }
+    scene.patchCount = static_cast<GLsizei>(patches.size());
+
+    // Keep the buffers non-empty so binding them is always valid
+    if (scene.controlPoints.empty())
+        scene.controlPoints.push_back(glm::vec4(0.0f));
+
+    glGenVertexArrays(1, &scene.vao);
+    glGenBuffers(3, scene.buffers);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, scene.buffers[0]);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(scene.primitives.size(), 1) * sizeof(UParametricGpuPrimitive), NULL, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, scene.buffers[1]);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(patches.size(), 1) * sizeof(UParametricGpuPatch), patches.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, scene.buffers[2]);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, scene.controlPoints.size() * sizeof(glm::vec4), scene.controlPoints.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    UGPU_TRACK(UGPU_BUFFER, scene.buffers[0], std::max<size_t>(scene.primitives.size(), 1) * sizeof(UParametricGpuPrimitive), "parametric");
+    UGPU_TRACK(UGPU_BUFFER, scene.buffers[1], std::max<size_t>(patches.size(), 1) * sizeof(UParametricGpuPatch), "parametric");
+    UGPU_TRACK(UGPU_BUFFER, scene.buffers[2], scene.controlPoints.size() * sizeof(glm::vec4), "parametric");
+
+    UUpdateParametricTransforms(scene);
+
+    ULOG_INFO("Parametric primitives: %zu primitives, %d patches, %zu bytes of control data", scene.primitives.size(), scene.patchCount,
+        scene.primitives.size() * sizeof(UParametricGpuPrimitive) + patches.size() * sizeof(UParametricGpuPatch) + scene.controlPoints.size() * sizeof(glm::vec4));
+}
+
+
+// Uploads the primitives' current world and normal matrices from the transform hierarchy
+void UUpdateParametricTransforms(UParametricScene& scene)
+{
+    if (scene.primitives.empty())
+        return;
+
+    UParametricGpuPrimitive records[64];
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, scene.buffers[0]);
+    for (size_t first = 0; first < scene.primitives.size(); first += 64)
+    {
+        const size_t count = std::min<size_t>(64, scene.primitives.size() - first);
+        for (size_t i = 0; i < count; ++i)
+        {
+            const UParametricPrimitive& primitive = scene.primitives[first + i];
+            UParametricGpuPrimitive& record = records[i];
+            record.model = gTransforms.world[primitive.node];
+            record.normalMatrix = glm::mat4(glm::transpose(glm::inverse(glm::mat3(record.model))));
+            record.params = primitive.params;
+            record.info[0] = primitive.type;
+            record.info[1] = primitive.controlPointOffset;
+            record.info[2] = 0;
+            record.info[3] = 0;
+        }
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, first * sizeof(UParametricGpuPrimitive), count * sizeof(UParametricGpuPrimitive), records);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+
+void UDestroyParametricScene(UParametricScene& scene)
+{
+    glDeleteVertexArrays(1, &scene.vao);
+    glDeleteBuffers(3, scene.buffers);
+    for (GLuint buffer : scene.buffers)
+        UReleaseGpuResource(UGPU_BUFFER, buffer);
+    scene.patchCount = 0;
+}
+
+
+// evaluateSurface of the parametric shaders on the CPU: object-space position and normal at a parameter coordinate
+void UEvaluateParametricSurface(const UParametricScene& scene, const UParametricPrimitive& primitive, int region, const glm::vec2& uv,
+    glm::vec3& position, glm::vec3& normal)
+{
+    const glm::vec4& params = primitive.params;
+    const float pi = glm::pi<float>();
+    const float phi = 2.0f * pi * uv.x;
+    const glm::vec2 ring(std::cos(phi), std::sin(phi));
+
+    if (primitive.type == UPARAMETRIC_SPHERE)
+    {
+        const float theta = pi * uv.y;
+        normal = glm::vec3(std::sin(theta) * ring.x, std::cos(theta), std::sin(theta) * ring.y);
+        position = params.x * normal;
+    }
+    else if (primitive.type == UPARAMETRIC_CYLINDER)
+    {
+        if (region == 0)
+        {
+            position = glm::vec3(uv.y * params.x * ring.x, 0.0f, uv.y * params.x * ring.y);
+            normal = glm::vec3(0.0f, -1.0f, 0.0f);
+        }
+        else if (region == 1)
+        {
+            position = glm::vec3(params.x * ring.x, uv.y * params.y, params.x * ring.y);
+            normal = glm::vec3(ring.x, 0.0f, ring.y);
+        }
+        else
+        {
+            position = glm::vec3((1.0f - uv.y) * params.x * ring.x, params.y, (1.0f - uv.y) * params.x * ring.y);
+            normal = glm::vec3(0.0f, 1.0f, 0.0f);
+        }
+    }
+    else if (primitive.type == UPARAMETRIC_TORUS)
+    {
+        const float theta = 2.0f * pi * uv.y;
+        const glm::vec3 tubeDirection(std::cos(theta) * ring.x, std::sin(theta), std::cos(theta) * ring.y);
+        position = glm::vec3(params.x * ring.x, 0.0f, params.x * ring.y) + params.y * tubeDirection;
+        normal = tubeDirection;
+    }
+    else
+    {
+        // Cubic Bernstein basis and its derivative in u and v
+        auto bernstein = [](float t) {
+            const float s = 1.0f - t;
+            return glm::vec4(s * s * s, 3.0f * t * s * s, 3.0f * t * t * s, t * t * t);
+        };
+        auto bernsteinDerivative = [](float t) {
+            const float s = 1.0f - t;
+            return glm::vec4(-3.0f * s * s, 3.0f * s * s - 6.0f * t * s, 6.0f * t * s - 3.0f * t * t, 3.0f * t * t);
+        };
+        const glm::vec4 bu = bernstein(uv.x), bv = bernstein(uv.y);
+        const glm::vec4 du = bernsteinDerivative(uv.x), dv = bernsteinDerivative(uv.y);
+        glm::vec3 tangentU(0.0f), tangentV(0.0f);
+        position = glm::vec3(0.0f);
+        for (int j = 0; j < 4; ++j)
+            for (int i = 0; i < 4; ++i)
+            {
+                const glm::vec3 point(scene.controlPoints[primitive.controlPointOffset + j * 4 + i]);
+                position += bu[i] * bv[j] * point;
+                tangentU += du[i] * bv[j] * point;
+                tangentV += bu[i] * dv[j] * point;
+            }
+        normal = glm::cross(tangentV, tangentU);
+        normal = glm::length(normal) > 1e-6f ? glm::normalize(normal) : glm::vec3(0.0f, 1.0f, 0.0f);
+    }
+}
+
+
+// Tessellates a primitive into untextured packed vertices and a triangle list, every patch into a level by level
+// grid as the GPU would at a uniform tessellation level
+void UTessellateParametricPrimitive(const UParametricScene& scene, const UParametricPrimitive& primitive, int level,
+    std::vector<UPackedVertex>& verts, std::vector<GLushort>& indices)
+{
+    int uSegments, vSegments, regions;
+    UGetParametricSegments(primitive.type, uSegments, vSegments, regions);
+    const int columns = uSegments * level;
+    const int rows = vSegments * level;
+
+    verts.clear();
+    indices.clear();
+    for (int region = 0; region < regions; ++region)
+    {
+        const size_t first = verts.size();
+        for (int row = 0; row <= rows; ++row)
+            for (int column = 0; column <= columns; ++column)
+            {
+                const glm::vec2 uv(float(column) / columns, float(row) / rows);
+                glm::vec3 position, normal;
+                UEvaluateParametricSurface(scene, primitive, region, uv, position, normal);
+
+                UPackedVertex vertex;
+                vertex.position[0] = UPackHalf(position.x);
+                vertex.position[1] = UPackHalf(position.y);
+                vertex.position[2] = UPackHalf(position.z);
+                vertex.material = UMATERIAL_NONE;
+                vertex.normal = UPackSnorm1010102(normal, 0.0f);
+                for (int channel = 0; channel < 4; ++channel)
+                    vertex.color[channel] = 255;
+                vertex.uv[0] = UPackUnorm16(uv.x);
+                vertex.uv[1] = UPackUnorm16(uv.y);
+                verts.push_back(vertex);
+            }
+
+        for (int row = 0; row < rows; ++row)
+            for (int column = 0; column < columns; ++column)
+            {
+                const GLushort a = static_cast<GLushort>(first + row * (columns + 1) + column);
+                const GLushort b = static_cast<GLushort>(a + 1);
+                const GLushort c = static_cast<GLushort>(a + columns + 2);
+                const GLushort d = static_cast<GLushort>(a + columns + 1);
+                const GLushort quad[6] = { a, b, c, a, c, d };
+                indices.insert(indices.end(), quad, quad + 6);
+            }
+    }
+}
+
+
+// Creates a framebuffer with one color attachment and optionally depth; samples > 0 makes it multisampled
+bool UCreateRenderTarget(URenderTarget& target, int width, int height, GLenum colorFormat, bool withDepth, int samples)
+{
+    target.width = width;
+    target.height = height;
+    target.samples = samples;
+    target.format = colorFormat;
+
+    glGenFramebuffers(1, &target.framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer);
+
+    if (samples > 0)
+    {
+        glGenRenderbuffers(1, &target.color);
+        glBindRenderbuffer(GL_RENDERBUFFER, target.color);
+        glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, colorFormat, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, target.color);
+        UGPU_TRACK(UGPU_RENDERBUFFER, target.color, UGpuTextureBytes(colorFormat, width, height, samples, 1), "render targets");
+    }
+    else
+    {
+        glGenTextures(1, &target.color);
+        glBindTexture(GL_TEXTURE_2D, target.color);
+        glTexStorage2D(GL_TEXTURE_2D, 1, colorFormat, width, height);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target.color, 0);
+        UGPU_TRACK(UGPU_TEXTURE, target.color, UGpuTextureBytes(colorFormat, width, height, 1, 1), "render targets");
+    }
+
+    if (withDepth)
+    {
+        glGenRenderbuffers(1, &target.depth);
+        glBindRenderbuffer(GL_RENDERBUFFER, target.depth);
+        if (samples > 0)
+            glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_DEPTH_COMPONENT24, width, height);
+        else
+            glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, target.depth);
+        UGPU_TRACK(UGPU_RENDERBUFFER, target.depth, UGpuTextureBytes(GL_DEPTH_COMPONENT24, width, height, std::max(samples, 1), 1), "render targets");
+    }
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+    {
+        ULOG_ERROR("Framebuffer %dx%d (%d samples) incomplete: 0x%x", width, height, samples, status);
+        return false;
+    }
+
+    return true;
+}
+
+
+void UDestroyRenderTarget(URenderTarget& target)
+{
+    if (target.samples > 0)
+        glDeleteRenderbuffers(1, &target.color);
+    else
+        glDeleteTextures(1, &target.color);
+    glDeleteRenderbuffers(1, &target.depth);
+    UReleaseGpuResource(target.samples > 0 ? UGPU_RENDERBUFFER : UGPU_TEXTURE, target.color);
+    UReleaseGpuResource(UGPU_RENDERBUFFER, target.depth);
+    glDeleteFramebuffers(1, &target.framebuffer);
+    target = URenderTarget();
+}
+
+
+// Starts timing into this frame's query; the query issued LATENCY frames ago is read first if it has finished
+void UBeginGpuTimer(UGpuTimer& timer)
+{
+    const int slot = static_cast<int>(gFrameIndex % UGpuTimer::LATENCY);
+    if (!timer.queries[slot])
+        glGenQueries(UGpuTimer::LATENCY, timer.queries);
+
+    if (timer.pending[slot])
+    {
+        GLint available = 0;
+        glGetQueryObjectiv(timer.queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available)
+        {
+            GLuint64 nanoseconds = 0;
+            glGetQueryObjectui64v(timer.queries[slot], GL_QUERY_RESULT, &nanoseconds);
+            timer.milliseconds += (nanoseconds * 1.0e-6 - timer.milliseconds) * 0.1;
+        }
+    }
+
+    glBeginQuery(GL_TIME_ELAPSED, timer.queries[slot]);
+    timer.pending[slot] = true;
+}
+
+
+void UEndGpuTimer()
+{
+    glEndQuery(GL_TIME_ELAPSED);
+}
+
+
+// Appends a pass; it is created disabled and without a target until the chain is created
+int UAddPostPass(UPostChain& chain, const char* name, const GLchar* fragmentSource, GLenum outputFormat, bool producesColor)
+{
+    UPostPass pass;
+    pass.name = name;
+    pass.fragmentSource = fragmentSource;
+    pass.outputFormat = outputFormat;
+    pass.producesColor = producesColor;
+    pass.enabled = false;
+    pass.programId = 0;
+
+    chain.passes.push_back(pass);
+    return static_cast<int>(chain.passes.size()) - 1;
+}
+
+
+// Builds the HDR scene target, the tone mapping, FXAA and SMAA passes and their programs
+bool UCreatePostChain(UPostChain& chain, int width, int height, int mode)
+{
+    chain.toneMapPass = UAddPostPass(chain, "ToneMap", toneMapFragmentShaderSource, GL_RGBA8, true);
+    chain.fxaaPass = UAddPostPass(chain, "FXAA", fxaaFragmentShaderSource, GL_RGBA8, true);
+    chain.smaaEdgePass = UAddPostPass(chain, "SMAA edges", smaaEdgeFragmentShaderSource, GL_RG8, false);
+    chain.smaaWeightPass = UAddPostPass(chain, "SMAA weights", smaaWeightFragmentShaderSource, GL_RGBA8, false);
+    chain.smaaBlendPass = UAddPostPass(chain, "SMAA blend", smaaBlendFragmentShaderSource, GL_RGBA8, true);
+    chain.upscalePass = UAddPostPass(chain, "Upscale", upscaleFragmentShaderSource, GL_RGBA8, true);
+
+    for (UPostPass& pass : chain.passes)
+    {
+        if (!UCreateShaderProgram(postVertexShaderSource, pass.fragmentSource, pass.programId))
+            return false;
+
+        // Fixed texture units: 0 is the previous pass, 1 the latest color result
+        glUniform1i(glGetUniformLocation(pass.programId, "sourceTexture"), 0);
+        glUniform1i(glGetUniformLocation(pass.programId, "colorTexture"), 1);
+    }
+    glUseProgram(0);
+
+    glGenVertexArrays(1, &chain.vao);
+
+    chain.renderScale = 1.0f;
+    if (!UResizePostChain(chain, width, height))
+        return false;
+
+    USetAntiAliasingMode(chain, mode);
+    return true;
+}
+
+
+// (Re)creates every target at the window size
+bool UResizePostChain(UPostChain& chain, int width, int height)
+{
+    chain.width = width;
+    chain.height = height;
+    USetRenderScale(chain, chain.renderScale);
+
+    UDestroyRenderTarget(chain.scene);
+    if (!UCreateRenderTarget(chain.scene, width, height, GL_RGBA16F, true, 0))
+        return false;
+
+    if (chain.msaaScene.framebuffer)
+    {
+        const int samples = chain.msaaScene.samples;
+        UDestroyRenderTarget(chain.msaaScene);
+        if (!UCreateRenderTarget(chain.msaaScene, width, height, GL_RGBA16F, true, samples))
+            return false;
+    }
+
+    for (UPostPass& pass : chain.passes)
+    {
+        UDestroyRenderTarget(pass.target);
+        if (!UCreateRenderTarget(pass.target, width, height, pass.outputFormat, false, 0))
+            return false;
+    }
+
+    return true;
+}
+
+
+// Enables the passes of an anti-aliasing mode; MSAA modes render into a multisampled target instead
+void USetAntiAliasingMode(UPostChain& chain, int mode)
+{
+    // Multiview tiles its layers into the single-sampled scene target, where an MSAA resolve would overwrite them
+    if (gMultiview.path != UMULTIVIEW_OFF && (mode == UAA_MSAA2 || mode == UAA_MSAA4))
+    {
+        ULOG_WARNING("Anti-aliasing: %s is not available with multiview", ANTI_ALIASING_NAMES[mode]);
+        mode = UAA_NONE;
+    }
+
+    chain.mode = mode;
+    for (UPostPass& pass : chain.passes)
+        pass.enabled = false;
+    chain.passes[chain.toneMapPass].enabled = true;
+    chain.passes[chain.fxaaPass].enabled = (mode == UAA_FXAA);
+    chain.passes[chain.smaaEdgePass].enabled = (mode == UAA_SMAA);
+    chain.passes[chain.smaaWeightPass].enabled = (mode == UAA_SMAA);
+    chain.passes[chain.smaaBlendPass].enabled = (mode == UAA_SMAA);
+
+    const int samples = mode == UAA_MSAA2 ? 2 : mode == UAA_MSAA4 ? 4 : 0;
+    if (chain.msaaScene.samples != samples)
+    {
+        UDestroyRenderTarget(chain.msaaScene);
+        if (samples > 0 && !UCreateRenderTarget(chain.msaaScene, chain.width, chain.height, GL_RGBA16F, true, samples))
+            UDestroyRenderTarget(chain.msaaScene);
+    }
+
+    ULOG_INFO("Anti-aliasing: %s", ANTI_ALIASING_NAMES[mode]);
+}
+
+
+// Looks up a mode by its command line name, -1 when unknown
+int UFindAntiAliasingMode(const char* name)
+{
+    for (int mode = 0; mode < UAA_MODE_COUNT; ++mode)
+        if (strcmp(name, ANTI_ALIASING_NAMES[mode]) == 0)
+            return mode;
+    return -1;
+}
+
+
+// Binds the scene target (multisampled in the MSAA modes) and starts the scene timer
+void UBeginScenePass(UPostChain& chain)
+{
+    const URenderTarget& target = chain.msaaScene.framebuffer ? chain.msaaScene : chain.scene;
+    glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer);
+    glViewport(0, 0, chain.renderWidth, chain.renderHeight);
+    UBeginGpuTimer(chain.sceneTimer);
+}
+
+
+// Resolves MSAA if needed and runs the enabled passes; the last one draws into the window
+void URunPostChain(UPostChain& chain)
+{
+    if (chain.msaaScene.framebuffer)
+    {
+        UBeginGpuTimer(chain.resolveTimer);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, chain.msaaScene.framebuffer);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, chain.scene.framebuffer);
+        glBlitFramebuffer(0, 0, chain.renderWidth, chain.renderHeight, 0, 0, chain.renderWidth, chain.renderHeight,
+            GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        UEndGpuTimer();
+    }
+
+    int lastEnabled = -1;
+    for (size_t i = 0; i < chain.passes.size(); ++i)
+        if (chain.passes[i].enabled)
+            lastEnabled = static_cast<int>(i);
+
+    glDisable(GL_DEPTH_TEST);
+    glBindVertexArray(chain.vao);
+
+    GLuint source = chain.scene.color;
+    GLuint color = chain.scene.color;
+    for (int i = 0; i <= lastEnabled; ++i)
+    {
+        UPostPass& pass = chain.passes[i];
+        if (!pass.enabled)
+            continue;
+
+        // Passes before the upscale work on the rendered corner only; the upscale fills the window
+        UBeginGpuTimer(pass.timer);
+        glBindFramebuffer(GL_FRAMEBUFFER, i == lastEnabled ? 0 : pass.target.framebuffer);
+        if (i == chain.upscalePass)
+            glViewport(0, 0, chain.width, chain.height);
+        else
+            glViewport(0, 0, chain.renderWidth, chain.renderHeight);
+
+        glUseProgram(pass.programId);
+        glUniform2f(glGetUniformLocation(pass.programId, "texelSize"), 1.0f / chain.width, 1.0f / chain.height);
+        glUniform2f(glGetUniformLocation(pass.programId, "uvScale"),
+            static_cast<float>(chain.renderWidth) / chain.width, static_cast<float>(chain.renderHeight) / chain.height);
+        glUniform2i(glGetUniformLocation(pass.programId, "renderSize"), chain.renderWidth, chain.renderHeight);
+        glUniform1f(glGetUniformLocation(pass.programId, "sharpness"), 0.25f + (1.0f - chain.renderScale));
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, source);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, color);
+
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        UCountDraw(1);
+        UEndGpuTimer();
+
+        source = pass.target.color;
+        if (pass.producesColor)
+            color = pass.target.color;
+    }
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindVertexArray(0);
+    glUseProgram(0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // Periodic per-pass report, so the AA modes can be compared by cost
+    if (gFrameIndex % 300 == 299)
+    {
+        char report[400];
+        int length = snprintf(report, sizeof(report), "GPU ms (%s, %dx%d): scene %.3f", ANTI_ALIASING_NAMES[chain.mode],
+            chain.renderWidth, chain.renderHeight, chain.sceneTimer.milliseconds);
+        if (chain.msaaScene.framebuffer && length < (int)sizeof(report))
+            length += snprintf(report + length, sizeof(report) - length, ", resolve %.3f", chain.resolveTimer.milliseconds);
+        for (const UPostPass& pass : chain.passes)
+            if (pass.enabled && length < (int)sizeof(report))
+                length += snprintf(report + length, sizeof(report) - length, ", %s %.3f", pass.name, pass.timer.milliseconds);
+        ULOG_INFO("%s", report);
+    }
+}
+
+
+// Total GPU time of the MSAA resolve and the enabled passes
+double UPostChainMilliseconds(const UPostChain& chain)
+{
+    double milliseconds = chain.msaaScene.framebuffer ? chain.resolveTimer.milliseconds : 0.0;
+    for (const UPostPass& pass : chain.passes)
+        if (pass.enabled)
+            milliseconds += pass.timer.milliseconds;
+    return milliseconds;
+}
+
+
+// Dynamic resolution starts at full scale and enables the sharpening upscale pass
+void USetDynamicResolution(UPostChain& chain, bool enabled, double frameBudgetMs)
+{
+    chain.dynamicResolution = enabled;
+    chain.frameBudgetMs = frameBudgetMs;
+    chain.passes[chain.upscalePass].enabled = enabled;
+    chain.lastScaleChange = gFrameIndex;
+    USetRenderScale(chain, 1.0f);
+
+    if (enabled)
+        ULOG_INFO("Dynamic resolution on, GPU budget %.2f ms", frameBudgetMs);
+    else
+        ULOG_INFO("Dynamic resolution off");
+}
+
+
+// Render size follows the scale, rounded to multiples of 8 pixels so small scale changes do not
+// reallocate anything or shift the image by fractions of a pixel every frame
+void USetRenderScale(UPostChain& chain, float scale)
+{
+    chain.renderScale = std::min(std::max(scale, MIN_RENDER_SCALE), MAX_RENDER_SCALE);
+    chain.renderWidth = std::min(chain.width, std::max(8, (static_cast<int>(chain.width * chain.renderScale) + 7) / 8 * 8));
+    chain.renderHeight = std::min(chain.height, std::max(8, (static_cast<int>(chain.height * chain.renderScale) + 7) / 8 * 8));
+}
+
+
+// Moves the render scale toward the budget. GPU cost is roughly proportional to the pixel count, so the
+// ideal scale is the current one times sqrt(budget / measured). The timers are smoothed and lag a few
+// frames, so changes are damped, wait for fresh measurements and ignore small errors.
+void UUpdateDynamicResolution(UPostChain& chain)
+{
+    const unsigned long long SETTLE_FRAMES = 2 * UGpuTimer::LATENCY + 4;
+    if (!chain.dynamicResolution || gFrameIndex - chain.lastScaleChange < SETTLE_FRAMES)
+        return;
+
+    const double frameMs = chain.sceneTimer.milliseconds + UPostChainMilliseconds(chain);
+    if (frameMs <= 0.0)
+        return;
+
+    const double ratio = chain.frameBudgetMs / frameMs;
+    if (ratio > 0.9 && ratio < 1.05)
+        return;
+
+    const float target = chain.renderScale * static_cast<float>(std::sqrt(ratio));
+    const float scale = std::min(std::max(chain.renderScale + (target - chain.renderScale) * 0.5f, MIN_RENDER_SCALE), MAX_RENDER_SCALE);
+    if (std::fabs(scale - chain.renderScale) < 0.01f)
+        return;
+
+    USetRenderScale(chain, scale);
+    chain.lastScaleChange = gFrameIndex;
+    ULOG_DEBUG("Render scale %.2f (%dx%d), GPU %.2f ms of %.2f", chain.renderScale, chain.renderWidth, chain.renderHeight,
+        frameMs, chain.frameBudgetMs);
+}
+
+
+void UDestroyPostChain(UPostChain& chain)
+{
+    UDestroyRenderTarget(chain.scene);
+    UDestroyRenderTarget(chain.msaaScene);
+    for (UPostPass& pass : chain.passes)
+    {
+        UDestroyRenderTarget(pass.target);
+        UDestroyShaderProgram(pass.programId);
+        glDeleteQueries(UGpuTimer::LATENCY, pass.timer.queries);
+    }
+    glDeleteQueries(UGpuTimer::LATENCY, chain.sceneTimer.queries);
+    glDeleteQueries(UGpuTimer::LATENCY, chain.resolveTimer.queries);
+    glDeleteVertexArrays(1, &chain.vao);
+    chain.passes.clear();
+}
+
+
+// Picks how the views are broadcast and creates their layers. The multiview shader variants depend on the
+// path, so this runs before they are built.
+bool UCreateMultiview(UMultiview& multiview, int views, int layout, int width, int height)
+{
+    GLint maxViews = 0;
+    if (GLEW_OVR_multiview)
+        glGetIntegerv(GL_MAX_VIEWS_OVR, &maxViews);
+
+    if (views <= maxViews)
+        multiview.path = UMULTIVIEW_OVR;
+    else if (GLEW_ARB_shader_viewport_layer_array || GLEW_AMD_vertex_shader_layer)
+        multiview.path = UMULTIVIEW_LAYERED;
+    else
+    {
+        ULOG_ERROR("Multiview needs OVR_multiview or ARB_shader_viewport_layer_array");
+        return false;
+    }
+    multiview.views = views;
+    multiview.layout = layout;
+    multiview.instances = multiview.path == UMULTIVIEW_LAYERED ? views : 1;
+
+    if (!UCreateMultiviewTargets(multiview, width, height))
+        return false;
+    ULOG_INFO("Multiview: %d %s views of %dx%d through %s", views, layout == UMULTIVIEW_STEREO ? "stereo" : "wall",
+        multiview.width, multiview.height, multiview.path == UMULTIVIEW_OVR ? "OVR_multiview" : "layered instancing");
+    return true;
+}
+
+
+// (Re)creates the view layers for a window of the given size; each view gets an equal share of its width
+bool UCreateMultiviewTargets(UMultiview& multiview, int width, int height)
+{
+    UDestroyMultiviewTargets(multiview);
+    multiview.width = std::max(1, width / multiview.views);
+    multiview.height = std::max(1, height);
+
+    // Unit 0 belongs to the post chain, which rebinds it every pass; the material arrays keep theirs
+    glActiveTexture(GL_TEXTURE0);
+    glGenTextures(1, &multiview.color);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, multiview.color);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_RGBA16F, multiview.width, multiview.height, multiview.views);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    UGPU_TRACK(UGPU_TEXTURE, multiview.color, UGpuTextureBytes(GL_RGBA16F, multiview.width, multiview.height, multiview.views, 1), "render targets");
+
+    glGenTextures(1, &multiview.depth);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, multiview.depth);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_DEPTH_COMPONENT24, multiview.width, multiview.height, multiview.views);
+    UGPU_TRACK(UGPU_TEXTURE, multiview.depth, UGpuTextureBytes(GL_DEPTH_COMPONENT24, multiview.width, multiview.height, multiview.views, 1), "render targets");
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    glGenFramebuffers(1, &multiview.framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, multiview.framebuffer);
+    if (multiview.path == UMULTIVIEW_OVR)
+    {
+        glFramebufferTextureMultiviewOVR(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, multiview.color, 0, 0, multiview.views);
+        glFramebufferTextureMultiviewOVR(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, multiview.depth, 0, 0, multiview.views);
+    }
+    else
+    {
+        // Layered attachments: gl_Layer picks the layer a primitive goes to
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, multiview.color, 0);
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, multiview.depth, 0);
+    }
+    const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glGenFramebuffers(1, &multiview.blitFramebuffer);
+
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+    {
+        ULOG_ERROR("Multiview framebuffer %dx%d x %d incomplete: 0x%x", multiview.width, multiview.height, multiview.views, status);
+        return false;
+    }
+    return true;
+}
+
+
+// Per-view matrices around the camera. Stereo moves the eyes apart along the camera's right axis and shifts each
+// frustum so the two converge STEREO_CONVERGENCE ahead; a wall turns every view about the camera's up axis by
+// its horizontal field of view, so neighbouring screens continue the image.
+void UUpdateMultiviewMatrices(UMultiview& multiview, const Camera& camera, int width, int height)
+{
+    const float aspect = float(width) / float(height);
+    const float tanHalfFov = std::tan(MULTIVIEW_FIELD_OF_VIEW * 0.5f);
+    for (int view = 0; view < multiview.views; ++view)
+    {
+        const float offset = view - 0.5f * (multiview.views - 1);     // Views from the left, centred on the camera
+        if (multiview.layout == UMULTIVIEW_STEREO)
+        {
+            const glm::vec3 eye = camera.Position + camera.Right * (offset * STEREO_EYE_SEPARATION);
+            const float top = MULTIVIEW_NEAR * tanHalfFov;
+            const float shift = offset * STEREO_EYE_SEPARATION * MULTIVIEW_NEAR / STEREO_CONVERGENCE;
+            multiview.viewProjection[view] = glm::frustum(-top * aspect - shift, top * aspect - shift, -top, top, MULTIVIEW_NEAR, MULTIVIEW_FAR)
+                * glm::lookAt(eye, eye + camera.Front, camera.Up);
+        }
+        else
+        {
+            const float yaw = offset * 2.0f * std::atan(tanHalfFov * aspect);
+            const glm::vec3 front = glm::vec3(glm::rotate(-yaw, camera.Up) * glm::vec4(camera.Front, 0.0f));
+            multiview.viewProjection[view] = glm::perspective(MULTIVIEW_FIELD_OF_VIEW, aspect, MULTIVIEW_NEAR, MULTIVIEW_FAR)
+                * glm::lookAt(camera.Position, camera.Position + front, camera.Up);
+        }
+    }
+}
+
+
+// Prelude of one stage of a shader variant. Multiview vertex stages read their view from VIEW_INDEX and route
+// the vertex to its layer with SET_VIEW_LAYER(); every other stage and variant sees view 0 and no layer output.
+std::string UMultiviewPrelude(const UMultiview& multiview, GLenum stage, bool enabled)
+{
+    if (!enabled || stage != GL_VERTEX_SHADER || multiview.path == UMULTIVIEW_OFF)
+        return "#define VIEW_INDEX 0\n#define SET_VIEW_LAYER()\n";
+    if (multiview.path == UMULTIVIEW_OVR)
+        return "#extension GL_OVR_multiview : require\nlayout(num_views = " + std::to_string(multiview.views) + ") in;\n"
+            "#define VIEW_INDEX int(gl_ViewID_OVR)\n#define SET_VIEW_LAYER()\n";
+    return std::string(GLEW_ARB_shader_viewport_layer_array ? "#extension GL_ARB_shader_viewport_layer_array : require\n"
+        : "#extension GL_AMD_vertex_shader_layer : require\n") + "#define VIEW_INDEX gl_InstanceID\n#define SET_VIEW_LAYER() gl_Layer = gl_InstanceID\n";
+}
+
+
+// Per-view matrices of a multiview variant; the program must be bound
+void USetMultiviewUniforms(const UMultiview& multiview, GLuint programId)
+{
+    if (multiview.path != UMULTIVIEW_OFF)
+        glUniformMatrix4fv(glGetUniformLocation(programId, "viewProjections"), multiview.views, GL_FALSE,
+            glm::value_ptr(multiview.viewProjection[0]));
+}
+
+
+// Redirects the scene pass into the view layers. Views share the post chain's render region, so dynamic
+// resolution scales them as it does the single view.
+void UBeginMultiviewPass(UMultiview& multiview, const UPostChain& chain, const Camera& camera)
+{
+    const int width = std::min(multiview.width, chain.renderWidth / multiview.views);
+    const int height = std::min(multiview.height, chain.renderHeight);
+    UUpdateMultiviewMatrices(multiview, camera, width, height);
+    glBindFramebuffer(GL_FRAMEBUFFER, multiview.framebuffer);
+    glViewport(0, 0, width, height);
+}
+
+
+// Tiles the views side by side over the render region of the scene target, for the post chain to take over
+void UEndMultiviewPass(const UMultiview& multiview, const UPostChain& chain)
+{
+    const int width = std::min(multiview.width, chain.renderWidth / multiview.views);
+    const int height = std::min(multiview.height, chain.renderHeight);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, multiview.blitFramebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, chain.scene.framebuffer);
+    for (int view = 0; view < multiview.views; ++view)
+    {
+        glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, multiview.color, 0, view);
+        glBlitFramebuffer(0, 0, width, height, chain.renderWidth * view / multiview.views, 0,
+            chain.renderWidth * (view + 1) / multiview.views, chain.renderHeight, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, chain.scene.framebuffer);
+    glViewport(0, 0, chain.renderWidth, chain.renderHeight);
+}
+
+
+void UDestroyMultiviewTargets(UMultiview& multiview)
+{
+    glDeleteFramebuffers(1, &multiview.framebuffer);
+    glDeleteFramebuffers(1, &multiview.blitFramebuffer);
+    glDeleteTextures(1, &multiview.color);
+    glDeleteTextures(1, &multiview.depth);
+    UReleaseGpuResource(UGPU_TEXTURE, multiview.color);
+    UReleaseGpuResource(UGPU_TEXTURE, multiview.depth);
+    multiview.framebuffer = multiview.blitFramebuffer = multiview.color = multiview.depth = 0;
+}
+
+
+// World-space box around a mesh-space box under an affine transform: the center moves with the transform and
+// each axis of the box adds the absolute value of its transformed half extent
+void UTransformBounds(const glm::mat4& model, const glm::vec3& lower, const glm::vec3& upper, glm::vec4& worldLower, glm::vec4& worldUpper)
+{
+    const glm::vec3 center = glm::vec3(model * glm::vec4((lower + upper) * 0.5f, 1.0f));
+    const glm::vec3 half = (upper - lower) * 0.5f;
+    const glm::vec3 extent = glm::abs(glm::vec3(model[0])) * half.x + glm::abs(glm::vec3(model[1])) * half.y
+        + glm::abs(glm::vec3(model[2])) * half.z;
+    worldLower = glm::vec4(center - extent, 1.0f);
+    worldUpper = glm::vec4(center + extent, 1.0f);
+}
+
+
+// Frustum planes of a view-projection matrix, pointing inwards: left, right, bottom, top, near, far. Each is
+// the w row of the matrix plus or minus one of the others.
+void UExtractFrustumPlanes(const glm::mat4& viewProjection, glm::vec4* planes)
+{
+    glm::vec4 rows[4];
+    for (int row = 0; row < 4; ++row)
+        rows[row] = glm::vec4(viewProjection[0][row], viewProjection[1][row], viewProjection[2][row], viewProjection[3][row]);
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        planes[axis * 2] = rows[3] + rows[axis];
+        planes[axis * 2 + 1] = rows[3] - rows[axis];
+    }
+}
+
+
+// Builds the object records, the scene parts first and then the --objects field in square rings around the
+// desk, and the buffers, programs and vertex array the cull and the multi-draws use. Runs after the scene and
+// the multiview path are set up.
+bool UCreateGpuScene(UGpuScene& scene, int extraObjects, bool occlusion)
+{
+    UPROFILE_FUNCTION();
+
+    if (!UCreateComputeProgram(cullComputeShaderSource, scene.cullProgramId))
+        return false;
+    scene.occlusion = occlusion;
+    if (occlusion && !UCreateComputeProgram(hizComputeShaderSource, scene.hizProgramId))
+        return false;
+
+    // Mesh-space bounds of every part, from its run of vertices
+    for (GLuint part = 0; part < GPU_SCENE_PARTS; ++part)
+    {
+        scene.partLower[part] = glm::vec3(1e30f);
+        scene.partUpper[part] = glm::vec3(-1e30f);
+        for (GLuint v = SCENE_PARTS[part].firstVertex; v < GLuint(SCENE_PARTS[part].firstVertex) + SCENE_PARTS[part].vertexCount; ++v)
+        {
+            const GLushort* position = SCENE_MESH.verts[v].position;
+            const glm::vec3 point(UUnpackHalf(position[0]), UUnpackHalf(position[1]), UUnpackHalf(position[2]));
+            scene.partLower[part] = glm::min(scene.partLower[part], point);
+            scene.partUpper[part] = glm::max(scene.partUpper[part], point);
+        }
+    }
+
+    auto describe = [](UCullObject& object, GLuint part) {
+        object.firstIndex = GLuint(SCENE_DRAWS[part].firstIndex);
+        object.indexCount = GLuint(SCENE_DRAWS[part].indexCount);
+        object.batch = SCENE_DRAWS[part].features & USHADER_TEXTURED ? UCULL_TEXTURED : UCULL_UNTEXTURED;
+        object.padding = 0;
+    };
+
+    // The parts follow the subject node; UUpdateGpuSceneParts places them
+    scene.objects.assign(GPU_SCENE_PARTS + extraObjects, UCullObject());
+    for (GLuint part = 0; part < GPU_SCENE_PARTS; ++part)
+        describe(scene.objects[part], part);
+
+    // The field stands on the level of the desk plane. Each object is a box, pyramid or house turned by a hashed
+    // angle about its own base, so neighbours differ without a random generator.
+    glm::vec4 deskLower, deskUpper;
+    UTransformBounds(gTransforms.world[gSubjectNode], scene.partLower[1], scene.partUpper[1], deskLower, deskUpper);
+    const GLuint kinds[] = { 0, 2, 3 };
+    uint32_t hash = 0x9e3779b9u;
+    size_t next = GPU_SCENE_PARTS;
+    for (int ring = int(std::ceil(STRESS_FIELD_CLEARING / STRESS_FIELD_SPACING)); next < scene.objects.size(); ++ring)
+    {
+        for (int cell = 0; cell < 8 * ring && next < scene.objects.size(); ++cell, ++next)
+        {
+            // Sides of the ring in turn: front, right, back, left
+            const int side = cell / (2 * ring);
+            const int step = cell % (2 * ring);
+            const int x = side == 0 ? step - ring : side == 1 ? ring : side == 2 ? ring - step : -ring;
+            const int z = side == 0 ? -ring : side == 1 ? step - ring : side == 2 ? ring : ring - step;
+
+            hash ^= hash << 13;
+            hash ^= hash >> 17;
+            hash ^= hash << 5;
+            const GLuint part = kinds[hash % 3];
+            const float yaw = (hash >> 8) / float(0x1000000) * glm::radians(360.0f);
+            const glm::vec3 base((scene.partLower[part].x + scene.partUpper[part].x) * 0.5f, scene.partLower[part].y,
+                (scene.partLower[part].z + scene.partUpper[part].z) * 0.5f);
+
+            UCullObject& object = scene.objects[next];
+            object.model = glm::translate(glm::vec3(x * STRESS_FIELD_SPACING, deskUpper.y, z * STRESS_FIELD_SPACING))
+                * glm::rotate(yaw, glm::vec3(0.0f, 1.0f, 0.0f)) * glm::translate(base * -1.0f);
+            UTransformBounds(object.model, scene.partLower[part], scene.partUpper[part], object.lower, object.upper);
+            describe(object, part);
+        }
+    }
+
+    // Every object could survive into one batch, so each run has a slot per object
+    scene.capacity = GLsizei(scene.objects.size());
+    scene.triangles = 0;
+    for (size_t i = 0; i < scene.objects.size(); ++i)
+    {
+        scene.triangles += scene.objects[i].indexCount / 3;
+        if (i + 1 == GPU_SCENE_PARTS)
+            scene.partTriangles = scene.triangles;
+    }
+    const size_t objectBytes = scene.objects.size() * sizeof(UCullObject);
+    const size_t commandBytes = UCULL_BATCH_COUNT * size_t(scene.capacity) * sizeof(UDrawElementsCommand);
+    glGenBuffers(1, &scene.objectBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, scene.objectBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, objectBytes, scene.objects.data(), GL_DYNAMIC_DRAW);
+    glGenBuffers(1, &scene.commandBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, scene.commandBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, commandBytes, nullptr, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    glGenBuffers(1, &scene.counterBuffer);
+    glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, scene.counterBuffer);
+    glBufferData(GL_ATOMIC_COUNTER_BUFFER, UCULL_BATCH_COUNT * sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, 0);
+    UGPU_TRACK(UGPU_BUFFER, scene.objectBuffer, objectBytes, "objects");
+    UGPU_TRACK(UGPU_BUFFER, scene.commandBuffer, commandBytes, "objects");
+    UGPU_TRACK(UGPU_BUFFER, scene.counterBuffer, UCULL_BATCH_COUNT * sizeof(GLuint), "objects");
+    UUpdateGpuSceneParts(scene);
+
+    // The scene mesh with the object index as a per-instance attribute. Layered multiview instances every draw
+    // once per view, so the index advances every that many instances.
+    std::vector<GLuint> objectIndices(scene.objects.size());
+    for (size_t i = 0; i < objectIndices.size(); ++i)
+        objectIndices[i] = GLuint(i);
+    glGenVertexArrays(1, &scene.vao);
+    glBindVertexArray(scene.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, gMesh.vbos[0]);
+    UPackedVertexLayout::Enable();
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gMesh.vbos[1]);
+    glGenBuffers(1, &scene.objectIndexBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, scene.objectIndexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, objectIndices.size() * sizeof(GLuint), objectIndices.data(), GL_STATIC_DRAW);
+    glVertexAttribIPointer(UATTRIBUTE_OBJECT, 1, GL_UNSIGNED_INT, 0, nullptr);
+    glEnableVertexAttribArray(UATTRIBUTE_OBJECT);
+    glVertexAttribDivisor(UATTRIBUTE_OBJECT, gMultiview.instances);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    UGPU_TRACK(UGPU_BUFFER, scene.objectIndexBuffer, objectIndices.size() * sizeof(GLuint), "objects");
+
+    // Without ARB_indirect_parameters every slot of a run is submitted and the unused ones draw nothing
+    scene.drawCount = GLEW_ARB_indirect_parameters != GL_FALSE;
+    ULOG_INFO("GPU scene: %zu objects, %zu bytes of records; draw counts %s, occlusion culling %s", scene.objects.size(), objectBytes,
+        scene.drawCount ? "on the GPU" : "fixed", scene.occlusion ? "on" : "off");
+    return true;
+}
+
+
+// Places the scene parts at the subject's world matrix, uploading them only when it moved
+void UUpdateGpuSceneParts(UGpuScene& scene)
+{
+    const glm::mat4& model = gTransforms.world[gSubjectNode];
+    if (scene.objects.empty() || memcmp(&scene.objects[0].model, &model, sizeof(model)) == 0)
+        return;
+
+    for (GLuint part = 0; part < GPU_SCENE_PARTS; ++part)
+    {
+        scene.objects[part].model = model;
+        UTransformBounds(model, scene.partLower[part], scene.partUpper[part], scene.objects[part].lower, scene.objects[part].upper);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, scene.objectBuffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, GPU_SCENE_PARTS * sizeof(UCullObject), scene.objects.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+
+// Culls the objects from firstObject on against the frustum of every view, and the depth pyramid when there
+// is one, then draws the survivors with the GPU_DRIVEN clay programs, one multi-draw per batch. The CPU work
+// is the same for a handful of objects or hundreds of thousands.
+void UDrawGpuScene(UGpuScene& scene, GLuint firstObject, const glm::mat4& viewProjection, const GLuint* programIds)
+{
+    UPROFILE_FUNCTION();
+
+    const GLuint objectCount = GLuint(scene.objects.size());
+    if (firstObject >= objectCount)
+        return;
+
+    // An object in any view is drawn to all of them
+    const bool multiview = gMultiview.path != UMULTIVIEW_OFF;
+    const int views = multiview ? gMultiview.views : 1;
+    glm::vec4 planes[CULL_MAX_PLANES];
+    for (int view = 0; view < views; ++view)
+        UExtractFrustumPlanes(multiview ? gMultiview.viewProjection[view] : viewProjection, planes + view * 6);
+
+    // Empty runs for the cull to append to. Without GPU draw counts every slot is submitted, so last frame's
+    // commands are cleared to empty draws.
+    glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, scene.counterBuffer);
+    glClearBufferData(GL_ATOMIC_COUNTER_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+    glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, 0);
+    if (!scene.drawCount)
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, scene.commandBuffer);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+
+    const GLuint programId = scene.cullProgramId;
+    const bool occlusion = scene.occlusion && scene.pyramidReady;
+    glUseProgram(programId);
+    glUniform1ui(glGetUniformLocation(programId, "firstObject"), firstObject);
+    glUniform1ui(glGetUniformLocation(programId, "objectCount"), objectCount);
+    glUniform1ui(glGetUniformLocation(programId, "capacity"), GLuint(scene.capacity));
+    glUniform1ui(glGetUniformLocation(programId, "instances"), GLuint(gMultiview.instances));
+    glUniform1i(glGetUniformLocation(programId, "planeCount"), views * 6);
+    glUniform4fv(glGetUniformLocation(programId, "frustumPlanes"), views * 6, &planes[0].x);
+    glUniform1i(glGetUniformLocation(programId, "occlusion"), occlusion);
+    if (occlusion)
+    {
+        glActiveTexture(GL_TEXTURE0 + HIZ_UNIT);
+        glBindTexture(GL_TEXTURE_2D, scene.pyramid);
+        glActiveTexture(GL_TEXTURE0);
+        glUniform1i(glGetUniformLocation(programId, "depthPyramid"), HIZ_UNIT);
+        glUniform1i(glGetUniformLocation(programId, "pyramidLevels"), scene.levels);
+        glUniform2i(glGetUniformLocation(programId, "pyramidSize"), scene.width, scene.height);
+        glUniform2f(glGetUniformLocation(programId, "pyramidRegion"), GLfloat(scene.pyramidRegionWidth), GLfloat(scene.pyramidRegionHeight));
+        glUniformMatrix4fv(glGetUniformLocation(programId, "pyramidViewProjection"), 1, GL_FALSE, glm::value_ptr(scene.pyramidViewProjection));
+    }
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CULL_OBJECT_BINDING, scene.objectBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CULL_COMMAND_BINDING, scene.commandBuffer);
+    glBindBufferBase(GL_ATOMIC_COUNTER_BUFFER, CULL_COUNTER_BINDING, scene.counterBuffer);
+    glDispatchCompute((objectCount - firstObject + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+
+    // The commands and counts are read back as draw parameters
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+
+    glBindVertexArray(scene.vao);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, scene.commandBuffer);
+    if (scene.drawCount)
+        glBindBuffer(GL_PARAMETER_BUFFER_ARB, scene.counterBuffer);
+    for (int batch = 0; batch < UCULL_BATCH_COUNT; ++batch)
+    {
+        glUseProgram(programIds[batch]);
+        const void* commands = (const void*)(batch * scene.capacity * sizeof(UDrawElementsCommand));
+        if (scene.drawCount)
+            glMultiDrawElementsIndirectCountARB(GL_TRIANGLES, GL_UNSIGNED_SHORT, commands, GLintptr(batch * sizeof(GLuint)), scene.capacity, 0);
+        else
+            glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_SHORT, commands, scene.capacity, 0);
+        UCountDraw(0); // What and how much is drawn is decided on the GPU
+    }
+    gFrameCounters.culledTriangles += (scene.triangles - (firstObject > 0 ? scene.partTriangles : 0)) * gMultiview.views;
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    if (scene.drawCount)
+        glBindBuffer(GL_PARAMETER_BUFFER_ARB, 0);
+}
+
+
+// (Re)creates the depth copy and the pyramid for a scene target of the given size; the next captured frame
+// fills them
+bool UCreateDepthPyramid(UGpuScene& scene, int width, int height)
+{
+    UDestroyDepthPyramid(scene);
+    scene.width = width;
+    scene.height = height;
+    scene.levels = 1;
+    while ((std::max(width, height) >> scene.levels) > 0)
+        ++scene.levels;
+
+    glActiveTexture(GL_TEXTURE0 + HIZ_UNIT);
+    glGenTextures(1, &scene.depth);
+    glBindTexture(GL_TEXTURE_2D, scene.depth);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT24, width, height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    UGPU_TRACK(UGPU_TEXTURE, scene.depth, UGpuTextureBytes(GL_DEPTH_COMPONENT24, width, height, 1, 1), "render targets");
+
+    glGenTextures(1, &scene.pyramid);
+    glBindTexture(GL_TEXTURE_2D, scene.pyramid);
+    glTexStorage2D(GL_TEXTURE_2D, scene.levels, GL_R32F, width, height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    UGPU_TRACK(UGPU_TEXTURE, scene.pyramid, UGpuTextureBytes(GL_R32F, width, height, 1, scene.levels), "render targets");
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0);
+
+    glGenFramebuffers(1, &scene.depthFramebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, scene.depthFramebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, scene.depth, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    const bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (!complete)
+        ULOG_ERROR("Depth pyramid framebuffer is incomplete");
+    return complete;
+}
+
+
+// Reduces the depth of the frame just drawn into the pyramid, for the next frame's occlusion test. Objects
+// that come out from behind an occluder can therefore show up a frame late.
+void UBuildDepthPyramid(UGpuScene& scene, const UPostChain& chain, const glm::mat4& viewProjection)
+{
+    UPROFILE_FUNCTION();
+
+    const URenderTarget& target = chain.msaaScene.framebuffer ? chain.msaaScene : chain.scene;
+    if ((scene.width != chain.width || scene.height != chain.height) && !UCreateDepthPyramid(scene, chain.width, chain.height))
+    {
+        ULOG_WARNING("Occlusion culling disabled");
+        scene.occlusion = false;
+        glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer);
+        return;
+    }
+
+    // Only the render region is copied; multisampled depth is resolved by the blit
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, target.framebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, scene.depthFramebuffer);
+    glBlitFramebuffer(0, 0, chain.renderWidth, chain.renderHeight, 0, 0, chain.renderWidth, chain.renderHeight, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer);
+
+    const GLuint programId = scene.hizProgramId;
+    glUseProgram(programId);
+    glUniform1i(glGetUniformLocation(programId, "source"), HIZ_UNIT);
+    const GLint sourceLevelLoc = glGetUniformLocation(programId, "sourceLevel");
+    const GLint sourceSizeLoc = glGetUniformLocation(programId, "sourceSize");
+    const GLint destinationSizeLoc = glGetUniformLocation(programId, "destinationSize");
+
+    // Each level reads the one above through the sampler and writes its own through the image unit
+    glActiveTexture(GL_TEXTURE0 + HIZ_UNIT);
+    int sourceWidth = chain.renderWidth;
+    int sourceHeight = chain.renderHeight;
+    for (int level = 0; level < scene.levels; ++level)
+    {
+        const int width = std::max(1, scene.width >> level);
+        const int height = std::max(1, scene.height >> level);
+        glBindTexture(GL_TEXTURE_2D, level == 0 ? scene.depth : scene.pyramid);
+        glBindImageTexture(0, scene.pyramid, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+        glUniform1i(sourceLevelLoc, level - 1);
+        glUniform2i(sourceSizeLoc, sourceWidth, sourceHeight);
+        glUniform2i(destinationSizeLoc, width, height);
+        glDispatchCompute((width + HIZ_GROUP_SIZE - 1) / HIZ_GROUP_SIZE, (height + HIZ_GROUP_SIZE - 1) / HIZ_GROUP_SIZE, 1);
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+        sourceWidth = width;
+        sourceHeight = height;
+    }
+    glBindImageTexture(0, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+    glActiveTexture(GL_TEXTURE0);
+
+    scene.pyramidReady = true;
+    scene.pyramidRegionWidth = chain.renderWidth;
+    scene.pyramidRegionHeight = chain.renderHeight;
+    scene.pyramidViewProjection = viewProjection;
+}
+
+
+void UDestroyDepthPyramid(UGpuScene& scene)
+{
+    glDeleteFramebuffers(1, &scene.depthFramebuffer);
+    glDeleteTextures(1, &scene.depth);
+    glDeleteTextures(1, &scene.pyramid);
+    UReleaseGpuResource(UGPU_TEXTURE, scene.depth);
+    UReleaseGpuResource(UGPU_TEXTURE, scene.pyramid);
+    scene.depthFramebuffer = scene.depth = scene.pyramid = 0;
+    scene.width = scene.height = scene.levels = 0;
+    scene.pyramidReady = false;
+}
+
+
+void UDestroyGpuScene(UGpuScene& scene)
+{
+    UDestroyDepthPyramid(scene);
+    glDeleteVertexArrays(1, &scene.vao);
+    for (GLuint buffer : { scene.objectBuffer, scene.commandBuffer, scene.counterBuffer, scene.objectIndexBuffer })
+    {
+        glDeleteBuffers(1, &buffer);
+        UReleaseGpuResource(UGPU_BUFFER, buffer);
+    }
+    if (scene.cullProgramId)
+        UDestroyShaderProgram(scene.cullProgramId);
+    if (scene.hizProgramId)
+        UDestroyShaderProgram(scene.hizProgramId);
+    scene = UGpuScene();
+}
+
+
+// Loads an image for the residency manager. A missing file is replaced by a generated checkerboard of the
+// two fallback colors, so the scene still runs without the resource folder.
+int UAddTexture(UTextureResidency& residency, const char* filename, const glm::vec3& fallbackA, const glm::vec3& fallbackB, int fallbackCells)
+{
+    UTextureImage image;
+    image.array = -1;
+    image.layer = -1;
+
+    unsigned char* pixels = stbi_load(filename, &image.width, &image.height, &image.channels, 0);
+    if (pixels && (image.channels == 3 || image.channels == 4))
+    {
+        flipImageVertically(pixels, image.width, image.height, image.channels);
+        image.pixels.assign(pixels, pixels + static_cast<size_t>(image.width) * image.height * image.channels);
+    }
+    else
+    {
+        if (pixels)
+            ULOG_WARNING("Texture %s has %d channels, using a generated checkerboard", filename, image.channels);
+        else
+            ULOG_WARNING("Failed to load texture %s, using a generated checkerboard", filename);
+
+        image.width = 256;
+        image.height = 256;
+        image.channels = 4;
+        image.pixels.resize(256 * 256 * 4);
+        const int cellSize = 256 / std::max(fallbackCells, 1);
+        for (int y = 0; y < 256; ++y)
+            for (int x = 0; x < 256; ++x)
+            {
+                const glm::vec3& color = ((x / cellSize + y / cellSize) & 1) ? fallbackB : fallbackA;
+                unsigned char* texel = &image.pixels[(y * 256 + x) * 4];
+                texel[0] = UPackUnorm8(color.r);
+                texel[1] = UPackUnorm8(color.g);
+                texel[2] = UPackUnorm8(color.b);
+                texel[3] = 255;
+            }
+    }
+    stbi_image_free(pixels);
+
+    residency.images.push_back(std::move(image));
+    return static_cast<int>(residency.images.size()) - 1;
+}
+
+
+// Adds a material sampling one image (or none when image < 0); returns its index in the material buffer
+int UAddMaterial(UTextureResidency& residency, int image, const glm::vec2& uvScale, const glm::vec4& tint)
+{
+    UMaterialGpu material = {};
+    material.texture[0] = image;    // Image index until UCommitTextures resolves it to an array and layer
+    material.texture[1] = 0;
+    material.uvScale = uvScale;
+    material.tint = tint;
+
+    residency.materials.push_back(material);
+    return static_cast<int>(residency.materials.size()) - 1;
+}
+
+
+// Packs the loaded images into texture arrays, makes them resident, uploads the material buffer and
+// compiles the material lookup shader for the path in use
+bool UCommitTextures(UTextureResidency& residency)
+{
+    residency.bindless = GLEW_ARB_bindless_texture != GL_FALSE;
+
+    // Group by format and size; every image becomes a layer of its group's array
+    for (UTextureImage& image : residency.images)
+    {
+        const GLenum format = image.channels == 4 ? GL_RGBA8 : GL_RGB8;
+        for (size_t a = 0; a < residency.arrays.size() && image.array < 0; ++a)
+        {
+            const UTextureArray& candidate = residency.arrays[a];
+            if (candidate.format == format && candidate.width == image.width && candidate.height == image.height)
+                image.array = static_cast<int>(a);
+        }
+
+        if (image.array < 0)
+        {
+            if (!residency.bindless && static_cast<int>(residency.arrays.size()) >= MAX_TEXTURE_ARRAYS)
+            {
+                ULOG_WARNING("More than %d texture formats and sizes, a %dx%d image is left untextured", MAX_TEXTURE_ARRAYS,
+                    image.width, image.height);
+                continue;
+            }
+
+            UTextureArray array = { format, image.width, image.height, 0, 0, 0 };
+            residency.arrays.push_back(array);
+            image.array = static_cast<int>(residency.arrays.size()) - 1;
+        }
+        image.layer = residency.arrays[image.array].layers++;
+    }
+
+    // Allocate each array with a full mip chain and upload its layers
+    for (size_t a = 0; a < residency.arrays.size(); ++a)
+    {
+        UTextureArray& array = residency.arrays[a];
+        const int levels = 1 + static_cast<int>(std::floor(std::log2(static_cast<float>(std::max(array.width, array.height)))));
+
+        glGenTextures(1, &array.texture);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, array.texture);
+        glTexStorage3D(GL_TEXTURE_2D_ARRAY, levels, array.format, array.width, array.height, array.layers);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        for (const UTextureImage& image : residency.images)
+            if (image.array == static_cast<int>(a))
+                glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, image.layer, image.width, image.height, 1,
+                    image.channels == 4 ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE, image.pixels.data());
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+        UGPU_TRACK(UGPU_TEXTURE, array.texture, UGpuTextureBytes(array.format, array.width, array.height, array.layers, levels), "textures");
+
+        // Bindless handles freeze the sampler state, so they are taken after the parameters are final
+        if (residency.bindless)
+        {
+            array.handle = glGetTextureHandleARB(array.texture);
+            glMakeTextureHandleResidentARB(array.handle);
+        }
+        else
+        {
+            glActiveTexture(GL_TEXTURE0 + TEXTURE_ARRAY_UNIT + static_cast<GLuint>(a));
+            glBindTexture(GL_TEXTURE_2D_ARRAY, array.texture);
+            glActiveTexture(GL_TEXTURE0);
+        }
+
+        ULOG_INFO("Texture array %zu: %dx%d, %d layers, %d levels", a, array.width, array.height, array.layers, levels);
+    }
+
+    // The CPU copies are no longer needed
+    for (UTextureImage& image : residency.images)
+        std::vector<unsigned char>().swap(image.pixels);
+
+    // Resolve image indices to array, layer and handle
+    for (UMaterialGpu& material : residency.materials)
+    {
+        const int image = material.texture[0];
+        const int array = image >= 0 && image < static_cast<int>(residency.images.size()) ? residency.images[image].array : -1;
+        material.texture[0] = array;
+        material.texture[1] = array >= 0 ? residency.images[image].layer : 0;
+        material.handle = array >= 0 ? residency.arrays[array].handle : 0;
+    }
+
+    glGenBuffers(1, &residency.materialBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, residency.materialBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(residency.materials.size(), 1) * sizeof(UMaterialGpu),
+        residency.materials.empty() ? nullptr : residency.materials.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    UGPU_TRACK(UGPU_BUFFER, residency.materialBuffer, std::max<size_t>(residency.materials.size(), 1) * sizeof(UMaterialGpu), "textures");
+
+    static const char* const versionLine = "#version 440 core\n";
+    static const char* const bindlessLine = "#extension GL_ARB_bindless_texture : require\n";
+    const char* const sources[] = { versionLine, residency.bindless ? bindlessLine : "", materialStructSource,
+        residency.bindless ? materialBindlessSource : materialArraySource };
+    if (!UCompileShader(GL_FRAGMENT_SHADER, sources, 4, "MATERIAL", residency.materialShader))
+        return false;
+
+    ULOG_INFO("Textures: %zu images in %zu arrays, %zu materials (%s)", residency.images.size(), residency.arrays.size(),
+        residency.materials.size(), residency.bindless ? "bindless" : "array units");
+    return true;
+}
+
+
+// Textures and materials of the scene, in UMaterial order
+// Loads the scene's images and describes its materials, without touching GL
+void UAddSceneMaterials(UTextureResidency& residency)
+{
+    const int desk = UAddTexture(residency, "../../resources/textures/blueDesk.png",
+        glm::vec3(0.35f, 0.45f, 0.8f), glm::vec3(0.25f, 0.35f, 0.7f), 8);
+    const int checkerboard = UAddTexture(residency, "../../resources/textures/checkerboard.png",
+        glm::vec3(1.0f), glm::vec3(0.1f), 8);
+
+    UAddMaterial(residency, desk, glm::vec2(2.0f), glm::vec4(1.0f));
+    UAddMaterial(residency, checkerboard, glm::vec2(1.0f), glm::vec4(1.0f));
+    static_assert(UMATERIAL_COUNT == 2, "UCreateMaterials must add one material per UMaterial");
+
+    // The desk streams from the virtual texture when one is open
+    if (gVirtualTexture.header.pageCount > 0)
+        residency.materials[UMATERIAL_DESK].texture[2] = 1;
+}
+
+
+bool UCreateMaterials(UTextureResidency& residency)
+{
+    UPROFILE_FUNCTION();
+
+    UAddSceneMaterials(residency);
+    return UCommitTextures(residency);
+}
+
+
+// Points a program's samplers at their fixed units. Every sampler gets its own unit even when unused, since
+// samplers of different types must never share one.
+void UBindMaterialTextures(const UTextureResidency& residency, GLuint programId)
+{
+    glUseProgram(programId);
+    if (!residency.bindless)
+    {
+        const GLint units[MAX_TEXTURE_ARRAYS] = { TEXTURE_ARRAY_UNIT, TEXTURE_ARRAY_UNIT + 1, TEXTURE_ARRAY_UNIT + 2, TEXTURE_ARRAY_UNIT + 3 };
+        glUniform1iv(glGetUniformLocation(programId, "textureArrays"), MAX_TEXTURE_ARRAYS, units);
+    }
+    glUniform1i(glGetUniformLocation(programId, "vtIndirection"), VIRTUAL_INDIRECTION_UNIT);
+    glUniform1i(glGetUniformLocation(programId, "vtCache"), VIRTUAL_CACHE_UNIT);
+    glUniform1i(glGetUniformLocation(programId, "vtSparseTexture"), VIRTUAL_SPARSE_UNIT);
+    glUniform1i(glGetUniformLocation(programId, "lightmap"), LIGHTMAP_UNIT);
+    glUniform1i(glGetUniformLocation(programId, "irradianceProbes"), PROBE_UNIT);
+    glUseProgram(0);
+}
+
+
+void UDestroyTextures(UTextureResidency& residency)
+{
+    for (UTextureArray& array : residency.arrays)
+    {
+        if (array.handle)
+            glMakeTextureHandleNonResidentARB(array.handle);
+        glDeleteTextures(1, &array.texture);
+        UReleaseGpuResource(UGPU_TEXTURE, array.texture);
+    }
+    glDeleteBuffers(1, &residency.materialBuffer);
+    UReleaseGpuResource(UGPU_BUFFER, residency.materialBuffer);
+    glDeleteShader(residency.materialShader);
+
+    residency.images.clear();
+    residency.arrays.clear();
+    residency.materials.clear();
+    residency.materialBuffer = 0;
+    residency.materialShader = 0;
+}
+
+
+void UThreadPoolWorker(UThreadPool& pool, int worker)
+{
+    UPROFILE_THREAD(pool.name, worker);
+
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    for (;;)
+    {
+        pool.wake.wait(lock, [&pool]() { return pool.stopping || !pool.jobs.empty(); });
+        if (pool.jobs.empty())
+            return; // Stopping and drained
+
+        std::function<void(int)> job = std::move(pool.jobs.front());
+        pool.jobs.pop_front();
+        ++pool.running;
+        lock.unlock();
+
+        {
+            UPROFILE_ZONE(pool.name);
+            job(worker);
+        }
+
+        lock.lock();
+        --pool.running;
+        if (pool.jobs.empty() && pool.running == 0)
+            pool.idle.notify_all();
+    }
+}
+
+
+void UStartThreadPool(UThreadPool& pool, int workerCount, const char* name)
+{
+    pool.stopping = false;
+    pool.name = name;
+    for (int i = 0; i < workerCount; ++i)
+        pool.workers.emplace_back(UThreadPoolWorker, std::ref(pool), i);
+}
+
+
+void USubmitJob(UThreadPool& pool, std::function<void(int)> job)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.jobs.push_back(std::move(job));
+    }
+    pool.wake.notify_one();
+}
+
+
+// Blocks until every submitted job has finished
+void UWaitThreadPool(UThreadPool& pool)
+{
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    pool.idle.wait(lock, [&pool]() { return pool.jobs.empty() && pool.running == 0; });
+}
+
+
+// Finishes the queued jobs and joins the workers
+void UStopThreadPool(UThreadPool& pool)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.stopping = true;
+    }
+    pool.wake.notify_all();
+    for (std::thread& worker : pool.workers)
+        worker.join();
+    pool.workers.clear();
+}
+
+
+// Procedural desk surface used to build the demo page file: blue wood grain with a fine grid and a coarser
+// plank pattern, so every mip level has detail worth streaming. Each texel averages 2 x 2 samples of its
+// footprint in mip 0 space.
+void UVirtualTextureTexel(int x, int y, int mip, unsigned char* rgba)
+{
+    const float scale = static_cast<float>(1 << mip);
+    glm::vec3 color(0.0f);
+    for (int sample = 0; sample < 4; ++sample)
+    {
+        const float u = (x + 0.25f + 0.5f * (sample & 1)) * scale;
+        const float v = (y + 0.25f + 0.5f * (sample >> 1)) * scale;
+        const float plank = std::floor(v / 256.0f);
+        const float grain = 0.5f + 0.5f * std::sin(u * 0.02f + 6.0f * std::sin(v * 0.013f + plank * 1.7f) + plank * 3.1f);
+        glm::vec3 sampleColor = glm::mix(glm::vec3(0.22f, 0.3f, 0.62f), glm::vec3(0.35f, 0.45f, 0.8f), grain);
+
+        const float gridU = std::fmod(u, 32.0f);
+        const float gridV = std::fmod(v, 32.0f);
+        if (gridU < 1.0f || gridV < 1.0f)
+            sampleColor *= 0.7f;
+        if (std::fmod(v, 256.0f) < 3.0f)
+            sampleColor *= 0.4f;
+        color += sampleColor * 0.25f;
+    }
+
+    rgba[0] = UPackUnorm8(color.r);
+    rgba[1] = UPackUnorm8(color.g);
+    rgba[2] = UPackUnorm8(color.b);
+    rgba[3] = 255;
+}
+
+
+// Writes a page file of the procedural desk, size x size texels at mip 0. Pages of one row are generated in
+// parallel and written in order, so memory stays at one row of pages.
+bool UBuildVirtualTexture(const char* filename, int size)
+{
+    FILE* file = fopen(filename, "wb");
+    if (!file)
+    {
+        ULOG_ERROR("Failed to create virtual texture %s", filename);
+        return false;
+    }
+
+    UVirtualTextureHeader header = { { 'U', 'V', 'T', '1' }, uint32_t(size), uint32_t(size), uint32_t(VIRTUAL_PAGE_CONTENT),
+        uint32_t(VIRTUAL_PAGE_BORDER), 0, 0 };
+    for (int pages = size / VIRTUAL_PAGE_CONTENT; ; pages /= 2)
+    {
+        ++header.mipCount;
+        header.pageCount += uint32_t(pages * pages);
+        if (pages == 1)
+            break;
+    }
+    fwrite(&header, sizeof(header), 1, file);
+
+    UThreadPool pool;
+    UStartThreadPool(pool, std::max(1, static_cast<int>(std::thread::hardware_concurrency())), "virtual texture build");
+    const auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t mip = 0; mip < header.mipCount; ++mip)
+    {
+        const int mipSize = size >> mip;
+        const int pages = mipSize / VIRTUAL_PAGE_CONTENT;
+        std::vector<unsigned char> row(VIRTUAL_PAGE_BYTES * pages);
+
+        for (int pageY = 0; pageY < pages; ++pageY)
+        {
+            for (int pageX = 0; pageX < pages; ++pageX)
+                USubmitJob(pool, [&row, pageX, pageY, mip, mipSize](int) {
+                    unsigned char* page = row.data() + VIRTUAL_PAGE_BYTES * pageX;
+                    for (int y = 0; y < VIRTUAL_PAGE_SIZE; ++y)
+                        for (int x = 0; x < VIRTUAL_PAGE_SIZE; ++x)
+                        {
+                            // The border wraps around the texture, matching GL_REPEAT on the whole surface
+                            const int u = (pageX * VIRTUAL_PAGE_CONTENT + x - VIRTUAL_PAGE_BORDER + mipSize) % mipSize;
+                            const int v = (pageY * VIRTUAL_PAGE_CONTENT + y - VIRTUAL_PAGE_BORDER + mipSize) % mipSize;
+                            UVirtualTextureTexel(u, v, static_cast<int>(mip), page + (size_t(y) * VIRTUAL_PAGE_SIZE + x) * 4);
+                        }
+                });
+            UWaitThreadPool(pool);
+            fwrite(row.data(), 1, row.size(), file);
+        }
+    }
+
+    UStopThreadPool(pool);
+    const bool ok = ferror(file) == 0;
+    fclose(file);
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ULOG_INFO("Virtual texture %s: %dx%d, %u mips, %u pages (%.1f MB) in %.1f s", filename, size, size, header.mipCount,
+        header.pageCount, header.pageCount * (VIRTUAL_PAGE_BYTES / 1048576.0), seconds);
+    return ok;
+}
+
+
+// Reads one page with the worker's own file handle
+void ULoadVirtualPage(UVirtualTexture& texture, int stagingIndex, int worker)
+{
+    UPROFILE_FUNCTION();
+
+    UVirtualPageLoad& load = texture.staging[stagingIndex];
+    FILE* file = texture.workerFiles[worker];
+    const int64_t offset = int64_t(sizeof(UVirtualTextureHeader)) + int64_t(VIRTUAL_PAGE_BYTES) * load.page;
+    load.ok = file && USeek64(file, offset, SEEK_SET) == 0 && fread(load.pixels.data(), 1, VIRTUAL_PAGE_BYTES, file) == VIRTUAL_PAGE_BYTES;
+
+    // The queue holds every staging index at most once, so it cannot be full
+    texture.completed.TryPush(stagingIndex);
+}
+
+
+// Mip, column and row of a page index
+void UVirtualPageCoordinates(const UVirtualTexture& texture, int page, int& mip, int& x, int& y)
+{
+    mip = 0;
+    while (mip + 1 < static_cast<int>(texture.mipOffset.size()) && page >= texture.mipOffset[mip + 1])
+        ++mip;
+    const int pagesX = std::max(texture.pagesX >> mip, 1);
+    x = (page - texture.mipOffset[mip]) % pagesX;
+    y = (page - texture.mipOffset[mip]) / pagesX;
+}
+
+
+// Writes one indirection texel: resident pages point at their cache slot
+void USetVirtualIndirection(UVirtualTexture& texture, int page, int slot)
+{
+    int mip, x, y;
+    UVirtualPageCoordinates(texture, page, mip, x, y);
+    const GLubyte entry[4] = { GLubyte(slot >= 0 ? slot % VIRTUAL_CACHE_PAGES : 0), GLubyte(slot >= 0 ? slot / VIRTUAL_CACHE_PAGES : 0),
+        0, GLubyte(slot >= 0 ? 1 : 0) };
+    glBindTexture(GL_TEXTURE_2D, texture.indirection);
+    glTexSubImage2D(GL_TEXTURE_2D, mip, x, y, 1, 1, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, entry);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+
+// Puts a loaded page into a cache slot (or commits it in the sparse texture) and publishes it
+void UMakeVirtualPageResident(UVirtualTexture& texture, int page, int slot, const unsigned char* pixels)
+{
+    const int evicted = texture.slotPage[slot];
+    if (evicted >= 0)
+    {
+        texture.pageSlot[evicted] = -1;
+        USetVirtualIndirection(texture, evicted, -1);
+        ++texture.evictions;
+    }
+
+    int mip, x, y;
+    UVirtualPageCoordinates(texture, page, mip, x, y);
+    glBindTexture(GL_TEXTURE_2D, texture.cache);
+    if (texture.sparse)
+    {
+        // Sparse pages carry no border; decommitting the evicted page keeps the committed memory fixed
+        if (evicted >= 0)
+        {
+            int evictedMip, evictedX, evictedY;
+            UVirtualPageCoordinates(texture, evicted, evictedMip, evictedX, evictedY);
+            glTexPageCommitmentARB(GL_TEXTURE_2D, evictedMip, evictedX * VIRTUAL_PAGE_CONTENT, evictedY * VIRTUAL_PAGE_CONTENT, 0,
+                VIRTUAL_PAGE_CONTENT, VIRTUAL_PAGE_CONTENT, 1, GL_FALSE);
+        }
+        glTexPageCommitmentARB(GL_TEXTURE_2D, mip, x * VIRTUAL_PAGE_CONTENT, y * VIRTUAL_PAGE_CONTENT, 0,
+            VIRTUAL_PAGE_CONTENT, VIRTUAL_PAGE_CONTENT, 1, GL_TRUE);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, VIRTUAL_PAGE_SIZE);
+        glPixelStorei(GL_UNPACK_SKIP_PIXELS, VIRTUAL_PAGE_BORDER);
+        glPixelStorei(GL_UNPACK_SKIP_ROWS, VIRTUAL_PAGE_BORDER);
+        glTexSubImage2D(GL_TEXTURE_2D, mip, x * VIRTUAL_PAGE_CONTENT, y * VIRTUAL_PAGE_CONTENT, VIRTUAL_PAGE_CONTENT, VIRTUAL_PAGE_CONTENT,
+            GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+        glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+    }
+    else
+    {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, (slot % VIRTUAL_CACHE_PAGES) * VIRTUAL_PAGE_SIZE, (slot / VIRTUAL_CACHE_PAGES) * VIRTUAL_PAGE_SIZE,
+            VIRTUAL_PAGE_SIZE, VIRTUAL_PAGE_SIZE, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    texture.slotPage[slot] = page;
+    texture.slotLastUsed[slot] = gFrameIndex;
+    texture.pageSlot[page] = slot;
+    USetVirtualIndirection(texture, page, slot);
+}
+
+
+// Opens a page file and creates the fixed-size GPU side: indirection, physical cache (or sparse texture) and
+// feedback buffers. The last mip's page is loaded right away and pinned.
+bool UCreateVirtualTexture(UVirtualTexture& texture, const char* filename)
+{
+    FILE* file = fopen(filename, "rb");
+    UVirtualTextureHeader& header = texture.header;
+    if (!file || fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, "UVT1", 4) != 0 ||
+        header.pageContent != uint32_t(VIRTUAL_PAGE_CONTENT) || header.pageBorder != uint32_t(VIRTUAL_PAGE_BORDER))
+    {
+        ULOG_ERROR("%s is not a virtual texture page file (build one with --build-virtual-texture)", filename);
+        if (file)
+            fclose(file);
+        header = UVirtualTextureHeader();
+        return false;
+    }
+
+    // The rest of the header sizes the GPU side and indexes the file, so it is checked against itself and the file
+    // before anything is allocated: whole pages, a mip chain no longer than the page grid, and every page present
+    const int64_t fileSize = USeek64(file, 0, SEEK_END) == 0 ? UTell64(file) : -1;
+    fclose(file);
+    const uint32_t pagesX = header.width / VIRTUAL_PAGE_CONTENT;
+    const uint32_t pagesY = header.height / VIRTUAL_PAGE_CONTENT;
+    uint32_t maxMips = 0;
+    while ((std::max(pagesX, pagesY) >> maxMips) > 0)
+        ++maxMips;
+    uint64_t pageCount = 0;
+    for (uint32_t mip = 0; mip < std::min(header.mipCount, maxMips); ++mip)
+        pageCount += uint64_t(std::max(pagesX >> mip, 1u)) * std::max(pagesY >> mip, 1u);
+    if (pagesX == 0 || pagesY == 0 || header.width % VIRTUAL_PAGE_CONTENT != 0 || header.height % VIRTUAL_PAGE_CONTENT != 0 ||
+        header.mipCount < 1 || header.mipCount > maxMips || header.pageCount != pageCount ||
+        fileSize < 0 || uint64_t(fileSize) < sizeof(header) + pageCount * VIRTUAL_PAGE_BYTES)
+    {
+        ULOG_ERROR("Virtual texture %s is corrupt or truncated", filename);
+        header = UVirtualTextureHeader();
+        return false;
+    }
+
+    texture.pagesX = static_cast<int>(pagesX);
+    texture.pagesY = static_cast<int>(pagesY);
+    int offset = 0;
+    for (uint32_t mip = 0; mip < header.mipCount; ++mip)
+    {
+        texture.mipOffset.push_back(offset);
+        offset += std::max(texture.pagesX >> mip, 1) * std::max(texture.pagesY >> mip, 1);
+    }
+    texture.pageSlot.assign(pageCount, -1);
+    texture.pageLoading.assign(pageCount, 0);
+    texture.slotPage.assign(VIRTUAL_CACHE_PAGES * VIRTUAL_CACHE_PAGES, -1);
+    texture.slotLastUsed.assign(texture.slotPage.size(), 0);
+    texture.feedbackData.resize(pageCount);
+
+    // Indirection: a mip chain of one texel per page
+    glGenTextures(1, &texture.indirection);
+    glBindTexture(GL_TEXTURE_2D, texture.indirection);
+    glTexStorage2D(GL_TEXTURE_2D, header.mipCount, GL_RGBA8UI, texture.pagesX, texture.pagesY);
+    for (uint32_t mip = 0; mip < header.mipCount; ++mip)
+    {
+        const std::vector<GLubyte> empty(size_t(std::max(texture.pagesX >> mip, 1)) * std::max(texture.pagesY >> mip, 1) * 4, 0);
+        glTexSubImage2D(GL_TEXTURE_2D, mip, 0, 0, std::max(texture.pagesX >> mip, 1), std::max(texture.pagesY >> mip, 1),
+            GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, empty.data());
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    UGPU_TRACK(UGPU_TEXTURE, texture.indirection, UGpuTextureBytes(GL_RGBA8UI, texture.pagesX, texture.pagesY, 1, header.mipCount), "virtual texture");
+
+    // Sparse textures need pages of exactly the file's content size
+    texture.sparse = false;
+    if (GLEW_ARB_sparse_texture)
+    {
+        GLint pageSizes = 0;
+        glGetInternalformativ(GL_TEXTURE_2D, GL_RGBA8, GL_NUM_VIRTUAL_PAGE_SIZES_ARB, 1, &pageSizes);
+        std::vector<GLint> sizesX(std::max(pageSizes, 1)), sizesY(std::max(pageSizes, 1));
+        glGetInternalformativ(GL_TEXTURE_2D, GL_RGBA8, GL_VIRTUAL_PAGE_SIZE_X_ARB, pageSizes, sizesX.data());
+        glGetInternalformativ(GL_TEXTURE_2D, GL_RGBA8, GL_VIRTUAL_PAGE_SIZE_Y_ARB, pageSizes, sizesY.data());
+        for (GLint i = 0; i < pageSizes && !texture.sparse; ++i)
+        {
+            if (sizesX[i] != VIRTUAL_PAGE_CONTENT || sizesY[i] != VIRTUAL_PAGE_CONTENT)
+                continue;
+
+            glGenTextures(1, &texture.cache);
+            glBindTexture(GL_TEXTURE_2D, texture.cache);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SPARSE_ARB, GL_TRUE);
+            glTexParameteri(GL_TEXTURE_2D, GL_VIRTUAL_PAGE_SIZE_INDEX_ARB, i);
+            glTexStorage2D(GL_TEXTURE_2D, header.mipCount, GL_RGBA8, header.width, header.height);
+            texture.sparse = true;
+        }
+    }
+    if (!texture.sparse)
+    {
+        glGenTextures(1, &texture.cache);
+        glBindTexture(GL_TEXTURE_2D, texture.cache);
+        glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, VIRTUAL_CACHE_PAGES * VIRTUAL_PAGE_SIZE, VIRTUAL_CACHE_PAGES * VIRTUAL_PAGE_SIZE);
+    }
+    // A sparse texture only occupies its committed pages, which never exceed the cache size
+    UGPU_TRACK(UGPU_TEXTURE, texture.cache, texture.slotPage.size() *
+        (texture.sparse ? size_t(VIRTUAL_PAGE_CONTENT) * VIRTUAL_PAGE_CONTENT * 4 : VIRTUAL_PAGE_BYTES), "virtual texture");
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, texture.sparse ? GL_LINEAR_MIPMAP_NEAREST : GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, texture.sparse ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, texture.sparse ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // The textures stay on their units for the whole run
+    glActiveTexture(GL_TEXTURE0 + VIRTUAL_INDIRECTION_UNIT);
+    glBindTexture(GL_TEXTURE_2D, texture.indirection);
+    glActiveTexture(GL_TEXTURE0 + (texture.sparse ? VIRTUAL_SPARSE_UNIT : VIRTUAL_CACHE_UNIT));
+    glBindTexture(GL_TEXTURE_2D, texture.cache);
+    glActiveTexture(GL_TEXTURE0);
+
+    // Feedback stamps start at 0, which no frame writes
+    glGenBuffers(1, &texture.feedback);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, texture.feedback);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, pageCount * sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+    const GLuint zero = 0;
+    glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    glGenBuffers(1, &texture.readback);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, texture.readback);
+    glBufferData(GL_COPY_WRITE_BUFFER, pageCount * sizeof(GLuint), nullptr, GL_STREAM_READ);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    UGPU_TRACK(UGPU_BUFFER, texture.feedback, pageCount * sizeof(GLuint), "virtual texture");
+    UGPU_TRACK(UGPU_BUFFER, texture.readback, pageCount * sizeof(GLuint), "virtual texture");
+
+    // Workers, each with its own handle on the page file, and their staging buffers
+    const int workerCount = std::max(1, std::min(4, static_cast<int>(std::thread::hardware_concurrency()) - 1));
+    for (int i = 0; i < workerCount; ++i)
+        texture.workerFiles.push_back(fopen(filename, "rb"));
+    texture.staging.resize(VIRTUAL_LOADS_IN_FLIGHT);
+    for (int i = 0; i < VIRTUAL_LOADS_IN_FLIGHT; ++i)
+    {
+        texture.staging[i].pixels.resize(VIRTUAL_PAGE_BYTES);
+        texture.freeStaging.push_back(i);
+    }
+
+    // The last mip is read synchronously and pinned in slot 0
+    texture.pinnedPage = pageCount - 1;
+    texture.staging[0].page = texture.pinnedPage;
+    ULoadVirtualPage(texture, 0, 0);
+    int loaded = -1;
+    texture.completed.TryPop(loaded);
+    if (!texture.staging[0].ok)
+    {
+        ULOG_ERROR("Failed to read the pages of %s", filename);
+        return false;
+    }
+    UMakeVirtualPageResident(texture, texture.pinnedPage, 0, texture.staging[0].pixels.data());
+
+    UStartThreadPool(texture.pool, workerCount, "virtual texture io");
+
+    const double virtualMb = pageCount * (VIRTUAL_PAGE_BYTES / 1048576.0);
+    const double residentMb = texture.slotPage.size() * (texture.sparse ? VIRTUAL_PAGE_CONTENT * VIRTUAL_PAGE_CONTENT * 4 : VIRTUAL_PAGE_BYTES) / 1048576.0;
+    ULOG_INFO("Virtual texture %s: %ux%u, %u mips, %d pages (%.1f MB); %zu resident pages (%.1f MB, %s), %d loader threads",
+        filename, header.width, header.height, header.mipCount, pageCount, virtualMb, texture.slotPage.size(), residentMb,
+        texture.sparse ? "sparse" : "page cache", workerCount);
+    return true;
+}
+
+
+// Per frame: upload pages the workers finished, read back feedback if it arrived, and request what is missing.
+// Coarse mips are requested first so the fallback chain fills in quickly.
+void UUpdateVirtualTexture(UVirtualTexture& texture)
+{
+    if (texture.header.pageCount == 0)
+        return;
+
+    // Finished loads go into the least recently used slot that was not needed this frame
+    int stagingIndex = -1;
+    for (int uploads = 0; uploads < VIRTUAL_UPLOADS_PER_FRAME && texture.completed.TryPop(stagingIndex); ++uploads)
+    {
+        UVirtualPageLoad& load = texture.staging[stagingIndex];
+        texture.pageLoading[load.page] = 0;
+
+        int victim = -1;
+        for (size_t slot = 0; slot < texture.slotPage.size(); ++slot)
+        {
+            if (texture.slotPage[slot] == texture.pinnedPage)
+                continue;
+            if (victim < 0 || texture.slotLastUsed[slot] < texture.slotLastUsed[victim])
+                victim = static_cast<int>(slot);
+        }
+
+        if (load.ok && victim >= 0 && (texture.slotPage[victim] < 0 || texture.slotLastUsed[victim] + 1 < gFrameIndex))
+        {
+            UMakeVirtualPageResident(texture, load.page, victim, load.pixels.data());
+            ++texture.loads;
+        }
+        else if (!load.ok)
+            ULOG_WARNING("Failed to read virtual texture page %d", load.page);
+
+        texture.freeStaging.push_back(stagingIndex);
+    }
+
+    // Feedback from a previous frame: touch resident pages, request the missing ones
+    if (!texture.readbackFence)
+        return;
+    const GLenum status = glClientWaitSync(texture.readbackFence, 0, 0);
+    if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+        return;
+    glDeleteSync(texture.readbackFence);
+    texture.readbackFence = 0;
+
+    glBindBuffer(GL_COPY_READ_BUFFER, texture.readback);
+    glGetBufferSubData(GL_COPY_READ_BUFFER, 0, texture.feedbackData.size() * sizeof(GLuint), texture.feedbackData.data());
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+    UFrameVector<int> requests{ UFrameAllocator<int>(gFrameArena) };
+    requests.reserve(texture.feedbackData.size());
+    for (size_t page = 0; page < texture.feedbackData.size(); ++page)
+    {
+        if (texture.feedbackData[page] != texture.readbackStamp)
+            continue;
+        if (texture.pageSlot[page] >= 0)
+            texture.slotLastUsed[texture.pageSlot[page]] = gFrameIndex;
+        else if (!texture.pageLoading[page])
+            requests.push_back(static_cast<int>(page));
+    }
+
+    // Higher page indices are coarser mips
+    std::sort(requests.begin(), requests.end(), [](int a, int b) { return a > b; });
+    for (int page : requests)
+    {
+        if (texture.freeStaging.empty())
+            break;
+
+        const int index = texture.freeStaging.back();
+        texture.freeStaging.pop_back();
+        texture.staging[index].page = page;
+        texture.pageLoading[page] = 1;
+        UVirtualTexture* owner = &texture;
+        USubmitJob(texture.pool, [owner, index](int worker) { ULoadVirtualPage(*owner, index, worker); });
+    }
+
+    if (gFrameIndex % 300 == 0)
+        ULOG_DEBUG("Virtual texture: %llu pages loaded, %llu evicted, %zu requested", texture.loads, texture.evictions, requests.size());
+}
+
+
+// Copies this frame's feedback stamps into the readback buffer behind a fence; one readback is in flight at a time
+void UCaptureVirtualTextureFeedback(UVirtualTexture& texture)
+{
+    if (texture.header.pageCount == 0 || texture.readbackFence)
+        return;
+
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    glBindBuffer(GL_COPY_READ_BUFFER, texture.feedback);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, texture.readback);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, texture.feedbackData.size() * sizeof(GLuint));
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    texture.readbackStamp = static_cast<GLuint>(gFrameIndex + 1);
+    texture.readbackFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+
+// Frame stamp and page layout for a program that samples the virtual texture
+void USetVirtualTextureUniforms(const UVirtualTexture& texture, GLuint programId)
+{
+    glUseProgram(programId);
+    glUniform1ui(glGetUniformLocation(programId, "vtFrame"), static_cast<GLuint>(gFrameIndex + 1));
+    glUniform2i(glGetUniformLocation(programId, "vtPages"), texture.pagesX, texture.pagesY);
+    glUniform1i(glGetUniformLocation(programId, "vtMipCount"), static_cast<GLint>(texture.header.mipCount));
+    glUniform1i(glGetUniformLocation(programId, "vtSparse"), texture.sparse ? 1 : 0);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, VIRTUAL_FEEDBACK_BINDING, texture.feedback);
+}
+
+
+void UDestroyVirtualTexture(UVirtualTexture& texture)
+{
+    if (texture.header.pageCount == 0)
+        return;
+
+    UStopThreadPool(texture.pool);
+    for (FILE* file : texture.workerFiles)
+        if (file)
+            fclose(file);
+    texture.workerFiles.clear();
+
+    if (texture.readbackFence)
+        glDeleteSync(texture.readbackFence);
+    glDeleteTextures(1, &texture.indirection);
+    glDeleteTextures(1, &texture.cache);
+    glDeleteBuffers(1, &texture.feedback);
+    glDeleteBuffers(1, &texture.readback);
+    UReleaseGpuResource(UGPU_TEXTURE, texture.indirection);
+    UReleaseGpuResource(UGPU_TEXTURE, texture.cache);
+    UReleaseGpuResource(UGPU_BUFFER, texture.feedback);
+    UReleaseGpuResource(UGPU_BUFFER, texture.readback);
+    texture.header = UVirtualTextureHeader();
+}
+
+
+// Procedural site: a checkered ground tile per cell and a few boxes of hashed size; the middle is kept clear for the desk
+void UBuildWorldCell(const UWorldHeader& header, int cellX, int cellZ, std::vector<UPackedVertex>& verts, std::vector<GLushort>& indices)
+{
+    verts.clear();
+    indices.clear();
+
+    auto addQuad = [&](const glm::vec3& a, const glm::vec3& b, const glm::vec3& c, const glm::vec3& d, const glm::vec3& normal,
+        GLushort material, const glm::vec4& color) {
+        const GLushort first = static_cast<GLushort>(verts.size());
+        const glm::vec3 corners[4] = { a, b, c, d };
+        const glm::vec2 uvs[4] = { { 0.0f, 0.0f }, { 1.0f, 0.0f }, { 1.0f, 1.0f }, { 0.0f, 1.0f } };
+        for (int i = 0; i < 4; ++i)
+        {
+            UPackedVertex vertex;
+            vertex.position[0] = UPackHalf(corners[i].x);
+            vertex.position[1] = UPackHalf(corners[i].y);
+            vertex.position[2] = UPackHalf(corners[i].z);
+            vertex.material = material;
+            vertex.normal = UPackSnorm1010102(normal, 0.0f);
+            for (int channel = 0; channel < 4; ++channel)
+                vertex.color[channel] = UPackUnorm8(color[channel]);
+            vertex.uv[0] = UPackUnorm16(uvs[i].x);
+            vertex.uv[1] = UPackUnorm16(uvs[i].y);
+            verts.push_back(vertex);
+        }
+        const GLushort quad[6] = { first, GLushort(first + 1), GLushort(first + 2), first, GLushort(first + 2), GLushort(first + 3) };
+        indices.insert(indices.end(), quad, quad + 6);
+    };
+
+    // The ground goes first: UDrawWorld draws the first WORLD_GROUND_INDICES indices with the textured variant
+    const float size = header.cellSize;
+    addQuad({ 0.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, size }, { size, 0.0f, size }, { size, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f },
+        UMATERIAL_CHECKERBOARD, glm::vec4(1.0f));
+
+    const int centerX = static_cast<int>(header.cellsX) / 2;
+    const int centerZ = static_cast<int>(header.cellsZ) / 2;
+    if (std::abs(cellX - centerX) <= 1 && std::abs(cellZ - centerZ) <= 1)
+        return;
+
+    uint32_t hash = uint32_t(cellX) * 73856093u ^ uint32_t(cellZ) * 19349663u ^ 0x9e3779b9u;
+    auto next = [&hash]() {
+        hash ^= hash << 13;
+        hash ^= hash >> 17;
+        hash ^= hash << 5;
+        return (hash & 0xffffff) / float(0x1000000);
+    };
+
+    const int buildings = 1 + static_cast<int>(next() * 4.0f);
+    for (int b = 0; b < buildings; ++b)
+    {
+        const glm::vec2 footprint(0.8f + next() * 2.2f, 0.8f + next() * 2.2f);
+        const glm::vec3 lower(0.3f + next() * (size - footprint.x - 0.6f), 0.0f, 0.3f + next() * (size - footprint.y - 0.6f));
+        const glm::vec3 upper = lower + glm::vec3(footprint.x, 1.0f + next() * next() * 12.0f, footprint.y);
+        const glm::vec4 color(0.5f + next() * 0.5f, 0.5f + next() * 0.5f, 0.5f + next() * 0.5f, 1.0f);
+
+        addQuad({ lower.x, lower.y, upper.z }, { upper.x, lower.y, upper.z }, { upper.x, upper.y, upper.z }, { lower.x, upper.y, upper.z },
+            { 0.0f, 0.0f, 1.0f }, UMATERIAL_NONE, color);
+        addQuad({ upper.x, lower.y, lower.z }, { lower.x, lower.y, lower.z }, { lower.x, upper.y, lower.z }, { upper.x, upper.y, lower.z },
+            { 0.0f, 0.0f, -1.0f }, UMATERIAL_NONE, color);
+        addQuad({ lower.x, lower.y, lower.z }, { lower.x, lower.y, upper.z }, { lower.x, upper.y, upper.z }, { lower.x, upper.y, lower.z },
+            { -1.0f, 0.0f, 0.0f }, UMATERIAL_NONE, color);
+        addQuad({ upper.x, lower.y, upper.z }, { upper.x, lower.y, lower.z }, { upper.x, upper.y, lower.z }, { upper.x, upper.y, upper.z },
+            { 1.0f, 0.0f, 0.0f }, UMATERIAL_NONE, color);
+        addQuad({ lower.x, upper.y, upper.z }, { upper.x, upper.y, upper.z }, { upper.x, upper.y, lower.z }, { lower.x, upper.y, lower.z },
+            { 0.0f, 1.0f, 0.0f }, UMATERIAL_NONE, color);
+    }
+}
+
+
+// Writes a procedural site of cells x cells centred under the scene, building the cells on all cores
+bool UBuildWorld(const char* filename, int cells)
+{
+    FILE* file = fopen(filename, "wb");
+    if (!file)
+    {
+        ULOG_ERROR("Failed to create world %s", filename);
+        return false;
+    }
+
+    UWorldHeader header = { { 'U', 'W', 'S', '1' }, uint32_t(cells), uint32_t(cells), WORLD_CELL_SIZE,
+        { -0.5f * cells * WORLD_CELL_SIZE, -1.0f, -0.5f * cells * WORLD_CELL_SIZE } };
+    std::vector<UWorldCellRecord> records(size_t(cells) * cells);
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(records.data(), sizeof(UWorldCellRecord), records.size(), file);
+
+    UThreadPool pool;
+    const int workers = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    UStartThreadPool(pool, workers, "world build");
+    const auto start = std::chrono::steady_clock::now();
+
+    // One row of cells at a time, so memory stays bounded for large sites
+    std::vector<std::vector<UPackedVertex>> rowVerts(cells);
+    std::vector<std::vector<GLushort>> rowIndices(cells);
+    uint64_t offset = sizeof(header) + sizeof(UWorldCellRecord) * records.size();
+    for (int z = 0; z < cells; ++z)
+    {
+        for (int x = 0; x < cells; ++x)
+            USubmitJob(pool, [&header, &rowVerts, &rowIndices, x, z](int) { UBuildWorldCell(header, x, z, rowVerts[x], rowIndices[x]); });
+        UWaitThreadPool(pool);
+
+        for (int x = 0; x < cells; ++x)
+        {
+            UWorldCellRecord& record = records[size_t(z) * cells + x];
+            record.offset = offset;
+            record.vertexCount = static_cast<uint32_t>(rowVerts[x].size());
+            record.indexCount = static_cast<uint32_t>(rowIndices[x].size());
+            fwrite(rowVerts[x].data(), sizeof(UPackedVertex), rowVerts[x].size(), file);
+            fwrite(rowIndices[x].data(), sizeof(GLushort), rowIndices[x].size(), file);
+            offset += rowVerts[x].size() * sizeof(UPackedVertex) + rowIndices[x].size() * sizeof(GLushort);
+        }
+    }
+    UStopThreadPool(pool);
+
+    // The table goes in last, now that the offsets are known
+    fseek(file, sizeof(header), SEEK_SET);
+    fwrite(records.data(), sizeof(UWorldCellRecord), records.size(), file);
+    const bool ok = ferror(file) == 0;
+    fclose(file);
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ULOG_INFO("World %s: %dx%d cells of %.0f units (%.1f MB) in %.1f s", filename, cells, cells, WORLD_CELL_SIZE, offset / 1048576.0, seconds);
+    return ok;
+}
+
+
+// fseek and ftell take a long, which is 32 bits on Windows; site files can be larger than that
+int USeek64(FILE* file, int64_t offset, int origin)
+{
+#ifdef _MSC_VER
+    return _fseeki64(file, offset, origin);
+#else
+    return fseeko(file, static_cast<off_t>(offset), origin);
+#endif
+}
+
+
+int64_t UTell64(FILE* file)
+{
+#ifdef _MSC_VER
+    return _ftelli64(file);
+#else
+    return static_cast<int64_t>(ftello(file));
+#endif
+}
+
+
+// A cell's counts size the staging buffers, so they are only trusted when its data lies inside the file, past
+// the cell table
+bool UIsValidWorldRecord(const UWorld& world, const UWorldCellRecord& record)
+{
+    const uint64_t dataStart = sizeof(UWorldHeader) + sizeof(UWorldCellRecord) * uint64_t(world.records.size());
+    const uint64_t bytes = uint64_t(record.vertexCount) * sizeof(UPackedVertex) + uint64_t(record.indexCount) * sizeof(GLushort);
+    return record.vertexCount <= WORLD_MAX_CELL_VERTICES && record.indexCount <= WORLD_MAX_CELL_INDICES &&
+        record.offset >= dataStart && record.offset <= world.fileSize && bytes <= world.fileSize - record.offset;
+}
+
+
+// Reads one cell with the worker's own file handle
+void ULoadWorldCell(UWorld& world, int stagingIndex, int worker)
+{
+    UPROFILE_FUNCTION();
+
+    UWorldCellLoad& load = world.staging[stagingIndex];
+    const UWorldCellRecord& record = world.records[load.cell];
+    FILE* file = world.workerFiles[worker];
+
+    load.ok = file && UIsValidWorldRecord(world, record);
+    if (load.ok)
+    {
+        load.verts.resize(record.vertexCount);
+        load.indices.resize(record.indexCount);
+        load.ok = USeek64(file, static_cast<int64_t>(record.offset), SEEK_SET) == 0 &&
+            fread(load.verts.data(), sizeof(UPackedVertex), record.vertexCount, file) == record.vertexCount &&
+            fread(load.indices.data(), sizeof(GLushort), record.indexCount, file) == record.indexCount;
+    }
+
+    // The queue holds every staging index at most once, so it cannot be full
+    world.completed.TryPush(stagingIndex);
+}
+
+
+// Opens a world file: reads the header and cell table and starts the I/O threads; no cell is loaded yet
+bool UCreateWorld(UWorld& world, const char* filename)
+{
+    const auto start = std::chrono::steady_clock::now();
+    FILE* file = fopen(filename, "rb");
+    UWorldHeader& header = world.header;
+    if (!file || fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, "UWS1", 4) != 0 || header.cellSize <= 0.0f)
+    {
+        ULOG_ERROR("%s is not a world file (build one with --build-world)", filename);
+        if (file)
+            fclose(file);
+        header = UWorldHeader();
+        return false;
+    }
+
+    // The table size comes from the header, so it is checked against the file before anything is allocated
+    const int64_t fileSize = USeek64(file, 0, SEEK_END) == 0 ? UTell64(file) : -1;
+    const uint64_t cellCount = uint64_t(header.cellsX) * header.cellsZ;
+    bool ok = fileSize > 0 && cellCount <= (uint64_t(fileSize) - sizeof(header)) / sizeof(UWorldCellRecord) &&
+        USeek64(file, sizeof(header), SEEK_SET) == 0;
+    if (ok)
+    {
+        world.fileSize = uint64_t(fileSize);
+        world.records.resize(size_t(cellCount));
+        ok = fread(world.records.data(), sizeof(UWorldCellRecord), world.records.size(), file) == world.records.size();
+    }
+    fclose(file);
+    if (!ok)
+    {
+        ULOG_ERROR("World %s is truncated", filename);
+        world.records.clear();
+        header = UWorldHeader();
+        return false;
+    }
+    for (const UWorldCellRecord& record : world.records)
+        if (!UIsValidWorldRecord(world, record))
+        {
+            ULOG_ERROR("World %s has a corrupt cell table", filename);
+            world.records.clear();
+            header = UWorldHeader();
+            return false;
+        }
+    world.cells.resize(world.records.size());
+    world.resident.reserve(world.records.size());
+
+    // Storage for the loads in flight is sized once, for the largest cell
+    uint32_t maxVertices = 0, maxIndices = 0;
+    for (const UWorldCellRecord& record : world.records)
+    {
+        maxVertices = std::max(maxVertices, record.vertexCount);
+        maxIndices = std::max(maxIndices, record.indexCount);
+    }
+    world.staging.resize(WORLD_LOADS_IN_FLIGHT);
+    for (int i = 0; i < WORLD_LOADS_IN_FLIGHT; ++i)
+    {
+        world.staging[i].verts.reserve(maxVertices);
+        world.staging[i].indices.reserve(maxIndices);
+        world.freeStaging.push_back(i);
+    }
+
+    // I/O threads: enough to keep a few reads in flight, each with its own handle
+    const int workers = glm::clamp(static_cast<int>(std::thread::hardware_concurrency()) / 2, 1, 4);
+    for (int i = 0; i < workers; ++i)
+        world.workerFiles.push_back(fopen(filename, "rb"));
+    UStartThreadPool(world.pool, workers, "world io");
+
+    world.lastCameraPosition = gCamera.Position;
+    world.velocity = glm::vec3(0.0f);
+
+    if (UFindGpuBudget("world").limit == 0)
+        USetGpuBudget("world", WORLD_DEFAULT_BUDGET);
+    USetGpuEvictionCallback("world", [](size_t overBytes) { return UEvictWorldCells(gWorld, overBytes); });
+
+    ULOG_INFO("World %s: %ux%u cells of %.0f units, opened in %.1f ms, %d I/O threads", filename, header.cellsX, header.cellsZ,
+        header.cellSize, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(), workers);
+    return true;
+}
+
+
+// Distance in cells (Chebyshev) from a cell to a world position
+int UWorldCellDistance(const UWorld& world, int cell, const glm::vec3& position)
+{
+    const int x = static_cast<int>(std::floor((position.x - world.header.origin[0]) / world.header.cellSize));
+    const int z = static_cast<int>(std::floor((position.z - world.header.origin[2]) / world.header.cellSize));
+    const int cellX = cell % static_cast<int>(world.header.cellsX);
+    const int cellZ = cell / static_cast<int>(world.header.cellsX);
+    return std::max(std::abs(cellX - x), std::abs(cellZ - z));
+}
+
+
+void UReleaseWorldCell(UWorld& world, int cell)
+{
+    UWorldCell& data = world.cells[cell];
+    glDeleteVertexArrays(1, &data.vao);
+    glDeleteBuffers(2, data.buffers);
+    UReleaseGpuResource(UGPU_BUFFER, data.buffers[0]);
+    UReleaseGpuResource(UGPU_BUFFER, data.buffers[1]);
+    data = UWorldCell();
+}
+
+
+// Uploads the cells the I/O threads finished, then requests the missing cells around the camera and around
+// where its velocity takes it, nearest first
+void UUpdateWorld(UWorld& world)
+{
+    if (world.cells.empty())
+        return;
+    const auto start = std::chrono::steady_clock::now();
+
+    // Smoothed velocity, so a single jerky frame does not send the prefetch across the site
+    const glm::vec3 cameraPosition = gCamera.Position;
+    if (gDeltaTime > 0.0f)
+        world.velocity = glm::mix(world.velocity, (cameraPosition - world.lastCameraPosition) / gDeltaTime, 0.2f);
+    world.lastCameraPosition = cameraPosition;
+    const glm::vec3 predicted = cameraPosition + world.velocity * static_cast<float>(WORLD_PREFETCH_SECONDS);
+
+    int stagingIndex = -1;
+    for (int uploads = 0; uploads < WORLD_UPLOADS_PER_FRAME && world.completed.TryPop(stagingIndex); ++uploads)
+    {
+        const UWorldCellLoad& load = world.staging[stagingIndex];
+        UWorldCell& cell = world.cells[load.cell];
+        cell.state = UCELL_UNLOADED;
+
+        // Cells the camera left behind while they were loading are dropped
+        const bool wanted = UWorldCellDistance(world, load.cell, cameraPosition) <= WORLD_LOAD_RADIUS ||
+            UWorldCellDistance(world, load.cell, predicted) <= WORLD_LOAD_RADIUS;
+        if (!load.ok)
+            ULOG_WARNING("Failed to read world cell %d", load.cell);
+        else if (wanted)
+        {
+            glGenVertexArrays(1, &cell.vao);
+            glBindVertexArray(cell.vao);
+            glGenBuffers(2, cell.buffers);
+            glBindBuffer(GL_ARRAY_BUFFER, cell.buffers[0]);
+            glBufferData(GL_ARRAY_BUFFER, load.verts.size() * sizeof(UPackedVertex), load.verts.data(), GL_STATIC_DRAW);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cell.buffers[1]);
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, load.indices.size() * sizeof(GLushort), load.indices.data(), GL_STATIC_DRAW);
+            UPackedVertexLayout::Enable();
+            glBindVertexArray(0);
+            cell.indexCount = static_cast<GLsizei>(load.indices.size());
+            cell.state = UCELL_RESIDENT;
+            world.resident.push_back(load.cell);
+            ++world.loads;
+
+            UGPU_TRACK(UGPU_BUFFER, cell.buffers[0], load.verts.size() * sizeof(UPackedVertex), "world");
+            UGPU_TRACK(UGPU_BUFFER, cell.buffers[1], load.indices.size() * sizeof(GLushort), "world");
+        }
+        world.freeStaging.push_back(stagingIndex);
+    }
+
+    // Missing cells in the square around the camera and the one around the predicted position
+    UFrameVector<std::pair<int, int>> requests{ UFrameAllocator<std::pair<int, int>>(gFrameArena) };
+    requests.reserve(2 * (2 * WORLD_LOAD_RADIUS + 1) * (2 * WORLD_LOAD_RADIUS + 1));
+    const glm::vec3 centers[2] = { cameraPosition, predicted };
+    for (int c = 0; c < 2; ++c)
+    {
+        const int centerX = static_cast<int>(std::floor((centers[c].x - world.header.origin[0]) / world.header.cellSize));
+        const int centerZ = static_cast<int>(std::floor((centers[c].z - world.header.origin[2]) / world.header.cellSize));
+        for (int z = centerZ - WORLD_LOAD_RADIUS; z <= centerZ + WORLD_LOAD_RADIUS; ++z)
+            for (int x = centerX - WORLD_LOAD_RADIUS; x <= centerX + WORLD_LOAD_RADIUS; ++x)
+            {
+                if (x < 0 || z < 0 || x >= static_cast<int>(world.header.cellsX) || z >= static_cast<int>(world.header.cellsZ))
+                    continue;
+                const int cell = z * static_cast<int>(world.header.cellsX) + x;
+                if (world.cells[cell].state == UCELL_UNLOADED)
+                    requests.emplace_back(UWorldCellDistance(world, cell, cameraPosition), cell);
+            }
+    }
+    std::sort(requests.begin(), requests.end());
+    requests.erase(std::unique(requests.begin(), requests.end()), requests.end());
+
+    for (const std::pair<int, int>& request : requests)
+    {
+        if (world.freeStaging.empty())
+            break;
+
+        const int index = world.freeStaging.back();
+        world.freeStaging.pop_back();
+        world.staging[index].cell = request.second;
+        world.cells[request.second].state = UCELL_LOADING;
+        UWorld* owner = &world;
+        USubmitJob(world.pool, [owner, index](int worker) { ULoadWorldCell(*owner, index, worker); });
+    }
+
+    world.worstUpdateMs = std::max(world.worstUpdateMs, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    if (gFrameIndex % 300 == 0)
+        ULOG_DEBUG("World: %zu cells resident (%.1f MB), %llu loaded, %llu evicted", world.resident.size(),
+            UGpuTagBytes("world") / 1048576.0, world.loads, world.evictions);
+}
+
+
+// Draws the resident cells in two passes: the textured ground quads with one program, then the untextured
+// buildings with the other. The caller has set the per-frame uniforms of both, multiview ones included.
+void UDrawWorld(const UWorld& world, GLuint groundProgramId, GLuint programId)
+{
+    if (world.resident.empty())
+        return;
+
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        const bool ground = pass == 0;
+        const GLuint passProgramId = ground ? groundProgramId : programId;
+        glUseProgram(passProgramId);
+        const GLint modelLoc = glGetUniformLocation(passProgramId, "model");
+        for (int index : world.resident)
+        {
+            const UWorldCell& cell = world.cells[index];
+            const GLsizei first = ground ? 0 : WORLD_GROUND_INDICES;
+            const GLsizei count = ground ? WORLD_GROUND_INDICES : GLsizei(cell.indexCount) - WORLD_GROUND_INDICES;
+            if (count <= 0)
+                continue;
+
+            const glm::vec3 corner(world.header.origin[0] + (index % world.header.cellsX) * world.header.cellSize, world.header.origin[1],
+                world.header.origin[2] + (index / world.header.cellsX) * world.header.cellSize);
+            const glm::mat4 model = glm::translate(corner);
+            glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+            glBindVertexArray(cell.vao);
+            glDrawElementsInstanced(GL_TRIANGLES, count, GL_UNSIGNED_SHORT, (void*)(first * sizeof(GLushort)), gMultiview.instances);
+            UCountDraw(count / 3 * gMultiview.views);
+        }
+    }
+}
+
+
+// "world" budget callback: drops the cells farthest from the camera, never the ones UUpdateWorld would request
+// again: those around the camera and around its predicted position
+size_t UEvictWorldCells(UWorld& world, size_t bytes)
+{
+    const glm::vec3 cameraPosition = gCamera.Position;
+    const glm::vec3 predicted = cameraPosition + world.velocity * static_cast<float>(WORLD_PREFETCH_SECONDS);
+    auto distance = [&world, &cameraPosition, &predicted](int cell) {
+        return std::min(UWorldCellDistance(world, cell, cameraPosition), UWorldCellDistance(world, cell, predicted));
+    };
+    std::sort(world.resident.begin(), world.resident.end(), [&distance](int a, int b) { return distance(a) < distance(b); });
+
+    const size_t before = UGpuTagBytes("world");
+    size_t freed = 0;
+    while (freed < bytes && !world.resident.empty() && distance(world.resident.back()) > WORLD_LOAD_RADIUS)
+    {
+        UReleaseWorldCell(world, world.resident.back());
+        world.resident.pop_back();
+        ++world.evictions;
+        freed = before - UGpuTagBytes("world");
+    }
+    return freed;
+}
+
+
+void UDestroyWorld(UWorld& world)
+{
+    if (world.cells.empty())
+        return;
+
+    UStopThreadPool(world.pool);
+    for (FILE* file : world.workerFiles)
+        if (file)
+            fclose(file);
+    world.workerFiles.clear();
+
+    for (int cell : world.resident)
+        UReleaseWorldCell(world, cell);
+    ULOG_INFO("World: %llu cells loaded, %llu evicted, worst streaming update %.2f ms", world.loads, world.evictions, world.worstUpdateMs);
+    world.resident.clear();
+    world.cells.clear();
+}
+
+
+// Bounds of a set of build primitives (or their centroids) along the way to a SAH split
+struct UBvhBounds
+{
+    glm::vec3 lower = glm::vec3(1e30f);
+    glm::vec3 upper = glm::vec3(-1e30f);
+
+    void Grow(const glm::vec3& point) { lower = glm::min(lower, point); upper = glm::max(upper, point); }
+    void Grow(const UBvhBounds& other) { lower = glm::min(lower, other.lower); upper = glm::max(upper, other.upper); }
+    float HalfArea() const
+    {
+        const glm::vec3 extent = glm::max(upper - lower, glm::vec3(0.0f));
+        return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+    }
+};
+
+struct UBvhPrimitive
+{
+    UBvhBounds bounds;
+    glm::vec3 centroid;
+};
+
+// A node whose subtree is built later (on a worker), over triangles [begin, end) of the build order
+struct UBvhSubtree
+{
+    uint32_t node;
+    uint32_t begin;
+    uint32_t end;
+    int depth;
+    std::vector<UBvhNode> nodes;
+};
+
+
+// Builds the subtree of nodes[nodeIndex] over order[begin, end) with binned SAH. Leaves keep a triangle range
+// (first, count) until UBuildBvh packs them. Nodes smaller than deferBelow are handed back instead of built.
+// Nodes at depth BVH_STACK_SIZE become leaves whatever their size, since traversal stacks one node per level.
+void UBuildBvhNode(std::vector<UBvhNode>& nodes, uint32_t nodeIndex, std::vector<uint32_t>& order, uint32_t begin, uint32_t end,
+    const std::vector<UBvhPrimitive>& primitives, int depth, uint32_t deferBelow, std::vector<UBvhSubtree>* deferred)
+{
+    UBvhBounds bounds, centroids;
+    for (uint32_t i = begin; i < end; ++i)
+    {
+        bounds.Grow(primitives[order[i]].bounds);
+        centroids.Grow(primitives[order[i]].centroid);
+    }
+    UBvhNode& node = nodes[nodeIndex];
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        node.lower[axis] = bounds.lower[axis];
+        node.upper[axis] = bounds.upper[axis];
+    }
+    node.first = begin;
+    node.count = end - begin;
+
+    const uint32_t count = end - begin;
+    if (count <= 4 || depth >= BVH_STACK_SIZE)
+        return;
+    if (deferred && count < deferBelow)
+    {
+        deferred->push_back({ nodeIndex, begin, end, depth, {} });
+        return;
+    }
+
+    // Cost in pack tests: a leaf tests every pack, a split pays one more box test plus each side's packs by area
+    int bestAxis = -1, bestBin = 0;
+    float bestCost = static_cast<float>((count + 3) / 4);
+    const glm::vec3 extent = centroids.upper - centroids.lower;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        if (extent[axis] <= 0.0f)
+            continue;
+
+        UBvhBounds binBounds[BVH_BINS];
+        uint32_t binCount[BVH_BINS] = {};
+        const float scale = BVH_BINS / extent[axis];
+        for (uint32_t i = begin; i < end; ++i)
+        {
+            const UBvhPrimitive& primitive = primitives[order[i]];
+            const int bin = std::min(BVH_BINS - 1, static_cast<int>((primitive.centroid[axis] - centroids.lower[axis]) * scale));
+            binBounds[bin].Grow(primitive.bounds);
+            ++binCount[bin];
+        }
+
+        // Sweep from the right to get the cost of every split plane in one pass from the left
+        float rightArea[BVH_BINS];
+        uint32_t rightCount[BVH_BINS];
+        UBvhBounds sweep;
+        uint32_t sweepCount = 0;
+        for (int bin = BVH_BINS - 1; bin > 0; --bin)
+        {
+            sweep.Grow(binBounds[bin]);
+            sweepCount += binCount[bin];
+            rightArea[bin] = sweep.HalfArea();
+            rightCount[bin] = sweepCount;
+        }
+        sweep = UBvhBounds();
+        sweepCount = 0;
+        const float parentArea = std::max(bounds.HalfArea(), 1e-20f);
+        for (int bin = 1; bin < BVH_BINS; ++bin)
+        {
+            sweep.Grow(binBounds[bin - 1]);
+            sweepCount += binCount[bin - 1];
+            if (sweepCount == 0 || rightCount[bin] == 0)
+                continue;
+            const float cost = 0.5f + (sweep.HalfArea() * ((sweepCount + 3) / 4) + rightArea[bin] * ((rightCount[bin] + 3) / 4)) / parentArea;
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = bin;
+            }
+        }
+    }
+
+    uint32_t middle;
+    if (bestAxis >= 0)
+    {
+        const float scale = BVH_BINS / extent[bestAxis];
+        const float lowerBound = centroids.lower[bestAxis];
+        middle = static_cast<uint32_t>(std::partition(order.begin() + begin, order.begin() + end, [&](uint32_t triangle) {
+            return std::min(BVH_BINS - 1, static_cast<int>((primitives[triangle].centroid[bestAxis] - lowerBound) * scale)) < bestBin;
+        }) - order.begin());
+    }
+    else if (count > uint32_t(BVH_MAX_LEAF_TRIANGLES))
+        middle = begin + count / 2;     // Coincident centroids (or no split pays off) but too many for a leaf
+    else
+        return;
+
+    const uint32_t left = static_cast<uint32_t>(nodes.size());
+    nodes[nodeIndex].first = left;
+    nodes[nodeIndex].count = 0;
+    nodes.resize(nodes.size() + 2);
+    UBuildBvhNode(nodes, left, order, begin, middle, primitives, depth + 1, deferBelow, deferred);
+    UBuildBvhNode(nodes, left + 1, order, middle, end, primitives, depth + 1, deferBelow, deferred);
+}
+
+
+// Builds the hierarchy over indexed triangles. The top of the tree is split on this thread until there are a
+// few subtrees per worker, then the subtrees are built in parallel into their own arrays and appended.
+void UBuildBvh(UBvh& bvh, const std::vector<glm::vec3>& positions, const std::vector<uint32_t>& indices, int workerCount)
+{
+    const uint32_t triangleCount = static_cast<uint32_t>(indices.size() / 3);
+    std::vector<UBvhPrimitive> primitives(triangleCount);
+    std::vector<uint32_t> order(triangleCount);
+    for (uint32_t t = 0; t < triangleCount; ++t)
+    {
+        UBvhPrimitive& primitive = primitives[t];
+        for (int corner = 0; corner < 3; ++corner)
+            primitive.bounds.Grow(positions[indices[t * 3 + corner]]);
+        primitive.centroid = 0.5f * (primitive.bounds.lower + primitive.bounds.upper);
+        order[t] = t;
+    }
+
+    bvh.nodes.clear();
+    bvh.nodes.reserve(size_t(triangleCount) / 2 + 1);
+    bvh.nodes.resize(1);
+    std::vector<UBvhSubtree> subtrees;
+    const uint32_t deferBelow = workerCount > 1 ? std::max<uint32_t>(4096, triangleCount / (workerCount * 4)) : 0;
+    UBuildBvhNode(bvh.nodes, 0, order, 0, triangleCount, primitives, 0, deferBelow, workerCount > 1 ? &subtrees : nullptr);
+
+    if (!subtrees.empty())
+    {
+        UThreadPool pool;
+        UStartThreadPool(pool, workerCount, "bvh build");
+        for (UBvhSubtree& subtree : subtrees)
+            USubmitJob(pool, [&subtree, &order, &primitives](int) {
+                subtree.nodes.resize(1);
+                UBuildBvhNode(subtree.nodes, 0, order, subtree.begin, subtree.end, primitives, subtree.depth, 0, nullptr);
+            });
+        UWaitThreadPool(pool);
+        UStopThreadPool(pool);
+
+        // Local node i > 0 lands at offset + i - 1; siblings stay adjacent, so only child indices change
+        for (UBvhSubtree& subtree : subtrees)
+        {
+            const uint32_t offset = static_cast<uint32_t>(bvh.nodes.size());
+            for (UBvhNode& node : subtree.nodes)
+                if (node.count == 0)
+                    node.first = offset + node.first - 1;
+            bvh.nodes[subtree.node] = subtree.nodes[0];
+            bvh.nodes.insert(bvh.nodes.end(), subtree.nodes.begin() + 1, subtree.nodes.end());
+        }
+    }
+
+    // Leaves switch from triangle ranges to runs of four-wide packs
+    bvh.packs.clear();
+    bvh.packs.reserve(size_t(triangleCount) / 2 + bvh.nodes.size());
+    for (UBvhNode& node : bvh.nodes)
+    {
+        if (node.count == 0)
+            continue;
+
+        const uint32_t first = node.first;
+        const uint32_t count = node.count;
+        node.first = static_cast<uint32_t>(bvh.packs.size());
+        node.count = (count + 3) / 4;
+        for (uint32_t i = 0; i < count; i += 4)
+        {
+            UBvhTrianglePack pack = {};
+            for (uint32_t lane = 0; lane < 4; ++lane)
+            {
+                pack.triangle[lane] = -1;
+                if (i + lane >= count)
+                    continue;
+
+                const uint32_t triangle = order[first + i + lane];
+                const glm::vec3 v0 = positions[indices[triangle * 3]];
+                const glm::vec3 e1 = positions[indices[triangle * 3 + 1]] - v0;
+                const glm::vec3 e2 = positions[indices[triangle * 3 + 2]] - v0;
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    pack.v0[axis][lane] = v0[axis];
+                    pack.e1[axis][lane] = e1[axis];
+                    pack.e2[axis][lane] = e2[axis];
+                }
+                pack.triangle[lane] = static_cast<int32_t>(triangle);
+            }
+            bvh.packs.push_back(pack);
+        }
+    }
+}
+
+
+#if USIMD_SSE
+// Entry distance of the ray into the node's box, or a negative value on a miss
+inline float URayBox(const UBvhNode& node, __m128 origin, __m128 inverseDirection, float maxDistance)
+{
+    // Lane 3 holds first/count; it is masked to an empty constraint
+    const __m128 lanes = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+    const __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.lower), origin), inverseDirection);
+    const __m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.upper), origin), inverseDirection);
+    __m128 enter = _mm_and_ps(_mm_min_ps(t1, t2), lanes);
+    __m128 exit = _mm_or_ps(_mm_and_ps(_mm_max_ps(t1, t2), lanes), _mm_andnot_ps(lanes, _mm_set1_ps(maxDistance)));
+    enter = _mm_max_ps(enter, _mm_shuffle_ps(enter, enter, _MM_SHUFFLE(2, 3, 0, 1)));
+    enter = _mm_max_ps(enter, _mm_shuffle_ps(enter, enter, _MM_SHUFFLE(1, 0, 3, 2)));
+    exit = _mm_min_ps(exit, _mm_shuffle_ps(exit, exit, _MM_SHUFFLE(2, 3, 0, 1)));
+    exit = _mm_min_ps(exit, _mm_shuffle_ps(exit, exit, _MM_SHUFFLE(1, 0, 3, 2)));
+    const float tEnter = _mm_cvtss_f32(enter);
+    return tEnter <= _mm_cvtss_f32(exit) ? tEnter : -1.0f;
+}
+
+
+// Moller-Trumbore against four triangles at once (two-sided); returns the lane hit closest within maxDistance
+inline int URayPack(const UBvhTrianglePack& pack, const float origin[3], const float direction[3], float& maxDistance)
+{
+    const __m128 ox = _mm_set1_ps(origin[0]), oy = _mm_set1_ps(origin[1]), oz = _mm_set1_ps(origin[2]);
+    const __m128 dx = _mm_set1_ps(direction[0]), dy = _mm_set1_ps(direction[1]), dz = _mm_set1_ps(direction[2]);
+    const __m128 e1x = _mm_loadu_ps(pack.e1[0]), e1y = _mm_loadu_ps(pack.e1[1]), e1z = _mm_loadu_ps(pack.e1[2]);
+    const __m128 e2x = _mm_loadu_ps(pack.e2[0]), e2y = _mm_loadu_ps(pack.e2[1]), e2z = _mm_loadu_ps(pack.e2[2]);
+
+    // p = d x e2, det = e1 . p
+    const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    const __m128 inverseDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+    const __m128 sx = _mm_sub_ps(ox, _mm_loadu_ps(pack.v0[0]));
+    const __m128 sy = _mm_sub_ps(oy, _mm_loadu_ps(pack.v0[1]));
+    const __m128 sz = _mm_sub_ps(oz, _mm_loadu_ps(pack.v0[2]));
+    const __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inverseDet);
+
+    // q = s x e1
+    const __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+    const __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+    const __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+    const __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inverseDet);
+    const __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inverseDet);
+
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+    __m128 mask = _mm_cmpgt_ps(absDet, _mm_set1_ps(1e-12f));
+    mask = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+    mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+    mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+    mask = _mm_and_ps(mask, _mm_cmpgt_ps(t, _mm_set1_ps(1e-6f)));
+    mask = _mm_and_ps(mask, _mm_cmplt_ps(t, _mm_set1_ps(maxDistance)));
+
+    const int bits = _mm_movemask_ps(mask);
+    if (!bits)
+        return -1;
+
+    float distances[4];
+    _mm_storeu_ps(distances, t);
+    int best = -1;
+    for (int lane = 0; lane < 4; ++lane)
+    {
+        if ((bits & (1 << lane)) && distances[lane] < maxDistance)
+        {
+            maxDistance = distances[lane];
+            best = lane;
+        }
+    }
+    return best;
+}
+#else
+inline float URayBox(const UBvhNode& node, const float origin[3], const float inverseDirection[3], float maxDistance)
+{
+    float enter = 0.0f, exit = maxDistance;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        const float t1 = (node.lower[axis] - origin[axis]) * inverseDirection[axis];
+        const float t2 = (node.upper[axis] - origin[axis]) * inverseDirection[axis];
+        enter = std::max(enter, std::min(t1, t2));
+        exit = std::min(exit, std::max(t1, t2));
+    }
+    return enter <= exit ? enter : -1.0f;
+}
+
+
+inline int URayPack(const UBvhTrianglePack& pack, const float origin[3], const float direction[3], float& maxDistance)
+{
+    int best = -1;
+    for (int lane = 0; lane < 4; ++lane)
+    {
+        const glm::vec3 d(direction[0], direction[1], direction[2]);
+        const glm::vec3 e1(pack.e1[0][lane], pack.e1[1][lane], pack.e1[2][lane]);
+        const glm::vec3 e2(pack.e2[0][lane], pack.e2[1][lane], pack.e2[2][lane]);
+        const glm::vec3 p = glm::cross(d, e2);
+        const float det = glm::dot(e1, p);
+        if (std::fabs(det) <= 1e-12f)
+            continue;
+
+        const glm::vec3 s = glm::vec3(origin[0], origin[1], origin[2]) - glm::vec3(pack.v0[0][lane], pack.v0[1][lane], pack.v0[2][lane]);
+        const glm::vec3 q = glm::cross(s, e1);
+        const float u = glm::dot(s, p) / det, v = glm::dot(d, q) / det, t = glm::dot(e2, q) / det;
+        if (u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t > 1e-6f && t < maxDistance)
+        {
+            maxDistance = t;
+            best = lane;
+        }
+    }
+    return best;
+}
+#endif
+
+
+// Closest hit along origin + t * direction for t in (0, maxDistance); the distance is in units of |direction|
+bool UIntersectBvh(const UBvh& bvh, const glm::vec3& origin, const glm::vec3& direction, float maxDistance, URayHit& hit)
+{
+    if (bvh.nodes.empty())
+        return false;
+
+    const float rayOrigin[3] = { origin.x, origin.y, origin.z };
+    const float rayDirection[3] = { direction.x, direction.y, direction.z };
+    float inverse[3];
+    for (int axis = 0; axis < 3; ++axis)
+        inverse[axis] = 1.0f / (std::fabs(direction[axis]) > 1e-20f ? direction[axis] : std::copysign(1e-20f, direction[axis]));
+#if USIMD_SSE
+    const __m128 boxOrigin = _mm_setr_ps(origin.x, origin.y, origin.z, 0.0f);
+    const __m128 boxInverse = _mm_setr_ps(inverse[0], inverse[1], inverse[2], 0.0f);
+#else
+    const float* boxOrigin = rayOrigin;
+    const float* boxInverse = inverse;
+#endif
+
+    // Nearer child first; the far one waits on the stack with its entry distance so it can be skipped later. The
+    // build stops at BVH_STACK_SIZE levels, and a path stacks at most one node per level, so the stack cannot overflow.
+    uint32_t stack[BVH_STACK_SIZE];
+    float stackDistance[BVH_STACK_SIZE];
+    int depth = 0;
+    int bestTriangle = -1;
+    float closest = maxDistance;
+
+    uint32_t nodeIndex = 0;
+    if (URayBox(bvh.nodes[0], boxOrigin, boxInverse, closest) < 0.0f)
+        return false;
+    for (;;)
+    {
+        const UBvhNode& node = bvh.nodes[nodeIndex];
+        if (node.count > 0)
+        {
+            for (uint32_t p = node.first; p < node.first + node.count; ++p)
+            {
+                const int lane = URayPack(bvh.packs[p], rayOrigin, rayDirection, closest);
+                if (lane >= 0)
+                    bestTriangle = bvh.packs[p].triangle[lane];
+            }
+        }
+        else
+        {
+            float nearDistance = URayBox(bvh.nodes[node.first], boxOrigin, boxInverse, closest);
+            float farDistance = URayBox(bvh.nodes[node.first + 1], boxOrigin, boxInverse, closest);
+            uint32_t nearNode = node.first, farNode = node.first + 1;
+            if (farDistance >= 0.0f && (nearDistance < 0.0f || farDistance < nearDistance))
+            {
+                std::swap(nearDistance, farDistance);
+                std::swap(nearNode, farNode);
+            }
+
+            if (nearDistance >= 0.0f)
+            {
+                if (farDistance >= 0.0f)
+                {
+                    stack[depth] = farNode;
+                    stackDistance[depth++] = farDistance;
+                }
+                nodeIndex = nearNode;
+                continue;
+            }
+        }
+
+        // Pop, skipping subtrees that start beyond the closest hit so far
+        while (depth > 0 && stackDistance[depth - 1] > closest)
+            --depth;
+        if (depth == 0)
+            break;
+        nodeIndex = stack[--depth];
+    }
+
+    if (bestTriangle < 0)
+        return false;
+    hit.triangle = bestTriangle;
+    hit.object = bestTriangle < static_cast<int>(bvh.triangleObject.size()) ? bvh.triangleObject[bestTriangle] : -1;
+    hit.distance = closest;
+    return true;
+}
+
+
+// Unpacks the scene mesh into positions and builds its BVH; objects are the mesh parts
+void UCreatePickScene(UBvh& bvh)
+{
+    UPROFILE_FUNCTION();
+
+    std::vector<UPackedVertex> verts;
+    std::vector<GLushort> meshIndices;
+    std::vector<UMeshPart> parts;
+    UBuildMeshData(verts, meshIndices, &parts);
+
+    std::vector<glm::vec3> positions(verts.size());
+    for (size_t v = 0; v < verts.size(); ++v)
+        positions[v] = glm::vec3(UUnpackHalf(verts[v].position[0]), UUnpackHalf(verts[v].position[1]), UUnpackHalf(verts[v].position[2]));
+    const std::vector<uint32_t> indices(meshIndices.begin(), meshIndices.end());
+
+    const auto start = std::chrono::steady_clock::now();
+    const int workers = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    UBuildBvh(bvh, positions, indices, workers);
+
+    bvh.objectNames.clear();
+    for (const UMeshPart& part : parts)
+        bvh.objectNames.push_back(part.name);
+    bvh.triangleObject.assign(indices.size() / 3, -1);
+    for (size_t t = 0; t < bvh.triangleObject.size(); ++t)
+        for (size_t p = 0; p < parts.size(); ++p)
+            if (indices[t * 3] >= parts[p].firstVertex && indices[t * 3] < uint32_t(parts[p].firstVertex) + parts[p].vertexCount)
+                bvh.triangleObject[t] = static_cast<int>(p);
+
+    ULOG_INFO("Pick BVH: %zu triangles, %zu nodes in %.2f ms", indices.size() / 3, bvh.nodes.size(),
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+}
+
+
+// Casts the ray under a point of the view (normalized device coordinates) against the subject's triangles
+bool UPickScreen(const glm::vec2& ndc, URayHit& hit)
+{
+    // Same matrices as URender
+    const glm::mat4 view = gCamera.GetViewMatrix();
+    const glm::mat4 projection = glm::perspective(45.0f, (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
+    const glm::mat4 inverseViewProjection = glm::inverse(projection * view);
+    const glm::vec4 farPoint = inverseViewProjection * glm::vec4(ndc.x, ndc.y, 1.0f, 1.0f);
+    const glm::vec3 direction = glm::normalize(glm::vec3(farPoint) / farPoint.w - gCamera.Position);
+
+    // The BVH is in mesh space; an affine transform keeps t, so distances come back in world units
+    const glm::mat4 toMesh = glm::inverse(gTransforms.world[gSubjectNode]);
+    const glm::vec3 origin = glm::vec3(toMesh * glm::vec4(gCamera.Position, 1.0f));
+    return UIntersectBvh(gSceneBvh, origin, glm::mat3(toMesh) * direction, 1e30f, hit);
+}
+
+
+// Splits the triangles into charts of connected, nearly coplanar triangles, projects every chart along its dominant
+// axis and shelf-packs the charts into the lightmap, shrinking the texel density until they fit. A vertex used by two
+// charts is duplicated; sourceVertex maps the unwrapped vertices back. The second UV set comes back in texels.
+bool UUnwrapLightmap(const std::vector<glm::vec3>& positions, const std::vector<uint32_t>& indices,
+    std::vector<uint32_t>& sourceVertex, std::vector<uint32_t>& unwrappedIndices, std::vector<glm::vec2>& lightmapUV)
+{
+    const size_t triangleCount = indices.size() / 3;
+    std::vector<glm::vec3> normals(triangleCount);
+    for (size_t t = 0; t < triangleCount; ++t)
+    {
+        const glm::vec3 n = glm::cross(positions[indices[t * 3 + 1]] - positions[indices[t * 3]], positions[indices[t * 3 + 2]] - positions[indices[t * 3]]);
+        normals[t] = glm::length(n) > 0.0f ? glm::normalize(n) : glm::vec3(0.0f, 1.0f, 0.0f);
+    }
+
+    // Union-find over triangles; winding is mixed, so normals pointing either way join
+    std::vector<uint32_t> parent(triangleCount);
+    for (size_t t = 0; t < triangleCount; ++t)
+        parent[t] = static_cast<uint32_t>(t);
+    auto root = [&parent](uint32_t t) {
+        while (parent[t] != t)
+            t = parent[t] = parent[parent[t]];
+        return t;
+    };
+    std::vector<std::vector<uint32_t>> vertexTriangles(positions.size());
+    for (size_t i = 0; i < indices.size(); ++i)
+        vertexTriangles[indices[i]].push_back(static_cast<uint32_t>(i / 3));
+    for (const std::vector<uint32_t>& triangles : vertexTriangles)
+        for (size_t a = 0; a < triangles.size(); ++a)
+            for (size_t b = a + 1; b < triangles.size(); ++b)
+                if (std::fabs(glm::dot(normals[triangles[a]], normals[triangles[b]])) > LIGHTMAP_CHART_COS)
+                    parent[root(triangles[a])] = root(triangles[b]);
+
+    std::vector<int> triangleChart(triangleCount, -1);
+    std::vector<int> rootChart(triangleCount, -1);
+    std::vector<ULightmapChart> charts;
+    for (size_t t = 0; t < triangleCount; ++t)
+    {
+        const uint32_t r = root(static_cast<uint32_t>(t));
+        if (rootChart[r] < 0)
+        {
+            rootChart[r] = static_cast<int>(charts.size());
+            charts.push_back({ glm::vec3(0.0f), 0, { 1e30f, 1e30f }, { -1e30f, -1e30f }, 0, 0, 0, 0 });
+        }
+        triangleChart[t] = rootChart[r];
+        ULightmapChart& chart = charts[rootChart[r]];
+        chart.normal += glm::dot(chart.normal, normals[t]) < 0.0f ? -normals[t] : normals[t];
+    }
+
+    // Project along the dominant axis of each chart
+    for (ULightmapChart& chart : charts)
+    {
+        const glm::vec3 n = glm::abs(chart.normal);
+        chart.axis = n.x >= n.y && n.x >= n.z ? 0 : (n.y >= n.z ? 1 : 2);
+    }
+    for (size_t t = 0; t < triangleCount; ++t)
+    {
+        ULightmapChart& chart = charts[triangleChart[t]];
+        for (int corner = 0; corner < 3; ++corner)
+            for (int k = 0; k < 2; ++k)
+            {
+                const float value = positions[indices[t * 3 + corner]][(chart.axis + 1 + k) % 3];
+                chart.lower[k] = std::min(chart.lower[k], value);
+                chart.upper[k] = std::max(chart.upper[k], value);
+            }
+    }
+
+    // Shelf packing, tallest charts first, from a density that would fill about half the lightmap
+    double area = 0.0;
+    for (const ULightmapChart& chart : charts)
+        area += double(chart.upper[0] - chart.lower[0]) * (chart.upper[1] - chart.lower[1]);
+    float density = static_cast<float>(std::sqrt(0.5 * LIGHTMAP_SIZE * LIGHTMAP_SIZE / std::max(area, 1e-6)));
+
+    std::vector<int> order(charts.size());
+    bool packed = false;
+    for (int attempt = 0; attempt < 64 && !packed; ++attempt, density *= 0.9f)
+    {
+        for (ULightmapChart& chart : charts)
+        {
+            chart.width = static_cast<int>(std::ceil((chart.upper[0] - chart.lower[0]) * density)) + 1 + 2 * LIGHTMAP_GUTTER;
+            chart.height = static_cast<int>(std::ceil((chart.upper[1] - chart.lower[1]) * density)) + 1 + 2 * LIGHTMAP_GUTTER;
+        }
+        for (size_t c = 0; c < order.size(); ++c)
+            order[c] = static_cast<int>(c);
+        std::sort(order.begin(), order.end(), [&charts](int a, int b) { return charts[a].height > charts[b].height; });
+
+        int x = 0, y = 0, shelfHeight = 0;
+        packed = true;
+        for (int c : order)
+        {
+            ULightmapChart& chart = charts[c];
+            if (x + chart.width > LIGHTMAP_SIZE)
+            {
+                x = 0;
+                y += shelfHeight;
+                shelfHeight = 0;
+            }
+            if (x + chart.width > LIGHTMAP_SIZE || y + chart.height > LIGHTMAP_SIZE)
+            {
+                packed = false;
+                break;
+            }
+            chart.x = x;
+            chart.y = y;
+            x += chart.width;
+            shelfHeight = std::max(shelfHeight, chart.height);
+        }
+        if (packed)
+            break;
+    }
+    if (!packed)
+        return false;
+
+    // One unwrapped vertex per (vertex, chart) pair
+    std::vector<std::vector<std::pair<int, uint32_t>>> splits(positions.size());
+    sourceVertex.clear();
+    lightmapUV.clear();
+    unwrappedIndices.resize(indices.size());
+    for (size_t i = 0; i < indices.size(); ++i)
+    {
+        const uint32_t vertex = indices[i];
+        const int c = triangleChart[i / 3];
+        uint32_t unwrapped = UINT32_MAX;
+        for (const std::pair<int, uint32_t>& split : splits[vertex])
+            if (split.first == c)
+                unwrapped = split.second;
+        if (unwrapped == UINT32_MAX)
+        {
+            const ULightmapChart& chart = charts[c];
+            unwrapped = static_cast<uint32_t>(sourceVertex.size());
+            splits[vertex].emplace_back(c, unwrapped);
+            sourceVertex.push_back(vertex);
+            lightmapUV.push_back(glm::vec2(
+                chart.x + LIGHTMAP_GUTTER + (positions[vertex][(chart.axis + 1) % 3] - chart.lower[0]) * density,
+                chart.y + LIGHTMAP_GUTTER + (positions[vertex][(chart.axis + 2) % 3] - chart.lower[1]) * density));
+        }
+        unwrappedIndices[i] = unwrapped;
+    }
+
+    ULOG_INFO("Lightmap unwrap: %zu charts, %zu -> %zu vertices, %.1f texels per unit", charts.size(), positions.size(),
+        sourceVertex.size(), density);
+    return true;
+}
+
+
+// Light from the lamp reaching a point, on the scale of the Phong diffuse term, when nothing is in the way
+glm::vec3 UBakeDirect(const UBakeScene& scene, const glm::vec3& point, const glm::vec3& normal, uint64_t& rays)
+{
+    const glm::vec3 toLight = scene.lightPosition - point;
+    const float distance = glm::length(toLight);
+    const float impact = glm::dot(normal, toLight) / distance;
+    if (impact <= 0.0f)
+        return glm::vec3(0.0f);
+
+    URayHit hit;
+    ++rays;
+    if (UIntersectBvh(scene.bvh, point + normal * BAKE_RAY_OFFSET, toLight / distance, distance - BAKE_RAY_OFFSET, hit))
+        return glm::vec3(0.0f);
+    return impact * scene.lightColor;
+}
+
+
+// One path sample of the light arriving at a point from other surfaces, along a cosine-weighted direction. With
+// that distribution the sample is already weighted for irradiance, so averaging samples gives the indirect term.
+glm::vec3 UBakeIndirect(const UBakeScene& scene, const glm::vec3& point, const glm::vec3& normal, int bounces, uint32_t& rng, uint64_t& rays)
+{
+    // xorshift32, turned into two uniforms in [0, 1)
+    float uniform[2];
+    for (float& u : uniform)
+    {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        u = (rng >> 8) * (1.0f / 16777216.0f);
+    }
+    const float radius = std::sqrt(uniform[0]);
+    const float angle = 6.28318531f * uniform[1];
+    const glm::vec3 tangent = glm::normalize(glm::cross(std::fabs(normal.x) > 0.5f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f), normal));
+    const glm::vec3 bitangent = glm::cross(normal, tangent);
+    const glm::vec3 direction = tangent * (radius * std::cos(angle)) + bitangent * (radius * std::sin(angle))
+        + normal * std::sqrt(std::max(0.0f, 1.0f - uniform[0]));
+
+    URayHit hit;
+    ++rays;
+    const glm::vec3 origin = point + normal * BAKE_RAY_OFFSET;
+    if (!UIntersectBvh(scene.bvh, origin, direction, 1e30f, hit))
+        return scene.lightColor * BAKE_SKY;
+
+    // The surface hit reflects what reaches its side facing the ray
+    const glm::vec3 hitPoint = origin + direction * hit.distance;
+    const glm::vec3 hitNormal = glm::dot(scene.normals[hit.triangle], direction) > 0.0f ? -scene.normals[hit.triangle] : scene.normals[hit.triangle];
+    glm::vec3 light = UBakeDirect(scene, hitPoint, hitNormal, rays);
+    if (bounces > 1)
+        light += UBakeIndirect(scene, hitPoint, hitNormal, bounces - 1, rng, rays);
+    return scene.albedo[hit.triangle] * light;
+}
+
+
+// Path traces the scene mesh, placed by model and lit by a lamp at lightPosition, into a lightmap and the irradiance
+// probes on every core. Touches neither GL nor the scene globals, so it can run off the render thread; a set cancel
+// flag makes the remaining jobs return at once. The parametric surfaces and streamed cells neither cast nor receive
+// baked light; they read the probes.
+bool UComputeBake(UBakeResult& result, const glm::mat4& model, const glm::vec3& lightPosition, const glm::vec3& lightColor,
+    const glm::vec3& albedo, int samples, const std::atomic<bool>* cancel)
+{
+    UPROFILE_FUNCTION();
+
+    const auto start = std::chrono::steady_clock::now();
+
+    std::vector<UPackedVertex> verts;
+    std::vector<GLushort> meshIndices;
+    std::vector<UMeshPart> parts;
+    UBuildMeshData(verts, meshIndices, &parts);
+
+    // Everything is baked in world space
+    std::vector<glm::vec3> positions(verts.size());
+    for (size_t v = 0; v < verts.size(); ++v)
+        positions[v] = glm::vec3(model * glm::vec4(UUnpackHalf(verts[v].position[0]), UUnpackHalf(verts[v].position[1]), UUnpackHalf(verts[v].position[2]), 1.0f));
+    const std::vector<uint32_t> indices(meshIndices.begin(), meshIndices.end());
+
+    std::vector<uint32_t> sourceVertex, unwrappedIndices;
+    std::vector<glm::vec2> lightmapUV;
+    if (!UUnwrapLightmap(positions, indices, sourceVertex, unwrappedIndices, lightmapUV))
+    {
+        ULOG_ERROR("Lightmap unwrap: the charts do not fit a %d x %d lightmap", LIGHTMAP_SIZE, LIGHTMAP_SIZE);
+        return false;
+    }
+
+    const int workers = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    UBakeScene scene;
+    UBuildBvh(scene.bvh, positions, indices, workers);
+    scene.lightPosition = lightPosition;
+    scene.lightColor = lightColor;
+    scene.normals.resize(indices.size() / 3);
+    scene.albedo.assign(indices.size() / 3, albedo);   // Textures are left out of the bounce light
+    for (size_t t = 0; t < scene.normals.size(); ++t)
+    {
+        const glm::vec3 n = glm::cross(positions[indices[t * 3 + 1]] - positions[indices[t * 3]], positions[indices[t * 3 + 2]] - positions[indices[t * 3]]);
+        scene.normals[t] = glm::length(n) > 0.0f ? glm::normalize(n) : glm::vec3(0.0f, 1.0f, 0.0f);
+    }
+
+    // Solids are baked on their outside, away from the centre of their part; flat parts on the side facing the lamp
+    std::vector<glm::vec3> partCentres(parts.size(), glm::vec3(0.0f));
+    for (size_t p = 0; p < parts.size(); ++p)
+    {
+        for (GLuint v = 0; v < parts[p].vertexCount; ++v)
+            partCentres[p] += positions[parts[p].firstVertex + v];
+        partCentres[p] /= float(std::max<GLuint>(parts[p].vertexCount, 1));
+    }
+
+    // Texels whose centre a triangle covers
+    std::vector<UBakeTexel> texels;
+    std::vector<char> covered(LIGHTMAP_SIZE * LIGHTMAP_SIZE, 0);
+    for (size_t t = 0; t < unwrappedIndices.size() / 3; ++t)
+    {
+        const uint32_t* corner = &unwrappedIndices[t * 3];
+        const glm::vec2 a = lightmapUV[corner[0]], b = lightmapUV[corner[1]], c = lightmapUV[corner[2]];
+        const float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+        if (std::fabs(area) < 1e-12f)
+            continue;
+
+        glm::vec3 normal = scene.normals[t];
+        const glm::vec3 centre = (positions[indices[t * 3]] + positions[indices[t * 3 + 1]] + positions[indices[t * 3 + 2]]) / 3.0f;
+        for (const UMeshPart& part : parts)
+            if (indices[t * 3] >= part.firstVertex && indices[t * 3] < part.firstVertex + part.vertexCount)
+            {
+                const float outside = glm::dot(normal, centre - partCentres[&part - parts.data()]);
+                if (outside < 0.0f || (std::fabs(outside) < 1e-4f && glm::dot(normal, scene.lightPosition - centre) < 0.0f))
+                    normal = -normal;
+            }
+
+        const int x0 = std::max(0, static_cast<int>(std::floor(std::min({ a.x, b.x, c.x }))));
+        const int x1 = std::min(LIGHTMAP_SIZE - 1, static_cast<int>(std::ceil(std::max({ a.x, b.x, c.x }))));
+        const int y0 = std::max(0, static_cast<int>(std::floor(std::min({ a.y, b.y, c.y }))));
+        const int y1 = std::min(LIGHTMAP_SIZE - 1, static_cast<int>(std::ceil(std::max({ a.y, b.y, c.y }))));
+        for (int y = y0; y <= y1; ++y)
+            for (int x = x0; x <= x1; ++x)
+            {
+                const glm::vec2 p(x + 0.5f, y + 0.5f);
+                const float w1 = ((p.x - a.x) * (c.y - a.y) - (p.y - a.y) * (c.x - a.x)) / area;
+                const float w2 = ((b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x)) / area;
+                const float w0 = 1.0f - w1 - w2;
+                if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f || covered[y * LIGHTMAP_SIZE + x])
+                    continue;
+                covered[y * LIGHTMAP_SIZE + x] = 1;
+                const glm::vec3 position = positions[sourceVertex[corner[0]]] * w0 + positions[sourceVertex[corner[1]]] * w1 + positions[sourceVertex[corner[2]]] * w2;
+                texels.push_back({ y * LIGHTMAP_SIZE + x, position, normal });
+            }
+    }
+
+    // Probes sit at the cell centres of a grid around the mesh
+    glm::vec3 lower(1e30f), upper(-1e30f);
+    for (const glm::vec3& position : positions)
+    {
+        lower = glm::min(lower, position);
+        upper = glm::max(upper, position);
+    }
+    result.probeLower = lower - glm::vec3(0.5f);
+    result.probeUpper = upper + glm::vec3(0.5f);
+    const int probeCount = PROBE_GRID.x * PROBE_GRID.y * PROBE_GRID.z;
+
+    // Texels in batches and probes one per job, over all cores; the calling thread reports progress
+    std::vector<glm::vec3>& lightmap = result.lightmap;
+    lightmap.assign(LIGHTMAP_SIZE * LIGHTMAP_SIZE, glm::vec3(0.0f));
+    std::vector<glm::vec3> probes(probeCount * 6);
+    std::atomic<size_t> done{ 0 };
+    std::atomic<uint64_t> totalRays{ 0 };
+    const size_t work = texels.size() + probes.size();
+
+    UThreadPool pool;
+    UStartThreadPool(pool, workers, "bake");
+    for (size_t first = 0; first < texels.size(); first += BAKE_TEXELS_PER_JOB)
+        USubmitJob(pool, [&, first](int) {
+            const size_t last = std::min(texels.size(), first + BAKE_TEXELS_PER_JOB);
+            if (cancel && cancel->load())
+            {
+                done += last - first;
+                return;
+            }
+            uint32_t rng = static_cast<uint32_t>(first) * 2654435761u + 1u;
+            uint64_t rays = 0;
+            for (size_t i = first; i < last; ++i)
+            {
+                const UBakeTexel& texel = texels[i];
+                glm::vec3 indirect(0.0f);
+                for (int s = 0; s < samples; ++s)
+                    indirect += UBakeIndirect(scene, texel.position, texel.normal, BAKE_BOUNCES, rng, rays);
+                lightmap[texel.texel] = UBakeDirect(scene, texel.position, texel.normal, rays) + indirect / float(samples);
+            }
+            totalRays += rays;
+            done += last - first;
+        });
+    for (int probe = 0; probe < probeCount; ++probe)
+        USubmitJob(pool, [&, probe](int) {
+            if (cancel && cancel->load())
+            {
+                done += 6;
+                return;
+            }
+            const int x = probe % PROBE_GRID.x, y = (probe / PROBE_GRID.x) % PROBE_GRID.y, z = probe / (PROBE_GRID.x * PROBE_GRID.y);
+            const glm::vec3 cell((x + 0.5f) / PROBE_GRID.x, (y + 0.5f) / PROBE_GRID.y, (z + 0.5f) / PROBE_GRID.z);
+            const glm::vec3 position = result.probeLower + (result.probeUpper - result.probeLower) * cell;
+            uint32_t rng = static_cast<uint32_t>(probe) * 2246822519u + 7u;
+            uint64_t rays = 0;
+            for (int face = 0; face < 6; ++face)
+            {
+                glm::vec3 normal(0.0f);
+                normal[face / 2] = face % 2 ? -1.0f : 1.0f;
+                glm::vec3 indirect(0.0f);
+                for (int s = 0; s < samples; ++s)
+                    indirect += UBakeIndirect(scene, position, normal, BAKE_BOUNCES, rng, rays);
+                probes[probe * 6 + face] = UBakeDirect(scene, position, normal, rays) + indirect / float(samples);
+            }
+            totalRays += rays;
+            done += 6;
+        });
+
+    auto lastReport = std::chrono::steady_clock::now();
+    while (done.load() < work)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        const auto now = std::chrono::steady_clock::now();
+        if (now - lastReport >= std::chrono::seconds(1))
+        {
+            lastReport = now;
+            ULOG_INFO("Baking: %3.0f%%, %.2f Mrays/s", 100.0 * done.load() / work,
+                totalRays.load() / std::chrono::duration<double>(now - start).count() * 1e-6);
+        }
+    }
+    UWaitThreadPool(pool);
+    UStopThreadPool(pool);
+    if (cancel && cancel->load())
+        return false;
+
+    // Grow the charts into their gutters, so bilinear filtering at a chart edge never reads unbaked texels
+    for (int pass = 0; pass < LIGHTMAP_GUTTER; ++pass)
+    {
+        std::vector<char> grown = covered;
+        for (int y = 0; y < LIGHTMAP_SIZE; ++y)
+            for (int x = 0; x < LIGHTMAP_SIZE; ++x)
+            {
+                if (covered[y * LIGHTMAP_SIZE + x])
+                    continue;
+                glm::vec3 sum(0.0f);
+                int count = 0;
+                for (int dy = -1; dy <= 1; ++dy)
+                    for (int dx = -1; dx <= 1; ++dx)
+                    {
+                        const int nx = x + dx, ny = y + dy;
+                        if (nx >= 0 && ny >= 0 && nx < LIGHTMAP_SIZE && ny < LIGHTMAP_SIZE && covered[ny * LIGHTMAP_SIZE + nx])
+                        {
+                            sum += lightmap[ny * LIGHTMAP_SIZE + nx];
+                            ++count;
+                        }
+                    }
+                if (count > 0)
+                {
+                    lightmap[y * LIGHTMAP_SIZE + x] = sum / float(count);
+                    grown[y * LIGHTMAP_SIZE + x] = 1;
+                }
+            }
+        covered.swap(grown);
+    }
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ULOG_INFO("Baked %zu texels and %d probes with %d samples on %d threads: %.2f s, %.1f Mrays (%.2f Mrays/s)",
+        texels.size(), probeCount, samples, workers, seconds, totalRays.load() * 1e-6, totalRays.load() / seconds * 1e-6);
+
+    // The lightmapped mesh: the packed vertices split along chart seams, with the lightmap coordinates beside them
+    result.verts.resize(sourceVertex.size());
+    result.lightmapUV.resize(sourceVertex.size() * 2);
+    for (size_t v = 0; v < sourceVertex.size(); ++v)
+    {
+        result.verts[v] = verts[sourceVertex[v]];
+        result.lightmapUV[v * 2] = UPackUnorm16(lightmapUV[v].x / LIGHTMAP_SIZE);
+        result.lightmapUV[v * 2 + 1] = UPackUnorm16(lightmapUV[v].y / LIGHTMAP_SIZE);
+    }
+    result.indices.assign(unwrappedIndices.begin(), unwrappedIndices.end());
+
+    result.probeTexels.resize(probes.size());
+    for (int probe = 0; probe < probeCount; ++probe)
+        for (int face = 0; face < 6; ++face)
+        {
+            const int x = probe % PROBE_GRID.x, yz = probe / PROBE_GRID.x;
+            result.probeTexels[(yz * 6 + face) * PROBE_GRID.x + x] = probes[probe * 6 + face];
+        }
+    result.lightPosition = lightPosition;
+    result.ok = true;
+    return true;
+}
+
+
+// Uploads a bake with a copy of the mesh carrying the lightmap coordinates, and makes its shaders
+bool UUploadBakedLighting(UBakedLighting& baked, const UBakeResult& result)
+{
+    glGenVertexArrays(1, &baked.mesh.vao);
+    glBindVertexArray(baked.mesh.vao);
+    glGenBuffers(2, baked.mesh.vbos);
+    glBindBuffer(GL_ARRAY_BUFFER, baked.mesh.vbos[0]);
+    glBufferData(GL_ARRAY_BUFFER, result.verts.size() * sizeof(UPackedVertex), result.verts.data(), GL_STATIC_DRAW);
+    UGPU_TRACK(UGPU_BUFFER, baked.mesh.vbos[0], result.verts.size() * sizeof(UPackedVertex), "lightmap");
+    baked.mesh.nIndices = result.indices.size();
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, baked.mesh.vbos[1]);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, result.indices.size() * sizeof(GLushort), result.indices.data(), GL_STATIC_DRAW);
+    UGPU_TRACK(UGPU_BUFFER, baked.mesh.vbos[1], result.indices.size() * sizeof(GLushort), "lightmap");
+    UPackedVertexLayout::Enable();
+
+    glGenBuffers(1, &baked.lightmapUVBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, baked.lightmapUVBuffer);
+    glBufferData(GL_ARRAY_BUFFER, result.lightmapUV.size() * sizeof(GLushort), result.lightmapUV.data(), GL_STATIC_DRAW);
+    UGPU_TRACK(UGPU_BUFFER, baked.lightmapUVBuffer, result.lightmapUV.size() * sizeof(GLushort), "lightmap");
+    glVertexAttribPointer(UATTRIBUTE_LIGHTMAP_UV, 2, GL_UNSIGNED_SHORT, GL_TRUE, 2 * sizeof(GLushort), nullptr);
+    glEnableVertexAttribArray(UATTRIBUTE_LIGHTMAP_UV);
+    glBindVertexArray(0);
+
+    baked.probeLower = result.probeLower;
+    baked.probeUpper = result.probeUpper;
+
+    // Light textures stay bound on their units for the whole run
+    glGenTextures(1, &baked.lightmap);
+    glActiveTexture(GL_TEXTURE0 + LIGHTMAP_UNIT);
+    glBindTexture(GL_TEXTURE_2D, baked.lightmap);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA16F, LIGHTMAP_SIZE, LIGHTMAP_SIZE);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, LIGHTMAP_SIZE, LIGHTMAP_SIZE, GL_RGB, GL_FLOAT, result.lightmap.data());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    UGPU_TRACK(UGPU_TEXTURE, baked.lightmap, UGpuTextureBytes(GL_RGBA16F, LIGHTMAP_SIZE, LIGHTMAP_SIZE, 1, 1), "lightmap");
+
+    glGenTextures(1, &baked.probes);
+    glActiveTexture(GL_TEXTURE0 + PROBE_UNIT);
+    glBindTexture(GL_TEXTURE_3D, baked.probes);
+    glTexStorage3D(GL_TEXTURE_3D, 1, GL_RGBA16F, PROBE_GRID.x * 6, PROBE_GRID.y, PROBE_GRID.z);
+    glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, PROBE_GRID.x * 6, PROBE_GRID.y, PROBE_GRID.z, GL_RGB, GL_FLOAT, result.probeTexels.data());
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    UGPU_TRACK(UGPU_TEXTURE, baked.probes, UGpuTextureBytes(GL_RGBA16F, PROBE_GRID.x * 6, PROBE_GRID.y, PROBE_GRID.z, 1), "lightmap");
+    glActiveTexture(GL_TEXTURE0);
+
+    // The lightmapped program, and the probe-lit variants the scene draws with once the bake is on. Variants
+    // left from an earlier bake get the new grid too.
+    UDeclareShaderPermutations(baked.shaders, "baked", bakedVertexShaderSource, bakedFragmentShaderSource, gTextures.materialShader);
+    baked.shaders.setup = USetupLitVariant;
+    const uint32_t viewFeatures = gMultiview.path != UMULTIVIEW_OFF ? USHADER_MULTIVIEW : 0u;
+    baked.programId = UGetShaderPermutation(baked.shaders, viewFeatures);
+    if (!baked.programId)
+        return false;
+    if (!UWarmShaderPermutations(gClayShaders, { USHADER_PROBE_LIGHTING | USHADER_TEXTURED | viewFeatures, USHADER_PROBE_LIGHTING | viewFeatures,
+            USHADER_PROBE_LIGHTING | USHADER_GPU_DRIVEN | USHADER_TEXTURED | viewFeatures, USHADER_PROBE_LIGHTING | USHADER_GPU_DRIVEN | viewFeatures })
+        || !UWarmShaderPermutations(gParametricShaders, { USHADER_PROBE_LIGHTING }))
+        return false;
+    for (const UShaderPermutations* set : { &gClayShaders, &gParametricShaders })
+        for (const UShaderVariant& variant : set->variants)
+            if (variant.features & USHADER_PROBE_LIGHTING)
+                USetProbeUniforms(baked, variant.programId);
+    glUseProgram(0);
 
-/* Vertex Shader Source Code*/
-const GLchar* clayVertexShaderSource = GLSL(440,
+    baked.lightPosition = result.lightPosition;
+    baked.ready = true;
+    return true;
+}
 
-layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
-layout(location = 1) in vec3 normal; // VAP position 1 for normals
 
-out vec3 vertexNormal; // For outgoing normals to fragment shader
-out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
+// Bakes on the calling thread with the scene as it is now, for --bake at load time
+bool UBakeLighting(UBakedLighting& baked, int samples)
+{
+    UBakeResult result;
+    return UComputeBake(result, gTransforms.world[gSubjectNode], glm::vec3(gTransforms.world[gLampNode][3]), gLightColor, gObjectColor,
+        samples, nullptr) && UUploadBakedLighting(baked, result);
+}
 
-//Uniform / Global variables for the  transform matrices
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
 
-void main()
+// Starts a bake of the scene as it is now on the bake thread; UUpdateBake picks up the result
+void UStartBake(int samples)
 {
-    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
+    UBakeJob& job = gBakeJob;
+    if (job.pool.workers.empty())
+        UStartThreadPool(job.pool, 1, "bake");
+
+    job.done = false;
+    job.cancel = false;
+    job.running = true;
+    const glm::mat4 model = gTransforms.world[gSubjectNode];
+    const glm::vec3 lightPosition(gTransforms.world[gLampNode][3]);
+    const glm::vec3 lightColor = gLightColor;
+    const glm::vec3 albedo = gObjectColor;
+    USubmitJob(job.pool, [&job, model, lightPosition, lightColor, albedo, samples](int) {
+        job.result = UBakeResult();
+        UComputeBake(job.result, model, lightPosition, lightColor, albedo, samples, &job.cancel);
+        job.done = true;
+    });
+}
 
-    vertexFragmentPos = vec3(model * vec4(position, 1.0f)); // Gets fragment / pixel position in world space only (exclude view and projection)
 
-    vertexNormal = mat3(transpose(inverse(model))) * normal; // get normal vectors in world space only and exclude normal translation properties
+// Once per frame: uploads a finished background bake in place of the previous one, and switches to it if asked
+void UUpdateBake()
+{
+    UBakeJob& job = gBakeJob;
+    if (!job.running || !job.done.load())
+        return;
+
+    UPROFILE_FUNCTION();
+    job.running = false;
+    const bool switchOn = job.switchOn;
+    job.switchOn = false;
+    if (!job.result.ok)
+        return;
+
+    gBakedLightingOn = false;
+    UDestroyBakedLighting(gBakedLighting);
+    const bool ok = UUploadBakedLighting(gBakedLighting, job.result);
+    job.result = UBakeResult();
+    if (ok && switchOn)
+        USetBakedLighting(true);
 }
-);
 
 
-/* Fragment Shader Source Code*/
-const GLchar* clayFragmentShaderSource = GLSL(440,
-    in vec4 vertexColor; // Variable to hold incoming color data from vertex shader
+// Abandons a bake still running and joins the bake thread
+void UStopBake()
+{
+    gBakeJob.cancel = true;
+    UStopThreadPool(gBakeJob.pool);
+    gBakeJob.running = false;
+    gBakeJob.result = UBakeResult();
+}
 
-in vec3 vertexNormal; // For incoming normals
-in vec3 vertexFragmentPos; // For incoming fragment position
 
-out vec4 fragmentColor; // For outgoing cube color to the GPU
+// Points a probe-lit program at the grid of the bake
+void USetProbeUniforms(const UBakedLighting& baked, GLuint programId)
+{
+    glUseProgram(programId);
+    glUniform3fv(glGetUniformLocation(programId, "probeLower"), 1, glm::value_ptr(baked.probeLower));
+    glUniform3fv(glGetUniformLocation(programId, "probeUpper"), 1, glm::value_ptr(baked.probeUpper));
+    glUniform3i(glGetUniformLocation(programId, "probeCount"), PROBE_GRID.x, PROBE_GRID.y, PROBE_GRID.z);
+}
 
-// Uniform / Global variables for object color, light color, light position, and camera/view position
-uniform vec3 objectColor;
-uniform vec3 lightColor;
-uniform vec3 lightPos;
-uniform vec3 viewPosition;
 
-void main()
+// Switches between baked and dynamic shading. The first switch bakes, and so does one after the lamp has moved;
+// that bake runs in the background and shading switches when it is done. Baked shading, and a bake on its way,
+// pause the lamp orbit, since the light only holds where it was baked.
+void USetBakedLighting(bool on)
 {
-    /*Phong lighting model calculations to generate ambient, diffuse, and specular components*/
+    gBakeJob.switchOn = false;
+    if (on)
+    {
+        gIsLampOrbiting = false;
+        const glm::vec3 lightPosition(gTransforms.world[gLampNode][3]);
+        if (!gBakedLighting.ready || glm::distance(lightPosition, gBakedLighting.lightPosition) > 1e-3f)
+        {
+            if (!gBakeJob.running)
+                UStartBake(gOptions.bakeSamples > 0 ? gOptions.bakeSamples : BAKE_DEFAULT_SAMPLES);
+            gBakeJob.switchOn = true;
+            ULOG_INFO("Baking in the background; shading switches when it is done");
+            return;
+        }
+    }
+    gBakedLightingOn = on;
+    ULOG_INFO("Shading: %s", on ? "baked" : "dynamic");
+}
 
-    //Calculate Ambient lighting*/
-    float ambientStrength = 0.1f; // Set ambient or global lighting strength
-    vec3 ambient = ambientStrength * lightColor; // Generate ambient light color
 
-    //Calculate Diffuse lighting*/
-    vec3 norm = normalize(vertexNormal); // Normalize vectors to 1 unit
-    vec3 lightDirection = normalize(lightPos - vertexFragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on cube
-    float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light
-    vec3 diffuse = impact * lightColor; // Generate diffuse light color
+void UDestroyBakedLighting(UBakedLighting& baked)
+{
+    if (baked.mesh.vao)
+    {
+        glDeleteVertexArrays(1, &baked.mesh.vao);
+        glDeleteBuffers(2, baked.mesh.vbos);
+        glDeleteBuffers(1, &baked.lightmapUVBuffer);
+        UReleaseGpuResource(UGPU_BUFFER, baked.mesh.vbos[0]);
+        UReleaseGpuResource(UGPU_BUFFER, baked.mesh.vbos[1]);
+        UReleaseGpuResource(UGPU_BUFFER, baked.lightmapUVBuffer);
+    }
+    glDeleteTextures(1, &baked.lightmap);
+    glDeleteTextures(1, &baked.probes);
+    UReleaseGpuResource(UGPU_TEXTURE, baked.lightmap);
+    UReleaseGpuResource(UGPU_TEXTURE, baked.probes);
+    UDestroyShaderPermutations(baked.shaders);
+    baked = UBakedLighting();
+}
 
-    //Calculate Specular lighting*/
-    float specularIntensity = 1.0f; // Set specular light strength
-    float highlightSize = 16.0f; // Set specular highlight size
-    vec3 viewDir = normalize(viewPosition - vertexFragmentPos); // Calculate view direction
-    vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
-    //Calculate specular component
-    float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
-    vec3 specular = specularIntensity * specularComponent * lightColor;
 
-    // Calculate phong result
-    vec3 phong = (ambient + diffuse + specular) * objectColor;
+// Mip chain of a material image for the software renderer; each level is the 2x2 box average of the one above
+void UCreateSoftwareTexture(USoftwareTexture& texture, const UTextureImage& image)
+{
+    texture.levels.clear();
+    texture.sizes.clear();
 
-    fragmentColor = vec4(phong, 1.0f); // Send lighting results to GPU
+    std::vector<unsigned char> level(size_t(image.width) * image.height * 4);
+    for (size_t texel = 0; texel < size_t(image.width) * image.height; ++texel)
+        for (int c = 0; c < 4; ++c)
+            level[texel * 4 + c] = c < image.channels ? image.pixels[texel * image.channels + c] : 255;
+    texture.levels.push_back(std::move(level));
+    texture.sizes.push_back(glm::ivec2(image.width, image.height));
+
+    while (texture.sizes.back().x > 1 || texture.sizes.back().y > 1)
+    {
+        const glm::ivec2 size = texture.sizes.back();
+        const glm::ivec2 next(std::max(size.x / 2, 1), std::max(size.y / 2, 1));
+        const std::vector<unsigned char>& source = texture.levels.back();
+        std::vector<unsigned char> reduced(size_t(next.x) * next.y * 4);
+        for (int y = 0; y < next.y; ++y)
+            for (int x = 0; x < next.x; ++x)
+                for (int c = 0; c < 4; ++c)
+                {
+                    int sum = 0;
+                    for (int dy = 0; dy < 2; ++dy)
+                        for (int dx = 0; dx < 2; ++dx)
+                            sum += source[(size_t(std::min(y * 2 + dy, size.y - 1)) * size.x + std::min(x * 2 + dx, size.x - 1)) * 4 + c];
+                    reduced[(size_t(y) * next.x + x) * 4 + c] = static_cast<unsigned char>((sum + 2) / 4);
+                }
+        texture.levels.push_back(std::move(reduced));
+        texture.sizes.push_back(next);
+    }
 }
-);
 
-/* Lamp Shader Source Code*/
-const GLchar* lampVertexShaderSource = GLSL(440,
 
-    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
+// Bilinear lookup in one level with GL_REPEAT wrapping
+glm::vec4 USampleSoftwareLevel(const USoftwareTexture& texture, int level, const glm::vec2& uv)
+{
+    const glm::ivec2 size = texture.sizes[level];
+    const unsigned char* texels = texture.levels[level].data();
+    const float x = uv.x * size.x - 0.5f, y = uv.y * size.y - 0.5f;
+    const float fx = std::floor(x), fy = std::floor(y);
+    const float tx = x - fx, ty = y - fy;
+    const int x0 = ((static_cast<int>(fx) % size.x) + size.x) % size.x, y0 = ((static_cast<int>(fy) % size.y) + size.y) % size.y;
+    const int x1 = (x0 + 1) % size.x, y1 = (y0 + 1) % size.y;
+
+    glm::vec4 result(0.0f);
+    const int xs[2] = { x0, x1 }, ys[2] = { y0, y1 };
+    const float wx[2] = { 1.0f - tx, tx }, wy[2] = { 1.0f - ty, ty };
+    for (int j = 0; j < 2; ++j)
+        for (int i = 0; i < 2; ++i)
+        {
+            const unsigned char* texel = texels + (size_t(ys[j]) * size.x + xs[i]) * 4;
+            result += glm::vec4(texel[0], texel[1], texel[2], texel[3]) * (wx[i] * wy[j] / 255.0f);
+        }
+    return result;
+}
 
-        //Uniform / Global variables for the  transform matrices
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
 
-void main()
+// Trilinear lookup like GL_LINEAR_MIPMAP_LINEAR, from the level of detail textureGrad would pick
+glm::vec4 USampleSoftwareTexture(const USoftwareTexture& texture, const glm::vec2& uv, float lod)
 {
-    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
+    const int lastLevel = static_cast<int>(texture.levels.size()) - 1;
+    if (lod <= 0.0f)
+        return USampleSoftwareLevel(texture, 0, uv);
+    if (lod >= float(lastLevel))
+        return USampleSoftwareLevel(texture, lastLevel, uv);
+
+    const int level = static_cast<int>(lod);
+    return glm::mix(USampleSoftwareLevel(texture, level, uv), USampleSoftwareLevel(texture, level + 1, uv), lod - float(level));
 }
-);
 
-/* Fragment Shader Source Code*/
-const GLchar* lampFragmentShaderSource = GLSL(440,
 
-    out vec4 fragmentColor; // For outgoing lamp color (smaller cube) to the GPU
+#if USIMD_AVX2
+// Whether the CPU has AVX2 and the OS saves the AVX registers
+bool UCpuSupportsAvx2()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+    __cpuid(info, 1);
+    const bool osSavesAvx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+    __cpuidex(info, 7, 0);
+    return osSavesAvx && (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
 
-void main()
+
+bool UCreateSoftwareRenderer(USoftwareRenderer& renderer, int width, int height, const UTextureResidency& residency)
 {
-    fragmentColor = vec4(1.0f); // Set color to white (1.0f,1.0f,1.0f) with alpha 1.0
+    renderer.width = width;
+    renderer.height = height;
+    renderer.tilesX = (width + SOFTWARE_TILE_SIZE - 1) / SOFTWARE_TILE_SIZE;
+    renderer.tilesY = (height + SOFTWARE_TILE_SIZE - 1) / SOFTWARE_TILE_SIZE;
+    renderer.color.assign(size_t(width) * height, 0);
+    renderer.depth.assign(size_t(width) * height, 1.0f);
+
+    renderer.textures.resize(residency.images.size());
+    for (size_t i = 0; i < residency.images.size(); ++i)
+        UCreateSoftwareTexture(renderer.textures[i], residency.images[i]);
+    renderer.materials = residency.materials;
+
+    renderer.workers = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    UStartThreadPool(renderer.pool, renderer.workers, "software");
+    return true;
 }
-);
 
-// Images are loaded with Y axis going down, but OpenGL's Y axis goes up, so let's flip it
-void flipImageVertically(unsigned char* image, int width, int height, int channels)
+
+// Clips a triangle against the near plane and sets up what is left of it (up to two triangles) for the tiles
+void USetupSoftwareTriangle(const USoftwareRenderer& renderer, const USoftwareVertex* corners, int material, bool lit,
+    std::vector<USoftwareTriangle>& triangles)
 {
-    for (int j = 0; j < height / 2; ++j)
+    // Sutherland-Hodgman against z >= -w leaves at most four vertices
+    USoftwareVertex polygon[4];
+    int count = 0;
+    for (int i = 0; i < 3; ++i)
     {
-        int index1 = j * width * channels;
-        int index2 = (height - 1 - j) * width * channels;
+        const USoftwareVertex& a = corners[i];
+        const USoftwareVertex& b = corners[(i + 1) % 3];
+        const float da = a.clip.z + a.clip.w, db = b.clip.z + b.clip.w;
+        if (da >= 0.0f)
+            polygon[count++] = a;
+        if ((da >= 0.0f) != (db >= 0.0f))
+        {
+            const float t = da / (da - db);
+            polygon[count++] = { glm::mix(a.clip, b.clip, t), glm::mix(a.world, b.world, t), glm::mix(a.normal, b.normal, t),
+                a.uv + (b.uv - a.uv) * t };
+        }
+    }
 
-        for (int i = width * channels; i > 0; --i)
+    // Viewport transform; y grows downwards so rows come out top to bottom
+    float screen[4][2];
+    float values[4][USOFT_PLANE_COUNT];
+    for (int i = 0; i < count; ++i)
+    {
+        const USoftwareVertex& v = polygon[i];
+        const float inverseW = 1.0f / v.clip.w;
+        screen[i][0] = (v.clip.x * inverseW * 0.5f + 0.5f) * renderer.width;
+        screen[i][1] = (0.5f - v.clip.y * inverseW * 0.5f) * renderer.height;
+        values[i][USOFT_DEPTH] = v.clip.z * inverseW * 0.5f + 0.5f;
+        values[i][USOFT_INVERSE_W] = inverseW;
+        for (int k = 0; k < 3; ++k)
         {
-            unsigned char tmp = image[index1];
-            image[index1] = image[index2];
-            image[index2] = tmp;
-            ++index1;
-            ++index2;
+            values[i][USOFT_WORLD + k] = v.world[k] * inverseW;
+            values[i][USOFT_NORMAL + k] = v.normal[k] * inverseW;
+        }
+        values[i][USOFT_UV] = v.uv.x * inverseW;
+        values[i][USOFT_UV + 1] = v.uv.y * inverseW;
+    }
+
+    for (int k = 1; k + 1 < count; ++k)
+    {
+        const int corner[3] = { 0, k, k + 1 };
+        const float* p0 = screen[corner[0]];
+        const float* p1 = screen[corner[1]];
+        const float* p2 = screen[corner[2]];
+        const float area = (p1[0] - p0[0]) * (p2[1] - p0[1]) - (p2[0] - p0[0]) * (p1[1] - p0[1]);
+        if (std::fabs(area) < 1e-8f)
+            continue;
+
+        // Clamped as floats first: close to the near plane the corners can be far beyond int range
+        const float lower[2] = { std::min({ p0[0], p1[0], p2[0] }), std::min({ p0[1], p1[1], p2[1] }) };
+        const float upper[2] = { std::max({ p0[0], p1[0], p2[0] }), std::max({ p0[1], p1[1], p2[1] }) };
+        if (upper[0] < 0.0f || upper[1] < 0.0f || lower[0] > renderer.width - 1.0f || lower[1] > renderer.height - 1.0f)
+            continue;
+
+        USoftwareTriangle triangle;
+        triangle.bounds[0] = static_cast<int>(std::max(0.0f, std::floor(lower[0])));
+        triangle.bounds[1] = static_cast<int>(std::max(0.0f, std::floor(lower[1])));
+        triangle.bounds[2] = static_cast<int>(std::min(renderer.width - 1.0f, std::ceil(upper[0])));
+        triangle.bounds[3] = static_cast<int>(std::min(renderer.height - 1.0f, std::ceil(upper[1])));
+
+        // Edge i runs from corner i to the next; the area's sign says which side is inside
+        const float sign = area > 0.0f ? 1.0f : -1.0f;
+        for (int e = 0; e < 3; ++e)
+        {
+            const float* a = screen[corner[e]];
+            const float* b = screen[corner[(e + 1) % 3]];
+            triangle.edge[e][0] = sign * (a[1] - b[1]);
+            triangle.edge[e][1] = sign * (b[0] - a[0]);
+            triangle.edge[e][2] = sign * (a[0] * b[1] - b[0] * a[1]);
         }
+
+        for (int p = 0; p < USOFT_PLANE_COUNT; ++p)
+        {
+            const float v0 = values[corner[0]][p], v1 = values[corner[1]][p], v2 = values[corner[2]][p];
+            const float a = ((v1 - v0) * (p2[1] - p0[1]) - (v2 - v0) * (p1[1] - p0[1])) / area;
+            const float b = ((v2 - v0) * (p1[0] - p0[0]) - (v1 - v0) * (p2[0] - p0[0])) / area;
+            triangle.plane[p][0] = a;
+            triangle.plane[p][1] = b;
+            triangle.plane[p][2] = v0 - a * p0[0] - b * p0[1];
+        }
+        triangle.material = material;
+        triangle.lit = lit;
+        triangles.push_back(triangle);
     }
 }
 
 
-int main(int argc, char* argv[])
+// Shades up to eight pixels of a row with the clay program's Phong model and writes the ones in the mask
+void UShadeSoftwarePixels(USoftwareRenderer& renderer, const USoftwareFrame& frame, const USoftwareTriangle& triangle,
+    UFloat8 x, float y, UFloat8 mask, UFloat8 depth, size_t pixel)
 {
-    if (!UInitialize(argc, argv, &gWindow))
-        return EXIT_FAILURE;
+    float r[8], g[8], b[8];
+    if (!triangle.lit)
+    {
+        UStore8(r, UBroadcast8(1.0f));
+        UStore8(g, UBroadcast8(1.0f));
+        UStore8(b, UBroadcast8(1.0f));
+    }
+    else
+    {
+        auto plane = [&](int p) { return UBroadcast8(triangle.plane[p][0]) * x + UBroadcast8(triangle.plane[p][1] * y + triangle.plane[p][2]); };
 
-    // Create the mesh
-    UCreateMesh(gMesh); // Calls the function to create the Vertex Buffer Object
+        // Perspective-correct attributes
+        const UFloat8 w = UBroadcast8(1.0f) / plane(USOFT_INVERSE_W);
+        UFloat8 world[3], normal[3];
+        for (int k = 0; k < 3; ++k)
+        {
+            world[k] = plane(USOFT_WORLD + k) * w;
+            normal[k] = plane(USOFT_NORMAL + k) * w;
+        }
 
-    // Create the shader program
-    if (!UCreateShaderProgram(clayVertexShaderSource, clayFragmentShaderSource, gClayProgramId))
-        return EXIT_FAILURE;
+        // Normal faced towards the viewer, light and view directions
+        UFloat8 toView[3], toLight[3];
+        for (int k = 0; k < 3; ++k)
+        {
+            toView[k] = UBroadcast8(frame.viewPosition[k]) - world[k];
+            toLight[k] = UBroadcast8(frame.lightPosition[k]) - world[k];
+        }
+        auto dot = [](const UFloat8* a, const UFloat8* b) { return a[0] * b[0] + a[1] * b[1] + a[2] * b[2]; };
+        auto normalize = [&dot](UFloat8* a) {
+            const UFloat8 scale = UBroadcast8(1.0f) / USqrt8(dot(a, a));
+            for (int k = 0; k < 3; ++k)
+                a[k] = a[k] * scale;
+        };
+        normalize(normal);
+        normalize(toView);
+        normalize(toLight);
+        const UFloat8 facing = USelect8(ULess8(dot(normal, toView), UBroadcast8(0.0f)), UBroadcast8(-1.0f), UBroadcast8(1.0f));
+        for (int k = 0; k < 3; ++k)
+            normal[k] = normal[k] * facing;
+
+        // Ambient + diffuse + specular, all scaled by the light colour
+        const UFloat8 impact = UMax8(dot(normal, toLight), UBroadcast8(0.0f));
+        UFloat8 reflected[3];
+        for (int k = 0; k < 3; ++k)
+            reflected[k] = UBroadcast8(2.0f) * dot(normal, toLight) * normal[k] - toLight[k];
+        UFloat8 specular = UMax8(dot(toView, reflected), UBroadcast8(0.0f));
+        specular = specular * specular;
+        specular = specular * specular;
+        specular = specular * specular;
+        specular = specular * specular;
+        const UFloat8 lighting = UBroadcast8(0.1f) + impact + specular;
+
+        // Albedo: objectColor, or the material texture per lane
+        float albedo[3][8];
+        for (int k = 0; k < 3; ++k)
+            UStore8(albedo[k], UBroadcast8(frame.objectColor[k]));
+        if (triangle.material >= 0)
+        {
+            const UMaterialGpu& material = renderer.materials[triangle.material];
+            float lanesX[8], lanesW[8];
+            UStore8(lanesX, x);
+            UStore8(lanesW, w);
+            const int lanes = UMask8(mask);
+            for (int lane = 0; lane < 8; ++lane)
+            {
+                if (!(lanes & (1 << lane)))
+                    continue;
+
+                glm::vec4 texel(1.0f);
+                if (material.texture[0] >= 0)
+                {
+                    // uv = U / Q with U and Q planes; the derivatives give textureGrad's level of detail
+                    const float q = 1.0f / lanesW[lane];
+                    const float* planeU = triangle.plane[USOFT_UV];
+                    const float* planeV = triangle.plane[USOFT_UV + 1];
+                    const float* planeQ = triangle.plane[USOFT_INVERSE_W];
+                    const float u = (planeU[0] * lanesX[lane] + planeU[1] * y + planeU[2]) * lanesW[lane];
+                    const float v = (planeV[0] * lanesX[lane] + planeV[1] * y + planeV[2]) * lanesW[lane];
+                    const glm::vec2 scaled = glm::vec2(u, v) * material.uvScale;
+                    const USoftwareTexture& texture = renderer.textures[material.texture[0]];
+                    const glm::vec2 size(float(texture.sizes[0].x), float(texture.sizes[0].y));
+                    const glm::vec2 dx = glm::vec2((planeU[0] - u * planeQ[0]) / q, (planeV[0] - v * planeQ[0]) / q) * material.uvScale * size;
+                    const glm::vec2 dy = glm::vec2((planeU[1] - u * planeQ[1]) / q, (planeV[1] - v * planeQ[1]) / q) * material.uvScale * size;
+                    const float rho = std::max(glm::length(dx), glm::length(dy));
+                    texel = USampleSoftwareTexture(texture, scaled, rho > 0.0f ? std::log2(rho) : 0.0f);
+                }
+                texel = texel * material.tint;
+                albedo[0][lane] = texel.r;
+                albedo[1][lane] = texel.g;
+                albedo[2][lane] = texel.b;
+            }
+        }
 
-    if (!UCreateShaderProgram(lampVertexShaderSource, lampFragmentShaderSource, gLampProgramId))
-        return EXIT_FAILURE;
+        // Clamped like the tone map pass
+        float* channels[3] = { r, g, b };
+        for (int k = 0; k < 3; ++k)
+            UStore8(channels[k], UMin8(UMax8(lighting * UBroadcast8(frame.lightColor[k]) * ULoad8(albedo[k]), UBroadcast8(0.0f)), UBroadcast8(1.0f)));
+    }
 
-    // Sets the background color of the window to black (it will be implicitely used by glClear)
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    // Write the covered pixels
+    float depths[8];
+    UStore8(depths, depth);
+    const int lanes = UMask8(mask);
+    for (int lane = 0; lane < 8; ++lane)
+        if (lanes & (1 << lane))
+        {
+            renderer.depth[pixel + lane] = depths[lane];
+            renderer.color[pixel + lane] = uint32_t(UPackUnorm8(r[lane])) | (uint32_t(UPackUnorm8(g[lane])) << 8) |
+                (uint32_t(UPackUnorm8(b[lane])) << 16) | 0xff000000u;
+        }
+}
 
-    // Load Textures ****************************
 
-    /* const char* texFilename = "../../resources/textures/blueDesk.png";
-    if (!UCreateTexture(texFilename, gTextureBlueDesk)) {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
+// Rasterizes every triangle binned to a tile, in submission order, eight pixels per step
+void URasterizeSoftwareTile(USoftwareRenderer& renderer, const USoftwareFrame& frame, int tile)
+{
+    UPROFILE_FUNCTION();
+
+    const int tileX = (tile % renderer.tilesX) * SOFTWARE_TILE_SIZE;
+    const int tileY = (tile / renderer.tilesX) * SOFTWARE_TILE_SIZE;
+    const int tileRight = std::min(tileX + SOFTWARE_TILE_SIZE, renderer.width) - 1;
+    const int tileBottom = std::min(tileY + SOFTWARE_TILE_SIZE, renderer.height) - 1;
+
+    // Clear the tile here rather than up front, so the clear is spread over the workers too
+    for (int y = tileY; y <= tileBottom; ++y)
+    {
+        std::fill_n(&renderer.color[size_t(y) * renderer.width + tileX], tileRight - tileX + 1, 0xff000000u);
+        std::fill_n(&renderer.depth[size_t(y) * renderer.width + tileX], tileRight - tileX + 1, 1.0f);
     }
-    texFilename = "../../resources/textures/checkerboard.png";
-    if (!UCreateTexture(texFilename, gTextureCheckerboard))  {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
-    } */
 
-    // render loop
-    // -----------
-    while (!glfwWindowShouldClose(gWindow))
+    static const float LANE_OFFSETS[8] = { 0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f };
+    const UFloat8 laneOffsets = ULoad8(LANE_OFFSETS);
+    const UFloat8 zero = UBroadcast8(0.0f);
+
+    for (size_t job = 0; job < renderer.bins.size(); ++job)
+        for (uint32_t index : renderer.bins[job][tile])
+        {
+            const USoftwareTriangle& triangle = renderer.triangles[job][index];
+            const int left = std::max(tileX, triangle.bounds[0]) & ~7;
+            const int right = std::min(tileRight, triangle.bounds[2]);
+            const int top = std::max(tileY, triangle.bounds[1]);
+            const int bottom = std::min(tileBottom, triangle.bounds[3]);
+
+            for (int y = top; y <= bottom; ++y)
+            {
+                const float centreY = y + 0.5f;
+                for (int x = left; x <= right; x += 8)
+                {
+                    const UFloat8 px = UBroadcast8(float(x)) + laneOffsets;
+
+                    // Inside all three edges and on screen
+                    UFloat8 mask = ULess8(px, UBroadcast8(float(right) + 1.0f));
+                    for (int e = 0; e < 3; ++e)
+                    {
+                        const UFloat8 value = UBroadcast8(triangle.edge[e][0]) * px + UBroadcast8(triangle.edge[e][1] * centreY + triangle.edge[e][2]);
+                        mask = UAnd8(mask, UGreaterEqual8(value, zero));
+                    }
+                    if (!UMask8(mask))
+                        continue;
+
+                    // Depth test against what the tile holds (GL_LESS)
+                    const size_t pixel = size_t(y) * renderer.width + x;
+                    const UFloat8 depth = UBroadcast8(triangle.plane[USOFT_DEPTH][0]) * px +
+                        UBroadcast8(triangle.plane[USOFT_DEPTH][1] * centreY + triangle.plane[USOFT_DEPTH][2]);
+                    float stored[8];
+                    for (int lane = 0; lane < 8; ++lane)
+                        stored[lane] = x + lane < renderer.width ? renderer.depth[pixel + lane] : 0.0f;
+                    mask = UAnd8(mask, ULess8(depth, ULoad8(stored)));
+                    if (UMask8(mask))
+                        UShadeSoftwarePixels(renderer, frame, triangle, px, centreY, mask, depth, pixel);
+                }
+            }
+        }
+}
+
+
+// Renders the draws into the renderer's framebuffer: vertex stage, clipping, setup and binning in parallel
+// batches of triangles, then one job per tile
+void URenderSoftware(USoftwareRenderer& renderer, const USoftwareFrame& frame, const std::vector<USoftwareDraw>& draws)
+{
+    struct USetupJob
     {
-        // per-frame timing
-// --------------------
-        float currentFrame = glfwGetTime();
-        gDeltaTime = currentFrame - gLastFrame;
-        gLastFrame = currentFrame;
+        int draw;
+        GLsizei first;
+        GLsizei last;
+    };
+    std::vector<USetupJob> jobs;
+    for (size_t d = 0; d < draws.size(); ++d)
+        for (GLsizei first = 0; first < draws[d].count; first += SOFTWARE_TRIANGLES_PER_JOB * 3)
+            jobs.push_back({ static_cast<int>(d), first, std::min(draws[d].count, first + SOFTWARE_TRIANGLES_PER_JOB * 3) });
+
+    const int tileCount = renderer.tilesX * renderer.tilesY;
+    renderer.triangles.resize(jobs.size());
+    renderer.bins.resize(jobs.size());
+    const glm::mat4 viewProjection = frame.projection * frame.view;
+
+    for (size_t j = 0; j < jobs.size(); ++j)
+        USubmitJob(renderer.pool, [&renderer, &draws, &jobs, &viewProjection, j, tileCount](int) {
+            const USetupJob& job = jobs[j];
+            const USoftwareDraw& draw = draws[job.draw];
+            const glm::mat3 normalMatrix = glm::mat3(glm::transpose(glm::inverse(draw.model)));
+            std::vector<USoftwareTriangle>& triangles = renderer.triangles[j];
+            std::vector<std::vector<uint32_t>>& bins = renderer.bins[j];
+            triangles.clear();
+            bins.resize(tileCount);
+            for (std::vector<uint32_t>& bin : bins)
+                bin.clear();
+
+            for (GLsizei i = job.first; i + 3 <= job.last; i += 3)
+            {
+                // Vertex stage, as in the clay vertex shader
+                USoftwareVertex corners[3];
+                GLushort material = 0;
+                for (int c = 0; c < 3; ++c)
+                {
+                    const UPackedVertex& vertex = (*draw.verts)[draw.indices ? (*draw.indices)[i + c] : i + c];
+                    const glm::vec4 position(UUnpackHalf(vertex.position[0]), UUnpackHalf(vertex.position[1]), UUnpackHalf(vertex.position[2]), 1.0f);
+                    const glm::vec4 world = draw.model * position;
+                    corners[c].clip = viewProjection * world;
+                    corners[c].world = glm::vec3(world);
+                    corners[c].normal = normalMatrix * UUnpackSnorm1010102(vertex.normal);
+                    corners[c].uv = glm::vec2(vertex.uv[0] / 65535.0f, vertex.uv[1] / 65535.0f);
+                    material = vertex.material;     // Flat attributes come from the last vertex, like GL's provoking vertex
+                }
+
+                const size_t before = triangles.size();
+                USetupSoftwareTriangle(renderer, corners, material == UMATERIAL_NONE ? -1 : int(material), draw.lit, triangles);
+
+                // Bin by bounding box
+                for (size_t t = before; t < triangles.size(); ++t)
+                {
+                    const int* bounds = triangles[t].bounds;
+                    for (int ty = bounds[1] / SOFTWARE_TILE_SIZE; ty <= bounds[3] / SOFTWARE_TILE_SIZE; ++ty)
+                        for (int tx = bounds[0] / SOFTWARE_TILE_SIZE; tx <= bounds[2] / SOFTWARE_TILE_SIZE; ++tx)
+                            bins[ty * renderer.tilesX + tx].push_back(static_cast<uint32_t>(t));
+                }
+            }
+        });
+    UWaitThreadPool(renderer.pool);
+
+    for (int tile = 0; tile < tileCount; ++tile)
+        USubmitJob(renderer.pool, [&renderer, &frame, tile](int) { URasterizeSoftwareTile(renderer, frame, tile); });
+    UWaitThreadPool(renderer.pool);
+}
 
-        // input
-        // -----
-        UProcessInput(gWindow);
 
-        // Render this frame
-        URender();
+// Writes the framebuffer as a binary PPM
+bool UWriteSoftwareImage(const USoftwareRenderer& renderer, const char* filename)
+{
+    FILE* file = fopen(filename, "wb");
+    if (!file)
+    {
+        ULOG_ERROR("Failed to open %s for writing", filename);
+        return false;
+    }
 
-        glfwPollEvents();
+    fprintf(file, "P6\n%d %d\n255\n", renderer.width, renderer.height);
+    std::vector<unsigned char> row(size_t(renderer.width) * 3);
+    for (int y = 0; y < renderer.height; ++y)
+    {
+        for (int x = 0; x < renderer.width; ++x)
+        {
+            const uint32_t color = renderer.color[size_t(y) * renderer.width + x];
+            row[x * 3] = color & 0xff;
+            row[x * 3 + 1] = (color >> 8) & 0xff;
+            row[x * 3 + 2] = (color >> 16) & 0xff;
+        }
+        fwrite(row.data(), 1, row.size(), file);
     }
+    fclose(file);
+    return true;
+}
 
-    // Release mesh data
-    UDestroyMesh(gMesh);
 
-    // Release texture******************************
-    //UDestroyTexture(gTextureBlueDesk);
-   //UDestroyTexture(gCheckerboard);
+// Compares the framebuffer with a GL frame of the same view, such as the first one --capture writes; fails when
+// more than SOFTWARE_REFERENCE_MAX_MISMATCH of the pixels are off by more than SOFTWARE_REFERENCE_TOLERANCE
+bool UCompareSoftwareImage(const USoftwareRenderer& renderer, const char* referencePath)
+{
+    int width, height, channels;
+    unsigned char* reference = stbi_load(referencePath, &width, &height, &channels, 3);
+    if (!reference)
+    {
+        ULOG_ERROR("Failed to load reference image %s", referencePath);
+        return false;
+    }
+    if (width != renderer.width || height != renderer.height)
+    {
+        ULOG_ERROR("Reference image %s is %dx%d, the software frame %dx%d", referencePath, width, height, renderer.width, renderer.height);
+        stbi_image_free(reference);
+        return false;
+    }
 
-    // Release shader program
-    UDestroyShaderProgram(gClayProgramId);
-    UDestroyShaderProgram(gLampProgramId);
+    const size_t pixels = size_t(width) * height;
+    size_t mismatched = 0;
+    uint64_t totalError = 0;
+    for (size_t pixel = 0; pixel < pixels; ++pixel)
+    {
+        const uint32_t color = renderer.color[pixel];
+        int worst = 0;
+        for (int channel = 0; channel < 3; ++channel)
+        {
+            const int error = std::abs(int((color >> (channel * 8)) & 0xff) - int(reference[pixel * 3 + channel]));
+            worst = std::max(worst, error);
+            totalError += error;
+        }
+        if (worst > SOFTWARE_REFERENCE_TOLERANCE)
+            ++mismatched;
+    }
+    stbi_image_free(reference);
 
-    exit(EXIT_SUCCESS); // Terminates the program successfully
+    const double mismatch = double(mismatched) / pixels;
+    ULOG_INFO("Software frame against %s: mean error %.2f, %.2f%% of pixels off by more than %d", referencePath,
+        double(totalError) / (pixels * 3), mismatch * 100.0, SOFTWARE_REFERENCE_TOLERANCE);
+    if (mismatch > SOFTWARE_REFERENCE_MAX_MISMATCH)
+    {
+        ULOG_ERROR("Software frame differs from the GL reference: %.2f%% of pixels, at most %.2f%% allowed", mismatch * 100.0,
+            SOFTWARE_REFERENCE_MAX_MISMATCH * 100.0);
+        return false;
+    }
+    return true;
 }
 
 
-// Initialize GLFW, GLEW, and create a window
-bool UInitialize(int argc, char* argv[], GLFWwindow** window)
+void UDestroySoftwareRenderer(USoftwareRenderer& renderer)
 {
-    // GLFW: initialize and configure
-    // ------------------------------
-    glfwInit();
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    UStopThreadPool(renderer.pool);
+    renderer.textures.clear();
+    renderer.triangles.clear();
+    renderer.bins.clear();
+}
 
-#ifdef __APPLE__
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+
+// The whole scene as the first GL frame would show it, rendered on the CPU with no window or GL context, written
+// to an image and, given --software-reference, checked against a frame the GL renderer drew
+bool URenderSoftwareImage(const char* filename)
+{
+    UTextureResidency images;
+    UAddSceneMaterials(images);
+
+    std::vector<UPackedVertex> verts;
+    std::vector<GLushort> indices;
+    UBuildMeshData(verts, indices);
+    UCreateScene();
+
+    USoftwareRenderer renderer;
+    if (!UCreateSoftwareRenderer(renderer, WINDOW_WIDTH, WINDOW_HEIGHT, images))
+        return false;
+
+    // Same matrices and Phong parameters as URender
+    USoftwareFrame frame;
+    frame.view = gCamera.GetViewMatrix();
+    frame.projection = glm::perspective(45.0f, (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
+    frame.objectColor = gObjectColor;
+    frame.lightColor = gLightColor;
+    frame.lightPosition = glm::vec3(gTransforms.world[gLampNode][3]);
+    frame.viewPosition = gCamera.Position;
+
+    // The lamp's indices address the whole mesh, as in the GL index buffer
+    const std::vector<UPackedVertex> meshVerts(std::begin(SCENE_MESH.verts), std::end(SCENE_MESH.verts));
+    const std::vector<GLushort> lampIndices(SCENE_MESH.indices + LAMP_FIRST_INDEX, SCENE_MESH.indices + LAMP_FIRST_INDEX + LAMP_INDEX_COUNT);
+    std::vector<USoftwareDraw> draws;
+    draws.push_back({ &verts, &indices, static_cast<GLsizei>(indices.size()), gTransforms.world[gSubjectNode], true });
+
+    // There are no tessellation stages here, so the curved primitives are tessellated up front at a fixed level
+    const size_t curvedCount = gParametricScene.primitives.size();
+    std::vector<std::vector<UPackedVertex>> curvedVerts(curvedCount);
+    std::vector<std::vector<GLushort>> curvedIndices(curvedCount);
+    for (size_t p = 0; p < curvedCount; ++p)
+    {
+        const UParametricPrimitive& primitive = gParametricScene.primitives[p];
+        UTessellateParametricPrimitive(gParametricScene, primitive, SOFTWARE_TESSELLATION_LEVEL, curvedVerts[p], curvedIndices[p]);
+        draws.push_back({ &curvedVerts[p], &curvedIndices[p], static_cast<GLsizei>(curvedIndices[p].size()), gTransforms.world[primitive.node], true });
+    }
+    draws.push_back({ &meshVerts, &lampIndices, LAMP_INDEX_COUNT, gTransforms.world[gLampNode], false });
+
+    const auto start = std::chrono::steady_clock::now();
+    URenderSoftware(renderer, frame, draws);
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    size_t triangles = 0;
+    for (const std::vector<USoftwareTriangle>& list : renderer.triangles)
+        triangles += list.size();
+#if USIMD_AVX2
+    const char* lanes = "AVX2";
+#else
+    const char* lanes = "scalar lanes";
+    ULOG_WARNING("The software rasterizer was built without AVX2 and ran its scalar lanes; the timing below is not the AVX2 path");
 #endif
+    ULOG_INFO("Software frame %dx%d: %zu triangles in %d tiles, %.2f ms on %d threads (%s)", renderer.width, renderer.height,
+        triangles, renderer.tilesX * renderer.tilesY, ms, renderer.workers, lanes);
+
+    bool ok = UWriteSoftwareImage(renderer, filename);
+    if (ok && gOptions.softwareReferencePath)
+        ok = UCompareSoftwareImage(renderer, gOptions.softwareReferencePath);
+    UDestroySoftwareRenderer(renderer);
+    return ok;
+}
 
-    // GLFW: window creation
-    // ---------------------
-    * window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
-    if (*window == NULL)
+
+// Capture format of a --capture path: a .y4m stream, or a printf pattern with one integer conversion naming
+// the PNG files; -1 for anything else
+int UFindCaptureFormat(const char* path)
+{
+    const size_t length = strlen(path);
+    if (length > 4 && strcmp(path + length - 4, ".y4m") == 0)
+        return UCAPTURE_Y4M;
+
+    int conversions = 0;
+    for (const char* c = path; *c; ++c)
     {
-        std::cout << "Failed to create GLFW window" << std::endl;
-        glfwTerminate();
-        return false;
+        if (*c != '%')
+            continue;
+        if (c[1] == '%')
+        {
+            ++c;
+            continue;
+        }
+        ++c;
+        while (*c >= '0' && *c <= '9')
+            ++c;
+        if (*c != 'd')
+            return -1;
+        ++conversions;
     }
-    glfwMakeContextCurrent(*window);
-    glfwSetFramebufferSizeCallback(*window, UResizeWindow);
-    glfwSetCursorPosCallback(*window, UMousePositionCallback);
-    glfwSetScrollCallback(*window, UMouseScrollCallback);
-    glfwSetMouseButtonCallback(*window, UMouseButtonCallback);
+    return conversions == 1 ? UCAPTURE_PNG : -1;
+}
 
-    // tell GLFW to capture our mouse
-    glfwSetInputMode(*window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 
-    // GLEW: initialize
-    // ----------------
-    // Note: if using GLEW version 1.13 or earlier
-    glewExperimental = GL_TRUE;
-    GLenum GlewInitResult = glewInit();
+bool UCreateFrameCapture(UFrameCapture& capture, const char* path, int width, int height)
+{
+    capture.format = UFindCaptureFormat(path);
+    capture.path = path;
+    capture.width = width;
+    capture.height = height;
 
-    if (GLEW_OK != GlewInitResult)
+    const size_t pixelBytes = size_t(width) * height * 4;
+    const size_t scanlineBytes = size_t(height) * (1 + size_t(width) * 3);
+    const size_t chromaBytes = size_t((width + 1) / 2) * ((height + 1) / 2);
+
+    if (capture.format == UCAPTURE_Y4M)
     {
-        std::cerr << glewGetErrorString(GlewInitResult) << std::endl;
-        return false;
+        capture.stream = fopen(path, "wb");
+        if (!capture.stream)
+        {
+            ULOG_ERROR("Failed to open capture stream %s for writing", path);
+            return false;
+        }
+        fprintf(capture.stream, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", width, height, CAPTURE_Y4M_FRAME_RATE);
     }
 
-    // Displays GPU OpenGL version
-    cout << "INFO: OpenGL Version: " << glGetString(GL_VERSION) << endl;
+    for (UCaptureSlot& slot : capture.ring)
+    {
+        glGenBuffers(1, &slot.buffer);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+        glBufferData(GL_PIXEL_PACK_BUFFER, pixelBytes, nullptr, GL_STREAM_READ);
+        UGPU_TRACK(UGPU_BUFFER, slot.buffer, pixelBytes, "capture");
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    // Encoders and the frames they work from. A PNG rarely comes out larger than its raw scanlines; one that does
+    // just grows its buffer.
+    stbi_write_png_compression_level = CAPTURE_PNG_COMPRESSION;
+    capture.workers = std::max(1, std::min(4, static_cast<int>(std::thread::hardware_concurrency()) - 1));
+    capture.frames.resize(capture.workers * CAPTURE_FRAMES_PER_WORKER);
+    for (size_t i = 0; i < capture.frames.size(); ++i)
+    {
+        UCapturedFrame& frame = capture.frames[i];
+        frame.pixels.resize(pixelBytes);
+        if (capture.format == UCAPTURE_PNG)
+        {
+            frame.rgb.resize(size_t(width) * height * 3);
+            frame.encoded.reserve(scanlineBytes + 1024);
+        }
+        else
+            frame.encoded.resize(6 + size_t(width) * height + 2 * chromaBytes);
+        capture.freeFrames.push_back(static_cast<int>(i));
+    }
+    UStartThreadPool(capture.pool, capture.workers, "capture");
 
+    ULOG_INFO("Capturing %dx%d frames to %s (%s, %d encoder threads)", width, height, path,
+        capture.format == UCAPTURE_Y4M ? "y4m stream" : "PNG sequence", capture.workers);
     return true;
 }
 
-// process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
-void UProcessInput(GLFWwindow* window)
+
+// Reads the presented image into the next pixel buffer; called after the post chain has drawn to the window
+void UCaptureFrame(UFrameCapture& capture)
 {
-    static const float cameraSpeed = 2.5f;
-
-    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-        glfwSetWindowShouldClose(window, true);
-
-    if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(FORWARD, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(BACKWARD, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(LEFT, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(RIGHT, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(UP, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(DOWN, gDeltaTime);
-
-    // Pause and resume lamp orbiting
-    static bool isLKeyDown = false;
-    if (glfwGetKey(window, GLFW_KEY_L) == GLFW_PRESS && !gIsLampOrbiting)
-        gIsLampOrbiting = true;
-    else if (glfwGetKey(window, GLFW_KEY_K) == GLFW_PRESS && gIsLampOrbiting)
-        gIsLampOrbiting = false;
-}
+    if (capture.frames.empty())
+        return;
+
+    URetireCaptureReadbacks(capture, false);
+
+    if (gFramebufferWidth != capture.width || gFramebufferHeight != capture.height)
+        ++capture.droppedSize;
+    else if (capture.pending == CAPTURE_RING_SIZE)
+        ++capture.droppedReadback;
+    else
+    {
+        UCaptureSlot& slot = capture.ring[capture.nextSlot];
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+        glReadBuffer(GL_BACK);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+        glReadPixels(0, 0, capture.width, capture.height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        capture.nextSlot = (capture.nextSlot + 1) % CAPTURE_RING_SIZE;
+        ++capture.pending;
+    }
 
-// glfw: whenever the window size changed (by OS or user resize) this callback function executes
-void UResizeWindow(GLFWwindow* window, int width, int height)
-{
-    glViewport(0, 0, width, height);
+    // At most one warning a second while frames are being lost
+    const unsigned long long dropped = capture.droppedReadback + capture.droppedEncoder + capture.droppedSize;
+    if (dropped != capture.reportedDrops && gFrameIndex % 60 == 0)
+    {
+        ULOG_WARNING("Capture dropped %llu frames (GPU behind: %llu, encoders behind: %llu, window resized: %llu)",
+            dropped - capture.reportedDrops, capture.droppedReadback, capture.droppedEncoder, capture.droppedSize);
+        capture.reportedDrops = dropped;
+    }
 }
 
 
-// glfw: whenever the mouse moves, this callback is called
-// -------------------------------------------------------
-void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
+// Hands every finished read, oldest first, to an encoder. Without wait it stops at the first read still in
+// flight; with wait it finishes them all, blocking on the GPU and on the encoders (used at shutdown).
+void URetireCaptureReadbacks(UFrameCapture& capture, bool wait)
 {
-    if (gFirstMouse)
+    int finished = -1;
+    while (capture.finished.TryPop(finished))
+        capture.freeFrames.push_back(finished);
+
+    const size_t bytes = size_t(capture.width) * capture.height * 4;
+    while (capture.pending > 0)
     {
-        gLastX = xpos;
-        gLastY = ypos;
-        gFirstMouse = false;
-    }
+        UCaptureSlot& slot = capture.ring[(capture.nextSlot + CAPTURE_RING_SIZE - capture.pending) % CAPTURE_RING_SIZE];
+        const GLenum status = glClientWaitSync(slot.fence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, wait ? CAPTURE_FLUSH_TIMEOUT_NS : 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED && !wait)
+            return;
+        glDeleteSync(slot.fence);
+        slot.fence = 0;
+        --capture.pending;
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+        {
+            ++capture.droppedReadback;
+            continue;
+        }
 
-    float xoffset = xpos - gLastX;
-    float yoffset = gLastY - ypos; // reversed since y-coordinates go from bottom to top
+        if (capture.freeFrames.empty() && wait)
+        {
+            UWaitThreadPool(capture.pool);
+            while (capture.finished.TryPop(finished))
+                capture.freeFrames.push_back(finished);
+        }
+        if (capture.freeFrames.empty())
+        {
+            ++capture.droppedEncoder;
+            continue;
+        }
 
-    gLastX = xpos;
-    gLastY = ypos;
+        const int index = capture.freeFrames.back();
+        UCapturedFrame& frame = capture.frames[index];
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+        const void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT);
+        if (pixels)
+        {
+            memcpy(frame.pixels.data(), pixels, bytes);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        if (!pixels)
+        {
+            ++capture.failed;
+            continue;
+        }
 
-    gCamera.ProcessMouseMovement(xoffset, yoffset);
+        capture.freeFrames.pop_back();
+        frame.number = capture.captured++;
+        UFrameCapture* owner = &capture;
+        USubmitJob(capture.pool, [owner, index](int) { UEncodeCapturedFrame(*owner, index); });
+    }
 }
 
 
-// glfw: whenever the mouse scroll wheel scrolls, this callback is called
-// ----------------------------------------------------------------------
-void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset) {
+// Worker job: encodes one frame and writes it, then returns the frame to the render thread
+void UEncodeCapturedFrame(UFrameCapture& capture, int index)
+{
+    UPROFILE_FUNCTION();
 
-    gCamera.ProcessMouseScroll(yoffset);
+    UCapturedFrame& frame = capture.frames[index];
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    if (capture.format == UCAPTURE_Y4M)
+    {
+        const size_t bytes = UEncodeY4mFrame(frame.pixels.data(), capture.width, capture.height, frame.encoded.data());
+        capture.encodeMicroseconds += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+        // Frames are queued in capture order, so the one whose turn it is has always been started
+        std::unique_lock<std::mutex> lock(capture.streamMutex);
+        capture.streamTurn.wait(lock, [&capture, &frame]() { return capture.nextStreamFrame == frame.number; });
+        if (fwrite(frame.encoded.data(), 1, bytes, capture.stream) != bytes)
+            ++capture.failed;
+        ++capture.nextStreamFrame;
+        lock.unlock();
+        capture.streamTurn.notify_all();
+    }
+    else
+    {
+        const bool encoded = UEncodePng(frame.pixels.data(), capture.width, capture.height, frame.rgb, frame.encoded);
+        capture.encodeMicroseconds += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+        char filename[1024];
+        snprintf(filename, sizeof(filename), capture.path.c_str(), static_cast<int>(frame.number));
+        FILE* file = encoded ? fopen(filename, "wb") : nullptr;
+        if (!file || fwrite(frame.encoded.data(), 1, frame.encoded.size(), file) != frame.encoded.size())
+            ++capture.failed;
+        if (file)
+            fclose(file);
+    }
 
+    capture.finished.TryPush(index);
 }
 
 
-// glfw: handle mouse button events
-// --------------------------------
-void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
+// One y4m frame: the FRAME tag, then full-size luma and 2x2-averaged chroma planes (BT.601, video range)
+size_t UEncodeY4mFrame(const unsigned char* rgba, int width, int height, unsigned char* out)
 {
-    switch (button)
+    const int chromaWidth = (width + 1) / 2;
+    const int chromaHeight = (height + 1) / 2;
+    memcpy(out, "FRAME\n", 6);
+    unsigned char* luma = out + 6;
+    unsigned char* blue = luma + size_t(width) * height;
+    unsigned char* red = blue + size_t(chromaWidth) * chromaHeight;
+
+    for (int y = 0; y < height; ++y)
     {
-    case GLFW_MOUSE_BUTTON_LEFT:
-    {
-        if (action == GLFW_PRESS)
-            cout << "Left mouse button pressed" << endl;
-        else
-            cout << "Left mouse button released" << endl;
+        const unsigned char* row = rgba + size_t(height - 1 - y) * width * 4;
+        unsigned char* lumaRow = luma + size_t(y) * width;
+        for (int x = 0; x < width; ++x)
+        {
+            const int r = row[x * 4], g = row[x * 4 + 1], b = row[x * 4 + 2];
+            lumaRow[x] = static_cast<unsigned char>(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+        }
     }
-    break;
 
-    case GLFW_MOUSE_BUTTON_MIDDLE:
+    for (int y = 0; y < chromaHeight; ++y)
     {
-        if (action == GLFW_PRESS)
-            cout << "Middle mouse button pressed" << endl;
-        else
-            cout << "Middle mouse button released" << endl;
+        // Source rows of the 2x2 block, top one first; the last row and column repeat on odd sizes
+        const unsigned char* top = rgba + size_t(height - 1 - 2 * y) * width * 4;
+        const unsigned char* bottom = rgba + size_t(std::max(height - 2 - 2 * y, 0)) * width * 4;
+        for (int x = 0; x < chromaWidth; ++x)
+        {
+            const int left = 2 * x * 4;
+            const int right = std::min(2 * x + 1, width - 1) * 4;
+            const int r = (top[left] + top[right] + bottom[left] + bottom[right] + 2) >> 2;
+            const int g = (top[left + 1] + top[right + 1] + bottom[left + 1] + bottom[right + 1] + 2) >> 2;
+            const int b = (top[left + 2] + top[right + 2] + bottom[left + 2] + bottom[right + 2] + 2) >> 2;
+            blue[size_t(y) * chromaWidth + x] = static_cast<unsigned char>(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+            red[size_t(y) * chromaWidth + x] = static_cast<unsigned char>(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+        }
     }
-    break;
 
-    case GLFW_MOUSE_BUTTON_RIGHT:
+    return 6 + size_t(width) * height + 2 * size_t(chromaWidth) * chromaHeight;
+}
+
+
+// RGB PNG of bottom-up RGBA rows, encoded by stb_image_write into out
+bool UEncodePng(const unsigned char* rgba, int width, int height, std::vector<unsigned char>& rgb, std::vector<unsigned char>& out)
+{
+    for (int y = 0; y < height; ++y)
     {
-        if (action == GLFW_PRESS)
-            cout << "Right mouse button pressed" << endl;
-        else
-            cout << "Right mouse button released" << endl;
+        const unsigned char* source = rgba + size_t(height - 1 - y) * width * 4;
+        unsigned char* row = rgb.data() + size_t(y) * width * 3;
+        for (int x = 0; x < width; ++x)
+            for (int c = 0; c < 3; ++c)
+                row[x * 3 + c] = source[x * 4 + c];
     }
-    break;
 
-    default:
-        cout << "Unhandled mouse button event" << endl;
-        break;
-    }
+    out.clear();
+    auto append = [](void* context, void* data, int size) {
+        std::vector<unsigned char>& bytes = *static_cast<std::vector<unsigned char>*>(context);
+        bytes.insert(bytes.end(), static_cast<unsigned char*>(data), static_cast<unsigned char*>(data) + size);
+    };
+    return stbi_write_png_to_func(append, &out, width, height, 3, rgb.data(), width * 3) != 0;
 }
 
-// Functioned called to render a frame
-void URender()
+
+// Finishes the reads in flight and the queued encodes, then reports what was captured and what was lost
+void UDestroyFrameCapture(UFrameCapture& capture)
 {
-    // Lamp orbits around the origin
-    const float angularVelocity = glm::radians(45.0f);
-    if (gIsLampOrbiting)
+    if (capture.frames.empty())
+        return;
+
+    URetireCaptureReadbacks(capture, true);
+    UStopThreadPool(capture.pool);
+    if (capture.stream && fclose(capture.stream) != 0)
+        ++capture.failed;
+    capture.stream = nullptr;
+
+    for (UCaptureSlot& slot : capture.ring)
     {
-        glm::vec4 newPosition = glm::rotate(angularVelocity * gDeltaTime, glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(gLightPosition, 1.0f);
-        gLightPosition.x = newPosition.x;
-        gLightPosition.y = newPosition.y;
-        gLightPosition.z = newPosition.z;
+        glDeleteBuffers(1, &slot.buffer);
+        UReleaseGpuResource(UGPU_BUFFER, slot.buffer);
+        slot.buffer = 0;
     }
 
-    // Enable z-depth
-    glEnable(GL_DEPTH_TEST);
+    const unsigned long long dropped = capture.droppedReadback + capture.droppedEncoder + capture.droppedSize;
+    ULOG_INFO("Capture: %llu frames to %s, %llu dropped (GPU behind: %llu, encoders behind: %llu, window resized: %llu), "
+        "encoding %.2f ms a frame on %d threads", capture.captured, capture.path.c_str(), dropped, capture.droppedReadback,
+        capture.droppedEncoder, capture.droppedSize, capture.captured ? capture.encodeMicroseconds / 1000.0 / capture.captured : 0.0,
+        capture.workers);
+    if (capture.failed > 0)
+        ULOG_ERROR("Capture: %llu frames could not be written", capture.failed.load());
 
-    // Clear the frame and z buffers
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    capture.frames.clear();
+    capture.freeFrames.clear();
+}
 
-    // 1. Scales the object by 2
-    glm::mat4 scale = glm::scale(glm::vec3(2.0f, 2.0f, 2.0f));
-    // 2. Rotates shape by 15 degrees in the x axis
-    glm::mat4 rotation = glm::rotate(0.0f, glm::vec3(1.0, 1.0f, 1.0f));
-    // 3. Place object at the origin
-    glm::mat4 translation = glm::translate(glm::vec3(0.0f, 0.0f, 0.0f));
-    // Model matrix: transformations are applied right-to-left order
-    glm::mat4 model = translation * rotation * scale;
 
-    // camera/view transformation
-    glm::mat4 view = gCamera.GetViewMatrix();
+// Counts one draw of the render thread for the overlay
+void UCountDraw(unsigned long long triangles)
+{
+    ++gFrameCounters.draws;
+    gFrameCounters.triangles += triangles;
+}
 
-    // Creates a perspective projection
-    glm::mat4 projection = glm::perspective(45.0f, (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
 
-    // Set the shader to be used
-    glUseProgram(gClayProgramId);
+// Creates the overlay program, the font atlas and the glyph buffer; statistics are gathered from the first frame
+bool UCreateHud(UHud& hud, double budgetMs)
+{
+    UPROFILE_FUNCTION();
 
-    // Retrieves and passes transform matrices to the Shader program
-    GLint modelLoc = glGetUniformLocation(gClayProgramId, "model");
-    GLint viewLoc = glGetUniformLocation(gClayProgramId, "view");
-    GLint projLoc = glGetUniformLocation(gClayProgramId, "projection");
+    if (!UCreateShaderProgram(hudVertexShaderSource, hudFragmentShaderSource, hud.programId))
+        return false;
+    glUseProgram(hud.programId);
+    glUniform1i(glGetUniformLocation(hud.programId, "font"), HUD_FONT_UNIT);
+    glUseProgram(0);
 
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+    // Glyph c is in columns 6c to 6c + 4, rows top to bottom
+    const int atlasWidth = HUD_CHAR_COUNT * 6;
+    unsigned char atlas[HUD_CHAR_COUNT * 6 * 7] = {};
+    for (int c = 0; c < HUD_CHAR_COUNT; ++c)
+        for (int column = 0; column < 5; ++column)
+            for (int row = 0; row < 7; ++row)
+                if (HUD_FONT[c][column] & (1 << row))
+                    atlas[row * atlasWidth + c * 6 + column] = 255;
+
+    glGenTextures(1, &hud.font);
+    glBindTexture(GL_TEXTURE_2D, hud.font);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_R8, atlasWidth, 7);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, atlasWidth, 7, GL_RED, GL_UNSIGNED_BYTE, atlas);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    UGPU_TRACK(UGPU_TEXTURE, hud.font, UGpuTextureBytes(GL_R8, atlasWidth, 7, 1, 1), "hud");
+
+    glGenBuffers(1, &hud.glyphBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, hud.glyphBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, HUD_MAX_GLYPHS * 2 * sizeof(GLuint), nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    UGPU_TRACK(UGPU_BUFFER, hud.glyphBuffer, HUD_MAX_GLYPHS * 2 * sizeof(GLuint), "hud");
+
+    glGenVertexArrays(1, &hud.vao);
+    hud.budgetMs = budgetMs;
+    hud.lastHeapAllocations = tHeapAllocations;
+    hud.lastDriverAllocations = tDriverHeapAllocations;
+    return true;
+}
 
-    // Reference matrix uniforms from the Cube Shader program for the cube color, light color, light position, and camera position
-    GLint objectColorLoc = glGetUniformLocation(gClayProgramId, "objectColor");
-    GLint lightColorLoc = glGetUniformLocation(gClayProgramId, "lightColor");
-    GLint lightPositionLoc = glGetUniformLocation(gClayProgramId, "lightPos");
-    GLint viewPositionLoc = glGetUniformLocation(gClayProgramId, "viewPosition");
 
-    // Pass color, light, and camera data to the Cube Shader program's corresponding uniforms
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
+// Records this frame's statistics and starts the counters of the next one. While the overlay is shown its text
+// is formatted a few times a second, and the glyphs are rebuilt only when the text differs from what they show.
+void UUpdateHud(UHud& hud)
+{
+    hud.frameMs.Push(gDeltaTime * 1000.0f);
+    hud.draws.Push(static_cast<float>(gFrameCounters.draws));
+    hud.triangles.Push(static_cast<float>(gFrameCounters.triangles));
+    hud.patches.Push(static_cast<float>(gFrameCounters.patches));
+    hud.culledTriangles.Push(static_cast<float>(gFrameCounters.culledTriangles));
+    hud.heapAllocations.Push(static_cast<float>(tHeapAllocations - hud.lastHeapAllocations));
+    hud.lastHeapAllocations = tHeapAllocations;
+    hud.driverAllocations.Push(static_cast<float>(tDriverHeapAllocations - hud.lastDriverAllocations));
+    hud.lastDriverAllocations = tDriverHeapAllocations;
+    gFrameCounters = UFrameCounters();
+
+    const double now = glfwGetTime();
+    if (!hud.visible || now - hud.lastTextTime < HUD_TEXT_INTERVAL)
+        return;
+    hud.lastTextTime = now;
+
+    UHudText text;
+    UFormatHudText(hud, text);
+    if (text.length == hud.text.length && text.lines == hud.text.lines && memcmp(text.chars, hud.text.chars, text.length) == 0 &&
+        memcmp(text.lineColor, hud.text.lineColor, text.lines) == 0)
+        return;
+
+    hud.text = text;
+    UBuildHudGlyphs(hud);
+}
 
-    // Activate the VBOs contained within the mesh's VAO
-    glBindVertexArray(gMesh.vao);
 
-    /*
-    // Bind textures on corresponding texture units
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureBlueDesk);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, gTextureCheckerboard);
-    */
+// Appends one line of the overlay text; lines past the last that fits are dropped
+void UAppendHudLine(UHudText& text, int color, const char* format, ...)
+{
+    const int capacity = static_cast<int>(sizeof(text.chars));
+    if (text.lines == HUD_MAX_LINES || text.length >= capacity - 1)
+        return;
+
+    va_list args;
+    va_start(args, format);
+    const int written = vsnprintf(text.chars + text.length, capacity - text.length, format, args);
+    va_end(args);
+    if (written < 0)
+        return;
+
+    text.length = std::min(text.length + written, capacity - 2);
+    text.chars[text.length++] = '\n';
+    text.chars[text.length] = '\0';
+    text.lineColor[text.lines++] = static_cast<unsigned char>(color);
+}
 
-    // Draws the triangles
-    glDrawElements(GL_TRIANGLES, gMesh.nIndices, GL_UNSIGNED_SHORT, NULL); // Draws the triangle
 
-     // LAMP: draw lamp
-    //----------------
-    glUseProgram(gLampProgramId);
+// Frame, GPU, draw, memory and input statistics; averages cover the frames in the rings
+void UFormatHudText(const UHud& hud, UHudText& text)
+{
+    const float frameMs = hud.frameMs.Average();
+    const int frameColor = frameMs <= hud.budgetMs ? UHUD_GREEN : frameMs <= 1.5 * hud.budgetMs ? UHUD_YELLOW : UHUD_RED;
+    UAppendHudLine(text, frameColor, "FRAME %6.2f ms  max %6.2f  %5.1f fps", frameMs, hud.frameMs.Max(),
+        frameMs > 0.0f ? 1000.0f / frameMs : 0.0f);
+
+    const UPostChain& chain = gPostChain;
+    UAppendHudLine(text, UHUD_WHITE, "GPU   %6.3f ms", chain.sceneTimer.milliseconds + UPostChainMilliseconds(chain) + hud.timer.milliseconds);
+    UAppendHudLine(text, UHUD_WHITE, "  %-13s %6.3f", "scene", chain.sceneTimer.milliseconds);
+    if (chain.msaaScene.framebuffer)
+        UAppendHudLine(text, UHUD_WHITE, "  %-13s %6.3f", "resolve", chain.resolveTimer.milliseconds);
+    for (const UPostPass& pass : chain.passes)
+        if (pass.enabled)
+            UAppendHudLine(text, UHUD_WHITE, "  %-13s %6.3f", pass.name, pass.timer.milliseconds);
+    UAppendHudLine(text, UHUD_WHITE, "  %-13s %6.3f", "hud", hud.timer.milliseconds);
+
+    UAppendHudLine(text, UHUD_WHITE, "DRAWS %4.0f  TRIANGLES %.1fk  PATCHES %.0f", hud.draws.Average(), hud.triangles.Average() / 1000.0f,
+        hud.patches.Average());
+    UAppendHudLine(text, UHUD_WHITE, "  %-13s %.1fk triangles at most", "GPU culled", hud.culledTriangles.Average() / 1000.0f);
+    UAppendHudLine(text, UHUD_WHITE, "GPU MEMORY %.1f MB  peak %.1f MB", gGpuRegistry.totalBytes / 1048576.0, gGpuRegistry.peakBytes / 1048576.0);
+    UAppendHudLine(text, UHUD_WHITE, "FRAME ARENA %zu of %zu KB", gFrameArena.highWater / 1024, gFrameArena.capacity / 1024);
+    const float allocations = hud.heapAllocations.Average();
+    UAppendHudLine(text, allocations > 0.0f ? UHUD_YELLOW : UHUD_WHITE, "HEAP  %.1f allocations a frame  driver %.1f", allocations,
+        hud.driverAllocations.Average());
+    UAppendHudLine(text, UHUD_WHITE, "INPUT %.1f ms  worst %.1f ms", gInputLatency.average * 1000.0, gInputLatency.worst * 1000.0);
+}
 
-    //Transform the smaller cube used as a visual que for the light source
-    model = glm::translate(gLightPosition) * glm::scale(gLightScale);
 
-    // Reference matrix uniforms from the Lamp Shader program
-    modelLoc = glGetUniformLocation(gLampProgramId, "model");
-    viewLoc = glGetUniformLocation(gLampProgramId, "view");
-    projLoc = glGetUniformLocation(gLampProgramId, "projection");
+// Lays the text out in window pixels, one glyph per printable character, and uploads it
+void UBuildHudGlyphs(UHud& hud)
+{
+    const int advance = 6 * HUD_GLYPH_SCALE;
+    const int lineHeight = 9 * HUD_GLYPH_SCALE;
+    const int left = 2 * HUD_MARGIN;
+    const int top = 2 * HUD_MARGIN;
+
+    GLuint glyphs[HUD_MAX_GLYPHS * 2];
+    int count = 0;
+    int line = 0;
+    int column = 0;
+    int widest = 0;
+    for (int i = 0; i < hud.text.length; ++i)
+    {
+        const unsigned char c = static_cast<unsigned char>(hud.text.chars[i]);
+        if (c == '\n')
+        {
+            ++line;
+            column = 0;
+            continue;
+        }
+        if (c > HUD_FIRST_CHAR && c < HUD_FIRST_CHAR + HUD_CHAR_COUNT && count < HUD_MAX_GLYPHS)
+        {
+            const GLuint color = hud.text.lineColor[std::min(line, hud.text.lines - 1)];
+            glyphs[2 * count] = GLuint(left + column * advance) | GLuint(top + line * lineHeight) << 16;
+            glyphs[2 * count + 1] = GLuint(c - HUD_FIRST_CHAR) | color << 8;
+            ++count;
+        }
+        widest = std::max(widest, ++column);
+    }
 
-    // Pass matrix data to the Lamp Shader program's matrix uniforms
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+    hud.glyphCount = count;
+    hud.textWidth = widest * advance;
+    hud.textHeight = line * lineHeight;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, hud.glyphBuffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, count * 2 * sizeof(GLuint), glyphs);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
 
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nIndices);
 
-    // Deactivate the Vertex Array Object
+// Draws the panel, the frame-time graph and the text over the presented image in one draw
+void UDrawHud(UHud& hud, int width, int height)
+{
+    if (!hud.visible)
+        return;
+
+    // The graph is two pixels a frame under the text; its top is twice the budget
+    const float graphWidth = 2.0f * HUD_HISTORY;
+    const float graphTop = 3.0f * HUD_MARGIN + hud.textHeight;
+    const float panelWidth = std::max(static_cast<float>(hud.textWidth), graphWidth) + 2.0f * HUD_MARGIN;
+    const float panelHeight = graphTop + HUD_GRAPH_HEIGHT;  // Starts a margin down, ends a margin under the graph
+
+    UBeginGpuTimer(hud.timer);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, width, height);
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+    const GLuint programId = hud.programId;
+    glUseProgram(programId);
+    glUniform2f(glGetUniformLocation(programId, "screenSize"), static_cast<float>(width), static_cast<float>(height));
+    glUniform4f(glGetUniformLocation(programId, "panel"), static_cast<float>(HUD_MARGIN), static_cast<float>(HUD_MARGIN), panelWidth, panelHeight);
+    glUniform4f(glGetUniformLocation(programId, "graph"), 2.0f * HUD_MARGIN, graphTop, graphWidth, static_cast<float>(HUD_GRAPH_HEIGHT));
+    glUniform1f(glGetUniformLocation(programId, "budgetMs"), static_cast<float>(hud.budgetMs));
+    glUniform1f(glGetUniformLocation(programId, "graphMs"), static_cast<float>(2.0 * hud.budgetMs));
+    glUniform1fv(glGetUniformLocation(programId, "frameTimes"), HUD_HISTORY, hud.frameMs.values);
+    glUniform1i(glGetUniformLocation(programId, "historyStart"), hud.frameMs.next);
+    glUniform1f(glGetUniformLocation(programId, "glyphScale"), static_cast<float>(HUD_GLYPH_SCALE));
+    glActiveTexture(GL_TEXTURE0 + HUD_FONT_UNIT);
+    glBindTexture(GL_TEXTURE_2D, hud.font);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, HUD_GLYPH_BINDING, hud.glyphBuffer);
+
+    glBindVertexArray(hud.vao);
+    glDrawArrays(GL_TRIANGLES, 0, 6 * (HUD_FIXED_QUADS + hud.glyphCount));
+
     glBindVertexArray(0);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, HUD_GLYPH_BINDING, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0);
     glUseProgram(0);
-
-    // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
-    glfwSwapBuffers(gWindow);    // Flips the the back buffer with the front buffer every frame.
+    glDisable(GL_BLEND);
+    UEndGpuTimer();
 }
 
 
-// Implements the UCreateMesh function
-void UCreateMesh(GLMesh& mesh)
+void UDestroyHud(UHud& hud)
 {
-    // Position and Color data
-    GLfloat verts[] = {
-        //Vertex Positions    // Colors (r,g,b,a)
-        //Vertex Positions      //Colors (r,g,b,a)
-        
-        // vertex location       vertex color        vertex texture
-         
-            //Front Square BLUE
-       -2.5f, -0.5f, 0.5f,   0.0f, 0.0f, 1.0f, 1.0f, //1.0f, 1.0f,  //0 BLUE Front Bottom Left
-       -2.0f, -0.5f, 0.5f,   0.0f, 0.0f, 1.0f, 1.0f, //1.0f, 1.0f, //1 BLUE Front Bottom Right
-       -2.5f, 0.0f, 0.5f,    0.0f, 0.0f, 1.0f, 1.0f,// 1.0f, 1.0f, //2 BLUE Front Top Left
-       -2.0f, 0.0f, 0.5f,    0.0f, 0.0f, 1.0f, 1.0f,// 1.0f, 1.0f, //3 BLUE Front Top Right
-
-            //Back Square GREEN
-       -2.0f, 0.0f, -0.5f,  0.0f, 0.5f, 0.0f, 1.0f,// 1.0f, 1.0f,// 4 GREEN Back Top Right
-       -2.5f, 0.0f, -0.5f,  0.0f, 0.5f, 0.0f, 1.0f,// 1.0f, 1.0f,//5 GREEN Back Top Left
-       -2.0f, -0.5f, -0.5f,  0.0f, 0.5f, 0.0f, 1.0f, //1.0f, 1.0f,//6 GREEN Back Bottom Right
-       -2.5f, -0.5f, -0.5f,  0.0f, 0.5f, 0.0f, 1.0f, //1.0f, 1.0f,//7 GREEN Back Bottom Left
-
-            //Left Rectangle YELLOW
-       -2.5f, -0.5f, 0.5f,  1.0f, 1.0f, 0.0f, 1.0f, //1.0f, 1.0f, //8 YELLOW Front Bottom Left
-       -2.5f, 0.0f, 0.5f,   1.0f, 1.0f, 0.0f, 1.0f, //1.0f, 1.0f,//9 YELLOW Front Top Left
-       -2.5f, 0.0f, -0.5f,  1.0f, 1.0f, 0.0f, 1.0f, //1.0f, 1.0f,//10 YELLOW Back Top Left
-       -2.5f, -0.5f, -0.5f,  1.0f, 1.0f, 0.0f, 1.0f, //1.0f, 1.0f,//11 YELLOW Back Bottom Left
-
-           //Bottom Rectangle BLUE -> GREEN
-       -2.5f, -0.5f, 0.5f,  0.0f, 0.0f, 1.0f, 1.0f,// 1.0f, 1.0f,//12 Blue Front Bottom Left
-       -2.0f, -0.5f, 0.5f,  0.0f, 0.0f, 1.0f, 1.0f,// 1.0f, 1.0f,//13 Blue Front Bottom Right
-       -2.5f, -0.5f, -0.5f,  0.0f, 0.5f, 0.0f, 1.0f,// 1.0f, 1.0f,//14 Green Back Bottom Left
-       -2.0f, -0.5f, -0.5f,  0.0f, 0.5f, 0.0f, 1.0f, //1.0f, 1.0f,//15 Green Back Bottom Right
-
-            //Top Rectangle YELLOW -> RED
-       -2.5f, 0.0f, 0.5f,   1.0f, 1.0f, 0.0f, 1.0f,// 1.0f, 1.0f,    //16 YELLOW Front Top Left
-       -2.0f, 0.0f, 0.5f,   1.0f, 0.0f, 0.0f, 1.0f,// 1.0f, 1.0f,    //17 RED Front Top Right
-       -2.0f, 0.0f, -0.5f,  1.0f, 0.0f, 0.0f, 1.0f,//1.0f, 1.0f,    //18 RED Back Top Right
-       -2.5f, 0.0f, -0.5f,  1.0f, 1.0f, 0.0f, 1.0f,// 1.0f, 1.0f,    //19 YELLOW Back Top Left
-
-            //Right Rectangle RED
-       -2.0f, -0.5f, 0.5f,  1.0f, 0.0f, 0.0f, 1.0f,// 1.0f, 1.0f,    //20 RED Front Bottom Right
-       -2.0f, 0.0f, 0.5f,   1.0f, 0.0f, 0.0f, 1.0f,// 1.0f, 1.0f,    //21 RED Front Top Right
-       -2.0f, 0.0f, -0.5f,  1.0f, 0.0f, 0.0f, 1.0f,// 1.0f, 1.0f,    //22 RED Back Top Right
-       -2.0f, -0.5f, -0.5f,  1.0f, 0.0f, 0.0f, 1.0f,// 1.0f, 1.0f,    //23 RED Back Bottom Right
-
-            //Plane the box is setting on
-        -5.0f, -0.51f, -5.0f,   0.5f, 0.5f, 1.0f, 1.0f,// 1.0f, 1.0f,   //24 Front Left - left side
-         5.0f, -0.51f, -5.0f,   0.5f, 0.5f, 1.0f, 1.0f,// 1.0f, 1.0f,   //25 Back Left - left side
-         5.0f, -0.51f,  5.0f,   0.5f, 0.5f, 1.0f, 1.0f,// 1.0f, 1.0f,   //26 Back Right - left side
-         5.0f, -0.51f, 5.0f,    0.5f, 0.5f, 1.0f, 1.0f,// 1.0f, 1.0f,    //27 Back Right - right side
-        -5.0f, -0.51f, 5.0f,    0.5f, 0.5f, 1.0f, 1.0f,// 1.0f, 1.0f,    //28 Front Right - right side
-        -5.0f, -0.51f, -5.0f,   0.5f, 0.5f, 1.0f, 1.0f,// 1.0f, 1.0f,   //29 Front Left - right side
-
-        //To make sure the box does not show through the bottom of the table
-        //Move the table down .01 further than the box
-
-        //pyramid
-        2.0f, -0.5f, 2.0f,  0.0f, 0.0f,     1.0f, 1.0f,// 1.0f, 1.0f,   //30
-        2.0f, -0.5f, 4.0f,  0.0f, 0.0f,     1.0f, 1.0f,// 1.0f, 1.0f,    //31
-        4.0f, -0.5f, 2.0f,  0.0f, 0.0f,     1.0f, 1.0f,// 1.0f, 1.0f,    //32
-        4.0f, -0.5f, 2.0f,  0.0f, 0.0f,     1.0f, 1.0f,// 1.0f, 1.0f,    //33
-        4.0f, -0.5f, 4.0f,  0.0f, 0.0f,     1.0f, 1.0f,// 1.0f, 1.0f,    //34
-        2.0f, -0.5f, 4.0f,  0.0f, 0.0f,     1.0f, 1.0f,// 1.0f, 1.0f,    //35
-
-        2.0f, -0.5f, 2.0f,  0.0f, 0.0f,     1.0f, 1.0f,// 1.0f, 1.0f,    //36
-        2.0f, -0.5f, 4.0f,  0.0f, 0.0f,     1.0f, 1.0f,// 1.0f, 1.0f,    //37
-        3.0f, 1.0f, 3.0f,   0.0f, 0.0f,     1.0f, 1.0f,// 1.0f, 1.0f,    //38
-
-        2.0f, -0.5f, 2.0f,  0.0f, 0.0f,     1.0f, 1.0f,// 1.0f, 1.0f,    //39
-        4.0f, -0.5f, 2.0f,  0.0f, 0.0f,     1.0f, 1.0f,// 1.0f, 1.0f,    //40
-        3.0f, 1.0f, 3.0f,   0.0f, 0.0f,     1.0f, 1.0f,// 1.0f, 1.0f,    //41
-
-        4.0f, -0.5f, 4.0f,  0.0f, 0.0f,     1.0f, 1.0f,// 1.0f, 1.0f,    //42
-        2.0f, -0.5f, 4.0f,  0.0f, 0.0f,     1.0f, 1.0f,// 1.0f, 1.0f,    //43
-        3.0f, 1.0f, 3.0f,   0.0f, 0.0f,     1.0f, 1.0f,// 1.0f, 1.0f,    //44
-
-        4.0f, -0.5f, 4.0f,  0.0f, 0.0f,     1.0f, 1.0f,// 1.0f, 1.0f,    //45
-        4.0f, -0.5f, 2.0f,  0.0f, 0.0f,     1.0f, 1.0f,// 1.0f, 1.0f,    //46
-        3.0f, 1.0f, 3.0f,   0.0f, 0.0f,     1.0f, 1.0f,// 1.0f, 1.0f,    //47
-
-        //new shapes added to scene 48 -> 
-
-        3.5f,  2.5f, -4.0f,  0.0f, 0.0f,    1.0f, 1.0f,// 1.0f, 1.0f,   //48
-        3.5f, -0.5f, -4.0f,  0.0f, 0.0f,    1.0f, 1.0f,// 1.0f, 1.0f,   //49
-       -0.5f, -0.5f, -4.0f,  0.0f, 0.0f,    1.0f, 1.0f,// 1.0f, 1.0f,   //50
-
-        3.5f,  2.5f, -4.0f,  0.0f, 0.0f,    1.0f, 1.0f,// 1.0f, 1.0f,   //51       
-       -0.5f,  2.5f, -4.0f,  0.0f, 0.0f,    1.0f, 1.0f,// 1.0f, 1.0f,   //52
-       -0.5f, -0.5f, -4.0f,  0.0f, 0.0f,    1.0f, 1.0f,// 1.0f, 1.0f,   //53
-
-        3.5f,  1.0f, -2.0f,  0.0f, 0.0f,    1.0f, 1.0f,// 1.0f, 1.0f,   //54
-        3.5f, -0.5f, -2.0f,  0.0f, 0.0f,    1.0f, 1.0f,// 1.0f, 1.0f,   //55
-       -0.5f, -0.5f, -2.0f,  0.0f, 0.0f,    1.0f, 1.0f,// 1.0f, 1.0f,   //56
-
-        3.5f,  1.0f, -2.0f,  0.0f, 0.0f,    1.0f, 1.0f,// 1.0f, 1.0f,   //57
-       -0.5f,  1.0f, -2.0f,  0.0f, 0.0f,    1.0f, 1.0f,// 1.0f, 1.0f,   //58
-       -0.5f, -0.5f, -2.0f,  0.0f, 0.0f,    1.0f, 1.0f,// 1.0f, 1.0f,   //59
-
-        3.5f,  2.5f, -4.0f,  0.0f, 0.0f,    1.0f, 1.0f,// 1.0f, 1.0f,   //60
-        3.5f,  1.0f, -2.0f,  0.0f, 0.0f,    1.0f, 1.0f,// 1.0f, 1.0f,   //61
-        3.5f, -0.5f, -2.0f,  0.0f, 0.0f,    1.0f, 1.0f,// 1.0f, 1.0f,   //62
-
-        3.5f,  2.5f, -4.0f,  0.0f, 0.0f,    1.0f, 1.0f,// 1.0f, 1.0f,   //63
-        3.5f, -0.5f, -4.0f,  0.0f, 0.0f, 1.0f, 1.0f,// 1.0f, 1.0f,   //64
-        3.5f, -0.5f, -2.0f,  0.0f, 0.0f, 1.0f, 1.0f,// 1.0f, 1.0f,   //65
-
-       -0.5f,  2.5f, -4.0f,  0.0f, 0.0f, 1.0f, 1.0f,// 1.0f, 1.0f,   //66
-       -0.5f,  1.0f, -2.0f,  0.0f, 0.0f, 1.0f, 1.0f,// 1.0f, 1.0f,   //67
-       -0.5f, -0.5f, -2.0f,  0.0f, 0.0f, 1.0f, 1.0f,// 1.0f, 1.0f,   //68
-
-       -0.5f,  2.5f, -4.0f,  0.0f, 0.0f, 1.0f, 1.0f,// 1.0f, 1.0f,   //69
-       -0.5f, -0.5f, -4.0f,  0.0f, 0.0f, 1.0f, 1.0f,// 1.0f, 1.0f,   //70
-       -0.5f, -0.5f, -2.0f,  0.0f, 0.0f, 1.0f, 1.0f,// 1.0f, 1.0f,   //71
-
-        4.0f,  2.5f, -4.0f,  0.0f, 0.0f, 1.0f, 1.0f,// 1.0f, 1.0f,   //72
-        4.0f, 0.85f, -1.8f,  0.0f, 0.0f, 1.0f, 1.0f,// 1.0f, 1.0f,   //73
-       -1.0f, 0.85f, -1.8f,  0.0f, 0.0f, 1.0f, 1.0f,// 1.0f, 1.0f,   //74
+    UDestroyShaderProgram(hud.programId);
+    glDeleteTextures(1, &hud.font);
+    glDeleteBuffers(1, &hud.glyphBuffer);
+    UReleaseGpuResource(UGPU_TEXTURE, hud.font);
+    UReleaseGpuResource(UGPU_BUFFER, hud.glyphBuffer);
+    glDeleteVertexArrays(1, &hud.vao);
+    glDeleteQueries(UGpuTimer::LATENCY, hud.timer.queries);
+    hud.programId = 0;
+    hud.font = 0;
+    hud.glyphBuffer = 0;
+    hud.vao = 0;
+}
 
-        4.0f,  2.5f, -4.0f,  0.0f, 0.0f, 1.0f, 1.0f,// 1.0f, 1.0f,   //75
-       -1.0f, 0.85f, -1.8f,  0.0f, 0.0f, 1.0f, 1.0f,// 1.0f, 1.0f,   //76
-       -1.0f,  2.5f, -4.0f,  0.0f, 0.0f, 1.0f, 1.0f,// 1.0f, 1.0f,   //77
 
-    };
+// Adds a GL object to the registry (or updates its size when it is already there) and enforces its tag's budget
+void URegisterGpuResource(int kind, GLuint id, size_t bytes, const char* tag, const char* file, int line)
+{
+    if (id == 0)
+        return;
 
-    // Index data to share position data
-    GLushort indices[] = {
-       0, 1, 2,  // Triangle 1 Front Side Bottom
-       1, 2, 3,  // Triangle 2 Front Side Top
-       4, 5, 6,  // Triangle 3 Back Side Top
-       5, 6, 7,  // Triangle 4 Back Side Bottom
-       8, 9, 10,  // Triangle 5 Left Side Top 
-       8, 10, 11,  // Triangle 6 Left Side Bottom
-       12, 13, 14,  // Triangle 7 Bottom Side Left 
-       13, 14, 15,  // Triangle 8 Bottom Side Right 
-       16, 17, 18,  // Triangle 9 Top Side Right 
-       16, 18, 19,  // Triangle 10 Top Side Left 
-       20, 21, 22,  // Triangle 11 Right Side Top
-       20, 22, 23,  // Triangle 12 Right Side Bottom
+    UGpuRegistry& registry = gGpuRegistry;
+    UGpuResource* existing = nullptr;
+    for (UGpuResource& resource : registry.resources)
+        if (resource.kind == kind && resource.id == id)
+            existing = &resource;
 
-       24, 25, 26, //Plane Triangle 1
-       27, 28, 29, //Plane Triangle 2
+    if (existing)
+    {
+        registry.totalBytes -= existing->bytes;
+        *existing = { kind, id, bytes, tag, file, line };
+    }
+    else
+        registry.resources.push_back({ kind, id, bytes, tag, file, line });
+    registry.totalBytes += bytes;
+    registry.peakBytes = std::max(registry.peakBytes, registry.totalBytes);
+
+    // The owner is usually in the middle of building something, so eviction waits for UEnforceGpuBudgets
+    for (UGpuBudget& budget : registry.budgets)
+        if (budget.tag == tag && budget.limit > 0 && UGpuTagBytes(tag) > budget.limit)
+            budget.exceeded = true;
+}
 
-       30, 31, 32,
-       33, 34, 35,
-       36, 37, 38,
-       39, 40, 41,
 
-       42, 43, 44,
-       45, 46, 47,
+void UReleaseGpuResource(int kind, GLuint id)
+{
+    if (id == 0)
+        return;
 
-       48, 49, 50,
-       51, 52, 53,
+    UGpuRegistry& registry = gGpuRegistry;
+    for (size_t i = 0; i < registry.resources.size(); ++i)
+    {
+        if (registry.resources[i].kind != kind || registry.resources[i].id != id)
+            continue;
 
-       54, 55, 56,
-       57, 58, 59,
+        registry.totalBytes -= registry.resources[i].bytes;
+        registry.resources[i] = registry.resources.back();
+        registry.resources.pop_back();
+        return;
+    }
 
-       60, 61, 62,
-       63, 64, 65,
+    ULOG_WARNING("Released untracked %s %u", GPU_RESOURCE_KIND_NAMES[kind], id);
+}
 
-       66, 67, 68,
-       69, 70, 71,
 
-       72, 73, 74,
-       75, 76, 77,
+// Bytes per texel (or per sample) of the internal formats used here
+size_t UGpuFormatBytes(GLenum format)
+{
+    switch (format)
+    {
+    case GL_RG8: return 2;
+    case GL_RGBA16F: return 8;
+    case GL_RGB8: return 4; // Drivers pad RGB8 to four bytes
+    default: return 4;      // GL_RGBA8, GL_RGBA8UI, GL_R32UI, GL_DEPTH_COMPONENT24
+    }
+}
 
 
-    };
+// Size of a texture with its mip chain; layers doubles as the sample count for multisampled storage
+size_t UGpuTextureBytes(GLenum format, int width, int height, int layers, int levels)
+{
+    size_t bytes = 0;
+    for (int level = 0; level < levels; ++level)
+        bytes += size_t(std::max(width >> level, 1)) * std::max(height >> level, 1) * layers * UGpuFormatBytes(format);
+    return bytes;
+}
 
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerColor = 4;
-    //const Gluint floatsPerUV = 2;
 
-    glGenVertexArrays(1, &mesh.vao); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao);
+size_t UGpuTagBytes(const char* tag)
+{
+    size_t bytes = 0;
+    for (const UGpuResource& resource : gGpuRegistry.resources)
+        if (strcmp(resource.tag, tag) == 0)
+            bytes += resource.bytes;
+    return bytes;
+}
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(2, mesh.vbos);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos[0]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
 
-    mesh.nIndices = sizeof(indices) / sizeof(indices[0]);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos[1]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+UGpuBudget& UFindGpuBudget(const char* tag)
+{
+    for (UGpuBudget& budget : gGpuRegistry.budgets)
+        if (budget.tag == tag)
+            return budget;
 
-    // Strides between vertex coordinates is 6 (x, y, z, r, g, b, a). A tightly packed stride is 0.
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerColor);// The number of floats before each
+    gGpuRegistry.budgets.emplace_back();
+    gGpuRegistry.budgets.back().tag = tag;
+    return gGpuRegistry.budgets.back();
+}
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
 
-    glVertexAttribPointer(1, floatsPerColor, GL_FLOAT, GL_FALSE, stride, (char*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
-    /*
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* (gloatsPerVertex + floatsPerColor)));
-    glEnableVertexAttribArray(2);*/
+void USetGpuBudget(const char* tag, size_t limit)
+{
+    UFindGpuBudget(tag).limit = limit;
+    ULOG_INFO("GPU budget \"%s\": %.2f MB", tag, limit / 1048576.0);
 }
 
 
-void UDestroyMesh(GLMesh& mesh)
+void USetGpuEvictionCallback(const char* tag, std::function<size_t(size_t)> evict)
 {
-    glDeleteVertexArrays(1, &mesh.vao);
-    glDeleteBuffers(2, mesh.vbos);
+    UFindGpuBudget(tag).evict = std::move(evict);
 }
 
-/*Generate and load the texture*/
-bool UCreateTexture(const char* filename, GLuint& textureId)
+
+// Runs the eviction callbacks of tags that went over budget since the last frame
+void UEnforceGpuBudgets()
 {
-    int width, height, channels;
-    unsigned char* image = stbi_load(filename, &width, &height, &channels, 0);
-    if (image)
+    for (UGpuBudget& budget : gGpuRegistry.budgets)
     {
-        flipImageVertically(image, width, height, channels);
+        if (!budget.exceeded)
+            continue;
+        budget.exceeded = false;
 
-        glGenTextures(1, &textureId);
-        glBindTexture(GL_TEXTURE_2D, textureId);
-
-        // set the texture wrapping parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        // set texture filtering parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        size_t used = UGpuTagBytes(budget.tag.c_str());
+        if (used > budget.limit && budget.evict)
+        {
+            [[maybe_unused]] const size_t freed = budget.evict(used - budget.limit);
+            used = UGpuTagBytes(budget.tag.c_str());
+            ULOG_DEBUG("GPU budget \"%s\": eviction freed %zu bytes", budget.tag.c_str(), freed);
+        }
 
-        if (channels == 3)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-        else if (channels == 4)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
-        else
+        if (used <= budget.limit)
+            budget.warned = false;
+        else if (!budget.warned)
         {
-            cout << "Not implemented to handle image with " << channels << " channels" << endl;
-            return false;
+            ULOG_WARNING("GPU budget \"%s\" exceeded: %.2f of %.2f MB", budget.tag.c_str(), used / 1048576.0, budget.limit / 1048576.0);
+            budget.warned = true;
         }
+    }
+}
 
-        glGenerateMipmap(GL_TEXTURE_2D);
 
-        stbi_image_free(image);
-        glBindTexture(GL_TEXTURE_2D, 0); // Unbind the texture
+// Totals per tag at INFO, every object at DEBUG
+void UDumpGpuResources()
+{
+    const UGpuRegistry& registry = gGpuRegistry;
+    ULOG_INFO("GPU memory: %.2f MB in %zu objects (peak %.2f MB)", registry.totalBytes / 1048576.0, registry.resources.size(),
+        registry.peakBytes / 1048576.0);
 
-        return true;
+    std::vector<const char*> tags;
+    for (const UGpuResource& resource : registry.resources)
+        if (std::none_of(tags.begin(), tags.end(), [&resource](const char* tag) { return strcmp(tag, resource.tag) == 0; }))
+            tags.push_back(resource.tag);
+
+    for (const char* tag : tags)
+    {
+        size_t limit = 0;
+        for (const UGpuBudget& budget : registry.budgets)
+            if (budget.tag == tag)
+                limit = budget.limit;
+
+        if (limit)
+            ULOG_INFO("  %-16s %9.2f MB of %.2f MB", tag, UGpuTagBytes(tag) / 1048576.0, limit / 1048576.0);
+        else
+            ULOG_INFO("  %-16s %9.2f MB", tag, UGpuTagBytes(tag) / 1048576.0);
     }
 
-    // Error loading the image
-    return false;
+#if ULOG_MIN_LEVEL <= ULOG_LEVEL_DEBUG
+    for (const UGpuResource& resource : registry.resources)
+        ULOG_DEBUG("  %s %u: %zu bytes [%s] %s:%d", GPU_RESOURCE_KIND_NAMES[resource.kind], resource.id, resource.bytes, resource.tag,
+            resource.file, resource.line);
+#endif
 }
 
 
-void UDestroyTexture(GLuint textureId)
+// Anything still registered at shutdown was never destroyed
+int UReportGpuLeaks()
 {
-    glGenTextures(1, &textureId);
+    for (const UGpuResource& resource : gGpuRegistry.resources)
+        ULOG_ERROR("Leaked %s %u: %zu bytes [%s] created at %s:%d", GPU_RESOURCE_KIND_NAMES[resource.kind], resource.id, resource.bytes,
+            resource.tag, resource.file, resource.line);
+
+    if (gGpuRegistry.resources.empty())
+        ULOG_INFO("No GPU resources leaked (peak %.2f MB)", gGpuRegistry.peakBytes / 1048576.0);
+    return static_cast<int>(gGpuRegistry.resources.size());
 }
 
 
-// Implements the UCreateShaders function
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId)
+void UCreateFrameArena(UFrameArena& arena, size_t bytesPerFrame)
 {
-    // Compilation and linkage error reporting
-    int success = 0;
-    char infoLog[512];
+    arena.capacity = bytesPerFrame;
+    for (int i = 0; i < UFrameArena::FRAMES; ++i)
+    {
+        arena.storage[i] = new unsigned char[bytesPerFrame];
+        arena.overflow[i].reserve(64);
+    }
+    arena.current = 0;
+    arena.used = 0;
+}
 
-    // Create a Shader program object.
-    programId = glCreateProgram();
 
-    // Create the vertex and fragment shader objects
-    GLuint vertexShaderId = glCreateShader(GL_VERTEX_SHADER);
-    GLuint fragmentShaderId = glCreateShader(GL_FRAGMENT_SHADER);
+// Switches to the other half; whatever it held (two frames ago) is discarded
+void UBeginFrameArena(UFrameArena& arena)
+{
+    arena.current = (arena.current + 1) % UFrameArena::FRAMES;
+    arena.used = 0;
 
-    // Retrive the shader source
-    glShaderSource(vertexShaderId, 1, &vtxShaderSource, NULL);
-    glShaderSource(fragmentShaderId, 1, &fragShaderSource, NULL);
+    for (void* block : arena.overflow[arena.current])
+        ::operator delete(block);
+    arena.overflow[arena.current].clear();
+}
 
-    // Compile the vertex shader, and print compilation errors (if any)
-    glCompileShader(vertexShaderId); // compile the vertex shader
-    // check for shader compile errors
-    glGetShaderiv(vertexShaderId, GL_COMPILE_STATUS, &success);
-    if (!success)
-    {
-        glGetShaderInfoLog(vertexShaderId, 512, NULL, infoLog);
-        std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
 
-        return false;
-    }
+void UDestroyFrameArena(UFrameArena& arena)
+{
+    if (arena.capacity)
+        ULOG_INFO("Frame arena: high water %.1f of %.1f KB per frame, %zu overflows (%.1f KB)", arena.highWater / 1024.0,
+            arena.capacity / 1024.0, arena.overflowCount, arena.overflowBytes / 1024.0);
 
-    glCompileShader(fragmentShaderId); // compile the fragment shader
-    // check for shader compile errors
-    glGetShaderiv(fragmentShaderId, GL_COMPILE_STATUS, &success);
-    if (!success)
+    for (int i = 0; i < UFrameArena::FRAMES; ++i)
     {
-        glGetShaderInfoLog(fragmentShaderId, sizeof(infoLog), NULL, infoLog);
-        std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
+        for (void* block : arena.overflow[i])
+            ::operator delete(block);
+        arena.overflow[i].clear();
+        delete[] arena.storage[i];
+        arena.storage[i] = nullptr;
+    }
+    arena.capacity = 0;
+}
 
-        return false;
+
+// --alloc-check: counts the main thread's heap allocations over the frames after the warm-up; returns false when done
+bool UUpdateAllocationCheck()
+{
+    static uint64_t driverStart = 0;
+    static size_t overflowStart = 0;
+    const int frame = static_cast<int>(gFrameIndex);
+    if (frame == ALLOC_CHECK_WARMUP_FRAMES)
+    {
+        gAllocCheckStart = tHeapAllocations;
+        driverStart = tDriverHeapAllocations;
+        overflowStart = gFrameArena.overflowCount;
     }
+    if (frame < ALLOC_CHECK_WARMUP_FRAMES + gOptions.allocCheckFrames)
+        return true;
 
-    // Attached compiled shaders to the shader program
-    glAttachShader(programId, vertexShaderId);
-    glAttachShader(programId, fragmentShaderId);
+    // The driver's allocations are its own business, so they are reported but do not fail the check
+    const uint64_t allocations = tHeapAllocations - gAllocCheckStart;
+    const unsigned long long driver = static_cast<unsigned long long>(tDriverHeapAllocations - driverStart);
+    const size_t overflows = gFrameArena.overflowCount - overflowStart;
+    gAllocCheckFailed = allocations > 0 || overflows > 0;
+    if (gAllocCheckFailed)
+        ULOG_ERROR("Allocation check failed: %llu heap allocations and %zu arena overflows in %d frames (driver: %llu)",
+            static_cast<unsigned long long>(allocations), overflows, gOptions.allocCheckFrames, driver);
+    else
+        ULOG_INFO("Allocation check passed: no heap allocations in %d frames (driver: %llu)", gOptions.allocCheckFrames, driver);
+    return false;
+}
 
-    glLinkProgram(programId);   // links the shader program
-    // check for linking errors
-    glGetProgramiv(programId, GL_LINK_STATUS, &success);
-    if (!success)
+
+// Records the executable segments of the program and of the C++ runtime, before the GL driver is loaded, so
+// operator new can tell the driver's allocations from the program's. Does nothing off ELF, where drivers bring
+// their own runtime and their allocations never reach the replacement.
+void UFindProgramCode()
+{
+#if defined(__ELF__)
+    // An address inside each module: this function, and a function of the C++ runtime
+    const void* markers[2] = { reinterpret_cast<const void*>(&UFindProgramCode), reinterpret_cast<const void*>(&std::terminate) };
+    int count = 0;
+    struct UCodeSearch
     {
-        glGetProgramInfoLog(programId, sizeof(infoLog), NULL, infoLog);
-        std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+        const void* const* markers;
+        int* count;
+    } search = { markers, &count };
+
+    dl_iterate_phdr([](dl_phdr_info* info, size_t, void* data) {
+        const UCodeSearch& search = *static_cast<const UCodeSearch*>(data);
+        bool wanted = false;
+        for (int i = 0; i < info->dlpi_phnum; ++i)
+        {
+            const ElfW(Phdr)& segment = info->dlpi_phdr[i];
+            const uintptr_t start = info->dlpi_addr + segment.p_vaddr;
+            for (int m = 0; m < 2; ++m)
+            {
+                const uintptr_t marker = reinterpret_cast<uintptr_t>(search.markers[m]);
+                wanted = wanted || (segment.p_type == PT_LOAD && marker >= start && marker < start + segment.p_memsz);
+            }
+        }
+        for (int i = 0; wanted && i < info->dlpi_phnum && *search.count < MAX_PROGRAM_CODE_RANGES; ++i)
+        {
+            const ElfW(Phdr)& segment = info->dlpi_phdr[i];
+            if (segment.p_type != PT_LOAD || !(segment.p_flags & PF_X))
+                continue;
+            gProgramCode[*search.count][0] = info->dlpi_addr + segment.p_vaddr;
+            gProgramCode[*search.count][1] = info->dlpi_addr + segment.p_vaddr + segment.p_memsz;
+            ++*search.count;
+        }
+        return 0;
+    }, &search);
+    gProgramCodeRanges.store(count, std::memory_order_release);
+#endif
+}
 
-        return false;
-    }
 
-    glUseProgram(programId);    // Uses the shader program
+// Counts an allocation against the calling thread, as the driver's when the caller is driver code; the blocks
+// themselves come from malloc
+void* UCountedNew(size_t size, const void* caller)
+{
+#if defined(__ELF__)
+    const bool driver = UIsDriverCode(caller);
+#else
+    const bool driver = false;
+#endif
+    if (driver)
+        ++tDriverHeapAllocations;
+    else
+        ++tHeapAllocations;
+    if (void* block = malloc(size ? size : 1))
+        return block;
+    throw std::bad_alloc();
+}
 
-    return true;
+
+// Global allocation counting for --alloc-check and the HUD. The array form is replaced as well, so its callers
+// are told apart too instead of all looking like the C++ runtime.
+void* operator new(size_t size)
+{
+    return UCountedNew(size, __builtin_return_address(0));
 }
 
 
-void UDestroyShaderProgram(GLuint programId)
+void* operator new[](size_t size)
 {
-    glDeleteProgram(programId);
+    return UCountedNew(size, __builtin_return_address(0));
+}
+
+
+void operator delete(void* block) noexcept
+{
+    free(block);
+}
+
+
+void operator delete(void* block, size_t) noexcept
+{
+    free(block);
+}
+
+
+void operator delete[](void* block) noexcept
+{
+    free(block);
 }
 
+
+void operator delete[](void* block, size_t) noexcept
+{
+    free(block);
+}